@@ -0,0 +1,298 @@
+#!/bin/sh
+# ========================================
+# OpenWrt Connect - connect latency benchmark
+# ========================================
+# Starts a local SSH server (OpenSSH sshd or dropbear) that stands in
+# for an OpenWrt device, runs openwrt-connect against it repeatedly and
+# reports p50/p99 per phase from the --trace output. Runs offline and
+# unprivileged; Linux only (fleet uses several 127.0.0.x addresses).
+#
+# Usage: bench/bench.sh [-n iterations] [-s openssh|dropbear] [-p port]
+#                       [-f fleet-size] [scenario...]
+#   scenarios: fresh-key existing-key fleet (default: all)
+#
+# Scenarios:
+#   fresh-key     no local key: keygen, auth probe, key push, session
+#   existing-key  key already registered: auth probe, session
+#   fleet         --fleet over <fleet-size> loopback addresses (default 8)
+#
+# Every iteration starts cold: the ControlMaster left by the previous
+# run is closed first.
+#
+# Status: not yet run end to end against a real sshd or dropbear. Only
+# the shell syntax and the "no server" path have been checked. No
+# reference numbers are recorded, so commit the first full run before
+# quoting any figures from it.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO_DIR=$(cd "$BENCH_DIR/.." && pwd)
+
+ITERATIONS=20
+SERVER=""
+PORT=2222
+FLEET_HOSTS=8
+
+while getopts "n:s:p:f:h" opt; do
+    case "$opt" in
+        n) ITERATIONS="$OPTARG" ;;
+        s) SERVER="$OPTARG" ;;
+        p) PORT="$OPTARG" ;;
+        f) FLEET_HOSTS="$OPTARG" ;;
+        *) sed -n '2,20p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+SCENARIOS="${*:-fresh-key existing-key fleet}"
+
+# ----------------------------------------
+# Find SSH server
+# ----------------------------------------
+find_tool() {
+    command -v "$1" 2>/dev/null || { [ -x "/usr/sbin/$1" ] && echo "/usr/sbin/$1"; } || true
+}
+SSHD=$(find_tool sshd)
+DROPBEAR=$(find_tool dropbear)
+REAL_SSH=$(find_tool ssh)
+
+if [ -z "$SERVER" ]; then
+    if [ -n "$SSHD" ]; then SERVER=openssh; elif [ -n "$DROPBEAR" ]; then SERVER=dropbear; fi
+fi
+case "$SERVER" in
+    openssh)  [ -n "$SSHD" ] || { echo "[ERROR] sshd not found."; exit 1; } ;;
+    dropbear) [ -n "$DROPBEAR" ] || { echo "[ERROR] dropbear not found."; exit 1; } ;;
+    *)        echo "[ERROR] No SSH server found (install openssh-server or dropbear)."; exit 1 ;;
+esac
+[ -n "$REAL_SSH" ] || { echo "[ERROR] ssh client not found."; exit 1; }
+
+# ----------------------------------------
+# Work directory
+# ----------------------------------------
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/owrt-bench.XXXXXX")
+SANDBOX="$WORK/device"
+SERVER_PID=""
+
+cleanup() {
+    [ -f "$WORK/fleet-hosts.txt" ] && close_masters
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$WORK/bin" "$WORK/home/.ssh" "$SANDBOX/etc/dropbear" "$SANDBOX/usr/bin"
+chmod 700 "$WORK/home/.ssh"
+export HOME="$WORK/home"
+BENCH_USER=$(id -un)
+
+"$REPO_DIR/openwrt-connect-build.sh" "$WORK/openwrt-connect" >/dev/null
+
+# Fake device: release file and the command the client runs
+echo "DISTRIB_ID='OpenWrt'" > "$SANDBOX/etc/openwrt_release"
+printf '#!/bin/sh\necho bench-ok\n' > "$SANDBOX/usr/bin/bench"
+chmod +x "$SANDBOX/usr/bin/bench"
+
+cat > "$WORK/bench.conf" <<EOF
+[general]
+product_name = OpenWrt Connect Bench
+default_ip = 127.0.0.1
+ssh_user = $BENCH_USER
+ssh_key_prefix = owrt-bench
+ssh_port = $PORT
+speculate = off
+script_push = off
+fleet_concurrency = $FLEET_HOSTS
+
+[command.bench]
+label = Benchmark
+url = http://127.0.0.1/unused.sh
+dir = /tmp/bench
+bin = /usr/bin/bench
+EOF
+
+# The key push step uses password auth, which an unprivileged server
+# cannot check. This wrapper answers it with a pre-registered key
+# whenever the client does not pass its own -i.
+ssh-keygen -q -t ed25519 -N "" -f "$WORK/push_key"
+cp "$WORK/push_key.pub" "$WORK/base_authorized_keys"
+cat > "$WORK/bin/ssh" <<EOF
+#!/bin/sh
+case " \$* " in
+    *" -i "*) exec "$REAL_SSH" -F /dev/null -o IdentitiesOnly=yes "\$@" ;;
+esac
+exec "$REAL_SSH" -F /dev/null -o IdentitiesOnly=yes -i "$WORK/push_key" "\$@"
+EOF
+chmod +x "$WORK/bin/ssh"
+PATH="$WORK/bin:$PATH"
+export PATH
+
+# Keys for the fleet addresses are registered up front
+i=2
+while [ "$i" -le $((FLEET_HOSTS + 1)) ]; do
+    echo "127.0.0.$i" >> "$WORK/fleet-hosts.txt"
+    ssh-keygen -q -t ed25519 -N "" -f "$HOME/.ssh/owrt-bench_127_0_0_${i}_ed25519"
+    cat "$HOME/.ssh/owrt-bench_127_0_0_${i}_ed25519.pub" >> "$WORK/base_authorized_keys"
+    i=$((i + 1))
+done
+
+reset_authorized_keys() {
+    cp "$WORK/base_authorized_keys" "$SANDBOX/etc/dropbear/authorized_keys"
+    chmod 600 "$SANDBOX/etc/dropbear/authorized_keys"
+}
+reset_authorized_keys
+
+# ----------------------------------------
+# Start SSH server
+# ----------------------------------------
+LISTEN="127.0.0.1"
+i=2
+while [ "$i" -le $((FLEET_HOSTS + 1)) ]; do
+    LISTEN="$LISTEN 127.0.0.$i"
+    i=$((i + 1))
+done
+
+if [ "$SERVER" = openssh ]; then
+    # sshd started as root needs its privilege separation directory
+    [ "$(id -u)" = 0 ] && mkdir -p /run/sshd
+    ssh-keygen -q -t ed25519 -N "" -f "$WORK/host_key"
+    {
+        echo "Port $PORT"
+        for a in $LISTEN; do echo "ListenAddress $a"; done
+        echo "HostKey $WORK/host_key"
+        echo "PidFile $WORK/sshd.pid"
+        echo "AuthorizedKeysFile $SANDBOX/etc/dropbear/authorized_keys"
+        echo "StrictModes no"
+        echo "UsePAM no"
+        echo "PasswordAuthentication no"
+        echo "ChallengeResponseAuthentication no"
+        echo "MaxStartups 100"
+        echo "LogLevel ERROR"
+        echo "ForceCommand $BENCH_DIR/fake-device.sh $SANDBOX"
+    } > "$WORK/sshd_config"
+    "$SSHD" -D -e -f "$WORK/sshd_config" 2>"$WORK/server.log" &
+    SERVER_PID=$!
+else
+    # -D (authorized_keys directory) needs dropbear 2022.82 or later
+    "$(find_tool dropbearkey)" -t ed25519 -f "$WORK/host_key" >/dev/null 2>&1
+    set --
+    for a in $LISTEN; do set -- "$@" -p "$a:$PORT"; done
+    "$DROPBEAR" -F -E -s -r "$WORK/host_key" -P "$WORK/dropbear.pid" \
+        -D "$SANDBOX/etc/dropbear" -c "$BENCH_DIR/fake-device.sh $SANDBOX" \
+        "$@" 2>"$WORK/server.log" &
+    SERVER_PID=$!
+fi
+
+# Wait until the server accepts connections
+i=0
+until "$WORK/bin/ssh" -p "$PORT" -o BatchMode=yes -o StrictHostKeyChecking=no \
+        -o UserKnownHostsFile=/dev/null -o LogLevel=ERROR \
+        "$BENCH_USER@127.0.0.1" true >/dev/null 2>&1; do
+    i=$((i + 1))
+    if [ "$i" -ge 50 ]; then
+        echo "[ERROR] SSH server did not start:"
+        cat "$WORK/server.log"
+        exit 1
+    fi
+    sleep 0.1
+done
+
+echo "========================================"
+echo "Server: $SERVER on port $PORT, $ITERATIONS iterations"
+echo "========================================"
+
+# ----------------------------------------
+# Scenarios
+# ----------------------------------------
+close_masters() {
+    for h in 127.0.0.1 $(cat "$WORK/fleet-hosts.txt"); do
+        "$REAL_SSH" -F /dev/null -p "$PORT" -o ControlPath="$HOME/.ssh/owrt-cm-%C" \
+            -O exit "$BENCH_USER@$h" >/dev/null 2>&1 || true
+    done
+}
+
+# Phase and per-host durations from one trace: "<scenario> <name> <us>"
+collect() {
+    scenario="$1"
+    awk -v s="$scenario" '
+        /"ph":"X"/ {
+            name = $0; sub(/.*"name":"/, "", name); sub(/".*/, "", name)
+            cat = $0;  sub(/.*"cat":"/, "", cat);   sub(/".*/, "", cat)
+            ts = $0;   sub(/.*"ts":/, "", ts);      sub(/,.*/, "", ts)
+            dur = $0;  sub(/.*"dur":/, "", dur);    sub(/,.*/, "", dur)
+            gsub(/ /, "_", name)
+            if (cat == "host") name = "host"
+            if (cat == "phase" || cat == "host") printf "%s %s %s\n", s, name, dur
+            if (ts + dur > wall) wall = ts + dur
+        }
+        END { printf "%s wall %d\n", s, wall }
+    ' "$WORK/trace.json" >> "$WORK/samples.txt"
+}
+
+# run_once <scenario> [nocollect]
+run_once() {
+    scenario="$1"
+    close_masters
+    case "$scenario" in
+        fresh-key)
+            rm -f "$HOME/.ssh/owrt-bench_127_0_0_1_ed25519" "$HOME/.ssh/owrt-bench_127_0_0_1_ed25519.pub"
+            rm -rf "$HOME/.openwrt-connect/devices"
+            reset_authorized_keys
+            printf '127.0.0.1\n\n' | "$WORK/openwrt-connect" bench --trace "$WORK/trace.json" \
+                > "$WORK/last.log" 2>&1
+            ;;
+        existing-key)
+            printf '127.0.0.1\n\n' | "$WORK/openwrt-connect" bench --trace "$WORK/trace.json" \
+                > "$WORK/last.log" 2>&1
+            ;;
+        fleet)
+            (cd "$WORK" && "$WORK/openwrt-connect" --fleet "$WORK/fleet-hosts.txt" bench \
+                --trace "$WORK/trace.json" > "$WORK/last.log" 2>&1 < /dev/null)
+            ;;
+    esac
+    if grep -q "FAILED" "$WORK/last.log" ||
+       { [ "$scenario" != fleet ] && ! grep -q "Completed successfully" "$WORK/last.log"; }; then
+        echo
+        echo "[ERROR] $scenario run failed:"
+        cat "$WORK/last.log"
+        exit 1
+    fi
+    [ "$2" = nocollect ] || collect "$scenario"
+}
+
+: > "$WORK/samples.txt"
+for scenario in $SCENARIOS; do
+    case "$scenario" in
+        fresh-key|existing-key|fleet) ;;
+        *) echo "[ERROR] Unknown scenario: $scenario"; exit 1 ;;
+    esac
+    # existing-key needs a registered key
+    if [ "$scenario" = existing-key ]; then run_once fresh-key nocollect; fi
+    printf '%-13s' "$scenario"
+    n=0
+    while [ "$n" -lt "$ITERATIONS" ]; do
+        run_once "$scenario"
+        printf '.'
+        n=$((n + 1))
+    done
+    echo
+done
+close_masters
+
+# ----------------------------------------
+# Report: p50 / p99 per scenario and phase
+# ----------------------------------------
+echo
+printf '%-13s %-14s %6s %10s %10s\n' "scenario" "phase" "n" "p50 ms" "p99 ms"
+sort -k1,1 -k2,2 -k3,3n "$WORK/samples.txt" | awk '
+    function flush() {
+        if (n == 0) return
+        i50 = int((n * 50 + 99) / 100); i99 = int((n * 99 + 99) / 100)
+        printf "%-13s %-14s %6d %10.1f %10.1f\n", key_s, key_p, n, v[i50] / 1000, v[i99] / 1000
+        n = 0
+    }
+    {
+        if ($1 != key_s || $2 != key_p) { flush(); key_s = $1; key_p = $2 }
+        v[++n] = $3
+    }
+    END { flush() }
+'
@@ -0,0 +1,147 @@
+/*
+ * config-bench.c - .conf parser benchmark
+ *
+ * Writes a catalog with <sections> [command.*] sections (one value longer
+ * than the old 512-byte field limit), then times load_config_file(),
+ * loading the same catalog from a compiled snapshot, and find_command()
+ * over every name.
+ *
+ * Build / run (from the repository root):
+ *   cc -std=gnu11 -O2 -pthread -o config-bench bench/config-bench.c
+ *   ./config-bench [sections] [iterations]
+ */
+#define main openwrt_connect_main
+#include "../openwrt-connect.c"
+#undef main
+
+#define LONG_VALUE_LEN  2000
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int write_catalog(const char *path, int sections)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) return 0;
+
+    fprintf(fp, "[general]\nproduct_name = Config Bench\ndefault_ip = 192.168.1.1\n\n");
+    for (int i = 0; i < sections; i++) {
+        fprintf(fp, "[command.site%05d]\n", i);
+        fprintf(fp, "label = Site script %d\n", i);
+        fprintf(fp, "icon = site.ico\n");
+        if (i == sections / 2) {
+            fprintf(fp, "url = https://example.com/");
+            for (int j = 0; j < LONG_VALUE_LEN; j++) fputc('a' + j % 26, fp);
+            fprintf(fp, ".sh\n");
+        } else {
+            fprintf(fp, "url = https://example.com/sites/site%05d.sh\n", i);
+        }
+        fprintf(fp, "dir = /tmp/site%05d\n", i);
+        fprintf(fp, "bin = /usr/bin/site%05d\n\n", i);
+    }
+    fclose(fp);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int sections = (argc > 1) ? atoi(argv[1]) : 10000;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 20;
+    char path[256];
+    char snap_path[256];
+    char name[64];
+    uint64_t *load_us;
+    uint64_t *snap_us;
+    uint64_t lookup_us;
+    Config cfg;
+
+    if (sections < 1 || iterations < 1) {
+        printf("Usage: config-bench [sections] [iterations]\n");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "config-bench-%d.conf", sections);
+    if (!write_catalog(path, sections)) {
+        printf("[ERROR] Cannot write %s\n", path);
+        return 1;
+    }
+    load_us = (uint64_t *)calloc((size_t)iterations, sizeof(uint64_t));
+    snap_us = (uint64_t *)calloc((size_t)iterations, sizeof(uint64_t));
+
+    for (int i = 0; i < iterations; i++) {
+        uint64_t start = now_us();
+        if (!load_config_file(path, &cfg)) {
+            printf("[ERROR] load_config_file failed\n");
+            return 1;
+        }
+        load_us[i] = now_us() - start;
+        if (i + 1 < iterations) config_free(&cfg);
+    }
+
+    /* 内容の確認: 全件登録・長い値の保持・全名前の検索 */
+    if (cfg.command_count != sections) {
+        printf("[ERROR] %d of %d sections loaded\n", cfg.command_count, sections);
+        return 1;
+    }
+    if (strlen(cfg.commands[sections / 2].url) != strlen("https://example.com/.sh") + LONG_VALUE_LEN) {
+        printf("[ERROR] long value truncated (%zu bytes)\n", strlen(cfg.commands[sections / 2].url));
+        return 1;
+    }
+
+    /* スナップショット: 書き出してから map + snapshot_load を計測 */
+    snprintf(snap_path, sizeof(snap_path), "config-bench-%d.snap", sections);
+    if (!snapshot_write(&cfg, path, snap_path)) {
+        printf("[ERROR] snapshot_write failed\n");
+        return 1;
+    }
+    for (int i = 0; i < iterations; i++) {
+        Config snap;
+        uint64_t start = now_us();
+        if (!snapshot_load_file(snap_path, "./", &snap)) {
+            printf("[ERROR] snapshot_load_file failed\n");
+            return 1;
+        }
+        snap_us[i] = now_us() - start;
+        if (snap.command_count != sections || !find_command(&snap, "site00000") ||
+            strcmp(snap.commands[sections / 2].url, cfg.commands[sections / 2].url) != 0) {
+            printf("[ERROR] snapshot content differs from text load\n");
+            return 1;
+        }
+        config_free(&snap);
+    }
+
+    lookup_us = now_us();
+    for (int i = 0; i < sections; i++) {
+        snprintf(name, sizeof(name), "site%05d", i);
+        CommandDef *c = find_command(&cfg, name);
+        if (!c || c != &cfg.commands[i]) {
+            printf("[ERROR] lookup failed: %s\n", name);
+            return 1;
+        }
+    }
+    lookup_us = now_us() - lookup_us;
+    if (find_command(&cfg, "missing")) {
+        printf("[ERROR] lookup of a missing name succeeded\n");
+        return 1;
+    }
+
+    qsort(load_us, (size_t)iterations, sizeof(uint64_t), compare_u64);
+    qsort(snap_us, (size_t)iterations, sizeof(uint64_t), compare_u64);
+    printf("sections:    %d (%d iterations)\n", sections, iterations);
+    printf("load:        min %.2f ms, p50 %.2f ms, p99 %.2f ms\n",
+        load_us[0] / 1000.0, load_us[(iterations - 1) / 2] / 1000.0,
+        load_us[(iterations * 99 + 99) / 100 - 1] / 1000.0);
+    printf("snapshot:    min %.2f ms, p50 %.2f ms, p99 %.2f ms\n",
+        snap_us[0] / 1000.0, snap_us[(iterations - 1) / 2] / 1000.0,
+        snap_us[(iterations * 99 + 99) / 100 - 1] / 1000.0);
+    printf("lookup:      %.0f ns per name\n", lookup_us * 1000.0 / sections);
+
+    config_free(&cfg);
+    free(load_us);
+    free(snap_us);
+    remove(path);
+    remove(snap_path);
+    return 0;
+}
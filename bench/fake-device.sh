@@ -0,0 +1,25 @@
+#!/bin/sh
+# Stand-in for an OpenWrt device, used as the forced command of the
+# benchmark SSH server. Runs the client's remote command with the
+# device paths (/etc, /root, /usr/bin) redirected into a sandbox
+# directory, so the key push and install script work unprivileged.
+#
+# Usage (from sshd_config / dropbear -c): fake-device.sh <sandbox-root>
+
+root="$1"
+cmd="$SSH_ORIGINAL_COMMAND"
+
+if [ -z "$cmd" ]; then
+    exec sh
+fi
+
+# Go through a placeholder so a rewritten path is never rewritten again
+cmd=$(printf '%s' "$cmd" | sed \
+    -e 's#/etc/#@SANDBOX@/etc/#g' \
+    -e 's#/root/#@SANDBOX@/root/#g' \
+    -e 's#/usr/bin/#@SANDBOX@/usr/bin/#g')
+cmd=$(printf '%s' "$cmd" | sed -e "s#@SANDBOX@#$root#g")
+
+PATH="$root/usr/bin:$PATH"
+export PATH
+exec sh -c "$cmd"
@@ -0,0 +1,184 @@
+/*
+ * inventory-bench.c - host inventory benchmark
+ *
+ * Builds an inventory of <hosts> records (sites, roles, one IPv4 each) in a
+ * scratch home directory, then times opening it, selecting by tag, by
+ * subnet and by both, looking up one name, journaled updates and the
+ * rewrite that folds the journal back into the base file.
+ *
+ * Build / run (from the repository root):
+ *   cc -std=gnu11 -O2 -pthread -o inventory-bench bench/inventory-bench.c
+ *   ./inventory-bench [hosts] [iterations]
+ */
+#define main openwrt_connect_main
+#include "../openwrt-connect.c"
+#undef main
+
+#define BENCH_SITES     40
+#define BENCH_UPDATES   200
+
+static const char *const SITES[] = { "tokyo", "osaka", "nagoya", "sapporo", "fukuoka" };
+static const char *const ROLES[] = { "ap", "gw", "switch" };
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void make_record(int i, HostRecord *r)
+{
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "host%05d", i);
+    snprintf(r->ips, sizeof(r->ips), "10.%d.%d.%d", i % BENCH_SITES, (i / 250) % 256, i % 250 + 1);
+    snprintf(r->tags, sizeof(r->tags), "role=%s,site=%s%s", ROLES[i % 3],
+             SITES[i % BENCH_SITES % 5], i % BENCH_SITES < 5 ? "" : "-branch");
+    snprintf(r->key, sizeof(r->key), "ed25519");
+    r->last_seen = 1700000000 + i;
+}
+
+/* 索引を使わない数え方 (結果の確認用) */
+static int count_linear(int hosts, const char *tag, int site)
+{
+    HostRecord r;
+    int n = 0;
+
+    for (int i = 0; i < hosts; i++) {
+        make_record(i, &r);
+        if (tag && !list_has(r.tags, tag)) continue;
+        if (site >= 0 && i % BENCH_SITES != site) continue;
+        n++;
+    }
+    return n;
+}
+
+static int time_select(const Inventory *inv, const char *selector, int iterations, uint64_t *us)
+{
+    int n = -1;
+
+    for (int i = 0; i < iterations; i++) {
+        int *hits;
+        uint64_t start = now_us();
+        n = inventory_select(inv, selector, &hits);
+        us[i] = now_us() - start;
+        free(hits);
+    }
+    qsort(us, (size_t)iterations, sizeof(uint64_t), compare_u64);
+    return n;
+}
+
+static void print_times(const char *label, const uint64_t *us, int iterations, int n)
+{
+    printf("%-26s p50 %5llu us, p99 %5llu us  (%d hosts)\n", label,
+        (unsigned long long)us[(iterations - 1) / 2],
+        (unsigned long long)us[(iterations * 99 + 99) / 100 - 1], n);
+}
+
+int main(int argc, char *argv[])
+{
+    int hosts = (argc > 1) ? atoi(argv[1]) : 10000;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 200;
+    char home[512], db_path[600], journal_path[600];
+    HostRecord *records, r;
+    Inventory inv;
+    uint64_t *us, start, open_us, update_us, compact_us;
+    int n;
+
+    if (hosts < BENCH_SITES || iterations < 1) {
+        printf("Usage: inventory-bench [hosts >= %d] [iterations]\n", BENCH_SITES);
+        return 1;
+    }
+    snprintf(home, sizeof(home), "inventory-bench-home");
+    make_dir(home);
+#ifdef _WIN32
+    _putenv_s(HOME_ENV, home);
+#else
+    setenv(HOME_ENV, home, 1);
+#endif
+    inventory_path("hosts.db", db_path, sizeof(db_path));
+    inventory_path("hosts.journal", journal_path, sizeof(journal_path));
+    remove(journal_path);
+
+    records = (HostRecord *)calloc((size_t)hosts, sizeof(HostRecord));
+    us = (uint64_t *)calloc((size_t)iterations, sizeof(uint64_t));
+    if (!records || !us) return 1;
+    for (int i = 0; i < hosts; i++) make_record(i, &records[i]);
+    qsort(records, (size_t)hosts, sizeof(HostRecord), host_record_compare);
+    if (!inventory_write_base(records, hosts, db_path)) {
+        printf("[ERROR] Cannot write %s\n", db_path);
+        return 1;
+    }
+
+    start = now_us();
+    if (!inventory_open(&inv)) {
+        printf("[ERROR] inventory_open failed\n");
+        return 1;
+    }
+    open_us = now_us() - start;
+    if (inventory_count(&inv) != hosts) {
+        printf("[ERROR] %d of %d hosts loaded\n", inventory_count(&inv), hosts);
+        return 1;
+    }
+
+    printf("hosts:       %d (%d iterations, base %s)\n\n", hosts, iterations, db_path);
+    n = time_select(&inv, "site=tokyo", iterations, us);
+    if (n != count_linear(hosts, "site=tokyo", -1)) {
+        printf("[ERROR] site=tokyo selected %d hosts\n", n);
+        return 1;
+    }
+    print_times("site=tokyo", us, iterations, n);
+
+    n = time_select(&inv, "10.7.0.0/16", iterations, us);
+    if (n != count_linear(hosts, NULL, 7)) {
+        printf("[ERROR] 10.7.0.0/16 selected %d hosts\n", n);
+        return 1;
+    }
+    print_times("10.7.0.0/16", us, iterations, n);
+
+    n = time_select(&inv, "site=tokyo,role=ap", iterations, us);
+    print_times("site=tokyo,role=ap", us, iterations, n);
+
+    n = time_select(&inv, "host04321", iterations, us);
+    print_times("name", us, iterations, n);
+
+    /* 追記による更新: 最終接続時刻とタグ */
+    start = now_us();
+    for (int i = 0; i < BENCH_UPDATES; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "host%05d", (i * 37) % hosts);
+        if (!inventory_touch(&inv, name, NULL, i % 2 ? "site=tokyo" : NULL)) {
+            printf("[ERROR] update of %s failed\n", name);
+            return 1;
+        }
+    }
+    update_us = now_us() - start;
+    n = time_select(&inv, "site=tokyo", iterations, us);
+    print_times("site=tokyo (+journal)", us, iterations, n);
+    if (!inventory_get(&inv, "host00037", &r) || strcmp(r.tags, "role=gw,site=tokyo") != 0) {
+        printf("[ERROR] journaled update not visible\n");
+        return 1;
+    }
+
+    start = now_us();
+    if (!inventory_compact(&inv)) {
+        printf("[ERROR] inventory_compact failed\n");
+        return 1;
+    }
+    compact_us = now_us() - start;
+    if (inventory_count(&inv) != hosts || inv.change_count != 0 ||
+        time_select(&inv, "site=tokyo", 1, us) != n) {
+        printf("[ERROR] rewritten inventory differs\n");
+        return 1;
+    }
+
+    printf("\nopen:        %.2f ms\n", open_us / 1000.0);
+    printf("update:      %.1f us per host (%d journaled)\n", (double)update_us / BENCH_UPDATES, BENCH_UPDATES);
+    printf("compact:     %.2f ms\n", compact_us / 1000.0);
+
+    inventory_close(&inv);
+    remove(db_path);
+    remove(journal_path);
+    free(records);
+    free(us);
+    return 0;
+}
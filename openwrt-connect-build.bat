@@ -51,9 +51,17 @@ REM ----------------------------------------
 echo Building openwrt-connect.exe...
 "%WINDRES%" openwrt-connect.rc -o openwrt-connect_res.o
 if %ERRORLEVEL% NEQ 0 ( echo [ERROR] windres failed & pause & exit /b 1 )
-"%GCC%" -o openwrt-connect.exe openwrt-connect.c openwrt-connect_res.o -mconsole -liphlpapi -lws2_32
+REM The exe requires admin (app.manifest), so the config snapshot is
+REM written by a helper built without the manifest and linked in as RCDATA.
+"%GCC%" -o openwrt-connect-snap.exe openwrt-connect.c -mconsole -liphlpapi -lws2_32
 if %ERRORLEVEL% NEQ 0 ( echo [ERROR] gcc failed & pause & exit /b 1 )
-del /Q openwrt-connect_res.o 2>nul
+openwrt-connect-snap.exe --compile-config openwrt-connect.snap
+if %ERRORLEVEL% NEQ 0 ( echo [ERROR] config snapshot failed & pause & exit /b 1 )
+"%WINDRES%" openwrt-connect-snap.rc -o openwrt-connect_snap.o
+if %ERRORLEVEL% NEQ 0 ( echo [ERROR] windres failed & pause & exit /b 1 )
+"%GCC%" -o openwrt-connect.exe openwrt-connect.c openwrt-connect_res.o openwrt-connect_snap.o -mconsole -liphlpapi -lws2_32
+if %ERRORLEVEL% NEQ 0 ( echo [ERROR] gcc failed & pause & exit /b 1 )
+del /Q openwrt-connect-snap.exe openwrt-connect.snap openwrt-connect_res.o openwrt-connect_snap.o 2>nul
 echo OK
 echo.
 
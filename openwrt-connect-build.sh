@@ -0,0 +1,87 @@
+#!/bin/sh
+# ========================================
+# OpenWrt Connect - POSIX build script
+# ========================================
+# Builds the core (config parser, script builder, discovery,
+# process runner) on Linux/macOS for development and benchmarks.
+# The shipping Windows build is openwrt-connect-build.bat.
+#
+# Usage: ./openwrt-connect-build.sh [output]
+#        ./openwrt-connect-build.sh test     (build and run tests/*.c)
+#   CC / CFLAGS are taken from the environment when set.
+
+set -e
+cd "$(dirname "$0")"
+
+echo "========================================"
+echo "OpenWrt Connect - Build Script (POSIX)"
+echo "========================================"
+echo
+
+# ----------------------------------------
+# Verify config file exists
+# ----------------------------------------
+if [ ! -f openwrt-connect.conf ]; then
+    echo "[ERROR] openwrt-connect.conf not found."
+    echo "This file defines available commands."
+    exit 1
+fi
+echo "Config: openwrt-connect.conf found"
+echo
+
+# ----------------------------------------
+# Find compiler
+# ----------------------------------------
+CC="${CC:-}"
+if [ -z "$CC" ]; then
+    for c in cc gcc clang; do
+        if command -v "$c" >/dev/null 2>&1; then
+            CC="$c"
+            break
+        fi
+    done
+fi
+if [ -z "$CC" ]; then
+    echo "[ERROR] C compiler not found (cc / gcc / clang)."
+    exit 1
+fi
+echo "Using: $CC"
+echo
+
+# ----------------------------------------
+# Tests (loopback, no device needed)
+# ----------------------------------------
+if [ "${1:-}" = "test" ]; then
+    CFLAGS="${CFLAGS:--O2 -Wall}"
+    TEST_DIR=$(mktemp -d "${TMPDIR:-/tmp}/owrt-test.XXXXXX")
+    trap 'rm -rf "$TEST_DIR"' EXIT
+    FAILED=0
+    for t in tests/*.c; do
+        name=$(basename "$t" .c)
+        echo "Building $name..."
+        # shellcheck disable=SC2086
+        "$CC" -std=gnu11 $CFLAGS -o "$TEST_DIR/$name" "$t" -pthread
+        echo "Running $name..."
+        "$TEST_DIR/$name" || FAILED=$((FAILED + 1))
+        echo
+    done
+    if [ "$FAILED" -ne 0 ]; then
+        echo "[ERROR] $FAILED test program(s) failed."
+        exit 1
+    fi
+    echo "All tests passed"
+    exit 0
+fi
+
+# ----------------------------------------
+# Build executable
+# ----------------------------------------
+OUT="${1:-openwrt-connect}"
+CFLAGS="${CFLAGS:--O2 -Wall}"
+
+echo "Building $OUT..."
+# shellcheck disable=SC2086
+"$CC" -std=gnu11 $CFLAGS -o "$OUT" openwrt-connect.c -pthread
+echo "OK"
+echo
+echo "Output: $OUT + openwrt-connect.conf"
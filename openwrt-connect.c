@@ -2,42 +2,567 @@
  * openwrt-connect.exe - Remote Setup Tool (Modular)
  *
  * Core features (built-in):
- *   - IPv4 gateway auto-detection
+ *   - Default gateway auto-detection (IPv4 / IPv6, ranked by route metric)
+ *   - Concurrent subnet scan for SSH devices (Dropbear / OpenSSH)
  *   - SSH key authentication management
  *   - .conf file driven command execution
  *
  * Usage:
  *   openwrt-connect.exe                  Interactive SSH connection
  *   openwrt-connect.exe <command>        Execute command defined in .conf
+ *   openwrt-connect.exe <command> <command>...
+ *                                        Execute several commands in order over one session
+ *   openwrt-connect.exe --scan [cidr]    Discover SSH devices on local subnets
+ *   openwrt-connect.exe --fleet <hosts> <command>
+ *                                        Run a command on many devices in parallel
+ *                                        (--live: show host-prefixed output as it arrives)
+ *   openwrt-connect.exe --push-keys <hosts>
+ *                                        Register the SSH key on many devices at once
+ *   openwrt-connect.exe --push <file> <path> [hosts]
+ *                                        Send a file in resumable checksummed chunks
+ *                                        (--compress: SSH compression)
+ *   openwrt-connect.exe --monitor <hosts>
+ *                                        Poll device health over persistent sessions
+ *                                        and store it as local time series
+ *   openwrt-connect.exe --monitor-query [host] [hours] [--csv]
+ *                                        Summarize the stored samples
+ *   openwrt-connect.exe --snapshot <hosts>
+ *                                        Record /etc/config per section (changed sections only)
+ *   openwrt-connect.exe --drift <hosts>
+ *                                        Report config changes since the last snapshot
+ *   openwrt-connect.exe --inventory [list|set|rm|import|compact] ...
+ *                                        Host inventory (name, addresses, tags, key, profile);
+ *                                        select with @<selector> wherever <hosts> is taken
+ *   openwrt-connect.exe --agent [status|stop]
+ *                                        Background agent keeping device sessions ready
+ *   openwrt-connect.exe --bench-link     Measure SSH ciphers / compression against a device
+ *                                        and keep the fastest for it
  *   openwrt-connect.exe --list           List available commands from .conf
  *   openwrt-connect.exe --help           Show usage
+ *   openwrt-connect.exe [command] --timing
+ *                                        Show per-phase timing after the session
+ *   openwrt-connect.exe [command] --trace <file>
+ *                                        Write a Chrome trace (JSON) of the launch
+ *   openwrt-connect.exe <command> --refresh
+ *                                        Check the script's url even within script_ttl
+ *   openwrt-connect.exe --compile-config [out]
+ *                                        Write the parsed .conf as a binary snapshot
  *
  * Configuration:
  *   Reads openwrt-connect.conf from the same directory as the executable.
- *   Commands are defined as [command.<name>] sections.
+ *   Commands are defined as [command.<name>] sections, named lists of
+ *   commands to run together as [sequence.<name>] sections.
+ *
+ * Portability:
+ *   The Windows build is the shipping target. The core (network probes,
+ *   .conf parser, script builder) also compiles on POSIX systems so it can
+ *   be exercised on Linux against local listeners.
  */
+#ifdef _WIN32
 #define _WIN32_WINNT 0x0600
 #include <winsock2.h>
 #include <windows.h>
 #include <ws2tcpip.h>
 #include <iphlpapi.h>
+#include <sddl.h>
+#include <conio.h>
+#include <io.h>
+
+#pragma comment(lib, "iphlpapi.lib")
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "advapi32.lib")
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+#endif
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 
-#pragma comment(lib, "iphlpapi.lib")
-#pragma comment(lib, "ws2_32.lib")
+/* ================================================== */
+/* Platform compatibility                             */
+/* ================================================== */
+#ifdef _WIN32
+typedef SOCKET sock_t;
+#define SOCK_INVALID        INVALID_SOCKET
+#define PATH_SEP            '\\'
+#define NULL_DEVICE         "NUL"
+#define HOME_ENV            "USERPROFILE"
+#define FILETIME_UNIX_EPOCH 116444736000000000ULL   /* 1970-01-01 in FILETIME units */
+#define sock_close(s)       closesocket(s)
+#define sock_poll(f, n, t)  WSAPoll((f), (ULONG)(n), (t))
+
+typedef HANDLE thread_t;
+typedef DWORD thread_ret_t;
+#define THREAD_CC           WINAPI
+typedef CRITICAL_SECTION mutex_t;
+#define mutex_init(m)       InitializeCriticalSection(m)
+#define mutex_destroy(m)    DeleteCriticalSection(m)
+#define mutex_lock(m)       EnterCriticalSection(m)
+#define mutex_unlock(m)     LeaveCriticalSection(m)
+typedef HANDLE file_lock_t;
+#define FILE_LOCK_NONE      INVALID_HANDLE_VALUE
+#else
+typedef int sock_t;
+#define SOCK_INVALID        (-1)
+#define PATH_SEP            '/'
+#define NULL_DEVICE         "/dev/null"
+#define HOME_ENV            "HOME"
+#define sock_close(s)       close(s)
+#define sock_poll(f, n, t)  poll((f), (nfds_t)(n), (t))
+
+typedef pthread_t thread_t;
+typedef void *thread_ret_t;
+#define THREAD_CC
+typedef pthread_mutex_t mutex_t;
+#define mutex_init(m)       pthread_mutex_init((m), NULL)
+#define mutex_destroy(m)    pthread_mutex_destroy(m)
+#define mutex_lock(m)       pthread_mutex_lock(m)
+#define mutex_unlock(m)     pthread_mutex_unlock(m)
+typedef int file_lock_t;
+#define FILE_LOCK_NONE      (-1)
+#endif
+
+typedef thread_ret_t (THREAD_CC *thread_fn)(void *);
+
+static int thread_start(thread_t *t, thread_fn fn, void *arg)
+{
+#ifdef _WIN32
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return (*t != NULL);
+#else
+    return (pthread_create(t, NULL, fn, arg) == 0);
+#endif
+}
+
+static void thread_join(thread_t t)
+{
+#ifdef _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
+}
+
+/* 終了を待たないスレッド */
+static void thread_detach(thread_t t)
+{
+#ifdef _WIN32
+    CloseHandle(t);
+#else
+    pthread_detach(t);
+#endif
+}
+
+static void sleep_ms(unsigned ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static int net_init(void)
+{
+#ifdef _WIN32
+    WSADATA wsa;
+    return (WSAStartup(MAKEWORD(2, 2), &wsa) == 0);
+#else
+    return 1;
+#endif
+}
+
+static int sock_set_nonblock(sock_t s)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    return (ioctlsocket(s, FIONBIO, &mode) == 0);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return (flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0);
+#endif
+}
+
+/* ノンブロッキングconnectが「接続中」で返ったか */
+static int sock_in_progress(void)
+{
+#ifdef _WIN32
+    return (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+    return (errno == EINPROGRESS);
+#endif
+}
+
+/* 単調増加クロック (ミリ秒) */
+static uint64_t now_ms(void)
+{
+#ifdef _WIN32
+    return (uint64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)(ts.tv_nsec / 1000000);
+#endif
+}
+
+/* 単調増加クロック (マイクロ秒, トレース用) */
+static uint64_t now_us(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER c;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&c);
+    return (uint64_t)(c.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t)(c.QuadPart % freq.QuadPart) * 1000000 / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)(ts.tv_nsec / 1000);
+#endif
+}
+
+/* スレッド番号 (トレースの tid) */
+static unsigned long thread_id(void)
+{
+#ifdef _WIN32
+    return (unsigned long)GetCurrentThreadId();
+#else
+    static unsigned long next_id = 0;
+    static __thread unsigned long id = 0;
+    if (id == 0) id = __sync_add_and_fetch(&next_id, 1);
+    return id;
+#endif
+}
+
+static void get_env(const char *name, char *buf, size_t size)
+{
+#ifdef _WIN32
+    if (!GetEnvironmentVariableA(name, buf, (DWORD)size)) buf[0] = '\0';
+#else
+    const char *v = getenv(name);
+    snprintf(buf, size, "%s", v ? v : "");
+#endif
+}
+
+static void make_dir(const char *path)
+{
+#ifdef _WIN32
+    CreateDirectoryA(path, NULL);
+#else
+    mkdir(path, 0700);
+#endif
+}
+
+/* 空のディレクトリを削除 */
+static void remove_dir(const char *path)
+{
+#ifdef _WIN32
+    RemoveDirectoryA(path);
+#else
+    rmdir(path);
+#endif
+}
+
+/* サイズと更新時刻 (Unix エポックからのナノ秒) */
+static int file_stat(const char *path, uint64_t *size, uint64_t *mtime)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    uint64_t ft;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fa)) return 0;
+    *size = ((uint64_t)fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+    /* FILETIME は 1601 年からの 100 ns 単位 */
+    ft = ((uint64_t)fa.ftLastWriteTime.dwHighDateTime << 32) | fa.ftLastWriteTime.dwLowDateTime;
+    *mtime = (ft > FILETIME_UNIX_EPOCH ? ft - FILETIME_UNIX_EPOCH : 0) * 100;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    *size = (uint64_t)st.st_size;
+#ifdef __APPLE__
+    *mtime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000 + (uint64_t)st.st_mtimespec.tv_nsec;
+#else
+    *mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+#endif
+    return 1;
+}
+
+/* ファイル全体を読み取り専用でマップ (空ファイル・失敗時は NULL) */
+static const void *map_file(const char *path, size_t *size)
+{
+#ifdef _WIN32
+    HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER len;
+    HANDLE m;
+    void *p = NULL;
+
+    if (f == INVALID_HANDLE_VALUE) return NULL;
+    if (GetFileSizeEx(f, &len) && len.QuadPart > 0) {
+        m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m) {
+            p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(m);
+        }
+        *size = (size_t)len.QuadPart;
+    }
+    CloseHandle(f);
+    return p;
+#else
+    struct stat st;
+    void *p = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) p = NULL;
+        *size = (size_t)st.st_size;
+    }
+    close(fd);
+    return p;
+#endif
+}
+
+static void unmap_file(const void *p, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(p);
+#else
+    munmap((void *)p, size);
+#endif
+}
+
+/* tmp を dst に置き換える (既存の dst は上書き) */
+static int replace_file(const char *tmp, const char *dst)
+{
+#ifdef _WIN32
+    return MoveFileExA(tmp, dst, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmp, dst) == 0;
+#endif
+}
+
+/* 開いているファイルを size バイトに切り詰める */
+static int file_truncate(FILE *fp, uint64_t size)
+{
+    if (fflush(fp) != 0) return 0;
+#ifdef _WIN32
+    return _chsize_s(_fileno(fp), (long long)size) == 0;
+#else
+    return ftruncate(fileno(fp), (off_t)size) == 0;
+#endif
+}
+
+/*
+ * path (なければ作る) の排他ロックを取る (別のプロセスとの書き込みの直列化)。
+ * wait = 0 なら、ほかが持っていればすぐ FILE_LOCK_NONE を返す。
+ * 同じプロセス内でも開くたびに別のロックになる。プロセスが終われば OS が外す
+ */
+static file_lock_t file_lock(const char *path, int wait)
+{
+#ifdef _WIN32
+    OVERLAPPED ov;
+    HANDLE h = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (h == INVALID_HANDLE_VALUE) return FILE_LOCK_NONE;
+    memset(&ov, 0, sizeof(ov));
+    if (!LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY), 0, 1, 0, &ov)) {
+        CloseHandle(h);
+        return FILE_LOCK_NONE;
+    }
+    return h;
+#else
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd < 0) return FILE_LOCK_NONE;
+    while (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return FILE_LOCK_NONE;
+        }
+    }
+    return fd;
+#endif
+}
+
+/* ハンドルを閉じればロックも外れる */
+static void file_unlock(file_lock_t lock)
+{
+    if (lock == FILE_LOCK_NONE) return;
+#ifdef _WIN32
+    CloseHandle(lock);
+#else
+    close(lock);
+#endif
+}
+
+/* 同梱のOpenSSHクライアント (ssh / ssh-keygen) のパス */
+static void get_ssh_tool(const char *sysroot, const char *tool, char *buf, size_t size)
+{
+#ifdef _WIN32
+    snprintf(buf, size, "%s\\System32\\OpenSSH\\%s.exe", sysroot, tool);
+#else
+    (void)sysroot;
+    snprintf(buf, size, "%s", tool);
+#endif
+}
 
 /* ================================================== */
 /* Configuration constants                            */
 /* ================================================== */
-#define MAX_COMMANDS        16
 #define MAX_VALUE_LEN       512
 #define MAX_LINE_LEN        1024
-#define MAX_CMD_BUF         8192
+#define MAX_ARGS            64
+#define AUTH_PROBE_TIMEOUT_MS       30000
+#define SSH_PORT            22
+#define APP_DATA_DIR        ".openwrt-connect"  /* under the user's home: scripts/, devices/ */
+
+/* Child processes (Windows: reader threads, wait on the process handle) */
+#define PROC_CANCEL_POLL_MS         100     /* how often a cancel flag is checked while waiting */
+#define PROC_DRAIN_WAIT_MS          2000    /* output still arriving after the child exited */
+
+/* --scan defaults (overridable in [general]) */
+#define SCAN_DEFAULT_CONCURRENCY    256
+#define SCAN_DEFAULT_TIMEOUT_MS     300
+#define SCAN_BANNER_TIMEOUT_MS      500
+#define SCAN_MIN_PREFIX             22      /* wider subnets are clamped around our own address */
+#define SCAN_MAX_SUBNETS            16
+
+/* Default gateway detection */
+#define GATEWAY_MAX_CANDIDATES      16
+#define GATEWAY_PROBE_COUNT         3       /* top-ranked candidates tried at once */
+#define GATEWAY_PROBE_TIMEOUT_MS    300
+
+/* Connection racing at startup (gateway, default_ip, link-local, last-known address) */
+#define RACE_MAX_CANDIDATES         8
+#define RACE_STAGGER_MS             250     /* head start of each candidate over the next */
+#define RACE_DEFAULT_TIMEOUT_MS     1000    /* connect + SSH banner, no RTT history */
+#define RACE_MIN_TIMEOUT_MS         200
+#define RACE_MAX_TIMEOUT_MS         5000
+#define RACE_LAST_IP_FILE           "last-ip"   /* under devices/ */
+#define AUTH_CONNECT_TIMEOUT        5       /* ssh ConnectTimeout (s) without RTT history */
+#define AUTH_CONNECT_MIN_TIMEOUT    2       /* a lost SYN is sent again after 1 s */
+
+/* --fleet defaults */
+#define FLEET_DEFAULT_CONCURRENCY   16
+#define FLEET_CONNECT_TIMEOUT       10
+#define FLEET_DEFAULT_TIMEOUT       600     /* s per host, 0 = no limit */
+#define FLEET_LOG_ROOT              "fleet-logs"    /* under APP_DATA_DIR */
+
+/* Output of concurrent remote runs (--fleet, parallel sequence steps) */
+#define OUTPUT_LINE_MAX             1024    /* longer lines are passed on in pieces */
+#define OUTPUT_TAIL_SIZE            2048    /* last bytes kept per host for the summary */
+#define OUTPUT_TAIL_LINES           5
+#define FLEET_COMBINED_LOG          "combined.log"
+
+/* Command sequences (several commands, or [sequence.*], in one launch) */
+#define SEQUENCE_MAX_DEPS           8
+
+/* --push-keys: the tool answers ssh's password prompt itself (SSH_ASKPASS) */
+#define ASKPASS_FLAG_ENV            "OWRT_ASKPASS"      /* "<loopback port>:<token>" */
+#define ASKPASS_TOKEN_BYTES         16
+#define ASKPASS_REPLY_TIMEOUT_MS    5000
+#define ASKPASS_MIN_SSH_VERSION     804     /* SSH_ASKPASS_REQUIRE=force: OpenSSH 8.4+ */
+#define KEY_PUSH_TIMEOUT_MS         60000
+
+/* SSH connection reuse (OpenSSH ControlMaster) */
+#define SSH_MUX_DEFAULT_PERSIST     60      /* seconds the master stays up after last use */
+
+/* --agent: background process holding prepared device sessions */
+#define AGENT_PROTOCOL_VERSION      2
+#define AGENT_DEFAULT_IDLE_TIMEOUT  600     /* seconds a session is kept without a launch */
+#define AGENT_CHECK_INTERVAL_MS     30000   /* health check of each kept session */
+#define AGENT_MAX_SESSIONS          16
+#define AGENT_REQUEST_TIMEOUT_MS    1000    /* HELLO / DETECT / WARM from a launch */
+#define AGENT_SOCKET_NAME           "agent.sock"            /* POSIX: under APP_DATA_DIR */
+#define AGENT_PIPE_PREFIX           "\\\\.\\pipe\\openwrt-connect-"   /* Windows: + user name */
+#define MAX_PHASES                  16
+#define CONFIG_SNAPSHOT_FILE        "openwrt-connect.snap"     /* --compile-config, next to the exe */
+#define CONFIG_SNAPSHOT_DIR         "config"    /* under APP_DATA_DIR: <exe dir hash>.snap */
+#define CONFIG_SNAPSHOT_RESOURCE    "CONFIG_SNAPSHOT"
+#define CONFIG_SNAPSHOT_VERSION     2           /* bump when Config or CommandDef changes */
+#define SPECULATE_PORT_TIMEOUT_MS   1000    /* TCP probe while the user is typing */
+
+/* Remote script cache (client side, content-addressed) */
+#define SCRIPT_FETCH_TIMEOUT_SEC    15
+#define SCRIPT_STALE_EXIT           93      /* device copy missing or outdated: push and rerun */
+#define KEY_INLINE_FAILED_EXIT      94      /* first-contact session could not register the key */
+#define SCRIPT_WRAPPER_TAG          "# openwrt-connect 2"   /* bump when the wrapper format changes */
+#define SCRIPT_DEFAULT_TTL          3600    /* seconds a checked script is used without asking the server */
+
+/* Cipher / compression choice per device */
+#define LINK_BENCH_BYTES            (4 * 1024 * 1024)   /* --bench-link: sent per option */
+#define LINK_TUNE_BYTES             (512 * 1024)        /* link_tune = on: first login of a device */
+#define LINK_BENCH_TIMEOUT_MS       60000
+
+/* --push: chunked file transfer */
+#define PUSH_CHUNK_SIZE             (1024 * 1024)
+#define PUSH_RETRIES                2       /* resumes after a dropped transfer */
+#define PUSH_TIMEOUT_MS             120000  /* inventory ssh, and the transfer ssh's base */
+#define PUSH_CHUNK_TIMEOUT_MS       30000   /* added to the transfer ssh per chunk sent */
+#define PUSH_PARTIAL_SUFFIX         ".owc-"     /* <destination>.owc-<hash>: resumable partial file */
+
+/* --monitor: health poller and time-series files */
+#define MONITOR_DEFAULT_INTERVAL    30      /* seconds between samples */
+#define MONITOR_RECONNECT_MS        15000   /* wait before reopening a lost session */
+#define MONITOR_SUMMARY_DELAY       3       /* seconds after each round before the summary line */
+#define MONITOR_REPLY_MAX           8192    /* bytes of one sample's output kept for parsing */
+#define MONITOR_KEYFRAME_EVERY      240     /* absolute record after this many deltas */
+#define MONITOR_MAX_HOSTS           4096
+#define MONITOR_FILE_MAGIC          "OWTS1\n"
+
+/* --snapshot / --drift: per-section config snapshots (content-addressed) */
+#define SNAPSHOT_TIMEOUT_MS         120000  /* one host: hash listing + changed sections */
+#define SNAPSHOT_MAX_SECTIONS       4096    /* per device */
+#define SNAPSHOT_DETAIL_LINES       20      /* changed lines shown per section in the drift report */
+#define SNAPSHOT_MANIFEST_TAG       "# openwrt-connect snapshot 1"
+
+/* --inventory: host records (mapped base file + journal) */
+#define INVENTORY_VERSION           1
+#define INVENTORY_JOURNAL_MAX       256     /* journaled changes before the base file is rewritten */
+#define INVENTORY_MAX_TERMS         8       /* conditions in one selector */
 /* .conf自動検出: exeと同ディレクトリの最初の.confファイルを使用 */
 static int find_conf_file(const char *exe_dir, char *conf_path, size_t size)
 {
+#ifdef _WIN32
     WIN32_FIND_DATAA fd;
     HANDLE hFind;
     char pattern[MAX_VALUE_LEN];
@@ -49,56 +574,522 @@ static int find_conf_file(const char *exe_dir, char *conf_path, size_t size)
     snprintf(conf_path, size, "%s%s", exe_dir, fd.cFileName);
     FindClose(hFind);
     return 1;
+#else
+    DIR *d = opendir(exe_dir);
+    struct dirent *de;
+    int found = 0;
+
+    if (!d) return 0;
+    while (!found && (de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len > 5 && strcmp(de->d_name + len - 5, ".conf") == 0) {
+            snprintf(conf_path, size, "%s%s", exe_dir, de->d_name);
+            found = 1;
+        }
+    }
+    closedir(d);
+    return found;
+#endif
 }
 
-#define SSH_OPTS \
-    " -o StrictHostKeyChecking=no" \
-    " -o UserKnownHostsFile=NUL" \
-    " -o GlobalKnownHostsFile=NUL" \
-    " -o HostKeyAlgorithms=+ssh-rsa" \
-    " -o PubkeyAcceptedKeyTypes=+ssh-rsa" \
-    " -o LogLevel=ERROR"
+/* 全ての ssh 呼び出しに付ける -o オプション */
+/* ホスト鍵はツール専用の known_hosts に記録する (UserKnownHostsFile は ssh_build_args で追加) */
+static const char *const SSH_BASE_OPTS[] = {
+    "StrictHostKeyChecking=accept-new",
+    "GlobalKnownHostsFile=" NULL_DEVICE,
+    "HashKnownHosts=no",
+    "UpdateHostKeys=no",
+    "HostKeyAlgorithms=+ssh-rsa",   /* 古い dropbear は RSA のホスト鍵しか持たない (追加のみで優先度は変えない) */
+    "LogLevel=ERROR",
+    NULL
+};
+
+/* --bench-link / link_tune で比べる暗号 (記録した選択の後ろにも予備として付ける) */
+static const char *const LINK_CIPHERS[] = {
+    "chacha20-poly1305@openssh.com",
+    "aes128-gcm@openssh.com",
+    "aes128-ctr",
+    NULL
+};
+#define LINK_CIPHER_COUNT   (sizeof(LINK_CIPHERS) / sizeof(LINK_CIPHERS[0]) - 1)
 
 /* ================================================== */
 /* Data structures                                    */
 /* ================================================== */
+/* 文字列は Config のアリーナ内 (.conf の本文) を指す。未設定は "" */
 typedef struct {
-    char name[64];           /* command name (section key) */
-    char label[MAX_VALUE_LEN];
-    char icon[MAX_VALUE_LEN];
-    char url[MAX_VALUE_LEN];
-    char dir[MAX_VALUE_LEN];
-    char bin[MAX_VALUE_LEN];
+    const char *name;        /* command name (section key) */
+    const char *label;
+    const char *icon;
+    const char *url;
+    const char *dir;
+    const char *bin;
+    const char *manifest;    /* url of the script's SHA-256 (optional) */
+    const char *steps;       /* [sequence.*]: command names, "name:dep+dep" for dependencies */
 } CommandDef;
 
+/* クライアント鍵の種類 (速い順) */
+typedef enum {
+    KEY_ED25519 = 0,
+    KEY_RSA,                 /* dropbear 2020.79 より前は ed25519 を受け付けない */
+    KEY_TYPE_COUNT
+} KeyType;
+
 typedef struct {
-    char product_name[MAX_VALUE_LEN];
-    char default_ip[64];
-    char ssh_user[64];
-    char ssh_key_prefix[64];
-    CommandDef commands[MAX_COMMANDS];
+    const char *product_name;
+    const char *default_ip;
+    const char *ssh_user;
+    const char *ssh_key_prefix;
+    int key_type;            /* KeyType tried first on a new device */
+    int key_shared;          /* one key for all devices instead of one per IP */
+    int ssh_port;
+    int scan_concurrency;    /* --scan: max in-flight probes */
+    int scan_timeout_ms;     /* --scan: connect timeout per host */
+    int fleet_concurrency;   /* --fleet: max hosts running at once */
+    int fleet_log_compress;  /* --fleet: pack the logs into <date-time>.tar.gz afterwards */
+    int fleet_timeout;       /* --fleet: seconds before a host's command is stopped (0 = no limit) */
+    int ssh_mux;             /* share one SSH connection between steps (0 = off) */
+    int ssh_mux_persist;     /* ControlPersist seconds */
+    int speculate;           /* prepare the default IP while the prompt waits */
+    int connect_race;        /* race the candidate addresses at startup (0 = gateway probe only) */
+    int script_push;         /* fetch url scripts here and send them over ssh (0 = device wget) */
+    int script_ttl;          /* seconds a checked script is reused (client cache and device wrapper) */
+    int agent;               /* ask the background agent for a prepared session (0 = off) */
+    int agent_idle_timeout;  /* seconds the agent keeps a session nobody uses */
+    int link_tune;           /* measure ciphers on a device's first login and keep the fastest */
+    int monitor_interval;    /* --monitor: seconds between samples */
+    CommandDef *commands;    /* in arena, file order */
     int command_count;
+    int *command_index;      /* name hash -> commands[] index (-1 = empty) */
+    int index_size;          /* power of two */
+    char *arena;             /* .conf text + tables, one allocation */
+    const char *loaded_from; /* "text" / "snapshot" / "embedded snapshot" / "defaults" */
+    const void *snapshot;    /* mapped snapshot file (NULL = none) */
+    size_t snapshot_size;
 } Config;
 
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+/* 子プロセスに渡す引数リスト (各要素はヒープに複製) */
+typedef struct {
+    char *argv[MAX_ARGS + 1];
+    int argc;
+} ArgList;
+
+typedef enum {
+    PROC_IN_NULL = 0,        /* 空の標準入力 */
+    PROC_IN_INHERIT,         /* コンソールを引き継ぐ */
+    PROC_IN_FILE,            /* in_path の内容 */
+    PROC_IN_DATA             /* in_data / in_len の内容 */
+} ProcInMode;
+
+typedef enum {
+    PROC_OUT_CAPTURE = 0,    /* パイプで受け取る */
+    PROC_OUT_INHERIT,        /* コンソールへそのまま出力 */
+    PROC_OUT_NULL
+} ProcOutMode;
+
+/* stream: 1 = stdout, 2 = stderr */
+typedef void (*proc_output_fn)(void *ctx, int stream, const char *data, size_t len);
+
+typedef struct {
+    ProcInMode in;
+    const char *in_path;
+    const char *in_data;
+    size_t in_len;
+    ProcOutMode out;
+    int merge_stderr;        /* stderr を stdout と同じストリームで受け取る */
+    int echo;                /* 受け取った出力をこちらのコンソールにも流す */
+    proc_output_fn on_output;/* 指定時は ProcResult に蓄積しない */
+    void *ctx;
+    int timeout_ms;          /* 0 = 無制限 */
+    volatile int *cancel;    /* 1 になったら子プロセスを終了 */
+    const char *const *env;  /* 追加・上書きする環境変数 "NAME=value" (NULL 終端, NULL = 引き継ぐだけ) */
+} ProcOptions;
+
+typedef struct {
+    int exit_code;           /* -1 = 起動失敗 */
+    int timed_out;
+    int cancelled;
+    StrBuf out;
+    StrBuf err;
+} ProcResult;
+
+/*
+ * 出力を受け取り続ける長時間の子プロセス (--monitor のデバイスごとの ssh)。
+ * 標準入力は空、stdout と stderr は1本のパイプ。多数の子の出力を ProcWaiter で
+ * 1つのスレッドから待つ (POSIX: poll, Windows: I/O 完了ポート)
+ */
+typedef struct ProcChild ProcChild;
+
+/* len = 0 は終了 (パイプが閉じて子プロセスは回収済み、running = 0) */
+typedef void (*proc_child_fn)(ProcChild *c, const char *data, size_t len);
+
+struct ProcChild {
+    void *ctx;
+    int running;
+#ifdef _WIN32
+    HANDLE process;
+    HANDLE job;
+    HANDLE pipe;
+    OVERLAPPED ov;           /* 読み取り中の1回分 (完了ポートのキーはこの ProcChild) */
+    char buf[4096];
+#else
+    pid_t pid;               /* プロセスグループの番号も兼ねる */
+    int fd;
+#endif
+};
+
+typedef struct {
+#ifdef _WIN32
+    HANDLE port;
+#else
+    int wake[2];             /* 別スレッドから待ちを解くためのパイプ */
+#endif
+} ProcWaiter;
+
+/* 接続したことのあるデバイス (ホスト鍵のフィンガープリントごとに1件) */
+typedef struct {
+    char fingerprint[64];    /* "SHA256:<base64>" of the host key */
+    char host_key[32];       /* host key algorithm (ssh-ed25519, ssh-rsa, ...) */
+    char ip[64];             /* last address it answered on */
+    char daemon[16];         /* dropbear / openssh / other ("" = not seen) */
+    char banner[128];
+    char board[64];          /* /tmp/sysinfo/board_name */
+    char release[96];        /* DISTRIB_DESCRIPTION from /etc/openwrt_release */
+    char key_type[16];       /* client key type the device accepted ("" = none yet) */
+    char cipher[48];         /* fastest cipher measured by --bench-link / link_tune ("" = ssh default) */
+    char compression[4];     /* "yes" / "no" with cipher */
+    char rtt[24];            /* "srtt/rttvar" ms of connect + SSH banner ("" = not measured) */
+    int64_t first_seen;
+    int64_t last_seen;
+} DeviceInfo;
+
+/* ssh の接続先と認証方法 */
+typedef struct {
+    const char *sysroot;
+    const char *user;
+    const char *host;
+    const char *key_path;    /* NULL = パスワード認証 */
+    KeyType key_type;        /* key_path の鍵の種類 */
+    DeviceInfo *device;      /* 登録済みの情報 (NULL = 不明)。認証確認で不足分を補う */
+    const char *ssh_dir;     /* ControlPath の置き場所 (NULL = 接続再利用なし) */
+    const Config *cfg;
+    volatile int *cancel;    /* NULL = 中断なし */
+} SshTarget;
+
+typedef enum {
+    AUTH_OK = 0,
+    AUTH_DENIED,             /* 接続できたが鍵が受け付けられない */
+    AUTH_UNREACHABLE,        /* 接続自体ができない */
+    AUTH_HOST_CHANGED        /* 記録と違うホスト鍵 (再インストール・別の機器) */
+} AuthResult;
+
+typedef enum {
+    SSH_DAEMON_NONE = 0,     /* port open, no SSH banner */
+    SSH_DAEMON_DROPBEAR,
+    SSH_DAEMON_OPENSSH,
+    SSH_DAEMON_OTHER
+} SshDaemon;
+
+typedef struct {
+    uint32_t network;        /* host byte order */
+    int prefix;
+    uint32_t self;           /* our own address on this subnet (0 = none) */
+} Subnet;
+
+typedef struct {
+    uint32_t addr;           /* host byte order */
+    SshDaemon daemon;
+    int rtt_ms;              /* TCP connect time */
+    char banner[128];
+} ScanResult;
+
+/* 既定ゲートウェイの候補 */
+typedef struct {
+    char ip[64];             /* IPv6 リンクローカルは "%<インターフェース>" 付き */
+    int family;              /* AF_INET / AF_INET6 */
+    uint32_t metric;         /* 実効メトリック (小さいほど優先) */
+} GatewayCandidate;
+
+/* 起動時の接続の競争で最初に SSH バナーを返したアドレス */
+typedef struct {
+    char ip[64];
+    const char *source;      /* "gateway" / "default_ip" / "link-local" / "last-known" */
+    int rtt_ms;              /* connect + SSH banner */
+    char banner[128];
+    int candidates;          /* addresses raced */
+} RaceResult;
+
+/* ローカルキャッシュから取り出したリモートスクリプト */
+typedef struct {
+    char *data;
+    size_t len;
+    char hash[65];           /* SHA-256 (hex) */
+    const char *source;      /* "download" / "cache" */
+} ScriptBlob;
+
+/* プロンプト入力中に既定IPに対して先行して行う準備 */
+typedef struct {
+    const Config *cfg;
+    const char *sysroot;
+    char ip[256];
+    KeyType key_type;
+    DeviceInfo device;       /* 記録 + この接続で分かったこと */
+    int device_known;
+    char key_path[512];
+    char pub_path[512];
+    char ssh_dir[512];
+    volatile int cancel;
+    int started;
+    thread_t thread;
+    /* 以下はスレッド終了後に参照 */
+    int port_open;           /* -1 = 未確認, 0 = 応答なし, 1 = 開いている */
+    int have_key;
+    int auth_done;
+    AuthResult auth;
+    char detail[256];
+} Speculation;
+
+/* 並列に動く ssh の出力の行き先 (コンソール・まとめログ) */
+typedef struct {
+    mutex_t lock;
+    FILE *combined;          /* 全ホストの行を1つにまとめたログ (NULL = なし) */
+    int live;                /* 行を "[名前] 行" としてコンソールにも表示 */
+    uint64_t start_ms;
+} OutputMux;
+
+/* 1ホスト (1手順) 分の出力。メモリは固定サイズ */
+typedef struct {
+    OutputMux *mux;
+    const char *name;
+    FILE *log;               /* 全出力をそのまま書く (NULL = なし) */
+    char line[OUTPUT_LINE_MAX];      /* 表示待ちの行の途中 */
+    size_t line_len;
+    char tail[OUTPUT_TAIL_SIZE];     /* 最後の出力 (リングバッファ) */
+    size_t tail_pos;
+    int tail_wrapped;
+} OutputStream;
+
+/* --push で送るファイル */
+typedef struct {
+    const char *local;
+    char remote[512];        /* デバイス側のパス */
+    const char *data;        /* マップしたファイル (空のファイルは NULL) */
+    size_t len;
+    char hash[65];           /* 全体の SHA-256 (hex) */
+    char (*chunk_hash)[65];  /* PUSH_CHUNK_SIZE ごとの SHA-256 */
+    int chunk_count;
+    int compress;            /* ssh の圧縮を使う */
+} PushFile;
+
+/* インベントリの1ホスト (空の文字列 = 未設定) */
+typedef struct {
+    char name[64];
+    char ips[128];           /* comma-separated; the first is the address used to connect */
+    char tags[256];          /* "key=value" comma-separated, sorted */
+    char key[16];            /* key type registered on the host (KEY_TYPE_NAMES) */
+    char profile[64];        /* command or sequence the host is set up with */
+    int64_t last_seen;       /* last successful contact (unix seconds, 0 = never) */
+} HostRecord;
+
+typedef struct Inventory Inventory;
+
+/* 1回の起動で続けて実行するコマンド (複数指定・[sequence.*]) */
+typedef enum {
+    STEP_PENDING = 0,
+    STEP_RUNNING,
+    STEP_OK,
+    STEP_FAILED,
+    STEP_SKIPPED
+} StepStatus;
+
+typedef struct SeqRun SeqRun;
+
+typedef struct {
+    SeqRun *run;
+    const CommandDef *cmd;
+    int deps[SEQUENCE_MAX_DEPS];     /* 先に成功している必要がある steps[] の添字 */
+    int dep_count;
+    ScriptBlob script;
+    StepStatus status;
+    int exit_code;
+    uint64_t start_ms;
+    uint64_t end_ms;
+    char note[64];
+    OutputStream out;        /* 並列実行時の出力 */
+} SeqStep;
+
+struct SeqRun {
+    char title[MAX_VALUE_LEN];
+    const Config *cfg;
+    const char *sysroot;
+    const SshTarget *target;
+    int refresh;
+    SeqStep *steps;
+    int count;
+    int graph;               /* 依存を書いた手順がある: 並列に実行し、出力に手順名を付ける */
+    int stopped;             /* 失敗した手順があった (以降は始めない) */
+    int done;
+    mutex_t lock;
+    OutputMux mux;           /* 並列実行時: 手順名を付けてコンソールへ */
+};
+
 /* ================================================== */
 /* Forward declarations                               */
 /* ================================================== */
 /* Network */
 int is_private_ip(const char *ip);
+int gateway_candidates(GatewayCandidate *out, int max);
 int get_default_gateway(char *ip, size_t size);
-int detect_router_ip(char *ip, size_t size);
+int route_watch_start(void);
+int detect_router_ip(const Config *cfg, char *ip, size_t size);
+
+/* Discovery */
+SshDaemon classify_ssh_banner(const char *banner);
+int parse_cidr(const char *text, Subnet *out);
+int get_local_subnets(Subnet *out, int max);
+int scan_hosts(const uint32_t *hosts, int count, int port, int concurrency,
+               int timeout_ms, ScanResult *results);
+int run_scan(const Config *cfg, int argc, char *argv[]);
+
+/* Connection racing */
+void rtt_update(DeviceInfo *d, int sample_ms);
+int race_connect(const Config *cfg, RaceResult *out);
+void race_remember(const char *ip);
 
 /* SSH key */
 int file_exists(const char *path);
-void get_key_paths(const Config *cfg, const char *ip, char *priv, char *pub, char *ssh_dir, size_t size);
-int ensure_ssh_key(const char *sysroot, const char *key_path, const char *ssh_dir);
-int test_key_auth(const char *sysroot, const char *key_path, const char *ip, const char *user);
-int send_public_key(const char *sysroot, const char *pub_path, const char *ip, const char *user);
+int key_type_from_name(const char *name);
+void get_key_paths(const Config *cfg, const char *ip, KeyType type, char *priv, char *pub,
+                   char *ssh_dir, size_t size);
+int key_type_recorded(const Config *cfg, const char *host, KeyType *type);
+void key_type_remember(const Config *cfg, const char *host, DeviceInfo *d, KeyType type);
+KeyType key_choose(const Config *cfg, const char *host, const char *banner);
+int key_for_host(const Config *cfg, const char *host, KeyType *type, char *key_path, char *pub_path,
+                 char *ssh_dir, size_t size);
+int ensure_ssh_key(const char *sysroot, KeyType type, const char *key_path, const char *ssh_dir);
+AuthResult test_key_auth(const SshTarget *t, char *detail, size_t detail_size);
+int send_public_key(const SshTarget *t, const char *pub_path);
+AuthResult key_migrate_legacy(SshTarget *t, char *key_path, char *pub_path, size_t size);
+int key_reauth(const SshTarget *t, const char *pub_path, char *detail, size_t detail_size);
+int key_install_inline(const SshTarget *t, const char *pub_path, StrBuf *sb);
+
+/* Process runner */
+void proc_init(void);
+int proc_run(const char *const argv[], const ProcOptions *opt, ProcResult *res);
+void proc_result_free(ProcResult *res);
+int proc_waiter_init(ProcWaiter *w);
+void proc_waiter_free(ProcWaiter *w);
+void proc_waiter_wake(ProcWaiter *w);
+int proc_child_start(ProcWaiter *w, const char *const argv[], ProcChild *c);
+void proc_child_stop(ProcChild *c);
+int proc_children_wait(ProcWaiter *w, ProcChild *const kids[], int count, int timeout_ms, proc_child_fn fn);
+
+/* Tracing */
+int trace_enabled(void);
+void trace_complete(const char *name, const char *cat, uint64_t start_us, const char *args);
+void trace_thread_name(const char *name);
+
+/* SSH invocation */
+void ssh_build_args(const SshTarget *t, ArgList *a);
+void ssh_add_destination(const SshTarget *t, ArgList *a);
+
+/* Connection reuse */
+int ssh_mux_available(const Config *cfg);
+void add_ssh_mux_args(ArgList *a, const Config *cfg, const char *ssh_dir);
+int ssh_mux_check(const SshTarget *t);
+void ssh_mux_close(const SshTarget *t);
+
+/* Speculative startup */
+void speculate_start(Speculation *sp, const Config *cfg, const char *sysroot, const char *ip);
+void speculate_join(Speculation *sp);
+void speculate_cancel(Speculation *sp);
+
+/* Device registry */
+void known_hosts_path(char *buf, size_t size);
+int known_host_fingerprint(const Config *cfg, const char *host, char *fp, size_t fp_size,
+                           char *alg, size_t alg_size);
+void known_hosts_forget(const Config *cfg, const char *host);
+int device_lookup(const Config *cfg, const char *host, DeviceInfo *d);
+int device_learned(const Config *cfg, const char *host, const DeviceInfo *learned);
+void device_forget_host(const Config *cfg, const char *host);
+void device_set_banner(DeviceInfo *d, const char *banner);
+
+/* Inventory */
+int inventory_open(Inventory *inv);
+void inventory_close(Inventory *inv);
+int inventory_compact(Inventory *inv);
+int inventory_count(const Inventory *inv);
+int inventory_get(const Inventory *inv, const char *name, HostRecord *out);
+int inventory_find_host(const Inventory *inv, const char *host, HostRecord *out);
+int inventory_put(Inventory *inv, const HostRecord *r);
+int inventory_remove(Inventory *inv, const char *name);
+int inventory_touch(Inventory *inv, const char *host, const char *key, const char *tags);
+int inventory_record_scan(const ScanResult *results, int count);
+void inventory_address(const HostRecord *r, char *buf, size_t size);
+int inventory_select(const Inventory *inv, const char *selector, int **out);
+void inventory_hit(const Inventory *inv, int hit, HostRecord *out);
+int run_inventory(int argc, char *argv[]);
+
+/* Link tuning */
+int link_tune(const SshTarget *t, DeviceInfo *d, size_t bytes, int report);
 
 /* Config */
 int load_config(const char *exe_path, Config *cfg);
+int load_config_file(const char *path, Config *cfg);
+void config_free(Config *cfg);
+int snapshot_write(const Config *cfg, const char *conf_path, const char *snap_path);
+int snapshot_load(const void *data, size_t size, const char *exe_dir, int allow_missing_source,
+                  Config *cfg);
+int snapshot_load_file(const char *snap_path, const char *exe_dir, Config *cfg);
+void snapshot_user_path(const char *exe_dir, char *buf, size_t size);
+int snapshot_load_embedded(const char *exe_dir, Config *cfg);
 CommandDef* find_command(Config *cfg, const char *name);
-void build_install_script(const CommandDef *cmd, char *buf, size_t size);
+/* Script cache */
+int script_cache_get(const Config *cfg, const CommandDef *cmd, const char *sysroot, int refresh,
+                     ScriptBlob *out);
+void script_blob_free(ScriptBlob *s);
+int script_push(ArgList *ssh_args, const CommandDef *cmd, const ScriptBlob *s, int ttl, ProcOptions *opt);
+
+void build_install_script(const CommandDef *cmd, const char *hash, int ttl, StrBuf *sb);
+void build_remote_command(const CommandDef *cmd, const char *hash, int ttl, int refresh, StrBuf *sb);
+
+/* Fleet */
+int run_fleet(const Config *cfg, const char *sysroot, const char *hosts_spec, const char *cmd_name,
+              int refresh, int live);
+int run_push_keys(const Config *cfg, const char *sysroot, const char *hosts_spec);
+
+/* File push */
+int push_file_load(const char *local, const char *remote, int compress, PushFile *f);
+void push_file_free(PushFile *f);
+int push_to_host(const SshTarget *t, const PushFile *f, char *stats, size_t stats_size);
+int run_push_fleet(const Config *cfg, const char *sysroot, const char *hosts_spec, const PushFile *f);
+
+/* Health monitor */
+int run_monitor(const Config *cfg, const char *sysroot, const char *hosts_spec);
+int run_monitor_query(const char *host, int hours, int csv);
+
+/* Configuration snapshots */
+int run_snapshot(const Config *cfg, const char *sysroot, const char *hosts_spec, int record);
+
+/* Sequence */
+int sequence_build(Config *cfg, int count, char *names[], SeqRun *run);
+void sequence_fetch_scripts(SeqRun *run);
+int sequence_run(SeqRun *run);
+void sequence_free(SeqRun *run);
+
+/* Agent */
+int agent_request(const char *request, char *reply, size_t size, int timeout_ms);
+int agent_connect(const Config *cfg);
+int agent_prepare(const Config *cfg, const char *host, KeyType *type, char *key_path, size_t size);
+void agent_warm(const char *host);
+int run_agent(const Config *cfg, const char *sysroot);
+int agent_command(const Config *cfg, const char *sysroot, const char *action);
 
 /* ================================================== */
 /* Utility functions                                  */
@@ -116,323 +1107,9675 @@ static void trim(char *s)
         *end-- = '\0';
 }
 
-static void get_exe_dir(char *buf, size_t size)
+static void get_exe_path(char *buf, size_t size)
 {
+#ifdef _WIN32
     GetModuleFileNameA(NULL, buf, (DWORD)size);
-    char *last_sep = strrchr(buf, '\\');
+#else
+    ssize_t n = readlink("/proc/self/exe", buf, size - 1);
+    buf[n > 0 ? n : 0] = '\0';
+#endif
+}
+
+static void get_exe_dir(char *buf, size_t size)
+{
+    get_exe_path(buf, size);
+    char *last_sep = strrchr(buf, PATH_SEP);
     if (last_sep) *(last_sep + 1) = '\0';
 }
 
+/* JSON 文字列用にエスケープ (収まらない分は切り捨て) */
+static void json_escape(const char *in, char *out, size_t size)
+{
+    size_t o = 0;
+
+    for (; *in && o + 7 < size; in++) {
+        unsigned char c = (unsigned char)*in;
+        if (c == '"' || c == '\\') {
+            out[o++] = '\\';
+            out[o++] = (char)c;
+        } else if (c < 0x20) {
+            o += (size_t)snprintf(out + o, size - o, "\\u%04x", c);
+        } else {
+            out[o++] = (char)c;
+        }
+    }
+    out[o] = '\0';
+}
+
+/* ホスト名をログファイル名に使える形へ */
+static void safe_file_name(const char *in, char *out, size_t size)
+{
+    size_t i;
+    for (i = 0; in[i] && i < size - 1; i++) {
+        char c = in[i];
+        int ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                 (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_';
+        out[i] = ok ? c : '_';
+    }
+    out[i] = '\0';
+}
+
+/* ~/.openwrt-connect/<sub> (なければ作る) */
+static void app_data_dir(const char *sub, char *buf, size_t size)
+{
+    char home[512] = {0};
+
+    get_env(HOME_ENV, home, sizeof(home));
+    snprintf(buf, size, "%s%c%s", home, PATH_SEP, APP_DATA_DIR);
+    make_dir(buf);
+    snprintf(buf + strlen(buf), size - strlen(buf), "%c%s", PATH_SEP, sub);
+    make_dir(buf);
+}
+
+/* ファイル全体をヒープに読み込む (末尾に '\0' を付ける) */
+static char *read_whole_file(const char *path, size_t *len)
+{
+    size_t size;
+    const void *map = map_file(path, &size);
+    char *buf;
+
+    if (!map) return NULL;
+    buf = (char *)malloc(size + 1);
+    if (buf) {
+        memcpy(buf, map, size);
+        buf[size] = '\0';
+        *len = size;
+    }
+    unmap_file(map, size);
+    return buf;
+}
+
+static int write_whole_file(const char *path, const char *data, size_t len)
+{
+    char tmp[1100];
+    FILE *fp;
+    int ok;
+
+    snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", path, thread_id());
+    fp = fopen(tmp, "wb");
+    if (!fp) return 0;
+    ok = (fwrite(data, 1, len, fp) == len);
+    ok = (fclose(fp) == 0) && ok;
+    if (ok) ok = replace_file(tmp, path);
+    if (!ok) remove(tmp);
+    return ok;
+}
+
 /* ================================================== */
-/* Network functions                                  */
+/* Growable buffers                                   */
 /* ================================================== */
-int is_private_ip(const char *ip)
+static int sb_append(StrBuf *sb, const char *data, size_t len)
 {
-    unsigned int b1, b2, b3, b4;
-    if (sscanf(ip, "%u.%u.%u.%u", &b1, &b2, &b3, &b4) != 4) return 0;
-    if (b1 == 10) return 1;
-    if (b1 == 172 && b2 >= 16 && b2 <= 31) return 1;
-    if (b1 == 192 && b2 == 168) return 1;
-    return 0;
+    if (sb->len + len + 1 > sb->cap) {
+        size_t ncap = sb->cap ? sb->cap : 256;
+        while (ncap < sb->len + len + 1) ncap *= 2;
+        char *n = (char *)realloc(sb->data, ncap);
+        if (!n) return 0;
+        sb->data = n;
+        sb->cap = ncap;
+    }
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+    return 1;
+}
+
+static int sb_puts(StrBuf *sb, const char *s)
+{
+    return sb_append(sb, s, strlen(s));
+}
+
+static int sb_appendf(StrBuf *sb, const char *fmt, ...)
+{
+    char stack[512];
+    char *buf = stack;
+    va_list ap;
+    int n, ok;
+
+    va_start(ap, fmt);
+    n = vsnprintf(stack, sizeof(stack), fmt, ap);
+    va_end(ap);
+    if (n < 0) return 0;
+    if ((size_t)n >= sizeof(stack)) {
+        buf = (char *)malloc((size_t)n + 1);
+        if (!buf) return 0;
+        va_start(ap, fmt);
+        vsnprintf(buf, (size_t)n + 1, fmt, ap);
+        va_end(ap);
+    }
+    ok = sb_append(sb, buf, (size_t)n);
+    if (buf != stack) free(buf);
+    return ok;
+}
+
+/* sh の単一引用符で囲んで追加 (' は '\'' に置き換え) */
+static int sb_append_quoted(StrBuf *sb, const char *s)
+{
+    if (!sb_append(sb, "'", 1)) return 0;
+    for (const char *p = s; *p; p++) {
+        if (*p == '\'') {
+            if (!sb_append(sb, "'\\''", 4)) return 0;
+        } else if (!sb_append(sb, p, 1)) {
+            return 0;
+        }
+    }
+    return sb_append(sb, "'", 1);
+}
+
+static void sb_free(StrBuf *sb)
+{
+    free(sb->data);
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+}
+
+static void args_add(ArgList *a, const char *s)
+{
+    if (a->argc >= MAX_ARGS) return;
+    a->argv[a->argc] = strdup(s);
+    if (a->argv[a->argc]) a->argc++;
+    a->argv[a->argc] = NULL;
+}
+
+static void args_addf(ArgList *a, const char *fmt, ...)
+{
+    char buf[2048];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    args_add(a, buf);
+}
+
+static void args_free(ArgList *a)
+{
+    for (int i = 0; i < a->argc; i++) free(a->argv[i]);
+    a->argc = 0;
+    a->argv[0] = NULL;
+}
+
+/* ================================================== */
+/* Process runner                                     */
+/* ================================================== */
+/*
+ * シェル (cmd.exe / sh) を介さずに外部プログラムを直接起動する。
+ * 引数は argv 配列で渡し、Windows では CreateProcess 用のコマンドラインを
+ * MSVCRT の規則でクォートして組み立てる。
+ *
+ * 標準出力・標準エラーはパイプで受け取り、コールバックへ逐次渡すか
+ * ProcResult に蓄積する。timeout_ms 経過または *cancel が立った時点で
+ * 子プロセスを終了させる。
+ */
+static void proc_deliver(const ProcOptions *opt, ProcResult *res, int stream,
+                         const char *data, size_t len)
+{
+    if (opt->echo) {
+        fwrite(data, 1, len, stream == 2 ? stderr : stdout);
+        fflush(stream == 2 ? stderr : stdout);
+    }
+    if (opt->on_output) {
+        opt->on_output(opt->ctx, stream, data, len);
+    } else {
+        sb_append(stream == 2 ? &res->err : &res->out, data, len);
+    }
+}
+
+/* 打ち切り判定 (タイムアウト / キャンセル) */
+static int proc_should_stop(const ProcOptions *opt, ProcResult *res, uint64_t start)
+{
+    if (opt->cancel && *opt->cancel) {
+        res->cancelled = 1;
+        return 1;
+    }
+    if (opt->timeout_ms > 0 && now_ms() - start >= (uint64_t)opt->timeout_ms) {
+        res->timed_out = 1;
+        return 1;
+    }
+    return 0;
+}
+
+void proc_result_free(ProcResult *res)
+{
+    sb_free(&res->out);
+    sb_free(&res->err);
+}
+
+/* "NAME=value" が env の中で上書きされるか (名前の比較は Windows では大文字小文字を区別しない) */
+static int env_overridden(const char *entry, const char *const *env)
+{
+    size_t len = strcspn(entry, "=");
+    for (int i = 0; env[i]; i++) {
+        if (strcspn(env[i], "=") != len) continue;
+#ifdef _WIN32
+        if (_strnicmp(entry, env[i], len) == 0) return 1;
+#else
+        if (strncmp(entry, env[i], len) == 0) return 1;
+#endif
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+/* MSVCRT の引数解析規則に合わせて1引数をクォート */
+static void win_quote_arg(StrBuf *sb, const char *arg)
+{
+    if (arg[0] != '\0' && strpbrk(arg, " \t\n\v\"") == NULL) {
+        sb_append(sb, arg, strlen(arg));
+        return;
+    }
+    sb_append(sb, "\"", 1);
+    for (const char *p = arg; ; p++) {
+        size_t backslashes = 0;
+        while (*p == '\\') {
+            p++;
+            backslashes++;
+        }
+        if (*p == '\0') {
+            for (size_t i = 0; i < backslashes * 2; i++) sb_append(sb, "\\", 1);
+            break;
+        }
+        if (*p == '"') {
+            for (size_t i = 0; i < backslashes * 2 + 1; i++) sb_append(sb, "\\", 1);
+        } else {
+            for (size_t i = 0; i < backslashes; i++) sb_append(sb, "\\", 1);
+        }
+        sb_append(sb, p, 1);
+    }
+    sb_append(sb, "\"", 1);
+}
+
+typedef struct {
+    HANDLE pipe;
+    const char *data;
+    size_t len;
+} PipeFeed;
+
+static thread_ret_t THREAD_CC pipe_feed_thread(void *arg)
+{
+    PipeFeed *f = (PipeFeed *)arg;
+    size_t off = 0;
+    while (off < f->len) {
+        DWORD chunk = (DWORD)((f->len - off > 65536) ? 65536 : f->len - off);
+        DWORD written = 0;
+        if (!WriteFile(f->pipe, f->data + off, chunk, &written, NULL) || written == 0) break;
+        off += written;
+    }
+    CloseHandle(f->pipe);
+    return 0;
+}
+
+/* 出力パイプ1本を EOF まで読むスレッド (stdout / stderr の渡し先は lock で直列にする) */
+typedef struct {
+    HANDLE pipe;
+    int stream;
+    const ProcOptions *opt;
+    ProcResult *res;
+    mutex_t *lock;
+} PipeReader;
+
+static thread_ret_t THREAD_CC pipe_reader_thread(void *arg)
+{
+    PipeReader *r = (PipeReader *)arg;
+    char buf[16384];
+    DWORD got = 0;
+
+    while (ReadFile(r->pipe, buf, sizeof(buf), &got, NULL) && got > 0) {
+        mutex_lock(r->lock);
+        proc_deliver(r->opt, r->res, r->stream, buf, got);
+        mutex_unlock(r->lock);
+    }
+    return 0;
+}
+
+/* 次に打ち切りを確かめるまでの待ち時間 (打ち切り条件が無ければ終了まで待つ) */
+static DWORD proc_wait_ms(const ProcOptions *opt, uint64_t start)
+{
+    DWORD wait = INFINITE;
+
+    if (opt->timeout_ms > 0) {
+        uint64_t elapsed = now_ms() - start;
+        wait = elapsed >= (uint64_t)opt->timeout_ms ? 0 : (DWORD)((uint64_t)opt->timeout_ms - elapsed);
+    }
+    /* キャンセルはフラグなので待てない: 間隔を空けて確かめる */
+    if (opt->cancel && wait > PROC_CANCEL_POLL_MS) wait = PROC_CANCEL_POLL_MS;
+    return wait;
+}
+
+/*
+ * 継承可能なパイプの作成から、CreateProcess の後で子側の端を閉じるまでを直列にする。
+ * 並列に起動した別の子プロセスがその端を継承すると、こちらの子が終わっても
+ * パイプが EOF にならず読み取りが止まるため。
+ */
+static mutex_t g_spawn_lock;
+
+static int proc_run_native(const char *const argv[], const ProcOptions *opt, ProcResult *res)
+{
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    HANDLE out_r = NULL, out_w = NULL, err_r = NULL, err_w = NULL, in_r = NULL, in_w = NULL;
+    HANDLE job = NULL;
+    StrBuf cmdline = {0};
+    PipeFeed feed;
+    PipeReader readers[2];
+    thread_t feeder, reader_threads[2];
+    mutex_t deliver_lock;
+    int have_feeder = 0, nreaders = 0, redirect = 0;
+    uint64_t start = now_ms();
+    DWORD code = 0;
+
+    memset(res, 0, sizeof(*res));
+    res->exit_code = -1;
+
+    for (int i = 0; argv[i]; i++) {
+        if (i > 0) sb_append(&cmdline, " ", 1);
+        win_quote_arg(&cmdline, argv[i]);
+    }
+    if (!cmdline.data) return -1;
+
+    /* 環境ブロック: 親の環境 (上書き分を除く) + 追加分, 各 "NAME=value\0" の末尾に "\0" */
+    StrBuf envblock = {0};
+    if (opt->env) {
+        char *parent = GetEnvironmentStringsA();
+        for (const char *e = parent; e && *e; e += strlen(e) + 1) {
+            if (!env_overridden(e, opt->env)) sb_append(&envblock, e, strlen(e) + 1);
+        }
+        if (parent) FreeEnvironmentStringsA(parent);
+        for (int i = 0; opt->env[i]; i++) sb_append(&envblock, opt->env[i], strlen(opt->env[i]) + 1);
+        sb_append(&envblock, "", 1);
+    }
+
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+
+    if (opt->in != PROC_IN_INHERIT || opt->out != PROC_OUT_INHERIT) {
+        redirect = 1;
+        mutex_lock(&g_spawn_lock);
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+        si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+        if (opt->in == PROC_IN_NULL) {
+            in_r = CreateFileA("NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+                               OPEN_EXISTING, 0, NULL);
+        } else if (opt->in == PROC_IN_FILE) {
+            in_r = CreateFileA(opt->in_path, GENERIC_READ, FILE_SHARE_READ, &sa,
+                               OPEN_EXISTING, 0, NULL);
+        } else if (opt->in == PROC_IN_DATA) {
+            if (CreatePipe(&in_r, &in_w, &sa, 0)) SetHandleInformation(in_w, HANDLE_FLAG_INHERIT, 0);
+        }
+        if (opt->in != PROC_IN_INHERIT) {
+            if (in_r == NULL || in_r == INVALID_HANDLE_VALUE) {
+                mutex_unlock(&g_spawn_lock);
+                sb_free(&cmdline);
+                sb_free(&envblock);
+                return -1;
+            }
+            si.hStdInput = in_r;
+        }
+
+        if (opt->out == PROC_OUT_CAPTURE) {
+            CreatePipe(&out_r, &out_w, &sa, 0);
+            SetHandleInformation(out_r, HANDLE_FLAG_INHERIT, 0);
+            if (opt->merge_stderr) {
+                err_w = out_w;
+            } else {
+                CreatePipe(&err_r, &err_w, &sa, 0);
+                SetHandleInformation(err_r, HANDLE_FLAG_INHERIT, 0);
+            }
+        } else if (opt->out == PROC_OUT_NULL) {
+            out_w = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+                                OPEN_EXISTING, 0, NULL);
+            err_w = out_w;
+        }
+        if (opt->out != PROC_OUT_INHERIT) {
+            si.hStdOutput = out_w;
+            si.hStdError = err_w;
+        }
+    }
+
+    /* 入出力を切り替えた子はジョブに入れ、打ち切り時は孫プロセス (ProxyCommand 等) ごと止める */
+    if (redirect) job = CreateJobObjectA(NULL, NULL);
+    BOOL ok = CreateProcessA(NULL, cmdline.data, NULL, NULL, redirect, job ? CREATE_SUSPENDED : 0,
+                             envblock.data, NULL, &si, &pi);
+    sb_free(&cmdline);
+    sb_free(&envblock);
+
+    /* 子プロセス側の端はこちらでは不要 */
+    if (in_r) CloseHandle(in_r);
+    if (out_w) CloseHandle(out_w);
+    if (err_w && err_w != out_w) CloseHandle(err_w);
+    if (redirect) mutex_unlock(&g_spawn_lock);
+
+    if (!ok) {
+        if (in_w) CloseHandle(in_w);
+        if (out_r) CloseHandle(out_r);
+        if (err_r) CloseHandle(err_r);
+        if (job) CloseHandle(job);
+        return -1;
+    }
+    if (job) {
+        /* 入れられなければ (入れ子のジョブ非対応の古い Windows) 子プロセスだけを止める */
+        if (!AssignProcessToJobObject(job, pi.hProcess)) {
+            CloseHandle(job);
+            job = NULL;
+        }
+        ResumeThread(pi.hThread);
+    }
+    CloseHandle(pi.hThread);
+
+    if (in_w) {
+        feed.pipe = in_w;
+        feed.data = opt->in_data;
+        feed.len = opt->in_len;
+        have_feeder = thread_start(&feeder, pipe_feed_thread, &feed);
+        if (!have_feeder) CloseHandle(in_w);
+    }
+
+    /* 出力はパイプごとのスレッドが届いた分から読み、こちらはプロセスの終了を待つ */
+    mutex_init(&deliver_lock);
+    HANDLE pipes[2] = { out_r, err_r };
+    for (int i = 0; i < 2; i++) {
+        if (!pipes[i]) continue;
+        readers[nreaders].pipe = pipes[i];
+        readers[nreaders].stream = i + 1;
+        readers[nreaders].opt = opt;
+        readers[nreaders].res = res;
+        readers[nreaders].lock = &deliver_lock;
+        if (thread_start(&reader_threads[nreaders], pipe_reader_thread, &readers[nreaders])) nreaders++;
+    }
+
+    int stopping = 0;
+    while (WaitForSingleObject(pi.hProcess, stopping ? INFINITE : proc_wait_ms(opt, start)) != WAIT_OBJECT_0) {
+        if (proc_should_stop(opt, res, start)) {
+            if (job) TerminateJobObject(job, 1);
+            else TerminateProcess(pi.hProcess, 1);
+            stopping = 1;
+        }
+    }
+
+    /* 残りの出力を読み切る。孫プロセスがパイプを握ったままなら止めて EOF にする */
+    for (int i = 0; i < nreaders; i++) {
+        if (WaitForSingleObject(reader_threads[i], PROC_DRAIN_WAIT_MS) != WAIT_OBJECT_0) {
+            if (job) TerminateJobObject(job, 1);
+            CancelSynchronousIo(reader_threads[i]);
+        }
+        thread_join(reader_threads[i]);
+    }
+    mutex_destroy(&deliver_lock);
+
+    GetExitCodeProcess(pi.hProcess, &code);
+    CloseHandle(pi.hProcess);
+    if (job) CloseHandle(job);
+    if (have_feeder) thread_join(feeder);
+    if (out_r) CloseHandle(out_r);
+    if (err_r) CloseHandle(err_r);
+
+    res->exit_code = (int)code;
+    return res->exit_code;
+}
+#else
+extern char **environ;
+
+static int pipe_cloexec(int fds[2])
+{
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) != 0) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+static void posix_close(int *fd)
+{
+    if (*fd >= 0) close(*fd);
+    *fd = -1;
+}
+
+/* 読めるだけ読む。EOFで fd を閉じる */
+static void posix_drain_fd(int *fd, int stream, const ProcOptions *opt, ProcResult *res)
+{
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(*fd, buf, sizeof(buf));
+        if (n > 0) {
+            proc_deliver(opt, res, stream, buf, (size_t)n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        posix_close(fd);
+        return;
+    }
+}
+
+static int proc_run_native(const char *const argv[], const ProcOptions *opt, ProcResult *res)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    int out_p[2] = { -1, -1 }, err_p[2] = { -1, -1 }, in_p[2] = { -1, -1 };
+    size_t in_off = 0;
+    uint64_t start = now_ms(), kill_at = 0;
+    int status = 0, exited = 0;
+    pid_t pid;
+
+    memset(res, 0, sizeof(*res));
+    res->exit_code = -1;
+
+    posix_spawn_file_actions_init(&fa);
+    if (opt->in == PROC_IN_NULL) {
+        posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    } else if (opt->in == PROC_IN_FILE) {
+        posix_spawn_file_actions_addopen(&fa, 0, opt->in_path, O_RDONLY, 0);
+    } else if (opt->in == PROC_IN_DATA && pipe_cloexec(in_p) == 0) {
+        posix_spawn_file_actions_adddup2(&fa, in_p[0], 0);
+        fcntl(in_p[1], F_SETFL, fcntl(in_p[1], F_GETFL) | O_NONBLOCK);
+    }
+    if (opt->out == PROC_OUT_CAPTURE && pipe_cloexec(out_p) == 0) {
+        posix_spawn_file_actions_adddup2(&fa, out_p[1], 1);
+        if (opt->merge_stderr) {
+            posix_spawn_file_actions_adddup2(&fa, out_p[1], 2);
+        } else if (pipe_cloexec(err_p) == 0) {
+            posix_spawn_file_actions_adddup2(&fa, err_p[1], 2);
+        }
+    } else if (opt->out == PROC_OUT_NULL) {
+        posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+        posix_spawn_file_actions_adddup2(&fa, 1, 2);
+    }
+
+    /* 端末を使わない子は独立したプロセスグループにし、停止時に孫ごと止める */
+    int own_group = (opt->in != PROC_IN_INHERIT && opt->out != PROC_OUT_INHERIT);
+    posix_spawnattr_init(&attr);
+    if (own_group) {
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+    }
+
+    /* 環境: 親の環境 (上書き分を除く) + 追加分 */
+    char **envp = environ;
+    if (opt->env) {
+        size_t n = 0, k = 0;
+        for (char **e = environ; *e; e++) n++;
+        for (int i = 0; opt->env[i]; i++) n++;
+        envp = (char **)malloc((n + 1) * sizeof(char *));
+        if (envp) {
+            for (char **e = environ; *e; e++) {
+                if (!env_overridden(*e, opt->env)) envp[k++] = *e;
+            }
+            for (int i = 0; opt->env[i]; i++) envp[k++] = (char *)opt->env[i];
+            envp[k] = NULL;
+        } else {
+            envp = environ;
+        }
+    }
+
+    int rc = posix_spawnp(&pid, argv[0], &fa, &attr, (char *const *)argv, envp);
+    if (envp != environ) free(envp);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    posix_close(&in_p[0]);
+    posix_close(&out_p[1]);
+    posix_close(&err_p[1]);
+    if (rc != 0) {
+        posix_close(&in_p[1]);
+        posix_close(&out_p[0]);
+        posix_close(&err_p[0]);
+        errno = rc;
+        return -1;
+    }
+    if (in_p[1] >= 0 && opt->in_len == 0) posix_close(&in_p[1]);
+    /* 読み出し側は非ブロッキング (孫プロセスがパイプを握っても止まらない) */
+    if (out_p[0] >= 0) fcntl(out_p[0], F_SETFL, fcntl(out_p[0], F_GETFL) | O_NONBLOCK);
+    if (err_p[0] >= 0) fcntl(err_p[0], F_SETFL, fcntl(err_p[0], F_GETFL) | O_NONBLOCK);
+
+    while (!exited) {
+        struct pollfd pfd[3];
+        int n = 0;
+
+        if (out_p[0] >= 0) { pfd[n].fd = out_p[0]; pfd[n].events = POLLIN; n++; }
+        if (err_p[0] >= 0) { pfd[n].fd = err_p[0]; pfd[n].events = POLLIN; n++; }
+        if (in_p[1] >= 0)  { pfd[n].fd = in_p[1];  pfd[n].events = POLLOUT; n++; }
+        for (int i = 0; i < n; i++) pfd[i].revents = 0;
+        poll(pfd, (nfds_t)n, 15);
+
+        for (int i = 0; i < n; i++) {
+            if (!pfd[i].revents) continue;
+            if (pfd[i].fd == out_p[0]) {
+                posix_drain_fd(&out_p[0], 1, opt, res);
+            } else if (pfd[i].fd == err_p[0]) {
+                posix_drain_fd(&err_p[0], 2, opt, res);
+            } else if (pfd[i].fd == in_p[1]) {
+                ssize_t w = write(in_p[1], opt->in_data + in_off, opt->in_len - in_off);
+                if (w > 0) in_off += (size_t)w;
+                if ((w < 0 && errno != EAGAIN) || in_off >= opt->in_len) posix_close(&in_p[1]);
+            }
+        }
+
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            exited = 1;
+        } else if (!kill_at && proc_should_stop(opt, res, start)) {
+            kill(own_group ? -pid : pid, SIGTERM);
+            kill_at = now_ms() + 2000;
+        } else if (kill_at && now_ms() >= kill_at) {
+            kill(own_group ? -pid : pid, SIGKILL);
+        }
+    }
+
+    /* 終了後に残っている出力を回収 */
+    if (out_p[0] >= 0) posix_drain_fd(&out_p[0], 1, opt, res);
+    if (err_p[0] >= 0) posix_drain_fd(&err_p[0], 2, opt, res);
+    posix_close(&in_p[1]);
+    posix_close(&out_p[0]);
+    posix_close(&err_p[0]);
+
+    if (WIFEXITED(status)) res->exit_code = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status)) res->exit_code = 128 + WTERMSIG(status);
+    return res->exit_code;
+}
+#endif
+
+/* 子プロセス1回分をトレースに記録 (-o オプションは省いて表示) */
+static void trace_process(const char *const argv[], uint64_t start_us, const ProcResult *res)
+{
+    char cmd[256] = {0};
+    char esc[320];
+    char args[400];
+    const char *name = argv[0];
+    const char *sep = strrchr(argv[0], PATH_SEP);
+    size_t len = 0;
+
+    if (sep) name = sep + 1;
+    for (int i = 1; argv[i] && len < sizeof(cmd) - 1; i++) {
+        if (strcmp(argv[i], "-o") == 0 && argv[i + 1]) {
+            i++;
+            continue;
+        }
+        int n = snprintf(cmd + len, sizeof(cmd) - len, "%s%s", len ? " " : "", argv[i]);
+        if (n < 0) break;
+        len += (size_t)n;
+    }
+    json_escape(cmd, esc, sizeof(esc));
+    snprintf(args, sizeof(args), "\"cmd\":\"%s\",\"exit\":%d%s%s", esc, res->exit_code,
+             res->timed_out ? ",\"timed_out\":true" : "",
+             res->cancelled ? ",\"cancelled\":true" : "");
+    trace_complete(name, "process", start_us, args);
+}
+
+/* 子プロセスを起動する前 (main の最初) に1回だけ呼ぶ */
+void proc_init(void)
+{
+#ifdef _WIN32
+    mutex_init(&g_spawn_lock);
+#else
+    /* 子プロセスが先に終わった stdin パイプへの書き込みで落ちないように */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+int proc_run(const char *const argv[], const ProcOptions *opt, ProcResult *res)
+{
+    uint64_t start_us = trace_enabled() ? now_us() : 0;
+    int rc;
+
+    /* 子プロセスがコンソールへ直接書く場合に表示順が崩れないよう先に出す */
+    if (opt->out == PROC_OUT_INHERIT) fflush(stdout);
+    rc = proc_run_native(argv, opt, res);
+
+    if (start_us) trace_process(argv, start_us, res);
+    return rc;
+}
+
+/* 出力を捨てて終了コードだけ得る簡易版 */
+static int proc_run_simple(const char *const argv[], ProcInMode in, ProcOutMode out)
+{
+    ProcOptions opt;
+    ProcResult res;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.in = in;
+    opt.out = out;
+    proc_run(argv, &opt, &res);
+    proc_result_free(&res);
+    return res.exit_code;
+}
+
+/* ---------- 長時間の子プロセス (出力をイベントで待つ) ---------- */
+#ifdef _WIN32
+int proc_waiter_init(ProcWaiter *w)
+{
+    w->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    return w->port != NULL;
+}
+
+void proc_waiter_free(ProcWaiter *w)
+{
+    if (w->port) CloseHandle(w->port);
+    w->port = NULL;
+}
+
+/* キー 0 の完了通知 = 起こすだけ */
+void proc_waiter_wake(ProcWaiter *w)
+{
+    PostQueuedCompletionStatus(w->port, 0, 0, NULL);
+}
+
+/* 次の読み取りを出す。すぐに失敗したら (パイプが閉じている) 0 バイトの完了として知らせる */
+static void proc_child_read(ProcWaiter *w, ProcChild *c)
+{
+    memset(&c->ov, 0, sizeof(c->ov));
+    if (!ReadFile(c->pipe, c->buf, sizeof(c->buf), NULL, &c->ov) && GetLastError() != ERROR_IO_PENDING) {
+        PostQueuedCompletionStatus(w->port, 0, (ULONG_PTR)c, &c->ov);
+    }
+}
+
+/*
+ * 無名パイプは重複 I/O にできないので、読み取り側を重複 I/O の名前付きパイプにする。
+ * インスタンスは1つだけで、作った直後にこちらが書き込み側として繋ぐ
+ */
+int proc_child_start(ProcWaiter *w, const char *const argv[], ProcChild *c)
+{
+    static volatile LONG serial;
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    HANDLE out_w = INVALID_HANDLE_VALUE, in_r = INVALID_HANDLE_VALUE;
+    StrBuf cmdline = {0};
+    char name[96];
+    BOOL ok = FALSE;
+
+    c->running = 0;
+    c->job = NULL;
+    for (int i = 0; argv[i]; i++) {
+        if (i > 0) sb_append(&cmdline, " ", 1);
+        win_quote_arg(&cmdline, argv[i]);
+    }
+    if (!cmdline.data) return 0;
+    snprintf(name, sizeof(name), "\\\\.\\pipe\\openwrt-connect-out-%lu-%ld", (unsigned long)GetCurrentProcessId(),
+             (long)InterlockedIncrement(&serial));
+
+    mutex_lock(&g_spawn_lock);
+    c->pipe = CreateNamedPipeA(name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                               PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                               1, 0, sizeof(c->buf), 0, NULL);
+    if (c->pipe != INVALID_HANDLE_VALUE) {
+        out_w = CreateFileA(name, GENERIC_WRITE, 0, &sa, OPEN_EXISTING, 0, NULL);
+        in_r = CreateFileA("NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+    }
+    if (out_w != INVALID_HANDLE_VALUE && in_r != INVALID_HANDLE_VALUE) {
+        memset(&si, 0, sizeof(si));
+        si.cb = sizeof(si);
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = in_r;
+        si.hStdOutput = out_w;
+        si.hStdError = out_w;
+        c->job = CreateJobObjectA(NULL, NULL);
+        ok = CreateProcessA(NULL, cmdline.data, NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &pi);
+    }
+    if (out_w != INVALID_HANDLE_VALUE) CloseHandle(out_w);
+    if (in_r != INVALID_HANDLE_VALUE) CloseHandle(in_r);
+    mutex_unlock(&g_spawn_lock);
+    sb_free(&cmdline);
+
+    if (!ok) {
+        if (c->pipe != INVALID_HANDLE_VALUE) CloseHandle(c->pipe);
+        if (c->job) CloseHandle(c->job);
+        c->pipe = NULL;
+        c->job = NULL;
+        return 0;
+    }
+    if (c->job && !AssignProcessToJobObject(c->job, pi.hProcess)) {
+        CloseHandle(c->job);
+        c->job = NULL;
+    }
+    ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+    c->process = pi.hProcess;
+    c->running = 1;
+    CreateIoCompletionPort(c->pipe, w->port, (ULONG_PTR)c, 0);
+    proc_child_read(w, c);
+    return 1;
+}
+
+/* パイプが閉じた子を回収する (終わっていなければ止める) */
+static void proc_child_reap(ProcChild *c)
+{
+    if (WaitForSingleObject(c->process, PROC_DRAIN_WAIT_MS) != WAIT_OBJECT_0) {
+        if (c->job) TerminateJobObject(c->job, 1);
+        else TerminateProcess(c->process, 1);
+    }
+    CloseHandle(c->process);
+    CloseHandle(c->pipe);
+    if (c->job) CloseHandle(c->job);
+    c->process = c->pipe = c->job = NULL;
+    c->running = 0;
+}
+
+/* 止めるだけ。終了は proc_children_wait が len = 0 で知らせる */
+void proc_child_stop(ProcChild *c)
+{
+    if (!c->running) return;
+    if (c->job) TerminateJobObject(c->job, 1);
+    else TerminateProcess(c->process, 1);
+}
+
+/*
+ * 出力が届くか、timeout_ms (負なら無制限) が過ぎるか、proc_waiter_wake まで待ち、
+ * 届いた分を fn に渡す。何か渡したら 1。
+ * 完了ポートは子を登録済みなので kids は使わない
+ */
+int proc_children_wait(ProcWaiter *w, ProcChild *const kids[], int count, int timeout_ms, proc_child_fn fn)
+{
+    DWORD wait = timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms;
+    int got = 0;
+
+    (void)kids;
+    (void)count;
+    for (;;) {
+        DWORD n = 0;
+        ULONG_PTR key = 0;
+        LPOVERLAPPED ov = NULL;
+        BOOL ok = GetQueuedCompletionStatus(w->port, &n, &key, &ov, wait);
+        ProcChild *c = (ProcChild *)key;
+
+        if (!ov) break;
+        got = 1;
+        if (ok && n > 0) {
+            fn(c, c->buf, n);
+            proc_child_read(w, c);
+        } else {
+            proc_child_reap(c);
+            fn(c, NULL, 0);
+        }
+        /* 溜まっている完了だけ続けて処理する */
+        wait = 0;
+    }
+    return got;
+}
+#else
+int proc_waiter_init(ProcWaiter *w)
+{
+    if (pipe_cloexec(w->wake) != 0) return 0;
+    fcntl(w->wake[0], F_SETFL, fcntl(w->wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(w->wake[1], F_SETFL, fcntl(w->wake[1], F_GETFL) | O_NONBLOCK);
+    return 1;
+}
+
+void proc_waiter_free(ProcWaiter *w)
+{
+    posix_close(&w->wake[0]);
+    posix_close(&w->wake[1]);
+}
+
+void proc_waiter_wake(ProcWaiter *w)
+{
+    if (write(w->wake[1], "", 1) < 0) {}
+}
+
+int proc_child_start(ProcWaiter *w, const char *const argv[], ProcChild *c)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    int out_p[2] = { -1, -1 };
+    int rc;
+
+    (void)w;
+    c->running = 0;
+    c->fd = -1;
+    if (pipe_cloexec(out_p) != 0) return 0;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, out_p[1], 1);
+    posix_spawn_file_actions_adddup2(&fa, out_p[1], 2);
+    /* 止めるときに孫 (ProxyCommand 等) ごと止められるよう独立したプロセスグループにする */
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    rc = posix_spawnp(&c->pid, argv[0], &fa, &attr, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    posix_close(&out_p[1]);
+    if (rc != 0) {
+        posix_close(&out_p[0]);
+        return 0;
+    }
+    fcntl(out_p[0], F_SETFL, fcntl(out_p[0], F_GETFL) | O_NONBLOCK);
+    c->fd = out_p[0];
+    c->running = 1;
+    return 1;
+}
+
+/* パイプが閉じた子を回収する (PROC_DRAIN_WAIT_MS 待っても終わらなければ止める) */
+static void proc_child_reap(ProcChild *c)
+{
+    uint64_t deadline = now_ms() + PROC_DRAIN_WAIT_MS;
+    int status;
+
+    posix_close(&c->fd);
+    while (waitpid(c->pid, &status, WNOHANG) == 0) {
+        if (now_ms() >= deadline) {
+            kill(-c->pid, SIGKILL);
+            waitpid(c->pid, &status, 0);
+            break;
+        }
+        sleep_ms(10);
+    }
+    c->running = 0;
+}
+
+/* 止めるだけ。終了は proc_children_wait が len = 0 で知らせる */
+void proc_child_stop(ProcChild *c)
+{
+    if (c->running) kill(-c->pid, SIGTERM);
+}
+
+/*
+ * 出力が届くか、timeout_ms (負なら無制限) が過ぎるか、proc_waiter_wake まで待ち、
+ * 届いた分を fn に渡す。何か渡したら 1
+ */
+int proc_children_wait(ProcWaiter *w, ProcChild *const kids[], int count, int timeout_ms, proc_child_fn fn)
+{
+    struct pollfd *pfd = (struct pollfd *)malloc(sizeof(struct pollfd) * (size_t)(count + 1));
+    char buf[4096];
+    int n = 0, got = 0;
+
+    if (!pfd) return 0;
+    pfd[n].fd = w->wake[0];
+    pfd[n].events = POLLIN;
+    pfd[n++].revents = 0;
+    for (int i = 0; i < count; i++) {
+        if (!kids[i]->running) continue;
+        pfd[n].fd = kids[i]->fd;
+        pfd[n].events = POLLIN;
+        pfd[n++].revents = 0;
+    }
+    if (poll(pfd, (nfds_t)n, timeout_ms) <= 0) {
+        free(pfd);
+        return 0;
+    }
+    if (pfd[0].revents) {
+        while (read(w->wake[0], buf, sizeof(buf)) > 0) {}
+    }
+    /* pfd[1..] は running だった子の順 */
+    for (int i = 0, k = 1; i < count && k < n; i++) {
+        ProcChild *c = kids[i];
+        if (!c->running) continue;
+        if (!pfd[k++].revents) continue;
+        got = 1;
+        for (;;) {
+            ssize_t r = read(c->fd, buf, sizeof(buf));
+            if (r > 0) {
+                fn(c, buf, (size_t)r);
+                continue;
+            }
+            if (r < 0 && (errno == EAGAIN || errno == EINTR)) break;
+            proc_child_reap(c);
+            fn(c, NULL, 0);
+            break;
+        }
+    }
+    free(pfd);
+    return got;
+}
+#endif
+
+/* キー入力待ち (cmd.exe の pause 相当) */
+static void pause_console(void)
+{
+#ifdef _WIN32
+    printf("Press any key to continue . . . ");
+    fflush(stdout);
+    _getch();
+    printf("\n");
+#else
+    int c;
+    printf("Press Enter to continue . . . ");
+    fflush(stdout);
+    while ((c = getchar()) != EOF && c != '\n') {}
+#endif
+}
+
+/* エコーなしで1行読む (パスワード入力) */
+static void read_secret(char *buf, size_t size)
+{
+#ifdef _WIN32
+    size_t n = 0;
+    int c;
+
+    while ((c = _getch()) != '\r' && c != '\n' && c != EOF) {
+        if (c == 0 || c == 0xE0) {
+            _getch();       /* 矢印・ファンクションキー */
+        } else if (c == '\b') {
+            if (n > 0) n--;
+        } else if (n + 1 < size) {
+            buf[n++] = (char)c;
+        }
+    }
+    buf[n] = '\0';
+#else
+    struct termios old, quiet;
+    int tty = (tcgetattr(STDIN_FILENO, &old) == 0);
+
+    if (tty) {
+        quiet = old;
+        quiet.c_lflag &= ~(tcflag_t)ECHO;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &quiet);
+    }
+    if (!fgets(buf, (int)size, stdin)) buf[0] = '\0';
+    buf[strcspn(buf, "\r\n")] = '\0';
+    if (tty) tcsetattr(STDIN_FILENO, TCSAFLUSH, &old);
+#endif
+    printf("\n");
+}
+
+/* パスワード等をメモリから消す (最適化で消されないよう volatile 経由) */
+static void wipe_secret(char *buf, size_t len)
+{
+    volatile char *p = buf;
+    while (len--) *p++ = 0;
+}
+
+/* 推測されない乱数 (トークン用)。得られなければ 0 */
+static int random_bytes(unsigned char *buf, size_t len)
+{
+#ifdef _WIN32
+    HCRYPTPROV prov;
+    int ok;
+
+    if (!CryptAcquireContextA(&prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT)) return 0;
+    ok = (CryptGenRandom(prov, (DWORD)len, buf) != 0);
+    CryptReleaseContext(prov, 0);
+    return ok;
+#else
+    FILE *fp = fopen("/dev/urandom", "rb");
+    int ok;
+
+    if (!fp) return 0;
+    ok = (fread(buf, 1, len, fp) == len);
+    fclose(fp);
+    return ok;
+#endif
+}
+
+/* ================================================== */
+/* Network functions                                  */
+/* ================================================== */
+/* IPv4 / IPv6 アドレスの表記か (IPv6 の %<scope> は許す。ホスト名や余計な文字は 0) */
+static int is_ip_literal(const char *s)
+{
+    char addr[64];
+    unsigned char buf[16];
+
+    snprintf(addr, sizeof(addr), "%.*s", (int)strcspn(s, "%"), s);
+    return inet_pton(AF_INET, addr, buf) == 1 || inet_pton(AF_INET6, addr, buf) == 1;
+}
+
+/* addr: ホストバイトオーダーのIPv4アドレス */
+static int is_private_addr(uint32_t addr)
+{
+    unsigned int b1 = addr >> 24, b2 = (addr >> 16) & 0xff;
+    if (b1 == 10) return 1;
+    if (b1 == 172 && b2 >= 16 && b2 <= 31) return 1;
+    if (b1 == 192 && b2 == 168) return 1;
+    return 0;
+}
+
+int is_private_ip(const char *ip)
+{
+    unsigned int b1, b2, b3, b4;
+    if (sscanf(ip, "%u.%u.%u.%u", &b1, &b2, &b3, &b4) != 4) return 0;
+    return is_private_addr((b1 << 24) | (b2 << 16) | (b3 << 8) | b4);
+}
+
+/*
+ * 既定ゲートウェイの検出
+ * IPv4 / IPv6 の既定経路のうち、インターフェースが接続中で次ホップが
+ * プライベート (IPv4 は RFC 1918、IPv6 はリンクローカル fe80::/10 と ULA fc00::/7) の
+ * ものを候補とし、実効メトリックの小さい順に並べる (同じなら IPv4 を先に)。
+ *   Windows: 経路のメトリック + インターフェースのメトリック (OS の経路選択と同じ)
+ *   Linux:   経路のメトリック
+ * 候補が複数あれば上位 GATEWAY_PROBE_COUNT 件の SSH ポートへ同時に接続し、
+ * 応答した中で最上位のものを使う (どれも応答しなければ最上位)。
+ * route_watch_start() の後は結果を保持し、経路・インターフェースの変更通知が
+ * 来るまで経路表を読み直さない (常駐するエージェント用)。
+ */
+static int add_gateway_candidate(GatewayCandidate *out, int count, int max, int family,
+                                 const unsigned char *addr, const char *scope, uint32_t metric)
+{
+    char ip[64];
+    char text[INET6_ADDRSTRLEN];
+
+    if (family == AF_INET) {
+        uint32_t a = ((uint32_t)addr[0] << 24) | ((uint32_t)addr[1] << 16) | ((uint32_t)addr[2] << 8) | addr[3];
+        if (!is_private_addr(a)) return count;
+        snprintf(ip, sizeof(ip), "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
+    } else {
+        int link_local = (addr[0] == 0xfe && (addr[1] & 0xc0) == 0x80);
+        int ula = ((addr[0] & 0xfe) == 0xfc);
+        if (!link_local && !ula) return count;
+        if (!inet_ntop(AF_INET6, addr, text, sizeof(text))) return count;
+        /* リンクローカルはインターフェースの指定が必要 (ssh root@fe80::1%eth0) */
+        snprintf(ip, sizeof(ip), "%s%s%s", text, link_local ? "%" : "", link_local ? scope : "");
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(out[i].ip, ip) == 0) {
+            if (metric < out[i].metric) out[i].metric = metric;
+            return count;
+        }
+    }
+    if (count >= max) return count;
+    snprintf(out[count].ip, sizeof(out[count].ip), "%s", ip);
+    out[count].family = family;
+    out[count].metric = metric;
+    return count + 1;
+}
+
+static int compare_gateway(const void *a, const void *b)
+{
+    const GatewayCandidate *x = (const GatewayCandidate *)a, *y = (const GatewayCandidate *)b;
+    if (x->metric != y->metric) return (x->metric > y->metric) - (x->metric < y->metric);
+    return (x->family != AF_INET) - (y->family != AF_INET);
+}
+
+#ifndef _WIN32
+/* /sys/class/net/<if>/operstate。読めなければ使える扱い (tun は "unknown") */
+static int iface_is_up(const char *iface)
+{
+    char path[128], state[32] = {0};
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/operstate", iface);
+    fp = fopen(path, "r");
+    if (!fp) return 1;
+    if (!fgets(state, sizeof(state), fp)) state[0] = '\0';
+    fclose(fp);
+    return strncmp(state, "down", 4) != 0 && strncmp(state, "lowerlayerdown", 14) != 0 &&
+           strncmp(state, "dormant", 7) != 0 && strncmp(state, "notpresent", 10) != 0;
+}
+
+static int hex_bytes(const char *hex, unsigned char *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        unsigned int b;
+        if (sscanf(hex + i * 2, "%2x", &b) != 1) return 0;
+        out[i] = (unsigned char)b;
+    }
+    return 1;
+}
+#endif
+
+/* 既定経路の候補を実効メトリック順に out へ。件数を返す */
+int gateway_candidates(GatewayCandidate *out, int max)
+{
+    int count = 0;
+#ifdef _WIN32
+    PMIB_IPFORWARD_TABLE2 table = NULL;
+
+    if (GetIpForwardTable2(AF_UNSPEC, &table) != NO_ERROR) return 0;
+    for (ULONG i = 0; i < table->NumEntries; i++) {
+        const MIB_IPFORWARD_ROW2 *r = &table->Table[i];
+        MIB_IPINTERFACE_ROW iface;
+        int family = r->NextHop.si_family;
+        char scope[16];
+
+        if (r->DestinationPrefix.PrefixLength != 0) continue;
+        if (family != AF_INET && family != AF_INET6) continue;
+        InitializeIpInterfaceEntry(&iface);
+        iface.Family = (ADDRESS_FAMILY)family;
+        iface.InterfaceIndex = r->InterfaceIndex;
+        if (GetIpInterfaceEntry(&iface) != NO_ERROR || !iface.Connected) continue;
+
+        snprintf(scope, sizeof(scope), "%lu", (unsigned long)r->InterfaceIndex);
+        if (family == AF_INET) {
+            uint32_t a = r->NextHop.Ipv4.sin_addr.s_addr;   /* ネットワークバイトオーダー */
+            count = add_gateway_candidate(out, count, max, family, (const unsigned char *)&a, scope,
+                                          r->Metric + iface.Metric);
+        } else {
+            count = add_gateway_candidate(out, count, max, family, r->NextHop.Ipv6.sin6_addr.s6_addr,
+                                          scope, r->Metric + iface.Metric);
+        }
+    }
+    FreeMibTable(table);
+#else
+    char line[256];
+    FILE *fp;
+
+    /* Iface Destination Gateway Flags RefCnt Use Metric Mask (値はネットワークバイトオーダーの16進) */
+    fp = fopen("/proc/net/route", "r");
+    while (fp && fgets(line, sizeof(line), fp)) {
+        char iface[64];
+        unsigned long dest, gw, mask;
+        unsigned int flags, metric;
+
+        if (sscanf(line, "%63s %lx %lx %x %*d %*d %u %lx", iface, &dest, &gw, &flags, &metric, &mask) != 6) continue;
+        if (dest != 0 || mask != 0 || gw == 0 || !(flags & 0x1) || !iface_is_up(iface)) continue;
+        uint32_t a = (uint32_t)gw;
+        count = add_gateway_candidate(out, count, max, AF_INET, (const unsigned char *)&a, iface, metric);
+    }
+    if (fp) fclose(fp);
+
+    /* dest plen src plen nexthop metric refcnt use flags iface */
+    fp = fopen("/proc/net/ipv6_route", "r");
+    while (fp && fgets(line, sizeof(line), fp)) {
+        char dest[33], hop[33], iface[64];
+        unsigned int plen, metric, flags;
+        unsigned char addr[16];
+
+        if (sscanf(line, "%32s %2x %*32s %*2x %32s %8x %*8x %*8x %8x %63s",
+                   dest, &plen, hop, &metric, &flags, iface) != 6) continue;
+        if (plen != 0 || strspn(dest, "0") != 32 || strspn(hop, "0") == 32) continue;
+        if (!(flags & 0x1) || !iface_is_up(iface) || !hex_bytes(hop, addr, 16)) continue;
+        count = add_gateway_candidate(out, count, max, AF_INET6, addr, iface, metric);
+    }
+    if (fp) fclose(fp);
+#endif
+    qsort(out, (size_t)count, sizeof(GatewayCandidate), compare_gateway);
+    return count;
+}
+
+/* 最上位の候補 (接続確認なし) */
+int get_default_gateway(char *ip, size_t size)
+{
+    GatewayCandidate c[GATEWAY_MAX_CANDIDATES];
+
+    if (gateway_candidates(c, GATEWAY_MAX_CANDIDATES) == 0) return 0;
+    snprintf(ip, size, "%s", c[0].ip);
+    return 1;
+}
+
+/*
+ * 上位 n 件の port へ同時に接続し、応答した中で最上位の添字を返す (なければ -1)。
+ * 上位の候補の結果が出た時点で終える。
+ */
+static int gateway_probe(const GatewayCandidate *c, int n, int port, int timeout_ms)
+{
+    sock_t fds[GATEWAY_PROBE_COUNT];
+    int state[GATEWAY_PROBE_COUNT];          /* 0 = 接続中, 1 = 応答あり, -1 = 失敗 */
+    char service[16];
+    uint64_t deadline = now_ms() + (uint64_t)timeout_ms;
+    int best = -1;
+
+    if (n > GATEWAY_PROBE_COUNT) n = GATEWAY_PROBE_COUNT;
+    snprintf(service, sizeof(service), "%d", port);
+    for (int i = 0; i < n; i++) {
+        struct addrinfo hints, *ai = NULL;
+
+        fds[i] = SOCK_INVALID;
+        state[i] = -1;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_flags = AI_NUMERICHOST;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(c[i].ip, service, &hints, &ai) != 0) continue;
+        fds[i] = socket(ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+        if (fds[i] != SOCK_INVALID && sock_set_nonblock(fds[i])) {
+            if (connect(fds[i], ai->ai_addr, (int)ai->ai_addrlen) == 0) state[i] = 1;
+            else if (sock_in_progress()) state[i] = 0;
+        }
+        freeaddrinfo(ai);
+    }
+
+    for (;;) {
+        struct pollfd pfds[GATEWAY_PROBE_COUNT];
+        int slot[GATEWAY_PROBE_COUNT];
+        int k = 0;
+        uint64_t now = now_ms();
+
+        /* 上位から見て、最初の未失敗が応答済みならそれ */
+        best = -1;
+        for (int i = 0; i < n && best < 0; i++) {
+            if (state[i] == 1) best = i;
+            else if (state[i] == 0) break;
+        }
+        if (best >= 0 || now >= deadline) break;
+        for (int i = 0; i < n; i++) {
+            if (state[i] != 0) continue;
+            pfds[k].fd = fds[i];
+            pfds[k].events = POLLOUT;
+            pfds[k].revents = 0;
+            slot[k++] = i;
+        }
+        if (k == 0) break;
+        if (sock_poll(pfds, k, (int)(deadline - now)) < 0) break;
+        for (int j = 0; j < k; j++) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (!(pfds[j].revents & (POLLOUT | POLLERR | POLLHUP))) continue;
+            getsockopt(fds[slot[j]], SOL_SOCKET, SO_ERROR, (char *)&err, &len);
+            state[slot[j]] = (err == 0 && (pfds[j].revents & POLLOUT)) ? 1 : -1;
+        }
+    }
+    if (best < 0) {
+        for (int i = 0; i < n && best < 0; i++) {
+            if (state[i] == 1) best = i;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (fds[i] != SOCK_INVALID) sock_close(fds[i]);
+    }
+    return best;
+}
+
+/* 経路の変更通知 (route_watch_start 後のみ結果を保持する) */
+static volatile long g_route_generation = 0;
+static int g_route_watch = 0;
+static mutex_t g_gateway_lock;
+static char g_gateway_ip[64];
+static long g_gateway_generation = -1;
+
+#ifdef _WIN32
+static void WINAPI route_changed(PVOID ctx, PMIB_IPFORWARD_ROW2 row, MIB_NOTIFICATION_TYPE type)
+{
+    (void)ctx;
+    (void)row;
+    (void)type;
+    InterlockedIncrement(&g_route_generation);
+}
+
+static void WINAPI iface_changed(PVOID ctx, PMIB_IPINTERFACE_ROW row, MIB_NOTIFICATION_TYPE type)
+{
+    (void)ctx;
+    (void)row;
+    (void)type;
+    InterlockedIncrement(&g_route_generation);
+}
+#elif defined(__linux__)
+/* rtnetlink の経路・リンク通知を受けるたびに世代を進める */
+static thread_ret_t THREAD_CC route_watch_thread(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char buf[8192];
+
+    trace_thread_name("route watch");
+    for (;;) {
+        ssize_t r = recv(fd, buf, sizeof(buf), 0);
+        if (r < 0 && errno == EINTR) continue;
+        __atomic_add_fetch(&g_route_generation, 1, __ATOMIC_SEQ_CST);
+        if (r < 0 && errno != ENOBUFS) break;
+    }
+    /* 通知が受けられなくなった: 以降は毎回検出する */
+    g_route_watch = 0;
+    close(fd);
+    return 0;
+}
+#endif
+
+/* 変更通知を登録し、detect_router_ip の結果を保持するようにする。通知が使えなければ 0 */
+int route_watch_start(void)
+{
+    if (g_route_watch) return 1;
+    mutex_init(&g_gateway_lock);
+#ifdef _WIN32
+    HANDLE route = NULL, iface = NULL;
+    if (NotifyRouteChange2(AF_UNSPEC, route_changed, NULL, FALSE, &route) != NO_ERROR) return 0;
+    if (NotifyIpInterfaceChange(AF_UNSPEC, iface_changed, NULL, FALSE, &iface) != NO_ERROR) {
+        CancelMibChangeNotify2(route);
+        return 0;
+    }
+    g_route_watch = 1;
+#elif defined(__linux__)
+    struct sockaddr_nl sa;
+    thread_t th;
+    int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+
+    if (fd < 0) return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        close(fd);
+        return 0;
+    }
+    g_route_watch = 1;
+    if (!thread_start(&th, route_watch_thread, (void *)(intptr_t)fd)) {
+        g_route_watch = 0;
+        close(fd);
+        return 0;
+    }
+    thread_detach(th);
+#endif
+    return g_route_watch;
+}
+
+int detect_router_ip(const Config *cfg, char *ip, size_t size)
+{
+    GatewayCandidate c[GATEWAY_MAX_CANDIDATES];
+    long generation = g_route_generation;
+    int count, best;
+
+    if (g_route_watch) {
+        int cached;
+        mutex_lock(&g_gateway_lock);
+        cached = (g_gateway_generation == generation);
+        if (cached) snprintf(ip, size, "%s", g_gateway_ip);
+        mutex_unlock(&g_gateway_lock);
+        if (cached) return ip[0] != '\0';
+    }
+
+    count = gateway_candidates(c, GATEWAY_MAX_CANDIDATES);
+    best = 0;
+    if (count > 1 && net_init()) {
+        best = gateway_probe(c, count, cfg->ssh_port, GATEWAY_PROBE_TIMEOUT_MS);
+        if (best < 0) best = 0;
+    }
+    snprintf(ip, size, "%s", count > 0 ? c[best].ip : "");
+
+    if (g_route_watch) {
+        mutex_lock(&g_gateway_lock);
+        snprintf(g_gateway_ip, sizeof(g_gateway_ip), "%s", ip);
+        g_gateway_generation = generation;
+        mutex_unlock(&g_gateway_lock);
+    }
+    return count > 0;
+}
+
+/* ================================================== */
+/* Discovery (concurrent subnet scan)                 */
+/* ================================================== */
+/*
+ * ローカルのプライベートサブネット上の全ホストに対し、port 22 への
+ * ノンブロッキングconnectを同時に張り、応答したホストをSSHバナーで
+ * Dropbear / OpenSSH に分類する。
+ *
+ * 同時接続数は concurrency で制限し、プローブが終わるたびに空いた
+ * スロットへ次のホストを投入する。存在しないホストはconnectタイムアウト
+ * まで待つことになるため、/24 全体でもおおよそ timeout_ms で終わる。
+ */
+typedef enum {
+    PROBE_FREE = 0,
+    PROBE_CONNECTING,
+    PROBE_BANNER
+} ProbeState;
+
+typedef struct {
+    ProbeState state;
+    sock_t fd;
+    uint32_t addr;
+    uint64_t start;
+    uint64_t deadline;
+    int rtt_ms;
+    size_t len;
+    char buf[128];
+} ScanProbe;
+
+static const char *ssh_daemon_name(SshDaemon d)
+{
+    switch (d) {
+    case SSH_DAEMON_DROPBEAR: return "dropbear";
+    case SSH_DAEMON_OPENSSH:  return "openssh";
+    case SSH_DAEMON_OTHER:    return "ssh";
+    default:                  return "-";
+    }
+}
+
+static void format_ipv4(uint32_t addr, char *buf, size_t size)
+{
+    snprintf(buf, size, "%u.%u.%u.%u",
+        addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+}
+
+static uint32_t prefix_mask(int prefix)
+{
+    return (prefix <= 0) ? 0 : (uint32_t)(0xffffffffu << (32 - prefix));
+}
+
+SshDaemon classify_ssh_banner(const char *banner)
+{
+    if (strncmp(banner, "SSH-", 4) != 0) return SSH_DAEMON_NONE;
+    if (strstr(banner, "dropbear")) return SSH_DAEMON_DROPBEAR;
+    if (strstr(banner, "OpenSSH")) return SSH_DAEMON_OPENSSH;
+    return SSH_DAEMON_OTHER;
+}
+
+/* "a.b.c.d/n" または "a.b.c.d" (= /32) */
+int parse_cidr(const char *text, Subnet *out)
+{
+    unsigned int b1, b2, b3, b4;
+    int prefix = 32;
+    char tail;
+
+    if (sscanf(text, "%u.%u.%u.%u/%d%c", &b1, &b2, &b3, &b4, &prefix, &tail) != 5 &&
+        sscanf(text, "%u.%u.%u.%u%c", &b1, &b2, &b3, &b4, &tail) != 4) {
+        return 0;
+    }
+    if (b1 > 255 || b2 > 255 || b3 > 255 || b4 > 255) return 0;
+    if (prefix < 0 || prefix > 32) return 0;
+
+    out->prefix = prefix;
+    out->network = ((b1 << 24) | (b2 << 16) | (b3 << 8) | b4) & prefix_mask(prefix);
+    out->self = 0;
+    return 1;
+}
+
+/* 同一サブネットを重複登録しない。広すぎるサブネットは自アドレス周辺に絞る */
+static int add_local_subnet(Subnet *out, int count, int max, uint32_t addr, int prefix)
+{
+    if (!is_private_addr(addr)) return count;
+    if (prefix < SCAN_MIN_PREFIX) prefix = SCAN_MIN_PREFIX;
+    if (prefix > 30) return count;
+
+    uint32_t network = addr & prefix_mask(prefix);
+    for (int i = 0; i < count; i++) {
+        if (out[i].network == network && out[i].prefix == prefix) return count;
+    }
+    if (count >= max) return count;
+
+    out[count].network = network;
+    out[count].prefix = prefix;
+    out[count].self = addr;
+    return count + 1;
+}
+
+int get_local_subnets(Subnet *out, int max)
+{
+    int count = 0;
+#ifdef _WIN32
+    ULONG size = 16 * 1024;
+    PIP_ADAPTER_ADDRESSES list = NULL;
+    ULONG ret;
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        list = (PIP_ADAPTER_ADDRESSES)malloc(size);
+        if (!list) return 0;
+        ret = GetAdaptersAddresses(AF_INET,
+            GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER,
+            NULL, list, &size);
+        if (ret != ERROR_BUFFER_OVERFLOW) break;
+        free(list);
+        list = NULL;
+    }
+    if (!list) return 0;
+    if (ret != NO_ERROR) {
+        free(list);
+        return 0;
+    }
+
+    for (PIP_ADAPTER_ADDRESSES a = list; a; a = a->Next) {
+        if (a->OperStatus != IfOperStatusUp || a->IfType == IF_TYPE_SOFTWARE_LOOPBACK) continue;
+        for (PIP_ADAPTER_UNICAST_ADDRESS u = a->FirstUnicastAddress; u; u = u->Next) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)u->Address.lpSockaddr;
+            if (sin->sin_family != AF_INET) continue;
+            count = add_local_subnet(out, count, max,
+                ntohl(sin->sin_addr.s_addr), u->OnLinkPrefixLength);
+        }
+    }
+    free(list);
+#else
+    struct ifaddrs *list, *a;
+
+    if (getifaddrs(&list) != 0) return 0;
+    for (a = list; a; a = a->ifa_next) {
+        if (!a->ifa_addr || !a->ifa_netmask || a->ifa_addr->sa_family != AF_INET) continue;
+        if (!(a->ifa_flags & IFF_UP) || (a->ifa_flags & IFF_LOOPBACK)) continue;
+
+        uint32_t addr = ntohl(((struct sockaddr_in *)a->ifa_addr)->sin_addr.s_addr);
+        uint32_t mask = ntohl(((struct sockaddr_in *)a->ifa_netmask)->sin_addr.s_addr);
+        int prefix = 0;
+        while (prefix < 32 && (mask & (0x80000000u >> prefix))) prefix++;
+        count = add_local_subnet(out, count, max, addr, prefix);
+    }
+    freeifaddrs(list);
+#endif
+    return count;
+}
+
+static void probe_close(ScanProbe *p)
+{
+    if (p->fd != SOCK_INVALID) sock_close(p->fd);
+    p->fd = SOCK_INVALID;
+    p->state = PROBE_FREE;
+}
+
+/* 接続開始。即時失敗した場合は0を返す */
+static int probe_start(ScanProbe *p, uint32_t addr, int port, int timeout_ms)
+{
+    struct sockaddr_in sa;
+
+    memset(p, 0, sizeof(*p));
+    p->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (p->fd == SOCK_INVALID) return 0;
+    if (!sock_set_nonblock(p->fd)) {
+        probe_close(p);
+        return 0;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((unsigned short)port);
+    sa.sin_addr.s_addr = htonl(addr);
+
+    p->addr = addr;
+    p->start = now_ms();
+    p->deadline = p->start + (uint64_t)timeout_ms;
+
+    if (connect(p->fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+        /* ループバック等では即座に接続が完了することがある */
+        p->state = PROBE_BANNER;
+        p->deadline = p->start + SCAN_BANNER_TIMEOUT_MS;
+        return 1;
+    }
+    if (!sock_in_progress()) {
+        probe_close(p);
+        return 0;
+    }
+    p->state = PROBE_CONNECTING;
+    return 1;
+}
+
+static void probe_finish(ScanProbe *p, ScanResult *results, int *found)
+{
+    ScanResult *r = &results[(*found)++];
+
+    p->buf[p->len] = '\0';
+    p->buf[strcspn(p->buf, "\r\n")] = '\0';
+    r->addr = p->addr;
+    r->rtt_ms = p->rtt_ms;
+    r->daemon = classify_ssh_banner(p->buf);
+    snprintf(r->banner, sizeof(r->banner), "%s", p->buf);
+    probe_close(p);
+}
+
+static int compare_scan_result(const void *a, const void *b)
+{
+    uint32_t x = ((const ScanResult *)a)->addr;
+    uint32_t y = ((const ScanResult *)b)->addr;
+    return (x > y) - (x < y);
+}
+
+/*
+ * hosts[] を最大 concurrency 本ずつ同時にプローブする。
+ * results は count 要素分の領域が必要。応答したホスト数を返す (アドレス順)。
+ */
+int scan_hosts(const uint32_t *hosts, int count, int port, int concurrency,
+               int timeout_ms, ScanResult *results)
+{
+    ScanProbe *probes;
+    struct pollfd *pfds;
+    int *slot_of;
+    int next = 0, active = 0, found = 0;
+
+    if (concurrency < 1) concurrency = 1;
+    if (concurrency > count) concurrency = count;
+    if (count <= 0) return 0;
+
+    probes = (ScanProbe *)calloc((size_t)concurrency, sizeof(ScanProbe));
+    pfds = (struct pollfd *)calloc((size_t)concurrency, sizeof(struct pollfd));
+    slot_of = (int *)calloc((size_t)concurrency, sizeof(int));
+    if (!probes || !pfds || !slot_of) {
+        free(probes);
+        free(pfds);
+        free(slot_of);
+        return 0;
+    }
+    for (int i = 0; i < concurrency; i++) probes[i].fd = SOCK_INVALID;
+
+    while (next < count || active > 0) {
+        /* 空きスロットに次のホストを投入 */
+        for (int i = 0; i < concurrency && next < count; i++) {
+            if (probes[i].state != PROBE_FREE) continue;
+            if (probe_start(&probes[i], hosts[next++], port, timeout_ms)) active++;
+        }
+        if (active == 0) continue;
+
+        uint64_t now = now_ms();
+        uint64_t nearest = UINT64_MAX;
+        int n = 0;
+        for (int i = 0; i < concurrency; i++) {
+            ScanProbe *p = &probes[i];
+            if (p->state == PROBE_FREE) continue;
+            pfds[n].fd = p->fd;
+            pfds[n].events = (p->state == PROBE_CONNECTING) ? POLLOUT : POLLIN;
+            pfds[n].revents = 0;
+            slot_of[n++] = i;
+            if (p->deadline < nearest) nearest = p->deadline;
+        }
+
+        int wait = (nearest > now) ? (int)(nearest - now) : 0;
+        if (sock_poll(pfds, n, wait) < 0) break;
+
+        now = now_ms();
+        for (int k = 0; k < n; k++) {
+            ScanProbe *p = &probes[slot_of[k]];
+            short ev = pfds[k].revents;
+
+            if (p->state == PROBE_CONNECTING) {
+                if (ev & (POLLOUT | POLLERR | POLLHUP)) {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(p->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &len);
+                    if (err != 0 || !(ev & POLLOUT)) {
+                        probe_close(p);
+                        active--;
+                        continue;
+                    }
+                    p->rtt_ms = (int)(now - p->start);
+                    p->state = PROBE_BANNER;
+                    p->deadline = now + SCAN_BANNER_TIMEOUT_MS;
+                } else if (now >= p->deadline) {
+                    probe_close(p);
+                    active--;
+                }
+                continue;
+            }
+
+            /* PROBE_BANNER: 最初の行 (SSH-2.0-...) が揃うまで読む */
+            if (ev & (POLLIN | POLLERR | POLLHUP)) {
+                int r = (int)recv(p->fd, p->buf + p->len, (int)(sizeof(p->buf) - 1 - p->len), 0);
+                if (r > 0) p->len += (size_t)r;
+                if (r <= 0 || memchr(p->buf, '\n', p->len) || p->len >= sizeof(p->buf) - 1) {
+                    probe_finish(p, results, &found);
+                    active--;
+                }
+            } else if (now >= p->deadline) {
+                /* ポートは開いているがバナーなし */
+                probe_finish(p, results, &found);
+                active--;
+            }
+        }
+    }
+
+    for (int i = 0; i < concurrency; i++) {
+        if (probes[i].state != PROBE_FREE) probe_close(&probes[i]);
+    }
+    free(probes);
+    free(pfds);
+    free(slot_of);
+
+    qsort(results, (size_t)found, sizeof(ScanResult), compare_scan_result);
+    return found;
+}
+
+/* サブネット内のホストアドレス一覧 (ネットワーク/ブロードキャスト/自アドレスを除く) */
+static int expand_subnet(const Subnet *sn, uint32_t *out, int max)
+{
+    uint32_t first, last;
+    int n = 0;
+
+    if (sn->prefix >= 31) {
+        first = sn->network;
+        last = sn->network | ~prefix_mask(sn->prefix);
+    } else {
+        first = sn->network + 1;
+        last = (sn->network | ~prefix_mask(sn->prefix)) - 1;
+    }
+    for (uint32_t a = first; a <= last && n < max; a++) {
+        if (a != sn->self) out[n++] = a;
+        if (a == UINT32_MAX) break;
+    }
+    return n;
+}
+
+int run_scan(const Config *cfg, int argc, char *argv[])
+{
+    Subnet subnets[SCAN_MAX_SUBNETS];
+    int subnet_count = 0;
+    int total = 0;
+    char addr[32];
+
+    /* 引数でCIDRが指定されていればそれを、なければローカルサブネットを走査 */
+    for (int i = 0; i < argc && subnet_count < SCAN_MAX_SUBNETS; i++) {
+        if (!parse_cidr(argv[i], &subnets[subnet_count])) {
+            printf("[ERROR] Invalid address range: %s\n", argv[i]);
+            return 1;
+        }
+        if (subnets[subnet_count].prefix < 16) {
+            printf("[ERROR] Range too large (minimum /16): %s\n", argv[i]);
+            return 1;
+        }
+        subnet_count++;
+    }
+    if (subnet_count == 0) {
+        subnet_count = get_local_subnets(subnets, SCAN_MAX_SUBNETS);
+        if (subnet_count == 0) {
+            printf("[ERROR] No private IPv4 subnet found on this machine.\n");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < subnet_count; i++) {
+        total += (subnets[i].prefix >= 31) ? (1 << (32 - subnets[i].prefix))
+                                           : (1 << (32 - subnets[i].prefix)) - 2;
+    }
+
+    uint32_t *hosts = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)total);
+    ScanResult *results = (ScanResult *)calloc((size_t)total, sizeof(ScanResult));
+    if (!hosts || !results) {
+        free(hosts);
+        free(results);
+        printf("[ERROR] Out of memory.\n");
+        return 1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < subnet_count; i++) {
+        format_ipv4(subnets[i].network, addr, sizeof(addr));
+        int n = expand_subnet(&subnets[i], hosts + count, total - count);
+        printf("Scanning %s/%d (%d hosts)\n", addr, subnets[i].prefix, n);
+        count += n;
+    }
+    printf("Probing port %d, %d in flight, %d ms timeout...\n\n",
+        cfg->ssh_port, cfg->scan_concurrency, cfg->scan_timeout_ms);
+
+    if (!net_init()) {
+        printf("[ERROR] Socket initialization failed.\n");
+        free(hosts);
+        free(results);
+        return 1;
+    }
+
+    uint64_t start = now_ms();
+    int found = scan_hosts(hosts, count, cfg->ssh_port, cfg->scan_concurrency,
+                           cfg->scan_timeout_ms, results);
+    uint64_t elapsed = now_ms() - start;
+
+    int ssh_found = 0;
+    if (found > 0) {
+        printf("  %-16s %-9s %6s  %s\n", "ADDRESS", "DAEMON", "RTT", "BANNER");
+    }
+    for (int i = 0; i < found; i++) {
+        ScanResult *r = &results[i];
+        format_ipv4(r->addr, addr, sizeof(addr));
+        printf("  %-16s %-9s %3d ms  %s\n", addr, ssh_daemon_name(r->daemon),
+            r->rtt_ms, r->banner[0] ? r->banner : "(no SSH banner)");
+        if (r->daemon != SSH_DAEMON_NONE) ssh_found++;
+    }
+    printf("\nFound %d SSH device(s) in %llu ms\n", ssh_found, (unsigned long long)elapsed);
+    if (ssh_found > 0) {
+        int known = inventory_record_scan(results, found);
+        if (known > 0) printf("Inventory: %d host(s) (--inventory list)\n", known);
+    }
+
+    free(hosts);
+    free(results);
+    return 0;
+}
+
+/* ================================================== */
+/* Connection racing (startup address choice)         */
+/* ================================================== */
+/*
+ * 起動時、デバイスの候補アドレス (既定ゲートウェイ・default_ip・
+ * IPv6 リンクローカルのゲートウェイ・前回接続したアドレス) へ少しずつ
+ * ずらして同時に接続し、最初に SSH バナーまで返したものを使う。
+ * ゲートウェイの推測が外れたときや、ルーターが別のアドレスファミリーで
+ * 応答するときに、1つのアドレスのタイムアウトを待たずに済む。
+ *
+ * 各候補のタイムアウトは、以前の接続で測ったそのデバイスの往復時間
+ * (デバイスの記録の rtt = 平滑化した値 / ばらつき、TCP の RTO と同じ計算)
+ * から決め、記録の無い候補は RACE_DEFAULT_TIMEOUT_MS とする。
+ * 往復時間の記録がある候補から (短い順に) 始め、次の候補は
+ * RACE_STAGGER_MS (とその候補のタイムアウトの短い方) 遅れて始める。
+ * 試行中の候補が全て失敗したら待たずに次を始める。
+ */
+typedef enum {
+    RACE_WAITING = 0,
+    RACE_CONNECTING,
+    RACE_BANNER,
+    RACE_FAILED
+} RaceState;
+
+typedef struct {
+    char ip[64];
+    const char *source;
+    int order;               /* 追加した順 (往復時間が同じときの順位) */
+    int srtt;                /* -1 = 記録なし */
+    int timeout_ms;
+    RaceState state;
+    sock_t fd;
+    uint64_t start;
+    uint64_t deadline;
+    size_t len;
+    char buf[128];
+} RaceCandidate;
+
+/* d->rtt ("srtt/rttvar") を読む。記録が無ければ 0 */
+static int rtt_parse(const DeviceInfo *d, int *srtt, int *rttvar)
+{
+    return d && sscanf(d->rtt, "%d/%d", srtt, rttvar) == 2 && *srtt >= 0 && *rttvar >= 0;
+}
+
+/* 往復時間の測定値を d->rtt に加える (RFC 6298 の平滑化) */
+void rtt_update(DeviceInfo *d, int sample_ms)
+{
+    int srtt, rttvar;
+
+    if (sample_ms < 0) return;
+    if (!rtt_parse(d, &srtt, &rttvar)) {
+        srtt = sample_ms;
+        rttvar = sample_ms / 2;
+    } else {
+        rttvar = (3 * rttvar + abs(srtt - sample_ms)) / 4;
+        srtt = (7 * srtt + sample_ms) / 8;
+    }
+    snprintf(d->rtt, sizeof(d->rtt), "%d/%d", srtt, rttvar);
+}
+
+/* 接続 + バナーのタイムアウト (ms)。記録が無ければ RACE_DEFAULT_TIMEOUT_MS */
+static int rtt_timeout_ms(const DeviceInfo *d)
+{
+    int srtt, rttvar, t;
+
+    if (!rtt_parse(d, &srtt, &rttvar)) return RACE_DEFAULT_TIMEOUT_MS;
+    t = srtt + 4 * rttvar;
+    if (t < RACE_MIN_TIMEOUT_MS) t = RACE_MIN_TIMEOUT_MS;
+    if (t > RACE_MAX_TIMEOUT_MS) t = RACE_MAX_TIMEOUT_MS;
+    return t;
+}
+
+/* ssh の ConnectTimeout (秒)。ssh の起動分の余裕を見てタイムアウトの2倍、記録が無ければ従来どおり */
+static int rtt_connect_timeout(const DeviceInfo *d)
+{
+    int srtt, rttvar, s;
+
+    if (!rtt_parse(d, &srtt, &rttvar)) return AUTH_CONNECT_TIMEOUT;
+    s = (2 * rtt_timeout_ms(d) + 999) / 1000;
+    if (s < AUTH_CONNECT_MIN_TIMEOUT) s = AUTH_CONNECT_MIN_TIMEOUT;
+    return s > AUTH_CONNECT_TIMEOUT ? AUTH_CONNECT_TIMEOUT : s;
+}
+
+static void race_last_ip_path(char *buf, size_t size)
+{
+    char dir[512];
+
+    app_data_dir("devices", dir, sizeof(dir));
+    snprintf(buf, size, "%s%c%s", dir, PATH_SEP, RACE_LAST_IP_FILE);
+}
+
+/* 鍵認証まで済んだアドレスを、次回の候補 (last-known) として残す */
+void race_remember(const char *ip)
+{
+    char path[600], line[80];
+
+    race_last_ip_path(path, sizeof(path));
+    snprintf(line, sizeof(line), "%s\n", ip);
+    write_whole_file(path, line, strlen(line));
+}
+
+static int race_last_ip(char *ip, size_t size)
+{
+    char path[600];
+    size_t len;
+    char *data;
+
+    race_last_ip_path(path, sizeof(path));
+    data = read_whole_file(path, &len);
+    if (!data) return 0;
+    data[strcspn(data, "\r\n")] = '\0';
+    snprintf(ip, size, "%s", data);
+    free(data);
+    return ip[0] != '\0';
+}
+
+static int race_add(RaceCandidate *c, int count, const Config *cfg, const char *ip, const char *source)
+{
+    DeviceInfo d;
+    int rttvar;
+
+    if (!ip[0] || count >= RACE_MAX_CANDIDATES) return count;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(c[i].ip, ip) == 0) return count;
+    }
+    memset(&c[count], 0, sizeof(c[count]));
+    snprintf(c[count].ip, sizeof(c[count].ip), "%s", ip);
+    c[count].source = source;
+    c[count].order = count;
+    c[count].fd = SOCK_INVALID;
+    device_lookup(cfg, ip, &d);
+    if (!rtt_parse(&d, &c[count].srtt, &rttvar)) c[count].srtt = -1;
+    c[count].timeout_ms = rtt_timeout_ms(&d);
+    return count + 1;
+}
+
+/* 往復時間の記録がある候補を短い順に先へ。他は追加した順のまま */
+static int compare_race(const void *a, const void *b)
+{
+    const RaceCandidate *x = (const RaceCandidate *)a, *y = (const RaceCandidate *)b;
+    if ((x->srtt < 0) != (y->srtt < 0)) return (x->srtt < 0) - (y->srtt < 0);
+    if (x->srtt != y->srtt) return (x->srtt > y->srtt) - (x->srtt < y->srtt);
+    return x->order - y->order;
+}
+
+static void race_close(RaceCandidate *c)
+{
+    if (c->fd != SOCK_INVALID) sock_close(c->fd);
+    c->fd = SOCK_INVALID;
+    c->state = RACE_FAILED;
+}
+
+static void race_start(RaceCandidate *c, int port, uint64_t now)
+{
+    struct addrinfo hints, *ai = NULL;
+    char service[16];
+
+    c->start = now;
+    c->deadline = now + (uint64_t)c->timeout_ms;
+    c->state = RACE_FAILED;
+    snprintf(service, sizeof(service), "%d", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICHOST;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(c->ip, service, &hints, &ai) != 0) return;
+    c->fd = socket(ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (c->fd != SOCK_INVALID && sock_set_nonblock(c->fd)) {
+        if (connect(c->fd, ai->ai_addr, (int)ai->ai_addrlen) == 0) c->state = RACE_BANNER;
+        else if (sock_in_progress()) c->state = RACE_CONNECTING;
+    }
+    freeaddrinfo(ai);
+    if (c->state == RACE_FAILED) race_close(c);
+}
+
+/* 接続中・バナー待ちの候補の数 */
+static int race_active(const RaceCandidate *c, int n)
+{
+    int active = 0;
+    for (int i = 0; i < n; i++) {
+        if (c[i].state == RACE_CONNECTING || c[i].state == RACE_BANNER) active++;
+    }
+    return active;
+}
+
+/* 候補アドレスを競わせる。どれかが SSH バナーを返せば 1 (out に結果) */
+int race_connect(const Config *cfg, RaceResult *out)
+{
+    RaceCandidate c[RACE_MAX_CANDIDATES];
+    GatewayCandidate gw[GATEWAY_MAX_CANDIDATES];
+    char last[64];
+    int count = 0, gw_count, started = 0, winner = -1;
+    uint64_t start_us = now_us(), next_start;
+
+    memset(out, 0, sizeof(*out));
+    if (!net_init()) return 0;
+    gw_count = gateway_candidates(gw, GATEWAY_MAX_CANDIDATES);
+    for (int i = 0, n = 0; i < gw_count && n < GATEWAY_PROBE_COUNT; i++) {
+        if (strchr(gw[i].ip, '%')) continue;
+        count = race_add(c, count, cfg, gw[i].ip, "gateway");
+        n++;
+    }
+    count = race_add(c, count, cfg, cfg->default_ip, "default_ip");
+    for (int i = 0; i < gw_count; i++) {
+        if (strchr(gw[i].ip, '%')) count = race_add(c, count, cfg, gw[i].ip, "link-local");
+    }
+    if (race_last_ip(last, sizeof(last))) count = race_add(c, count, cfg, last, "last-known");
+    qsort(c, (size_t)count, sizeof(RaceCandidate), compare_race);
+
+    next_start = now_ms();
+    while (winner < 0) {
+        struct pollfd pfds[RACE_MAX_CANDIDATES];
+        int slot[RACE_MAX_CANDIDATES];
+        int k = 0;
+        uint64_t now = now_ms(), wake;
+
+        /* 順番の来た候補を始める。試行中のものが無くなっていれば待たない */
+        while (started < count && (now >= next_start || race_active(c, started) == 0)) {
+            int stagger = c[started].timeout_ms < RACE_STAGGER_MS ? c[started].timeout_ms : RACE_STAGGER_MS;
+            race_start(&c[started], cfg->ssh_port, now);
+            next_start = now + (uint64_t)stagger;
+            started++;
+        }
+        wake = (started < count) ? next_start : UINT64_MAX;
+        for (int i = 0; i < started; i++) {
+            if (c[i].state != RACE_CONNECTING && c[i].state != RACE_BANNER) continue;
+            if (now >= c[i].deadline) {
+                race_close(&c[i]);
+                continue;
+            }
+            pfds[k].fd = c[i].fd;
+            pfds[k].events = (c[i].state == RACE_CONNECTING) ? POLLOUT : POLLIN;
+            pfds[k].revents = 0;
+            slot[k++] = i;
+            if (c[i].deadline < wake) wake = c[i].deadline;
+        }
+        if (k == 0) {
+            if (started >= count) break;
+            continue;
+        }
+        if (sock_poll(pfds, k, (int)(wake - now)) < 0) break;
+
+        for (int j = 0; j < k && winner < 0; j++) {
+            RaceCandidate *p = &c[slot[j]];
+            short ev = pfds[j].revents;
+
+            if (!(ev & (POLLOUT | POLLIN | POLLERR | POLLHUP))) continue;
+            if (p->state == RACE_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(p->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &len);
+                if (err != 0 || !(ev & POLLOUT)) race_close(p);
+                else p->state = RACE_BANNER;
+                continue;
+            }
+            /* 最初の行 (SSH-2.0-...) が揃えば勝ち */
+            int r = (int)recv(p->fd, p->buf + p->len, (int)(sizeof(p->buf) - 1 - p->len), 0);
+            if (r > 0) p->len += (size_t)r;
+            p->buf[p->len] = '\0';
+            if (r > 0 && !strchr(p->buf, '\n') && p->len < sizeof(p->buf) - 1) continue;
+            p->buf[strcspn(p->buf, "\r\n")] = '\0';
+            if (classify_ssh_banner(p->buf) != SSH_DAEMON_NONE) winner = slot[j];
+            else race_close(p);
+        }
+    }
+
+    if (winner >= 0) {
+        snprintf(out->ip, sizeof(out->ip), "%s", c[winner].ip);
+        out->source = c[winner].source;
+        out->rtt_ms = (int)(now_ms() - c[winner].start);
+        snprintf(out->banner, sizeof(out->banner), "%s", c[winner].buf);
+    }
+    out->candidates = count;
+    for (int i = 0; i < started; i++) {
+        if (c[i].fd != SOCK_INVALID) sock_close(c[i].fd);
+    }
+
+    char args[160];
+    snprintf(args, sizeof(args), "\"candidates\":%d,\"winner\":\"%s\",\"source\":\"%s\"",
+             count, out->ip, out->source ? out->source : "");
+    trace_complete("connection race", "network", start_us, args);
+    return winner >= 0;
+}
+
+/* ================================================== */
+/* SSH key authentication                             */
+/* ================================================== */
+int file_exists(const char *path)
+{
+#ifdef _WIN32
+    DWORD attr = GetFileAttributesA(path);
+    return (attr != INVALID_FILE_ATTRIBUTES && !(attr & FILE_ATTRIBUTE_DIRECTORY));
+#else
+    struct stat st;
+    return (stat(path, &st) == 0 && S_ISREG(st.st_mode));
+#endif
+}
+
+static const char *const KEY_TYPE_NAMES[KEY_TYPE_COUNT] = { "ed25519", "rsa" };
+
+int key_type_from_name(const char *name)
+{
+    for (int i = 0; i < KEY_TYPE_COUNT; i++) {
+        if (strcmp(name, KEY_TYPE_NAMES[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/*
+ * 鍵ファイル名
+ *   デバイスごと: <prefix>_<IP>_<type>   (RSA は以前からの名前と同じ)
+ *   共有 (key_shared = on): <prefix>_<type>
+ */
+static void key_paths_for(const Config *cfg, const char *ip, KeyType type, int shared,
+                          char *priv, char *pub, char *ssh_dir, size_t size)
+{
+    char userprofile[512] = {0};
+    char key_name[256] = {0};
+    char ip_safe[256] = {0};
+    const char *p;
+    char *q;
+
+    /* IPアドレスの区切り (IPv4 の '.'、IPv6 の ':' と '%') をアンダースコアに置き換え */
+    for (p = ip, q = ip_safe; *p && (q - ip_safe < (int)sizeof(ip_safe) - 1); p++) {
+        *q++ = (*p == '.' || *p == ':' || *p == '%') ? '_' : *p;
+    }
+    *q = '\0';
+
+    if (shared) {
+        snprintf(key_name, sizeof(key_name), "%s_%s", cfg->ssh_key_prefix, KEY_TYPE_NAMES[type]);
+    } else {
+        snprintf(key_name, sizeof(key_name), "%s_%s_%s", cfg->ssh_key_prefix, ip_safe,
+                 KEY_TYPE_NAMES[type]);
+    }
+
+    get_env(HOME_ENV, userprofile, sizeof(userprofile));
+    snprintf(ssh_dir, size, "%s%c.ssh", userprofile, PATH_SEP);
+    snprintf(priv, size, "%s%c%s", ssh_dir, PATH_SEP, key_name);
+    snprintf(pub, size, "%s%c%s.pub", ssh_dir, PATH_SEP, key_name);
+}
+
+void get_key_paths(const Config *cfg, const char *ip, KeyType type, char *priv, char *pub,
+                   char *ssh_dir, size_t size)
+{
+    key_paths_for(cfg, ip, type, cfg->key_shared, priv, pub, ssh_dir, size);
+}
+
+/* デバイスの記録にある、受け付けられた鍵の種類。記録が無ければ 0 */
+int key_type_recorded(const Config *cfg, const char *host, KeyType *type)
+{
+    DeviceInfo d;
+    int t;
+
+    if (!device_lookup(cfg, host, &d)) return 0;
+    t = key_type_from_name(d.key_type);
+    if (t < 0) return 0;
+    *type = (KeyType)t;
+    return 1;
+}
+
+/* 鍵認証が通った: 鍵の種類と d (NULL 可) の内容をデバイスの記録に反映 */
+void key_type_remember(const Config *cfg, const char *host, DeviceInfo *d, KeyType type)
+{
+    DeviceInfo learned;
+
+    if (!d) {
+        memset(&learned, 0, sizeof(learned));
+        d = &learned;
+    }
+    snprintf(d->key_type, sizeof(d->key_type), "%s", KEY_TYPE_NAMES[type]);
+    device_learned(cfg, host, d);
+}
+
+/* SSH バナーから ed25519 の対応を判定 (dropbear は 2020.79 から対応)。不明なら対応とみなす */
+static int banner_supports_ed25519(const char *banner)
+{
+    const char *p = strstr(banner, "dropbear_");
+    int year = 0, minor = 0;
+
+    if (!p || sscanf(p + 9, "%d.%d", &year, &minor) != 2) return 1;
+    return year * 100 + minor >= 202079;
+}
+
+/* SSH バナーを取得 (IPv4 のみ)。取れなければ 0 */
+static int probe_ssh_banner(const Config *cfg, const char *host, char *banner, size_t size)
+{
+    struct in_addr in4;
+    ScanResult r;
+
+    if (!net_init() || inet_pton(AF_INET, host, &in4) != 1) return 0;
+    uint32_t addr = ntohl(in4.s_addr);
+    if (scan_hosts(&addr, 1, cfg->ssh_port, 1, SPECULATE_PORT_TIMEOUT_MS, &r) <= 0) return 0;
+    if (r.daemon == SSH_DAEMON_NONE) return 0;
+    snprintf(banner, size, "%s", r.banner);
+    return 1;
+}
+
+/*
+ * 使う鍵の種類: 記録があればそれ。初回は key_type (既定 ed25519) とし、
+ * バナーで古い dropbear と分かれば RSA にする。banner が NULL ならバナーは見ない。
+ */
+KeyType key_choose(const Config *cfg, const char *host, const char *banner)
+{
+    KeyType type;
+
+    if (key_type_recorded(cfg, host, &type)) return type;
+    if (cfg->key_type == KEY_ED25519 && banner && !banner_supports_ed25519(banner)) return KEY_RSA;
+    return (KeyType)cfg->key_type;
+}
+
+/*
+ * 作成済みの鍵だけで接続するとき (--fleet, --agent) の鍵: key_choose の種類。
+ * その鍵が無ければ、鍵の種類の記録が無い以前からのデバイスとみなして
+ * デバイスごとの RSA 鍵。どちらも無ければ 0。
+ */
+int key_for_host(const Config *cfg, const char *host, KeyType *type, char *key_path, char *pub_path,
+                 char *ssh_dir, size_t size)
+{
+    *type = key_choose(cfg, host, NULL);
+    get_key_paths(cfg, host, *type, key_path, pub_path, ssh_dir, size);
+    if (!file_exists(key_path) && *type != KEY_RSA) {
+        *type = KEY_RSA;
+        key_paths_for(cfg, host, KEY_RSA, 0, key_path, pub_path, ssh_dir, size);
+    }
+    return file_exists(key_path);
+}
+
+/* ssh-keygen を実行 (表示なし)。中断された場合は作りかけの鍵を消す */
+static int run_keygen(const char *sysroot, KeyType type, const char *key_path, const char *ssh_dir,
+                      volatile int *cancel, ProcResult *res)
+{
+    char keygen[512];
+    char pub_path[520];
+    ProcOptions opt;
+
+    make_dir(ssh_dir);
+    get_ssh_tool(sysroot, "ssh-keygen", keygen, sizeof(keygen));
+    const char *argv[] = { keygen, "-q", "-t", KEY_TYPE_NAMES[type], "-N", "", "-f", key_path, NULL };
+
+    memset(&opt, 0, sizeof(opt));
+    opt.in = PROC_IN_NULL;
+    opt.merge_stderr = 1;
+    opt.cancel = cancel;
+    proc_run(argv, &opt, res);
+    if (res->cancelled) {
+        snprintf(pub_path, sizeof(pub_path), "%s.pub", key_path);
+        remove(key_path);
+        remove(pub_path);
+    }
+    return res->exit_code;
+}
+
+int ensure_ssh_key(const char *sysroot, KeyType type, const char *key_path, const char *ssh_dir)
+{
+    ProcResult res;
+
+    if (file_exists(key_path)) return 1;
+
+    printf("Generating SSH key (%s)...\n", KEY_TYPE_NAMES[type]);
+    run_keygen(sysroot, type, key_path, ssh_dir, NULL, &res);
+    if (res.exit_code != 0) {
+        printf("[ERROR] ssh-keygen failed (exit %d)\n", res.exit_code);
+        if (res.out.data) printf("%s\n", res.out.data);
+    }
+    proc_result_free(&res);
+    return (res.exit_code == 0);
+}
+
+/* ssh 出力の先頭行を detail に写す */
+static void first_line(const char *text, char *detail, size_t size)
+{
+    if (!detail || size == 0) return;
+    snprintf(detail, size, "%s", text ? text : "");
+    detail[strcspn(detail, "\r\n")] = '\0';
+}
+
+/* ssh の出力が、記録と違うホスト鍵による中止か */
+static int host_key_changed(const char *out)
+{
+    return strstr(out, "REMOTE HOST IDENTIFICATION HAS CHANGED") != NULL ||
+           strstr(out, "Host key verification failed") != NULL;
+}
+
+/*
+ * デバイス情報の取得 (リモート側)。認証確認の接続で1回だけ実行し、
+ * 以後は記録を使う。出力は owrt-<key>=<value> の行。
+ */
+static const char DEVICE_FACTS_SCRIPT[] =
+    "[ -f /etc/openwrt_release ] && . /etc/openwrt_release;"
+    "echo \"owrt-board=$(cat /tmp/sysinfo/board_name 2>/dev/null)\";"
+    "echo \"owrt-release=$DISTRIB_DESCRIPTION\";"
+    "exit 0";
+
+static void parse_device_facts(const char *out, DeviceInfo *d)
+{
+    static const struct { const char *prefix; size_t offset; size_t size; } facts[] = {
+        { "owrt-board=", offsetof(DeviceInfo, board), sizeof(d->board) },
+        { "owrt-release=", offsetof(DeviceInfo, release), sizeof(d->release) },
+    };
+
+    for (const char *line = out; *line; ) {
+        size_t len = strcspn(line, "\r\n");
+        for (size_t i = 0; i < sizeof(facts) / sizeof(facts[0]); i++) {
+            size_t plen = strlen(facts[i].prefix);
+            if (len > plen && strncmp(line, facts[i].prefix, plen) == 0) {
+                snprintf((char *)d + facts[i].offset, facts[i].size, "%.*s",
+                         (int)(len - plen), line + plen);
+            }
+        }
+        line += len;
+        line += strspn(line, "\r\n");
+    }
+}
+
+/*
+ * 鍵で入れるか確認する。t->device があり OpenWrt の版が未記録なら、
+ * 同じ接続でボード名と版を取得して t->device に入れる。
+ */
+AuthResult test_key_auth(const SshTarget *t, char *detail, size_t detail_size)
+{
+    ArgList a = {0};
+    ProcOptions opt;
+    ProcResult res;
+    AuthResult result;
+    int want_facts = (t->device && !t->device->release[0]);
+
+    ssh_build_args(t, &a);
+    args_add(&a, "-o");
+    args_add(&a, "BatchMode=yes");
+    args_add(&a, "-o");
+    args_addf(&a, "ConnectTimeout=%d", rtt_connect_timeout(t->device));
+    ssh_add_destination(t, &a);
+    args_add(&a, want_facts ? DEVICE_FACTS_SCRIPT : "exit");
+
+    memset(&opt, 0, sizeof(opt));
+    opt.in = PROC_IN_NULL;
+    opt.merge_stderr = 1;
+    opt.timeout_ms = AUTH_PROBE_TIMEOUT_MS;
+    opt.cancel = t->cancel;
+    proc_run((const char *const *)a.argv, &opt, &res);
+    args_free(&a);
+
+    const char *out = res.out.data ? res.out.data : "";
+    first_line(out, detail, detail_size);
+
+    if (res.exit_code == 0) {
+        if (want_facts) parse_device_facts(out, t->device);
+        result = AUTH_OK;
+    } else if (host_key_changed(out)) {
+        first_line("host key changed", detail, detail_size);
+        result = AUTH_HOST_CHANGED;
+    } else if (res.cancelled) {
+        first_line("cancelled", detail, detail_size);
+        result = AUTH_UNREACHABLE;
+    } else if (res.exit_code < 0) {
+        first_line("ssh client could not be started", detail, detail_size);
+        result = AUTH_UNREACHABLE;
+    } else if (res.timed_out ||
+               strstr(out, "Connection refused") || strstr(out, "timed out") ||
+               strstr(out, "No route to host") || strstr(out, "unreachable") ||
+               strstr(out, "Could not resolve")) {
+        if (res.timed_out) first_line("connection timed out", detail, detail_size);
+        result = AUTH_UNREACHABLE;
+    } else {
+        /* Permission denied 等: 公開鍵の登録へ進む */
+        result = AUTH_DENIED;
+    }
+    proc_result_free(&res);
+    return result;
+}
+
+/*
+ * 公開鍵の登録 (リモート側, 鍵は標準入力 (KEY_INSTALL_STDIN) または k に設定済み)。
+ * 鍵本体 (2番目のフィールド) で既存行を探し、無ければ追加・重複していれば1行に戻す。
+ * 一時ファイルへ書いてから mv で置き換えるので、途中で切れても元のファイルは壊れない。
+ * 変更が無ければ書き込まない。結果は1ファイル1行:
+ *   key added: <file> / key present: <file> / key present: <file> (duplicates removed)
+ * OpenWrt の確認 (KEY_INSTALL_CHECK) は、デバイスの記録に版があれば省く。
+ */
+static const char KEY_INSTALL_CHECK[] =
+    "[ -f /etc/openwrt_release ] || { echo 'ERROR: Not an OpenWrt device. Aborting.'; exit 1; };";
+
+static const char KEY_INSTALL_STDIN[] = "k=$(cat);";
+
+static const char KEY_INSTALL_SCRIPT[] =
+    "b=$(printf '%s\n' \"$k\" | awk '{print $2; exit}');"
+    "[ -n \"$b\" ] || { echo 'ERROR: Empty public key.'; exit 1; };"
+    "n=0;"
+    "for f in /etc/dropbear/authorized_keys /root/.ssh/authorized_keys; do"
+    "  [ -d \"${f%/*}\" ] || continue;"
+    "  t=\"$f.tmp.$$\";"
+    "  { [ -f \"$f\" ] && cat \"$f\"; } | awk -v k=\"$k\" -v b=\"$b\""
+    "    '{for(i=1;i<=NF;i++) if($i==b){if(!d)print; d=1; next}; print} END{if(!d)print k}' > \"$t\""
+    "    || { rm -f \"$t\"; echo \"ERROR: Cannot write $f\"; exit 1; };"
+    "  if [ -f \"$f\" ] && cmp -s \"$f\" \"$t\"; then rm -f \"$t\"; echo \"key present: $f\";"
+    "  else"
+    "    if [ -f \"$f\" ] && grep -qF \"$b\" \"$f\"; then s='key present'; x=' (duplicates removed)';"
+    "    else s='key added'; x=''; fi;"
+    "    chmod 600 \"$t\" && mv -f \"$t\" \"$f\" || { rm -f \"$t\"; echo \"ERROR: Cannot write $f\"; exit 1; };"
+    "    echo \"$s: $f$x\";"
+    "  fi;"
+    "  n=$((n+1));"
+    "done;"
+    "[ $n -gt 0 ] || { echo 'ERROR: No authorized_keys directory found.'; exit 1; }";
+
+static void add_key_install_script(const SshTarget *t, ArgList *a)
+{
+    int known_openwrt = (t->device && t->device->release[0]);
+    args_addf(a, "%s%s%s", known_openwrt ? "" : KEY_INSTALL_CHECK, KEY_INSTALL_STDIN, KEY_INSTALL_SCRIPT);
+}
+
+/*
+ * 本セッションの前置きとして公開鍵を登録するコマンドを sb に追加する
+ * (鍵はコマンドに埋め込む。標準入力は端末のまま)。
+ * 登録の出力は出さず、登録できなければ KEY_INLINE_FAILED_EXIT で終了する。
+ */
+int key_install_inline(const SshTarget *t, const char *pub_path, StrBuf *sb)
+{
+    int known_openwrt = (t->device && t->device->release[0]);
+    size_t len;
+    char *pub = read_whole_file(pub_path, &len);
+
+    if (!pub) return 0;
+    pub[strcspn(pub, "\r\n")] = '\0';
+    sb_puts(sb, "k=");
+    sb_append_quoted(sb, pub);
+    sb_appendf(sb, "; (%s%s) >/dev/null 2>&1 || exit %d; ",
+               known_openwrt ? "" : KEY_INSTALL_CHECK, KEY_INSTALL_SCRIPT, KEY_INLINE_FAILED_EXIT);
+    free(pub);
+    return 1;
+}
+
+/* 以前の版の RSA 鍵 (<prefix>_<IP>_rsa) が t の鍵とは別にあれば 1 (パスを old_key / old_pub に) */
+static int key_legacy_present(const SshTarget *t, char *old_key, char *old_pub, size_t size)
+{
+    char ssh_dir[512];
+
+    key_paths_for(t->cfg, t->host, KEY_RSA, 0, old_key, old_pub, ssh_dir, size);
+    return (strcmp(old_key, t->key_path) != 0 && file_exists(old_key));
+}
+
+int send_public_key(const SshTarget *t, const char *pub_path)
+{
+    SshTarget pw = *t;
+    ArgList a = {0};
+    ProcOptions opt;
+    ProcResult res;
+
+    printf("Registering public key (password required once)...\n\n");
+
+    /* パスワード認証で接続し、標準入力から公開鍵を渡す
+       (マスター接続にすると後の鍵確認がそれに相乗りして鍵の可否を判定できない) */
+    pw.key_path = NULL;
+    pw.ssh_dir = NULL;
+    ssh_build_args(&pw, &a);
+    ssh_add_destination(&pw, &a);
+    add_key_install_script(t, &a);
+
+    memset(&opt, 0, sizeof(opt));
+    opt.in = PROC_IN_FILE;
+    opt.in_path = pub_path;
+    opt.out = PROC_OUT_INHERIT;
+    proc_run((const char *const *)a.argv, &opt, &res);
+    args_free(&a);
+    proc_result_free(&res);
+    return (res.exit_code == 0);
+}
+
+/*
+ * SSH_ASKPASS として起動された自分自身へパスワードを渡す窓口。
+ * ssh は起動時に標準入出力以外の fd を閉じるため、継承したパイプは askpass まで届かない。
+ * そこでループバックの一時ポートで1回だけ待ち受け、環境変数にはポートと
+ * 使い捨てのトークンだけを置く (パスワードは子プロセスの環境に載せない)。
+ * トークンが一致した接続にだけパスワードを返す。
+ */
+typedef struct {
+    sock_t fd;
+    int port;
+    char token[ASKPASS_TOKEN_BYTES * 2 + 1];
+    const char *password;
+    volatile int stop;
+    thread_t thread;
+} AskpassServer;
+
+static thread_ret_t THREAD_CC askpass_serve_thread(void *arg)
+{
+    AskpassServer *as = (AskpassServer *)arg;
+
+    while (!as->stop) {
+        char line[ASKPASS_TOKEN_BYTES * 2 + 4];
+        size_t used = 0;
+        sock_t c = accept(as->fd, NULL, NULL);
+
+        if (c == SOCK_INVALID) break;
+        while (used < sizeof(line) - 1 && !memchr(line, '\n', used)) {
+            struct pollfd pfd = { c, POLLIN, 0 };
+            if (sock_poll(&pfd, 1, ASKPASS_REPLY_TIMEOUT_MS) <= 0) break;
+            int n = (int)recv(c, line + used, (int)(sizeof(line) - 1 - used), 0);
+            if (n <= 0) break;
+            used += (size_t)n;
+        }
+        line[used] = '\0';
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!as->stop && strcmp(line, as->token) == 0) {
+            /* 末尾の改行で受け取り側は全体が届いたと分かる (空のパスワードもある) */
+            send(c, as->password, (int)strlen(as->password), 0);
+            send(c, "\n", 1, 0);
+            as->stop = 1;
+        }
+        sock_close(c);
+    }
+    return 0;
+}
+
+/* 127.0.0.1 の空きポートで待ち受けを始める。env_value に ASKPASS_FLAG_ENV の値 */
+static int askpass_server_start(AskpassServer *as, const char *password, char *env_value, size_t size)
+{
+    unsigned char raw[ASKPASS_TOKEN_BYTES];
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+
+    memset(as, 0, sizeof(*as));
+    as->password = password;
+    if (!net_init() || !random_bytes(raw, sizeof(raw))) return 0;
+    for (size_t i = 0; i < sizeof(raw); i++) snprintf(as->token + i * 2, 3, "%02x", raw[i]);
+    wipe_secret((char *)raw, sizeof(raw));
+
+    as->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (as->fd == SOCK_INVALID) return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(as->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(as->fd, 4) != 0 ||
+        getsockname(as->fd, (struct sockaddr *)&sa, &len) != 0 ||
+        !thread_start(&as->thread, askpass_serve_thread, as)) {
+        sock_close(as->fd);
+        return 0;
+    }
+    as->port = ntohs(sa.sin_port);
+    snprintf(env_value, size, "%s=%d:%s", ASKPASS_FLAG_ENV, as->port, as->token);
+    return 1;
+}
+
+/* 使われなかった場合は自分で接続して accept を抜けさせる */
+static void askpass_server_stop(AskpassServer *as)
+{
+    struct sockaddr_in sa;
+    sock_t c;
+
+    as->stop = 1;
+    c = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (c != SOCK_INVALID) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons((unsigned short)as->port);
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        connect(c, (struct sockaddr *)&sa, sizeof(sa));
+        sock_close(c);
+    }
+    thread_join(as->thread);
+    sock_close(as->fd);
+    wipe_secret(as->token, sizeof(as->token));
+}
+
+/*
+ * KEY_INSTALL_SCRIPT を表示なしで実行し、出力を res に取り込む。
+ * t->key_path があれば鍵認証 (BatchMode)。なければ password を
+ * SSH_ASKPASS として起動した自分自身から ssh に渡す (OpenSSH 8.4+, AskpassServer 経由)。
+ */
+static int key_install_quiet(const SshTarget *t, const char *pub_path, const char *password,
+                             ProcResult *res)
+{
+    char exe_path[512];
+    char askpass_env[600], flag_env[100];
+    const char *env[] = { askpass_env, "SSH_ASKPASS_REQUIRE=force", flag_env, NULL };
+    AskpassServer askpass;
+    int serving = 0;
+    ArgList a = {0};
+    ProcOptions opt;
+
+    ssh_build_args(t, &a);
+    args_add(&a, "-o");
+    args_addf(&a, "ConnectTimeout=%d", FLEET_CONNECT_TIMEOUT);
+    args_add(&a, "-o");
+    args_add(&a, t->key_path ? "BatchMode=yes" : "NumberOfPasswordPrompts=1");
+    ssh_add_destination(t, &a);
+    add_key_install_script(t, &a);
+
+    memset(&opt, 0, sizeof(opt));
+    opt.in = PROC_IN_FILE;
+    opt.in_path = pub_path;
+    opt.merge_stderr = 1;
+    opt.timeout_ms = KEY_PUSH_TIMEOUT_MS;
+    if (!t->key_path) {
+        get_exe_path(exe_path, sizeof(exe_path));
+        snprintf(askpass_env, sizeof(askpass_env), "SSH_ASKPASS=%s", exe_path);
+        serving = askpass_server_start(&askpass, password ? password : "", flag_env, sizeof(flag_env));
+        if (!serving) {
+            memset(res, 0, sizeof(*res));
+            res->exit_code = -1;
+            sb_puts(&res->out, "ERROR: cannot pass the password to ssh\n");
+            args_free(&a);
+            return res->exit_code;
+        }
+        opt.env = env;
+    }
+    proc_run((const char *const *)a.argv, &opt, res);
+    args_free(&a);
+    if (serving) askpass_server_stop(&askpass);
+    return res->exit_code;
+}
+
+/*
+ * t の鍵が通らないとき、以前の RSA 鍵 (<prefix>_<IP>_rsa) で入れるか試す。
+ * 入れればその接続で t の鍵を登録する (パスワード不要) → AUTH_OK。
+ * デバイスが t の鍵を受け付けない場合は以前の鍵に切り替える
+ * (key_path / pub_path を書き換え、t->key_type = KEY_RSA) → AUTH_OK。
+ * 以前の鍵が無い・通らない場合は AUTH_DENIED。
+ * 判定が混ざらないよう、ここでは接続再利用を使わない。
+ */
+AuthResult key_migrate_legacy(SshTarget *t, char *key_path, char *pub_path, size_t size)
+{
+    char old_key[512], old_pub[512];
+    SshTarget old = *t, probe = *t;
+    ProcResult res;
+
+    if (!key_legacy_present(t, old_key, old_pub, sizeof(old_key))) return AUTH_DENIED;
+
+    old.key_path = old_key;
+    old.key_type = KEY_RSA;
+    old.ssh_dir = NULL;
+    if (test_key_auth(&old, NULL, 0) != AUTH_OK) return AUTH_DENIED;
+
+    int installed = (key_install_quiet(&old, pub_path, NULL, &res) == 0);
+    proc_result_free(&res);
+    probe.ssh_dir = NULL;
+    if (installed && test_key_auth(&probe, NULL, 0) == AUTH_OK) return AUTH_OK;
+
+    snprintf(key_path, size, "%s", old_key);
+    snprintf(pub_path, size, "%s", old_pub);
+    t->key_type = KEY_RSA;
+    return AUTH_OK;
+}
+
+/*
+ * 事前確認を省いて本セッションに入り、ssh が失敗 (255) したときの立て直し。
+ * 鍵が拒否されていれば登録し直して確かめる → 1 (再接続してよい)。
+ * 鍵が通る (255 はリモートコマンドの終了コード) か接続できなければ 0。
+ */
+int key_reauth(const SshTarget *t, const char *pub_path, char *detail, size_t detail_size)
+{
+    if (test_key_auth(t, detail, detail_size) != AUTH_DENIED) return 0;
+    printf("\nThe device no longer accepts the saved key; registering it again.\n");
+    if (!send_public_key(t, pub_path)) return 0;
+    return (test_key_auth(t, detail, detail_size) == AUTH_OK);
+}
+
+/* ================================================== */
+/* SSH invocation                                     */
+/* ================================================== */
+/* ssh 実行ファイル・共通オプション・接続再利用・鍵を argv に積む */
+void ssh_build_args(const SshTarget *t, ArgList *a)
+{
+    char ssh_exe[512];
+    char known_hosts[560];
+
+    get_ssh_tool(t->sysroot, "ssh", ssh_exe, sizeof(ssh_exe));
+    args_add(a, ssh_exe);
+    for (int i = 0; SSH_BASE_OPTS[i]; i++) {
+        args_add(a, "-o");
+        args_add(a, SSH_BASE_OPTS[i]);
+    }
+    /* パスに空白があっても ssh の -o 解析で分割されないよう引用符で囲む */
+    known_hosts_path(known_hosts, sizeof(known_hosts));
+    args_add(a, "-o");
+    args_addf(a, "UserKnownHostsFile=\"%s\"", known_hosts);
+    if (t->cfg->ssh_port != SSH_PORT) args_addf(a, "-p%d", t->cfg->ssh_port);
+    /* --bench-link / link_tune で選んだ暗号 (残りの候補を予備に続ける) と圧縮 */
+    if (t->device && t->device->cipher[0]) {
+        StrBuf ciphers = {0};
+        sb_appendf(&ciphers, "Ciphers=%s", t->device->cipher);
+        for (int i = 0; LINK_CIPHERS[i]; i++) {
+            if (strcmp(LINK_CIPHERS[i], t->device->cipher) != 0) sb_appendf(&ciphers, ",%s", LINK_CIPHERS[i]);
+        }
+        args_add(a, "-o");
+        args_add(a, ciphers.data);
+        sb_free(&ciphers);
+    }
+    if (t->device && t->device->compression[0]) {
+        args_add(a, "-o");
+        args_addf(a, "Compression=%s", t->device->compression);
+    }
+    if (t->ssh_dir) add_ssh_mux_args(a, t->cfg, t->ssh_dir);
+    if (t->key_path && t->key_path[0]) {
+        /* 新しい OpenSSH は SHA-1 署名の ssh-rsa を既定で無効にしている (RSA 鍵のときだけ許可) */
+        if (t->key_type == KEY_RSA) {
+            args_add(a, "-o");
+            args_add(a, "PubkeyAcceptedKeyTypes=+ssh-rsa");
+        }
+        args_add(a, "-i");
+        args_add(a, t->key_path);
+    }
+}
+
+/* user@host (以降の引数はリモートコマンド) */
+void ssh_add_destination(const SshTarget *t, ArgList *a)
+{
+    args_addf(a, "%s@%s", t->user, t->host);
+}
+
+/* ================================================== */
+/* Connection reuse (SSH multiplexing)                */
+/* ================================================== */
+/*
+ * 認証プローブ・公開鍵登録・本セッションで1本の認証済み接続を共有する。
+ * OpenSSH の ControlMaster を使い、最初に認証に成功した ssh がマスターとなり、
+ * 以降の ssh はその接続上の新しいチャネルとして動く (鍵交換・認証なし)。
+ * マスターは ControlPersist 秒間残るため、続けて起動した場合も再利用される。
+ *
+ * Windows 同梱の OpenSSH は ControlMaster に対応していないため、
+ * Windows ではステップごとに接続する。その代わり鍵が通った記録のあるデバイスは
+ * 認証確認を省いて本セッションだけで接続し (main の auth_assumed)、
+ * 記録の無いデバイスは本セッションの接続の先頭で公開鍵を登録する (key_install_inline)。
+ * 手順の連続実行・--push・回線測定はこれまで通りステップごとにハンドシェイクする。
+ */
+int ssh_mux_available(const Config *cfg)
+{
+#ifdef _WIN32
+    (void)cfg;
+    return 0;
+#else
+    return cfg->ssh_mux;
+#endif
+}
+
+void add_ssh_mux_args(ArgList *a, const Config *cfg, const char *ssh_dir)
+{
+    if (!ssh_mux_available(cfg)) return;
+
+    /* %C = ローカル/リモートホスト・ポート・ユーザーのハッシュ */
+    args_add(a, "-o");
+    args_add(a, "ControlMaster=auto");
+    args_add(a, "-o");
+    args_addf(a, "ControlPath=%s%cowrt-cm-%%C", ssh_dir, PATH_SEP);
+    args_add(a, "-o");
+    args_addf(a, "ControlPersist=%d", cfg->ssh_mux_persist);
+}
+
+/* マスター接続が生きているか (ssh -O check) */
+int ssh_mux_check(const SshTarget *t)
+{
+    ArgList a = {0};
+    int ret;
+
+    if (!t->ssh_dir || !ssh_mux_available(t->cfg)) return 0;
+    ssh_build_args(t, &a);
+    args_add(&a, "-O");
+    args_add(&a, "check");
+    ssh_add_destination(t, &a);
+    ret = proc_run_simple((const char *const *)a.argv, PROC_IN_NULL, PROC_OUT_NULL);
+    args_free(&a);
+    return ret == 0;
+}
+
+/* 残っているマスター接続を閉じる (ssh -O exit) */
+void ssh_mux_close(const SshTarget *t)
+{
+    ArgList a = {0};
+
+    if (!t->ssh_dir || !ssh_mux_available(t->cfg)) return;
+    ssh_build_args(t, &a);
+    args_add(&a, "-O");
+    args_add(&a, "exit");
+    ssh_add_destination(t, &a);
+    proc_run_simple((const char *const *)a.argv, PROC_IN_NULL, PROC_OUT_NULL);
+    args_free(&a);
+}
+
+/* ================================================== */
+/* Phase timing and tracing                           */
+/* ================================================== */
+/*
+ * --timing: 起動から接続までの各フェーズの所要時間を表示
+ * --trace <file>: フェーズと全ての子プロセスを Chrome trace 形式 (JSON) で書き出す。
+ *   chrome://tracing や ui.perfetto.dev で開き、拠点ごとの起動を比較できる。
+ *   無効時は各フックでフラグを1つ見るだけ。
+ */
+typedef struct {
+    const char *name;
+    uint64_t start_us;
+    uint64_t ms;
+} PhaseTime;
+
+typedef struct {
+    char ph;                 /* 'X' = 区間, 'M' = スレッド名 */
+    char name[64];
+    const char *cat;
+    char args[400];          /* JSON オブジェクトの中身 */
+    uint64_t ts_us;          /* トレース開始からの経過 */
+    uint64_t dur_us;
+    unsigned long tid;
+} TraceEvent;
+
+static PhaseTime g_phases[MAX_PHASES];
+static int g_phase_count = 0;
+
+static TraceEvent *g_trace = NULL;
+static int g_trace_count = 0;
+static int g_trace_cap = 0;
+static int g_trace_on = 0;
+static uint64_t g_trace_t0 = 0;
+static const char *g_trace_path = NULL;
+static mutex_t g_trace_lock;
+
+int trace_enabled(void)
+{
+    return g_trace_on;
+}
+
+static void trace_push(char ph, const char *name, const char *cat,
+                       uint64_t start_us, uint64_t dur_us, const char *args)
+{
+    TraceEvent *e;
+
+    mutex_lock(&g_trace_lock);
+    if (g_trace_count == g_trace_cap) {
+        int cap = g_trace_cap ? g_trace_cap * 2 : 64;
+        TraceEvent *p = (TraceEvent *)realloc(g_trace, (size_t)cap * sizeof(TraceEvent));
+        if (!p) {
+            mutex_unlock(&g_trace_lock);
+            return;
+        }
+        g_trace = p;
+        g_trace_cap = cap;
+    }
+    e = &g_trace[g_trace_count++];
+    e->ph = ph;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->cat = cat;
+    snprintf(e->args, sizeof(e->args), "%s", args ? args : "");
+    e->ts_us = (start_us > g_trace_t0) ? start_us - g_trace_t0 : 0;
+    e->dur_us = dur_us;
+    e->tid = thread_id();
+    mutex_unlock(&g_trace_lock);
+}
+
+/* start_us から現在までの区間を記録 */
+void trace_complete(const char *name, const char *cat, uint64_t start_us, const char *args)
+{
+    if (!g_trace_on) return;
+    trace_push('X', name, cat, start_us, now_us() - start_us, args);
+}
+
+/* 呼び出したスレッドに表示名を付ける */
+void trace_thread_name(const char *name)
+{
+    if (!g_trace_on) return;
+    trace_push('M', name, NULL, g_trace_t0, 0, NULL);
+}
+
+static void trace_write(void)
+{
+    FILE *fp = fopen(g_trace_path, "w");
+
+    if (!fp) {
+        fprintf(stderr, "[ERROR] Cannot write trace: %s\n", g_trace_path);
+        return;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+                "\"args\":{\"name\":\"openwrt-connect\"}}");
+    for (int i = 0; i < g_trace_count; i++) {
+        const TraceEvent *e = &g_trace[i];
+        char name[160];
+
+        json_escape(e->name, name, sizeof(name));
+        if (e->ph == 'M') {
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,"
+                        "\"args\":{\"name\":\"%s\"}}", e->tid, name);
+        } else {
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,"
+                        "\"ts\":%llu,\"dur\":%llu,\"args\":{%s}}",
+                    name, e->cat, e->tid, (unsigned long long)e->ts_us,
+                    (unsigned long long)e->dur_us, e->args);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+/* トレースを有効化し、終了時にファイルへ書き出す (エラー終了時も含む) */
+static void trace_start(const char *path)
+{
+    mutex_init(&g_trace_lock);
+    g_trace_path = path;
+    g_trace_t0 = now_us();
+    g_trace_on = 1;
+    trace_thread_name("main");
+    atexit(trace_write);
+}
+
+static int phase_begin(const char *name)
+{
+    if (g_phase_count >= MAX_PHASES) return -1;
+    g_phases[g_phase_count].name = name;
+    g_phases[g_phase_count].start_us = now_us();
+    g_phases[g_phase_count].ms = 0;
+    return g_phase_count++;
+}
+
+static void phase_end(int id)
+{
+    if (id < 0) return;
+    g_phases[id].ms = (now_us() - g_phases[id].start_us) / 1000;
+    trace_complete(g_phases[id].name, "phase", g_phases[id].start_us, NULL);
+}
+
+static void print_phase_times(const Config *cfg)
+{
+    uint64_t total = 0;
+
+    printf("\nPhase timing:\n");
+    for (int i = 0; i < g_phase_count; i++) {
+        printf("  %-14s %7llu ms\n", g_phases[i].name, (unsigned long long)g_phases[i].ms);
+        total += g_phases[i].ms;
+    }
+    printf("  %-14s %7llu ms\n", "total", (unsigned long long)total);
+    printf("Config: %s\n", cfg->loaded_from);
+    if (ssh_mux_available(cfg)) {
+        printf("Connection reuse: on (ControlMaster, persist %d s)\n", cfg->ssh_mux_persist);
+    } else {
+        printf("Connection reuse: off (one SSH handshake per step)\n");
+    }
+}
+
+/* ================================================== */
+/* Speculative startup                                */
+/* ================================================== */
+/*
+ * IPアドレスの入力待ちの間に、表示中の既定IPに対して
+ * ポート22の到達確認 → 鍵生成 → 鍵認証プローブ を先行して行う。
+ * 接続再利用が有効なら認証プローブの接続がそのままマスターになるため、
+ * 既定IPを受け入れた場合は認証済みの接続が用意された状態で本処理に入る。
+ * 別のIPが入力された場合は中断し、作りかけの鍵とマスター接続を片付ける。
+ * 画面には何も出力しない (エラーは本処理の再実行で表示される)。
+ */
+static thread_ret_t THREAD_CC speculate_worker(void *arg)
+{
+    Speculation *sp = (Speculation *)arg;
+    struct in_addr in4;
+    ScanResult r;
+    SshTarget t;
+
+    trace_thread_name("prefetch");
+
+    /* IPv4 の場合のみ TCP で到達確認 (ホスト名は ssh に任せる) */
+    r.banner[0] = '\0';
+    if (net_init() && inet_pton(AF_INET, sp->ip, &in4) == 1) {
+        uint32_t addr = ntohl(in4.s_addr);
+        uint64_t start_us = now_us();
+        sp->port_open = (scan_hosts(&addr, 1, sp->cfg->ssh_port, 1, SPECULATE_PORT_TIMEOUT_MS, &r) > 0);
+        trace_complete("port probe", "network", start_us,
+                       sp->port_open ? "\"open\":true" : "\"open\":false");
+    }
+    if (sp->cancel) return 0;
+
+    /* 鍵の種類は記録かポート確認で得たバナーで決める (本処理も sp->key_type を使う) */
+    sp->device_known = device_lookup(sp->cfg, sp->ip, &sp->device);
+    if (sp->port_open > 0 && r.banner[0]) device_set_banner(&sp->device, r.banner);
+    sp->key_type = key_choose(sp->cfg, sp->ip, sp->device.banner[0] ? sp->device.banner : NULL);
+    get_key_paths(sp->cfg, sp->ip, sp->key_type, sp->key_path, sp->pub_path, sp->ssh_dir,
+                  sizeof(sp->key_path));
+    if (file_exists(sp->key_path)) {
+        sp->have_key = 1;
+    } else {
+        ProcResult res;
+        sp->have_key = (run_keygen(sp->sysroot, sp->key_type, sp->key_path, sp->ssh_dir, &sp->cancel,
+                                   &res) == 0);
+        proc_result_free(&res);
+    }
+    if (sp->cancel || !sp->have_key || sp->port_open == 0) return 0;
+
+    memset(&t, 0, sizeof(t));
+    t.sysroot = sp->sysroot;
+    t.user = sp->cfg->ssh_user;
+    t.host = sp->ip;
+    t.key_path = sp->key_path;
+    t.key_type = sp->key_type;
+    t.device = &sp->device;
+    t.ssh_dir = sp->ssh_dir;
+    t.cfg = sp->cfg;
+    t.cancel = &sp->cancel;
+    sp->auth = test_key_auth(&t, sp->detail, sizeof(sp->detail));
+    /* 中断されても認証プローブは走った (マスター接続ができている場合がある) */
+    sp->auth_done = 1;
+    return 0;
+}
+
+void speculate_start(Speculation *sp, const Config *cfg, const char *sysroot, const char *ip)
+{
+    memset(sp, 0, sizeof(*sp));
+    if (!cfg->speculate) return;
+
+    sp->cfg = cfg;
+    sp->sysroot = sysroot;
+    sp->port_open = -1;
+    snprintf(sp->ip, sizeof(sp->ip), "%s", ip);
+    sp->started = thread_start(&sp->thread, speculate_worker, sp);
+}
+
+/* 先行処理の完了を待つ (結果はそのまま使う) */
+void speculate_join(Speculation *sp)
+{
+    if (!sp->started) return;
+    thread_join(sp->thread);
+    sp->started = 0;
+}
+
+/* 別のIPが入力された: 中断して後片付け */
+void speculate_cancel(Speculation *sp)
+{
+    if (!sp->started) return;
+    sp->cancel = 1;
+    speculate_join(sp);
+
+    /* プローブの途中で止めた場合も結果に関わらずマスター接続を閉じる (無ければ何もしない) */
+    if (sp->auth_done) {
+        SshTarget t;
+        memset(&t, 0, sizeof(t));
+        t.sysroot = sp->sysroot;
+        t.user = sp->cfg->ssh_user;
+        t.host = sp->ip;
+        t.key_path = sp->key_path;
+        t.ssh_dir = sp->ssh_dir;
+        t.cfg = sp->cfg;
+        ssh_mux_close(&t);
+    }
+    sp->auth_done = 0;
+}
+
+/* argv から flag を取り除き、見つかれば1を返す */
+static int take_flag(int *argc, char *argv[], const char *flag)
+{
+    int found = 0, j = 1;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], flag) == 0) found = 1;
+        else argv[j++] = argv[i];
+    }
+    *argc = j;
+    argv[j] = NULL;
+    return found;
+}
+
+/* argv から "option <value>" を取り除き、値を返す (なければ NULL) */
+static const char *take_option(int *argc, char *argv[], const char *option)
+{
+    const char *value = NULL;
+    int j = 1;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], option) == 0 && i + 1 < *argc) value = argv[++i];
+        else argv[j++] = argv[i];
+    }
+    *argc = j;
+    argv[j] = NULL;
+    return value;
+}
+
+/* ================================================== */
+/* Configuration file parser                          */
+/* ================================================== */
+/*
+ * .conf は全体を1ブロックに読み込み、行・キー・値をその場で区切って使う (コピーなし)。
+ * 同じブロックの末尾にコマンド表と名前のハッシュ索引を置くため、
+ * 読み込みはファイルサイズに比例した1回の確保で済み、行や値の長さ・
+ * コマンド数に上限はない。
+ */
+static void config_defaults(Config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->product_name = "OpenWrt Connect";
+    cfg->default_ip = "192.168.1.1";
+    cfg->ssh_user = "root";
+    cfg->ssh_key_prefix = "owrt-connect";
+    cfg->ssh_port = SSH_PORT;
+    cfg->scan_concurrency = SCAN_DEFAULT_CONCURRENCY;
+    cfg->scan_timeout_ms = SCAN_DEFAULT_TIMEOUT_MS;
+    cfg->fleet_concurrency = FLEET_DEFAULT_CONCURRENCY;
+    cfg->fleet_log_compress = 0;
+    cfg->fleet_timeout = FLEET_DEFAULT_TIMEOUT;
+    cfg->ssh_mux = 1;
+    cfg->ssh_mux_persist = SSH_MUX_DEFAULT_PERSIST;
+    cfg->key_type = KEY_ED25519;
+    cfg->key_shared = 0;
+    cfg->speculate = 1;
+    cfg->connect_race = 1;
+    cfg->script_push = 1;
+    cfg->script_ttl = SCRIPT_DEFAULT_TTL;
+    cfg->agent = 0;
+    cfg->agent_idle_timeout = AGENT_DEFAULT_IDLE_TIMEOUT;
+    cfg->link_tune = 0;
+    cfg->monitor_interval = MONITOR_DEFAULT_INTERVAL;
+    cfg->loaded_from = "defaults";
+}
+
+/* FNV-1a */
+static uint32_t hash_name(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* 同名のコマンドは先に定義されたものを優先 */
+static void index_command(Config *cfg, int idx)
+{
+    uint32_t mask = (uint32_t)cfg->index_size - 1;
+    uint32_t slot = hash_name(cfg->commands[idx].name) & mask;
+
+    while (cfg->command_index[slot] >= 0) {
+        if (strcmp(cfg->commands[cfg->command_index[slot]].name, cfg->commands[idx].name) == 0) return;
+        slot = (slot + 1) & mask;
+    }
+    cfg->command_index[slot] = idx;
+}
+
+static void parse_general(Config *cfg, const char *key, const char *val)
+{
+    if (strcmp(key, "product_name") == 0)
+        cfg->product_name = val;
+    else if (strcmp(key, "default_ip") == 0)
+        cfg->default_ip = val;
+    else if (strcmp(key, "ssh_user") == 0)
+        cfg->ssh_user = val;
+    else if (strcmp(key, "ssh_key_prefix") == 0)
+        cfg->ssh_key_prefix = val;
+    else if (strcmp(key, "key_type") == 0 && key_type_from_name(val) >= 0)
+        cfg->key_type = key_type_from_name(val);
+    else if (strcmp(key, "key_shared") == 0)
+        cfg->key_shared = (strcmp(val, "off") != 0 && strcmp(val, "0") != 0);
+    else if (strcmp(key, "ssh_port") == 0 && atoi(val) > 0 && atoi(val) < 65536)
+        cfg->ssh_port = atoi(val);
+    else if (strcmp(key, "scan_concurrency") == 0 && atoi(val) > 0)
+        cfg->scan_concurrency = atoi(val);
+    else if (strcmp(key, "scan_timeout_ms") == 0 && atoi(val) > 0)
+        cfg->scan_timeout_ms = atoi(val);
+    else if (strcmp(key, "fleet_concurrency") == 0 && atoi(val) > 0)
+        cfg->fleet_concurrency = atoi(val);
+    else if (strcmp(key, "fleet_log_compress") == 0)
+        cfg->fleet_log_compress = (strcmp(val, "off") != 0 && strcmp(val, "0") != 0);
+    else if (strcmp(key, "fleet_timeout") == 0 && atoi(val) >= 0)
+        cfg->fleet_timeout = atoi(val);
+    else if (strcmp(key, "ssh_mux") == 0)
+        cfg->ssh_mux = (strcmp(val, "off") != 0 && strcmp(val, "0") != 0);
+    else if (strcmp(key, "ssh_mux_persist") == 0 && atoi(val) >= 0)
+        cfg->ssh_mux_persist = atoi(val);
+    else if (strcmp(key, "speculate") == 0)
+        cfg->speculate = (strcmp(val, "off") != 0 && strcmp(val, "0") != 0);
+    else if (strcmp(key, "connect_race") == 0)
+        cfg->connect_race = (strcmp(val, "off") != 0 && strcmp(val, "0") != 0);
+    else if (strcmp(key, "script_push") == 0)
+        cfg->script_push = (strcmp(val, "off") != 0 && strcmp(val, "0") != 0);
+    else if (strcmp(key, "script_ttl") == 0 && atoi(val) >= 0)
+        cfg->script_ttl = atoi(val);
+    else if (strcmp(key, "agent") == 0)
+        cfg->agent = (strcmp(val, "off") != 0 && strcmp(val, "0") != 0);
+    else if (strcmp(key, "agent_idle_timeout") == 0 && atoi(val) > 0)
+        cfg->agent_idle_timeout = atoi(val);
+    else if (strcmp(key, "link_tune") == 0)
+        cfg->link_tune = (strcmp(val, "off") != 0 && strcmp(val, "0") != 0);
+    else if (strcmp(key, "monitor_interval") == 0 && atoi(val) > 0)
+        cfg->monitor_interval = atoi(val);
+}
+
+static void parse_command_key(CommandDef *c, const char *key, const char *val)
+{
+    if (strcmp(key, "label") == 0)
+        c->label = val;
+    else if (strcmp(key, "icon") == 0)
+        c->icon = val;
+    else if (strcmp(key, "url") == 0)
+        c->url = val;
+    else if (strcmp(key, "dir") == 0)
+        c->dir = val;
+    else if (strcmp(key, "bin") == 0)
+        c->bin = val;
+    else if (strcmp(key, "manifest") == 0)
+        c->manifest = val;
+    else if (strcmp(key, "steps") == 0)
+        c->steps = val;
+}
+
+int load_config_file(const char *path, Config *cfg)
+{
+    FILE *fp;
+    long size;
+    size_t len, sections = 0, text_size, table_off, index_off;
+    char *block, *p, *end;
+    const char *section = "";
+    CommandDef *current = NULL;
+
+    config_defaults(cfg);
+
+    fp = fopen(path, "rb");
+    if (!fp) return 0;
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0) {
+        fclose(fp);
+        return 0;
+    }
+    rewind(fp);
+
+    block = (char *)malloc((size_t)size + 1);
+    if (!block) {
+        fclose(fp);
+        return 0;
+    }
+    len = fread(block, 1, (size_t)size, fp);
+    fclose(fp);
+    block[len] = '\0';
+
+    /* '[' の数はセクション数の上限 */
+    for (size_t i = 0; i < len; i++) {
+        if (block[i] == '[') sections++;
+    }
+    cfg->index_size = 8;
+    while ((size_t)cfg->index_size < sections * 2) cfg->index_size *= 2;
+
+    text_size = len + 1;
+    table_off = (text_size + 15) & ~(size_t)15;
+    index_off = table_off + sections * sizeof(CommandDef);
+    p = (char *)realloc(block, index_off + (size_t)cfg->index_size * sizeof(int));
+    if (!p) {
+        free(block);
+        cfg->index_size = 0;
+        return 0;
+    }
+    block = p;
+    cfg->arena = block;
+    cfg->commands = (CommandDef *)(block + table_off);
+    cfg->command_index = (int *)(block + index_off);
+    memset(cfg->command_index, 0xff, (size_t)cfg->index_size * sizeof(int));
+
+    for (p = block, end = block + len; p < end; ) {
+        char *line = p;
+        char *nl = (char *)memchr(p, '\n', (size_t)(end - p));
+
+        if (nl) {
+            *nl = '\0';
+            p = nl + 1;
+        } else {
+            p = end;
+        }
+        trim(line);
+
+        /* 空行・コメント行をスキップ */
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        /* セクションヘッダ */
+        if (line[0] == '[') {
+            char *close = strchr(line, ']');
+            if (!close) continue;
+            *close = '\0';
+            section = line + 1;
+            current = NULL;
+
+            /* [command.<name>] / [sequence.<name>] の場合、コマンドを登録 (同じ名前空間) */
+            const char *name = NULL;
+            if (strncmp(section, "command.", 8) == 0 && section[8] != '\0') name = section + 8;
+            if (strncmp(section, "sequence.", 9) == 0 && section[9] != '\0') name = section + 9;
+            if (name) {
+                current = &cfg->commands[cfg->command_count];
+                current->name = name;
+                current->label = current->icon = current->url = "";
+                current->dir = current->bin = current->manifest = current->steps = "";
+                index_command(cfg, cfg->command_count++);
+            }
+            continue;
+        }
+
+        /* key = value の解析 */
+        char *eq = strchr(line, '=');
+        if (!eq) continue;
+
+        *eq = '\0';
+        char *key = line;
+        char *val = eq + 1;
+        trim(key);
+        trim(val);
+
+        if (strcmp(section, "general") == 0) {
+            parse_general(cfg, key, val);
+        } else if (current) {
+            parse_command_key(current, key, val);
+        }
+    }
+    cfg->loaded_from = "text";
+    return 1;
+}
+
+int load_config(const char *exe_path, Config *cfg)
+{
+    char conf_path[MAX_VALUE_LEN];
+    char snap_path[MAX_VALUE_LEN];
+
+    /* 変更されていなければコンパイル済みスナップショットを使う (検索・解析なし) */
+    if (snapshot_load_embedded(exe_path, cfg)) return 1;
+    snprintf(snap_path, sizeof(snap_path), "%s%s", exe_path, CONFIG_SNAPSHOT_FILE);
+    if (snapshot_load_file(snap_path, exe_path, cfg)) return 1;
+    snapshot_user_path(exe_path, snap_path, sizeof(snap_path));
+    if (snapshot_load_file(snap_path, exe_path, cfg)) return 1;
+
+    /* .confのパスを構築 (EXEと同じディレクトリの.confを自動検出) */
+    if (!find_conf_file(exe_path, conf_path, sizeof(conf_path))) {
+        config_defaults(cfg);
+        printf("[WARN] No .conf file found in: %s\n", exe_path);
+        printf("[WARN] Using built-in defaults.\n\n");
+        return 0;
+    }
+
+    if (!load_config_file(conf_path, cfg)) {
+        printf("[WARN] Config file not found: %s\n", conf_path);
+        printf("[WARN] Using built-in defaults.\n\n");
+        return 0;
+    }
+    /* 次回の起動用 (書けない場所なら何もしない) */
+    snapshot_write(cfg, conf_path, snap_path);
+    return 1;
+}
+
+void config_free(Config *cfg)
+{
+    free(cfg->arena);
+    if (cfg->snapshot) unmap_file(cfg->snapshot, cfg->snapshot_size);
+    config_defaults(cfg);
+}
+
+CommandDef* find_command(Config *cfg, const char *name)
+{
+    uint32_t mask, slot;
+
+    if (cfg->command_count == 0) return NULL;
+    mask = (uint32_t)cfg->index_size - 1;
+    for (slot = hash_name(name) & mask; cfg->command_index[slot] >= 0; slot = (slot + 1) & mask) {
+        CommandDef *c = &cfg->commands[cfg->command_index[slot]];
+        if (strcmp(c->name, name) == 0) return c;
+    }
+    return NULL;
+}
+
+/* ================================================== */
+/* Config snapshot                                    */
+/* ================================================== */
+/*
+ * 解析済みの Config をそのまま読み込める形で保存したもの。
+ *   [SnapHeader][Config][CommandDef x count][int index x index_size][文字列プール]
+ * Config / CommandDef 内の文字列ポインタは文字列プール内のオフセットに置き換え、
+ * 同じ文字列はプールに1つだけ置く。それ以外 (数値設定) はそのままコピーするため、
+ * [general] に数値キーを追加しても対応は不要。文字列フィールドを追加した場合は
+ * CONFIG_STRING_FIELDS に加える (CommandDef は全フィールドが文字列)。
+ * 構造体のサイズ・バージョン・ポインタの位置 (layout_hash) が一致しないものは使わない。
+ *
+ * 元の .conf はサイズと更新時刻で確認し、時刻だけ違う場合は内容のハッシュで確認する。
+ * EXE のリソース (CONFIG_SNAPSHOT) → EXE と同じ場所の openwrt-connect.snap
+ * (--compile-config) → ユーザーごとのスナップショット → .conf の順に使う。
+ * .conf を解析したときはユーザーごとの場所 (~/.openwrt-connect/config/) に書く
+ * (EXE の置き場所は書き込めないことや、複数のユーザーで共有されることがある)。
+ */
+typedef struct {
+    char magic[4];           /* "OWCS" */
+    uint32_t version;
+    uint32_t config_size;    /* sizeof(Config) */
+    uint32_t command_size;   /* sizeof(CommandDef) */
+    uint64_t layout_hash;    /* snapshot_layout_hash() of the writing build */
+    uint64_t source_size;
+    uint64_t source_mtime;
+    uint64_t source_hash;    /* FNV-1a 64 of the .conf */
+    uint32_t conf_name;      /* .conf file name (pool offset), relative to the exe dir */
+    uint32_t command_count;
+    uint32_t index_size;
+    uint32_t config_off;
+    uint32_t commands_off;
+    uint32_t index_off;
+    uint32_t strings_off;
+    uint32_t total_size;
+} SnapHeader;
+
+static const size_t CONFIG_STRING_FIELDS[] = {
+    offsetof(Config, product_name),
+    offsetof(Config, default_ip),
+    offsetof(Config, ssh_user),
+    offsetof(Config, ssh_key_prefix),
+};
+#define CONFIG_STRING_FIELD_COUNT (sizeof(CONFIG_STRING_FIELDS) / sizeof(CONFIG_STRING_FIELDS[0]))
+#define COMMAND_STRING_FIELD_COUNT (sizeof(CommandDef) / sizeof(const char *))
+
+/* 文字列プール (重複排除つき) */
+typedef struct {
+    StrBuf data;
+    uint32_t *slots;         /* offset + 1 (0 = empty) */
+    uint32_t mask;
+} SnapPool;
+
+static uint64_t hash_bytes(const char *p, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/* 文字列・ポインタのフィールドの位置 (並べ替えや追加でサイズが変わらなくても検出する) */
+static uint64_t snapshot_layout_hash(void)
+{
+    size_t layout[CONFIG_STRING_FIELD_COUNT + 9];
+    size_t n = 0;
+
+    layout[n++] = sizeof(Config);
+    layout[n++] = sizeof(CommandDef);
+    for (size_t i = 0; i < CONFIG_STRING_FIELD_COUNT; i++) layout[n++] = CONFIG_STRING_FIELDS[i];
+    layout[n++] = offsetof(Config, commands);
+    layout[n++] = offsetof(Config, command_count);
+    layout[n++] = offsetof(Config, command_index);
+    layout[n++] = offsetof(Config, index_size);
+    layout[n++] = offsetof(Config, arena);
+    layout[n++] = offsetof(Config, loaded_from);
+    layout[n++] = offsetof(Config, snapshot);
+    return hash_bytes((const char *)layout, n * sizeof(size_t));
+}
+
+/* .conf から作ったスナップショットの置き場所 (EXE のディレクトリごとに1つ) */
+void snapshot_user_path(const char *exe_dir, char *buf, size_t size)
+{
+    char dir[MAX_VALUE_LEN];
+
+    app_data_dir(CONFIG_SNAPSHOT_DIR, dir, sizeof(dir));
+    snprintf(buf, size, "%s%c%016llx.snap", dir, PATH_SEP,
+             (unsigned long long)hash_bytes(exe_dir, strlen(exe_dir)));
+}
+
+static uint32_t pool_intern(SnapPool *pool, const char *s)
+{
+    uint32_t slot = hash_name(s) & pool->mask;
+
+    while (pool->slots[slot]) {
+        uint32_t off = pool->slots[slot] - 1;
+        if (strcmp(pool->data.data + off, s) == 0) return off;
+        slot = (slot + 1) & pool->mask;
+    }
+    uint32_t off = (uint32_t)pool->data.len;
+    sb_append(&pool->data, s, strlen(s) + 1);
+    pool->slots[slot] = off + 1;
+    return off;
+}
+
+static const char **field_at(void *base, size_t off)
+{
+    return (const char **)((char *)base + off);
+}
+
+static int hash_file(const char *path, uint64_t *hash)
+{
+    size_t size = 0;
+    const void *p = map_file(path, &size);
+
+    if (!p) {
+        /* 空ファイル */
+        if (!file_exists(path)) return 0;
+        *hash = hash_bytes("", 0);
+        return 1;
+    }
+    *hash = hash_bytes((const char *)p, size);
+    unmap_file(p, size);
+    return 1;
+}
+
+int snapshot_write(const Config *cfg, const char *conf_path, const char *snap_path)
+{
+    SnapHeader h;
+    SnapPool pool;
+    Config img;
+    CommandDef *cmds = NULL;
+    StrBuf out = {0};
+    char tmp_path[MAX_VALUE_LEN + 8];
+    const char *conf_name = strrchr(conf_path, PATH_SEP);
+    uint32_t slots = 16;
+    int ok = 0;
+    FILE *fp;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "OWCS", 4);
+    h.version = CONFIG_SNAPSHOT_VERSION;
+    h.config_size = (uint32_t)sizeof(Config);
+    h.command_size = (uint32_t)sizeof(CommandDef);
+    h.layout_hash = snapshot_layout_hash();
+    if (!file_stat(conf_path, &h.source_size, &h.source_mtime) ||
+        !hash_file(conf_path, &h.source_hash)) {
+        return 0;
+    }
+
+    while (slots < (uint32_t)(cfg->command_count * COMMAND_STRING_FIELD_COUNT + 16) * 2) slots *= 2;
+    memset(&pool, 0, sizeof(pool));
+    pool.slots = (uint32_t *)calloc(slots, sizeof(uint32_t));
+    pool.mask = slots - 1;
+    cmds = (CommandDef *)calloc((size_t)cfg->command_count + 1, sizeof(CommandDef));
+    if (!pool.slots || !cmds) goto done;
+
+    h.conf_name = pool_intern(&pool, conf_name ? conf_name + 1 : conf_path);
+
+    /* 文字列はオフセットに、それ以外のポインタは 0 に */
+    img = *cfg;
+    for (size_t i = 0; i < CONFIG_STRING_FIELD_COUNT; i++) {
+        const char **f = field_at(&img, CONFIG_STRING_FIELDS[i]);
+        *f = (const char *)(uintptr_t)pool_intern(&pool, *f);
+    }
+    img.commands = NULL;
+    img.command_index = NULL;
+    img.arena = NULL;
+    img.loaded_from = NULL;
+    img.snapshot = NULL;
+    img.snapshot_size = 0;
+
+    for (int i = 0; i < cfg->command_count; i++) {
+        cmds[i] = cfg->commands[i];
+        for (size_t j = 0; j < COMMAND_STRING_FIELD_COUNT; j++) {
+            const char **f = field_at(&cmds[i], j * sizeof(const char *));
+            *f = (const char *)(uintptr_t)pool_intern(&pool, *f);
+        }
+    }
+
+    h.command_count = (uint32_t)cfg->command_count;
+    h.index_size = (uint32_t)(cfg->command_count ? cfg->index_size : 0);
+    h.config_off = (uint32_t)((sizeof(SnapHeader) + 15) & ~(size_t)15);
+    h.commands_off = (uint32_t)((h.config_off + sizeof(Config) + 15) & ~(size_t)15);
+    h.index_off = h.commands_off + h.command_count * (uint32_t)sizeof(CommandDef);
+    h.strings_off = h.index_off + h.index_size * (uint32_t)sizeof(int);
+    h.total_size = h.strings_off + (uint32_t)pool.data.len;
+
+    out.data = (char *)calloc(1, h.total_size);
+    if (!out.data) goto done;
+    memcpy(out.data, &h, sizeof(h));
+    memcpy(out.data + h.config_off, &img, sizeof(Config));
+    if (h.command_count) {
+        memcpy(out.data + h.commands_off, cmds, h.command_count * sizeof(CommandDef));
+        memcpy(out.data + h.index_off, cfg->command_index, h.index_size * sizeof(int));
+    }
+    memcpy(out.data + h.strings_off, pool.data.data, pool.data.len);
+
+    /* 書きかけを読まれないよう一時ファイルから置き換える */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snap_path);
+    fp = fopen(tmp_path, "wb");
+    if (!fp) goto done;
+    ok = (fwrite(out.data, 1, h.total_size, fp) == h.total_size);
+    ok = (fclose(fp) == 0) && ok;
+    ok = ok && replace_file(tmp_path, snap_path);
+    if (!ok) remove(tmp_path);
+
+done:
+    free(out.data);
+    free(cmds);
+    free(pool.slots);
+    sb_free(&pool.data);
+    return ok;
+}
+
+/* 元の .conf が変わっていないか (サイズ・時刻 → 内容のハッシュ) */
+static int snapshot_source_matches(const SnapHeader *h, const char *conf_path, int allow_missing)
+{
+    uint64_t size, mtime, hash;
+
+    if (!file_stat(conf_path, &size, &mtime)) return allow_missing;
+    if (size != h->source_size) return 0;
+    if (mtime == h->source_mtime) return 1;
+    return hash_file(conf_path, &hash) && hash == h->source_hash;
+}
+
+/*
+ * 各領域が重ならず順に並び、ハッシュ索引が壊れていないか。
+ * 文字列は base[size - 1] が '\0' なので、オフセットがプール内なら終端がある。
+ */
+static int snapshot_layout_valid(const SnapHeader *h, const char *base, size_t size)
+{
+    uint64_t index_end = h->index_off + (uint64_t)h->index_size * sizeof(int);
+    uint32_t empty = 0;
+
+    if (memcmp(h->magic, "OWCS", 4) != 0 || h->version != CONFIG_SNAPSHOT_VERSION ||
+        h->config_size != sizeof(Config) || h->command_size != sizeof(CommandDef) ||
+        h->layout_hash != snapshot_layout_hash() || h->total_size != size || base[size - 1] != '\0') {
+        return 0;
+    }
+    if (h->config_off < sizeof(SnapHeader) ||
+        h->config_off + (uint64_t)sizeof(Config) > h->commands_off ||
+        h->commands_off + (uint64_t)h->command_count * sizeof(CommandDef) > h->index_off ||
+        index_end > h->strings_off || h->strings_off >= size ||
+        h->conf_name >= size - h->strings_off) {
+        return 0;
+    }
+    if (h->command_count == 0) return (h->index_size == 0);
+
+    /* 索引は直接参照するので int 境界に置かれていること */
+    if (h->index_off % sizeof(int) != 0 || h->index_size == 0 ||
+        (h->index_size & (h->index_size - 1)) != 0) {
+        return 0;
+    }
+    const int *index = (const int *)(uintptr_t)(base + h->index_off);
+    for (uint32_t i = 0; i < h->index_size; i++) {
+        if (index[i] < 0) empty++;
+        if (index[i] < -1 || (index[i] >= 0 && (uint32_t)index[i] >= h->command_count)) return 0;
+    }
+    /* 空きが無いと find_command の探索が終わらない */
+    return (empty > 0);
+}
+
+/* 文字列フィールドのオフセットをプール内のポインタに戻す。範囲外なら 0 */
+static int snapshot_fix_string(const char **f, const char *pool, size_t pool_size)
+{
+    uintptr_t off = (uintptr_t)*f;
+
+    if (off >= pool_size) return 0;
+    *f = pool + off;
+    return 1;
+}
+
+int snapshot_load(const void *data, size_t size, const char *exe_dir, int allow_missing_source,
+                  Config *cfg)
+{
+    const char *base = (const char *)data;
+    const char *pool;
+    size_t pool_size;
+    char conf_path[MAX_VALUE_LEN];
+    SnapHeader h;
+    Config img;
+    CommandDef *cmds;
+
+    if (size < sizeof(SnapHeader)) return 0;
+    memcpy(&h, base, sizeof(h));
+    if (!snapshot_layout_valid(&h, base, size)) return 0;
+    pool = base + h.strings_off;
+    pool_size = size - h.strings_off;
+    snprintf(conf_path, sizeof(conf_path), "%s%s", exe_dir, pool + h.conf_name);
+    if (!snapshot_source_matches(&h, conf_path, allow_missing_source)) return 0;
+
+    cmds = (CommandDef *)malloc(((size_t)h.command_count + 1) * sizeof(CommandDef));
+    if (!cmds) return 0;
+
+    /* 壊れたスナップショットは使わず .conf の解析に戻る */
+    memcpy(&img, base + h.config_off, sizeof(Config));
+    for (size_t i = 0; i < CONFIG_STRING_FIELD_COUNT; i++) {
+        if (!snapshot_fix_string(field_at(&img, CONFIG_STRING_FIELDS[i]), pool, pool_size)) {
+            free(cmds);
+            return 0;
+        }
+    }
+    memcpy(cmds, base + h.commands_off, h.command_count * sizeof(CommandDef));
+    for (uint32_t i = 0; i < h.command_count; i++) {
+        for (size_t j = 0; j < COMMAND_STRING_FIELD_COUNT; j++) {
+            if (!snapshot_fix_string(field_at(&cmds[i], j * sizeof(const char *)), pool, pool_size)) {
+                free(cmds);
+                return 0;
+            }
+        }
+    }
+
+    *cfg = img;
+    cfg->commands = cmds;
+    cfg->command_count = (int)h.command_count;
+    cfg->command_index = (int *)(uintptr_t)(base + h.index_off);
+    cfg->index_size = (int)h.index_size;
+    cfg->arena = (char *)cmds;
+    cfg->loaded_from = "snapshot";
+    cfg->snapshot = NULL;
+    cfg->snapshot_size = 0;
+    return 1;
+}
+
+int snapshot_load_file(const char *snap_path, const char *exe_dir, Config *cfg)
+{
+    size_t size = 0;
+    const void *p = map_file(snap_path, &size);
+
+    if (!p) return 0;
+    if (!snapshot_load(p, size, exe_dir, 0, cfg)) {
+        unmap_file(p, size);
+        return 0;
+    }
+    cfg->snapshot = p;
+    cfg->snapshot_size = size;
+    return 1;
+}
+
+/* ビルド時に EXE へ埋め込んだスナップショット (.conf が無い場合もこれを使う) */
+int snapshot_load_embedded(const char *exe_dir, Config *cfg)
+{
+#ifdef _WIN32
+    HRSRC res = FindResourceA(NULL, CONFIG_SNAPSHOT_RESOURCE, RT_RCDATA);
+    HGLOBAL mem;
+    const void *p;
+
+    if (!res || !(mem = LoadResource(NULL, res)) || !(p = LockResource(mem))) return 0;
+    if (!snapshot_load(p, SizeofResource(NULL, res), exe_dir, 1, cfg)) return 0;
+    cfg->loaded_from = "embedded snapshot";
+    return 1;
+#else
+    (void)exe_dir;
+    (void)cfg;
+    return 0;
+#endif
+}
+
+/* --compile-config: 常に .conf を解析し直して書き出す */
+static int compile_config(const char *exe_dir, const char *out_path)
+{
+    char conf_path[MAX_VALUE_LEN];
+    char snap_path[MAX_VALUE_LEN];
+    uint64_t size, mtime;
+    Config cfg;
+
+    if (!find_conf_file(exe_dir, conf_path, sizeof(conf_path)) || !load_config_file(conf_path, &cfg)) {
+        printf("[ERROR] No .conf file found in: %s\n", exe_dir);
+        return 1;
+    }
+    if (out_path) snprintf(snap_path, sizeof(snap_path), "%s", out_path);
+    else snprintf(snap_path, sizeof(snap_path), "%s%s", exe_dir, CONFIG_SNAPSHOT_FILE);
+
+    if (!snapshot_write(&cfg, conf_path, snap_path) || !file_stat(snap_path, &size, &mtime)) {
+        printf("[ERROR] Cannot write snapshot: %s\n", snap_path);
+        config_free(&cfg);
+        return 1;
+    }
+    printf("Config snapshot: %s (%d commands, %llu bytes)\n", snap_path, cfg.command_count,
+           (unsigned long long)size);
+    config_free(&cfg);
+    return 0;
+}
+
+/* ================================================== */
+/* Remote script cache (content-addressed)            */
+/* ================================================== */
+/*
+ * url のスクリプトはこちら側で取得し、SHA-256 を名前にして保存する。
+ *   <HOME>/.openwrt-connect/scripts/<sha256>       スクリプト本体
+ *   <HOME>/.openwrt-connect/scripts/url-<fnv64>    "<sha256>\n<url>\n"
+ * 取得できない場合 (オフライン等) は最後に取得した版を使う。
+ * デバイスへは ssh の標準入力で送り、デバイス側の版が同じなら送らない。
+ */
+typedef struct {
+    uint32_t state[8];
+    uint64_t bits;
+    unsigned char block[64];
+    size_t used;
+} Sha256;
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256 *c, const unsigned char *p)
+{
+    uint32_t w[64], v[8];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+               ((uint32_t)p[i * 4 + 2] << 8) | (uint32_t)p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, c->state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^ SHA256_ROR(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + SHA256_K[i] + w[i];
+        uint32_t s0 = SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^ SHA256_ROR(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for (int i = 0; i < 8; i++) c->state[i] += v[i];
+}
+
+/* data の SHA-256 (32 バイト) */
+static void sha256_digest(const void *data, size_t len, unsigned char out[32])
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    const unsigned char *p = (const unsigned char *)data;
+    Sha256 c;
+
+    memcpy(c.state, init, sizeof(init));
+    c.bits = (uint64_t)len * 8;
+    for (; len >= 64; p += 64, len -= 64) sha256_block(&c, p);
+
+    /* 末尾: 0x80 と長さ (ビッグエンディアン) を付けて1〜2ブロック */
+    memset(c.block, 0, sizeof(c.block));
+    memcpy(c.block, p, len);
+    c.block[len] = 0x80;
+    if (len >= 56) {
+        sha256_block(&c, c.block);
+        memset(c.block, 0, sizeof(c.block));
+    }
+    for (int i = 0; i < 8; i++) c.block[63 - i] = (unsigned char)(c.bits >> (i * 8));
+    sha256_block(&c, c.block);
+
+    for (int i = 0; i < 32; i++) out[i] = (unsigned char)(c.state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+/* data の SHA-256 を 64 文字の16進で hex に書く */
+static void sha256_hex(const void *data, size_t len, char hex[65])
+{
+    unsigned char d[32];
+
+    sha256_digest(data, len, d);
+    for (int i = 0; i < 32; i++) snprintf(hex + i * 2, 3, "%02x", d[i]);
+}
+
+static void script_cache_dir(char *buf, size_t size)
+{
+    app_data_dir("scripts", buf, size);
+}
+
+/* curl で url を path に取得 (Windows 10 以降は System32 に同梱) */
+static int script_download(const char *sysroot, const char *url, const char *path)
+{
+    char curl[512];
+    char timeout[16];
+    ProcOptions opt;
+    ProcResult res;
+
+#ifdef _WIN32
+    snprintf(curl, sizeof(curl), "%s\\System32\\curl.exe", sysroot);
+#else
+    (void)sysroot;
+    snprintf(curl, sizeof(curl), "curl");
+#endif
+    snprintf(timeout, sizeof(timeout), "%d", SCRIPT_FETCH_TIMEOUT_SEC);
+    const char *argv[] = { curl, "-fsSL", "--max-time", timeout, "-o", path, url, NULL };
+
+    memset(&opt, 0, sizeof(opt));
+    opt.in = PROC_IN_NULL;
+    opt.merge_stderr = 1;
+    proc_run(argv, &opt, &res);
+    proc_result_free(&res);
+    return (res.exit_code == 0);
+}
+
+/* url に対応する最後に取得した版を読み込む (url が一致し、内容がハッシュと合うもの) */
+static int script_cache_load(const char *dir, const char *url_path, const char *url,
+                             ScriptBlob *out, uint64_t *checked_ns)
+{
+    char blob_path[700];
+    char actual[65];
+    char *ref;
+    size_t ref_len, url_len = strlen(url);
+    uint64_t size;
+
+    ref = read_whole_file(url_path, &ref_len);
+    if (!ref) return 0;
+    if (ref_len < 66 + url_len || ref[64] != '\n' || strncmp(ref + 65, url, url_len) != 0 ||
+        ref[65 + url_len] != '\n') {
+        free(ref);
+        return 0;
+    }
+    memcpy(out->hash, ref, 64);
+    out->hash[64] = '\0';
+    free(ref);
+    if (!file_stat(url_path, &size, checked_ns)) *checked_ns = 0;
+
+    snprintf(blob_path, sizeof(blob_path), "%s%c%s", dir, PATH_SEP, out->hash);
+    out->data = read_whole_file(blob_path, &out->len);
+    if (out->data) {
+        sha256_hex(out->data, out->len, actual);
+        if (strcmp(actual, out->hash) == 0) return 1;
+    }
+    script_blob_free(out);
+    return 0;
+}
+
+/* url → ハッシュの対応を書き直す (更新時刻が最後に確認した時刻になる) */
+static void script_cache_mark(const char *url_path, const char *url, const char *hash)
+{
+    StrBuf ref = {0};
+    if (sb_appendf(&ref, "%s\n%s\n", hash, url)) write_whole_file(url_path, ref.data, ref.len);
+    sb_free(&ref);
+}
+
+/* manifest (先頭の語が SHA-256) を取得する。取得できなければ 0 */
+static int script_fetch_manifest(const char *sysroot, const char *url, const char *tmp_path, char hash[65])
+{
+    char *text;
+    size_t len;
+    int ok = 0;
+
+    if (!script_download(sysroot, url, tmp_path)) {
+        remove(tmp_path);
+        return 0;
+    }
+    text = read_whole_file(tmp_path, &len);
+    remove(tmp_path);
+    if (text && strspn(text, "0123456789abcdefABCDEF") == 64) {
+        for (int i = 0; i < 64; i++) hash[i] = (char)tolower((unsigned char)text[i]);
+        hash[64] = '\0';
+        ok = 1;
+    }
+    free(text);
+    return ok;
+}
+
+/*
+ * 前回の確認から script_ttl 秒以内ならサーバーに問い合わせずキャッシュを使う。
+ * 期限切れ (または refresh) の場合、manifest があればそのハッシュで確認し、
+ * 変わっていれば (manifest がなければ常に) 本体を取得する。
+ */
+int script_cache_get(const Config *cfg, const CommandDef *cmd, const char *sysroot, int refresh,
+                     ScriptBlob *out)
+{
+    char dir[600], url_path[700], blob_path[700], tmp_path[700];
+    char want[65] = {0};
+    uint64_t url_hash = hash_bytes(cmd->url, strlen(cmd->url));
+    uint64_t checked_ns = 0;
+    int cached;
+
+    memset(out, 0, sizeof(*out));
+    if (!cfg->script_push || cmd->url[0] == '\0') return 0;
+
+    script_cache_dir(dir, sizeof(dir));
+    snprintf(url_path, sizeof(url_path), "%s%curl-%016llx", dir, PATH_SEP, (unsigned long long)url_hash);
+    snprintf(tmp_path, sizeof(tmp_path), "%s%cfetch-%016llx.%lu.tmp", dir, PATH_SEP,
+             (unsigned long long)url_hash, thread_id());
+
+    cached = script_cache_load(dir, url_path, cmd->url, out, &checked_ns);
+    if (cached && !refresh &&
+        (uint64_t)time(NULL) < checked_ns / 1000000000ull + (uint64_t)cfg->script_ttl) {
+        out->source = "cache";
+        return 1;
+    }
+
+    if (cmd->manifest[0] != '\0' && script_fetch_manifest(sysroot, cmd->manifest, tmp_path, want) &&
+        cached && strcmp(want, out->hash) == 0) {
+        script_cache_mark(url_path, cmd->url, out->hash);
+        out->source = "cache, manifest unchanged";
+        return 1;
+    }
+
+    /* 最新版を取得して内容のハッシュで保存 (manifest と合わなければ使わない) */
+    if (script_download(sysroot, cmd->url, tmp_path)) {
+        ScriptBlob fresh;
+        memset(&fresh, 0, sizeof(fresh));
+        fresh.data = read_whole_file(tmp_path, &fresh.len);
+        if (fresh.data) sha256_hex(fresh.data, fresh.len, fresh.hash);
+        if (fresh.data && (want[0] == '\0' || strcmp(want, fresh.hash) == 0)) {
+            remove(tmp_path);
+            snprintf(blob_path, sizeof(blob_path), "%s%c%s", dir, PATH_SEP, fresh.hash);
+            if (!file_exists(blob_path)) write_whole_file(blob_path, fresh.data, fresh.len);
+            script_cache_mark(url_path, cmd->url, fresh.hash);
+            fresh.source = (cached && strcmp(fresh.hash, out->hash) == 0) ? "download, unchanged" : "download";
+            script_blob_free(out);
+            *out = fresh;
+            return 1;
+        }
+        script_blob_free(&fresh);
+    }
+    remove(tmp_path);
+
+    /* 取得できなければ最後に取得した版 */
+    if (cached) {
+        out->source = "cache, offline";
+        return 1;
+    }
+    return 0;
+}
+
+void script_blob_free(ScriptBlob *s)
+{
+    free(s->data);
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * スクリプトを標準入力でデバイスへ送り、インストールする。
+ * ssh_args は接続先まで積んだ ssh の引数 (リモートコマンドを追加して実行し、解放する)。
+ * opt は出力先などを呼び出し側で設定しておく (入力はここで設定)。
+ */
+int script_push(ArgList *ssh_args, const CommandDef *cmd, const ScriptBlob *s, int ttl, ProcOptions *opt)
+{
+    StrBuf remote = {0};
+    ProcResult res;
+
+    build_install_script(cmd, s->hash, ttl, &remote);
+    args_add(ssh_args, remote.data ? remote.data : "false");
+    sb_free(&remote);
+
+    opt->in = PROC_IN_DATA;
+    opt->in_data = s->data;
+    opt->in_len = s->len;
+    proc_run((const char *const *)ssh_args->argv, opt, &res);
+    args_free(ssh_args);
+    proc_result_free(&res);
+    return (res.exit_code == 0);
+}
+
+/* ================================================== */
+/* Device registry                                    */
+/* ================================================== */
+/*
+ * 接続したデバイスの情報をホスト鍵のフィンガープリントごとに記録する。
+ *   <HOME>/.openwrt-connect/devices/known_hosts         ssh が書くホスト鍵 (accept-new)
+ *   <HOME>/.openwrt-connect/devices/SHA256_<base64url>  "key = value" の行
+ * IP から known_hosts でフィンガープリントを引いて記録を読む。
+ * IP が変わっても同じ鍵なら同じ記録を使い、同じ IP で鍵が変われば ssh が接続を止める
+ * (AUTH_HOST_CHANGED)。記録は接続のたびに分かった項目だけ更新する。
+ */
+static const char BASE64_CHARS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t base64_decode(const char *in, size_t len, unsigned char *out, size_t size)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t o = 0;
+
+    for (size_t i = 0; i < len && in[i] != '='; i++) {
+        const char *p = in[i] ? strchr(BASE64_CHARS, in[i]) : NULL;
+        if (!p) return 0;
+        acc = (acc << 6) | (uint32_t)(p - BASE64_CHARS);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (o >= size) return 0;
+            out[o++] = (unsigned char)(acc >> bits);
+        }
+    }
+    return o;
+}
+
+/* パディングなし (ssh-keygen -l と同じ表記) */
+static void base64_encode(const unsigned char *in, size_t len, char *out, size_t size)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t o = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        acc = (acc << 8) | in[i];
+        bits += 8;
+        while (bits >= 6 && o + 1 < size) {
+            bits -= 6;
+            out[o++] = BASE64_CHARS[(acc >> bits) & 63];
+        }
+    }
+    if (bits > 0 && o + 1 < size) out[o++] = BASE64_CHARS[(acc << (6 - bits)) & 63];
+    out[o] = '\0';
+}
+
+void known_hosts_path(char *buf, size_t size)
+{
+    char dir[512];
+
+    app_data_dir("devices", dir, sizeof(dir));
+    snprintf(buf, size, "%s%cknown_hosts", dir, PATH_SEP);
+}
+
+/* known_hosts でのホスト名 (ポート22以外は "[host]:port") */
+static void known_hosts_name(const Config *cfg, const char *host, char *buf, size_t size)
+{
+    if (cfg->ssh_port == SSH_PORT) snprintf(buf, size, "%s", host);
+    else snprintf(buf, size, "[%s]:%d", host, cfg->ssh_port);
+}
+
+/* 行の最初のフィールド (カンマ区切りのホスト名) に name があるか */
+static int known_hosts_match(const char *line, const char *end, const char *name)
+{
+    size_t n = strlen(name);
+    const char *p = line;
+
+    while (p < end && *p != ' ' && *p != '\t') {
+        const char *q = p;
+        while (q < end && *q != ',' && *q != ' ' && *q != '\t') q++;
+        if ((size_t)(q - p) == n && memcmp(p, name, n) == 0) return 1;
+        p = (q < end && *q == ',') ? q + 1 : q;
+    }
+    return 0;
+}
+
+/* 空白区切りの次のトークン [*p, 戻り値) */
+static const char *next_token(const char **p, const char *end)
+{
+    const char *s = *p;
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+    *p = s;
+    while (s < end && *s != ' ' && *s != '\t' && *s != '\r') s++;
+    return s;
+}
+
+/* host の記録済みホスト鍵のフィンガープリント ("SHA256:...") と種類。なければ 0 */
+int known_host_fingerprint(const Config *cfg, const char *host, char *fp, size_t fp_size,
+                           char *alg, size_t alg_size)
+{
+    char path[560], name[300];
+    size_t len;
+    char *data;
+    int found = 0;
+
+    known_hosts_path(path, sizeof(path));
+    known_hosts_name(cfg, host, name, sizeof(name));
+    data = read_whole_file(path, &len);
+    if (!data) return 0;
+
+    for (const char *line = data; *line && !found; ) {
+        const char *end = strchr(line, '\n');
+        if (!end) end = line + strlen(line);
+        if (*line != '#' && *line != '@' && known_hosts_match(line, end, name)) {
+            const char *p = line, *alg_start, *alg_end, *key_end;
+            unsigned char blob[2048], digest[32];
+            size_t blob_len;
+
+            p = next_token(&p, end);             /* ホスト名 */
+            alg_end = next_token(&p, end);
+            alg_start = p;
+            p = alg_end;
+            key_end = next_token(&p, end);
+            blob_len = base64_decode(p, (size_t)(key_end - p), blob, sizeof(blob));
+            if (blob_len > 0) {
+                sha256_digest(blob, blob_len, digest);
+                snprintf(fp, fp_size, "SHA256:");
+                base64_encode(digest, sizeof(digest), fp + strlen(fp), fp_size - strlen(fp));
+                if (alg) snprintf(alg, alg_size, "%.*s", (int)(alg_end - alg_start), alg_start);
+                found = 1;
+            }
+        }
+        line = *end ? end + 1 : end;
+    }
+    free(data);
+    return found;
+}
+
+/* host のホスト鍵を known_hosts から消す (別のデバイスを受け入れるとき) */
+void known_hosts_forget(const Config *cfg, const char *host)
+{
+    char path[560], name[300];
+    StrBuf kept = {0};
+    size_t len;
+    char *data;
+
+    known_hosts_path(path, sizeof(path));
+    known_hosts_name(cfg, host, name, sizeof(name));
+    data = read_whole_file(path, &len);
+    if (!data) return;
+
+    for (const char *line = data; *line; ) {
+        const char *end = strchr(line, '\n');
+        end = end ? end + 1 : line + strlen(line);
+        if (!known_hosts_match(line, end, name)) sb_append(&kept, line, (size_t)(end - line));
+        line = end;
+    }
+    write_whole_file(path, kept.data ? kept.data : "", kept.len);
+    sb_free(&kept);
+    free(data);
+}
+
+#define DEVICE_FIELD(f) { #f, offsetof(DeviceInfo, f), sizeof(((DeviceInfo *)0)->f) }
+
+static const struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+} DEVICE_FIELDS[] = {
+    DEVICE_FIELD(fingerprint),
+    DEVICE_FIELD(host_key),
+    DEVICE_FIELD(ip),
+    DEVICE_FIELD(daemon),
+    DEVICE_FIELD(banner),
+    DEVICE_FIELD(board),
+    DEVICE_FIELD(release),
+    DEVICE_FIELD(key_type),
+    DEVICE_FIELD(cipher),
+    DEVICE_FIELD(compression),
+    DEVICE_FIELD(rtt),
+};
+#define DEVICE_FIELD_COUNT (sizeof(DEVICE_FIELDS) / sizeof(DEVICE_FIELDS[0]))
+
+/* 記録ファイル名: ':' を '_'、base64 の '+' '/' を '-' '_' にする */
+static void device_path(const char *fingerprint, char *buf, size_t size)
+{
+    char dir[512], name[64];
+    size_t i;
+
+    for (i = 0; fingerprint[i] && i < sizeof(name) - 1; i++) {
+        char c = fingerprint[i];
+        name[i] = (c == ':' || c == '/') ? '_' : (c == '+') ? '-' : c;
+    }
+    name[i] = '\0';
+    app_data_dir("devices", dir, sizeof(dir));
+    snprintf(buf, size, "%s%c%s", dir, PATH_SEP, name);
+}
+
+static int device_load(const char *fingerprint, DeviceInfo *d)
+{
+    char path[600];
+    size_t len;
+    char *data, *line, *next;
+
+    memset(d, 0, sizeof(*d));
+    device_path(fingerprint, path, sizeof(path));
+    data = read_whole_file(path, &len);
+    if (!data) return 0;
+
+    for (line = data; line && *line; line = next) {
+        char *eq;
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        eq = strchr(line, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        trim(line);
+        trim(eq + 1);
+        if (strcmp(line, "first_seen") == 0) d->first_seen = strtoll(eq + 1, NULL, 10);
+        else if (strcmp(line, "last_seen") == 0) d->last_seen = strtoll(eq + 1, NULL, 10);
+        for (size_t i = 0; i < DEVICE_FIELD_COUNT; i++) {
+            if (strcmp(line, DEVICE_FIELDS[i].name) == 0) {
+                snprintf((char *)d + DEVICE_FIELDS[i].offset, DEVICE_FIELDS[i].size, "%s", eq + 1);
+            }
+        }
+    }
+    free(data);
+    snprintf(d->fingerprint, sizeof(d->fingerprint), "%s", fingerprint);
+    return 1;
+}
+
+static int device_save(const DeviceInfo *d)
+{
+    char path[600];
+    StrBuf sb = {0};
+    int ok;
+
+    for (size_t i = 0; i < DEVICE_FIELD_COUNT; i++) {
+        sb_appendf(&sb, "%s = %s\n", DEVICE_FIELDS[i].name, (const char *)d + DEVICE_FIELDS[i].offset);
+    }
+    sb_appendf(&sb, "first_seen = %lld\nlast_seen = %lld\n",
+               (long long)d->first_seen, (long long)d->last_seen);
+    device_path(d->fingerprint, path, sizeof(path));
+    ok = write_whole_file(path, sb.data, sb.len);
+    sb_free(&sb);
+    return ok;
+}
+
+/* host に記録済みのデバイス。known_hosts に無い・記録が無ければ 0 (d は空) */
+int device_lookup(const Config *cfg, const char *host, DeviceInfo *d)
+{
+    char fp[64];
+
+    memset(d, 0, sizeof(*d));
+    if (!known_host_fingerprint(cfg, host, fp, sizeof(fp), NULL, 0)) return 0;
+    return device_load(fp, d);
+}
+
+/*
+ * 接続に成功した後、分かった項目 (learned の空でないもの) を記録に反映する。
+ * ホスト鍵は直前の接続で ssh が known_hosts に書いたものを使う。
+ */
+int device_learned(const Config *cfg, const char *host, const DeviceInfo *learned)
+{
+    char fp[64], alg[32];
+    DeviceInfo d;
+
+    if (!known_host_fingerprint(cfg, host, fp, sizeof(fp), alg, sizeof(alg))) return 0;
+    if (!device_load(fp, &d)) {
+        snprintf(d.fingerprint, sizeof(d.fingerprint), "%s", fp);
+        d.first_seen = (int64_t)time(NULL);
+    }
+    for (size_t i = 0; i < DEVICE_FIELD_COUNT; i++) {
+        const char *v = (const char *)learned + DEVICE_FIELDS[i].offset;
+        if (v[0]) snprintf((char *)&d + DEVICE_FIELDS[i].offset, DEVICE_FIELDS[i].size, "%s", v);
+    }
+    snprintf(d.fingerprint, sizeof(d.fingerprint), "%s", fp);
+    snprintf(d.host_key, sizeof(d.host_key), "%s", alg);
+    snprintf(d.ip, sizeof(d.ip), "%s", host);
+    d.last_seen = (int64_t)time(NULL);
+    return device_save(&d);
+}
+
+/* 別のデバイスに置き換わった host を忘れる (以前のデバイスの記録は IP だけ消して残す) */
+void device_forget_host(const Config *cfg, const char *host)
+{
+    DeviceInfo d;
+
+    if (device_lookup(cfg, host, &d) && strcmp(d.ip, host) == 0) {
+        d.ip[0] = '\0';
+        device_save(&d);
+    }
+    known_hosts_forget(cfg, host);
+}
+
+/* バナーで分かる項目を d に入れる */
+void device_set_banner(DeviceInfo *d, const char *banner)
+{
+    if (classify_ssh_banner(banner) == SSH_DAEMON_NONE) return;
+    snprintf(d->banner, sizeof(d->banner), "%s", banner);
+    snprintf(d->daemon, sizeof(d->daemon), "%s", ssh_daemon_name(classify_ssh_banner(banner)));
+}
+
+/*
+ * host のホスト鍵が記録と違う: 以前のデバイスを表示して、新しいデバイスとして
+ * 受け入れるか確認する。受け入れたら known_hosts から消して d を空にし 1。
+ */
+static int confirm_new_device(const Config *cfg, const char *host, DeviceInfo *d)
+{
+    char answer[16] = {0};
+
+    printf("\n[WARNING] The host key of %s has changed.\n", host);
+    printf("The device was reinstalled or replaced, or another machine is using this address.\n");
+    if (d->fingerprint[0]) {
+        printf("  Previous device: %s / %s\n", d->board[0] ? d->board : "unknown board",
+               d->release[0] ? d->release : "unknown release");
+        printf("  Previous key:    %s %s\n", d->host_key, d->fingerprint);
+    }
+    printf("Trust the new device and continue? [y/N]: ");
+    fflush(stdout);
+    if (!fgets(answer, sizeof(answer), stdin) || (answer[0] != 'y' && answer[0] != 'Y')) {
+        printf("Cancelled.\n\n");
+        return 0;
+    }
+    device_forget_host(cfg, host);
+    memset(d, 0, sizeof(*d));
+    printf("\n");
+    return 1;
+}
+
+/* ================================================== */
+/* Host inventory                                     */
+/* ================================================== */
+/*
+ * 多数のデバイスを名前・アドレス・タグで管理する。
+ *   <HOME>/.openwrt-connect/inventory/hosts.db       読み取り専用でマップするベース
+ *   <HOME>/.openwrt-connect/inventory/hosts.journal  以降の変更 (1行1件の追記)
+ *
+ * hosts.db: [InvHeader][InvRecord x n][InvTag x t][postings][InvAddr x a][文字列プール]
+ *   InvRecord は名前順 (名前の検索は二分探索)。
+ *   InvTag は "key=value" の文字列順で、postings にそのタグを持つ記録の番号を昇順に並べる。
+ *   InvAddr は IPv4 アドレス順 (CIDR は範囲の二分探索)。
+ *   文字列は Config スナップショットと同じ重複排除つきのプールに置く。
+ * hosts.journal: "set\t<name>\t<ips>\t<tags>\t<key>\t<profile>\t<last_seen>" / "del\t<name>"
+ *   開くときに読み込み、同じ名前のベースの記録を隠す。INVENTORY_JOURNAL_MAX 件を超えたら
+ *   閉じるときにベースを書き直して空にする (途中で止まっても同じ変更を当て直すだけ)。
+ * hosts.lock: 開いてから閉じるまで持つ排他ロック。--fleet・--scan・--push-keys 等が
+ *   別のプロセスで同時に動いても、追記と書き直しが混ざって変更が消えることはない。
+ *
+ * セレクター: ',' 区切りの条件すべてに一致するホスト
+ *   all / key=value (タグ) / a.b.c.d/n (IPv4 の範囲) / 名前またはアドレス
+ * 最も絞れる索引 (タグ・範囲・名前) で候補を出し、残りの条件は候補ごとに確認する。
+ */
+typedef struct {
+    char magic[4];           /* "OWIV" */
+    uint32_t version;
+    uint32_t record_size;    /* sizeof(InvRecord) */
+    uint32_t record_count;
+    uint32_t tag_count;
+    uint32_t posting_count;
+    uint32_t addr_count;
+    uint32_t records_off;
+    uint32_t tags_off;
+    uint32_t postings_off;
+    uint32_t addrs_off;
+    uint32_t strings_off;
+    uint32_t total_size;
+} InvHeader;
+
+typedef struct {
+    uint32_t name;           /* string pool offsets */
+    uint32_t ips;
+    uint32_t tags;
+    uint32_t key;
+    uint32_t profile;
+    uint32_t reserved;
+    int64_t last_seen;
+} InvRecord;
+
+typedef struct {
+    uint32_t tag;            /* "key=value" */
+    uint32_t first;          /* postings[first .. first + count) */
+    uint32_t count;
+} InvTag;
+
+typedef struct {
+    uint32_t addr;           /* IPv4, host byte order */
+    uint32_t record;
+} InvAddr;
+
+typedef struct {
+    HostRecord rec;
+    int removed;
+} InvChange;
+
+struct Inventory {
+    const void *map;
+    size_t map_size;
+    const InvHeader *h;      /* NULL = no base file */
+    const InvRecord *records;
+    const InvTag *tags;
+    const uint32_t *postings;
+    const InvAddr *addrs;
+    const char *strings;
+    unsigned char *shadowed; /* base record replaced or removed by the journal */
+    InvChange *changes;      /* one entry per name (latest change) */
+    int change_count;
+    int change_cap;
+    FILE *journal;           /* opened on the first change */
+    file_lock_t lock;        /* hosts.lock, held until inventory_close */
+};
+
+typedef enum {
+    INV_TERM_ALL = 0,
+    INV_TERM_TAG,
+    INV_TERM_SUBNET,
+    INV_TERM_NAME
+} InvTermKind;
+
+typedef struct {
+    InvTermKind kind;
+    const char *text;        /* into the selector copy */
+    Subnet sn;
+} InvTerm;
+
+static void inventory_path(const char *name, char *buf, size_t size)
+{
+    char dir[512];
+
+    app_data_dir("inventory", dir, sizeof(dir));
+    snprintf(buf, size, "%s%c%s", dir, PATH_SEP, name);
+}
+
+/* ---------- 文字列の一覧 ("a,b,c") ---------- */
+/* s を seps で区切って (その場で '\0' を入れる) 空でない語を out に。語数を返す */
+static int split_words(char *s, const char *seps, char **out, int max)
+{
+    int n = 0;
+
+    while (*s && n < max) {
+        s += strspn(s, seps);
+        if (!*s) break;
+        out[n++] = s;
+        s += strcspn(s, seps);
+        if (*s) *s++ = '\0';
+    }
+    return n;
+}
+
+static int list_has(const char *list, const char *item)
+{
+    size_t n = strlen(item);
+
+    for (const char *p = list; *p; ) {
+        size_t len = strcspn(p, ",");
+        if (len == n && memcmp(p, item, n) == 0) return 1;
+        p += len + (p[len] ? 1 : 0);
+    }
+    return 0;
+}
+
+/* ips のどれかが sn の範囲の IPv4 アドレスか */
+static int ips_in_subnet(const char *ips, const Subnet *sn)
+{
+    char addr[64];
+    Subnet a;
+
+    for (const char *p = ips; *p; ) {
+        size_t len = strcspn(p, ",");
+        snprintf(addr, sizeof(addr), "%.*s", (int)len, p);
+        if (!strchr(addr, '/') && parse_cidr(addr, &a) &&
+            (a.network & prefix_mask(sn->prefix)) == sn->network) {
+            return 1;
+        }
+        p += len + (p[len] ? 1 : 0);
+    }
+    return 0;
+}
+
+static int compare_cstr(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/*
+ * tags に add ("key=value" の並び) を重ねて正規化する。
+ * 同じ key は後のものを残し、"key=" は消す。空白は区切りとして扱う。値に ',' は使えない。
+ */
+static int tags_merge(char *tags, size_t size, const char *add)
+{
+    char buf[2][512];
+    char *items[64], *words[64];
+    int n = 0;
+    StrBuf out = {0};
+
+    snprintf(buf[0], sizeof(buf[0]), "%s", tags);
+    snprintf(buf[1], sizeof(buf[1]), "%s", add ? add : "");
+    for (int b = 0; b < 2; b++) {
+        int count = split_words(buf[b], ", \t", words, 64);
+        for (int w = 0; w < count; w++) {
+            char *tok = words[w];
+            char *eq = strchr(tok, '=');
+            if (!eq || eq == tok) return 0;
+            for (int i = 0; i < n; i++) {
+                if (strncmp(items[i], tok, (size_t)(eq - tok) + 1) == 0) items[i--] = items[--n];
+            }
+            if (eq[1] && n < (int)(sizeof(items) / sizeof(items[0]))) items[n++] = tok;
+        }
+    }
+    qsort(items, (size_t)n, sizeof(items[0]), compare_cstr);
+    for (int i = 0; i < n; i++) sb_appendf(&out, "%s%s", i ? "," : "", items[i]);
+    if (out.len >= size) {
+        sb_free(&out);
+        return 0;
+    }
+    snprintf(tags, size, "%s", out.data ? out.data : "");
+    sb_free(&out);
+    return 1;
+}
+
+/* ---------- ベース (hosts.db) ---------- */
+static const char *inv_str(const Inventory *inv, uint32_t off)
+{
+    return inv->strings + off;
+}
+
+/*
+ * 壊れた・細工されたファイルで範囲外を読まないよう、索引が指す先をすべて確かめる。
+ * 文字列プールは '\0' で終わるので、プール内の位置ならどこから読んでも止まる
+ */
+static int inventory_base_valid(const void *p, size_t size)
+{
+    const InvHeader *h = (const InvHeader *)p;
+    const InvRecord *records;
+    const InvTag *tags;
+    const uint32_t *postings;
+    const InvAddr *addrs;
+    const char *strings;
+    uint32_t strings_size;
+
+    if (size < sizeof(InvHeader) || memcmp(h->magic, "OWIV", 4) != 0) return 0;
+    if (h->version != INVENTORY_VERSION || h->record_size != sizeof(InvRecord)) return 0;
+    if (h->total_size != size || h->strings_off >= size || h->records_off < sizeof(InvHeader)) return 0;
+    if (h->records_off % 8 || h->tags_off % 4 || h->postings_off % 4 || h->addrs_off % 4) return 0;
+    if ((uint64_t)h->records_off + (uint64_t)h->record_count * sizeof(InvRecord) > h->tags_off ||
+        (uint64_t)h->tags_off + (uint64_t)h->tag_count * sizeof(InvTag) > h->postings_off ||
+        (uint64_t)h->postings_off + (uint64_t)h->posting_count * sizeof(uint32_t) > h->addrs_off ||
+        (uint64_t)h->addrs_off + (uint64_t)h->addr_count * sizeof(InvAddr) > h->strings_off) {
+        return 0;
+    }
+    strings = (const char *)p + h->strings_off;
+    strings_size = (uint32_t)(size - h->strings_off);
+    if (strings[strings_size - 1] != '\0') return 0;
+
+    records = (const InvRecord *)((const char *)p + h->records_off);
+    for (uint32_t i = 0; i < h->record_count; i++) {
+        const InvRecord *r = &records[i];
+        if (r->name >= strings_size || r->ips >= strings_size || r->tags >= strings_size ||
+            r->key >= strings_size || r->profile >= strings_size) {
+            return 0;
+        }
+    }
+    tags = (const InvTag *)((const char *)p + h->tags_off);
+    for (uint32_t i = 0; i < h->tag_count; i++) {
+        if (tags[i].tag >= strings_size || (uint64_t)tags[i].first + tags[i].count > h->posting_count) return 0;
+    }
+    postings = (const uint32_t *)((const char *)p + h->postings_off);
+    for (uint32_t i = 0; i < h->posting_count; i++) {
+        if (postings[i] >= h->record_count) return 0;
+    }
+    addrs = (const InvAddr *)((const char *)p + h->addrs_off);
+    for (uint32_t i = 0; i < h->addr_count; i++) {
+        if (addrs[i].record >= h->record_count) return 0;
+    }
+    return 1;
+}
+
+static void base_record(const Inventory *inv, int i, HostRecord *out)
+{
+    const InvRecord *r = &inv->records[i];
+
+    snprintf(out->name, sizeof(out->name), "%s", inv_str(inv, r->name));
+    snprintf(out->ips, sizeof(out->ips), "%s", inv_str(inv, r->ips));
+    snprintf(out->tags, sizeof(out->tags), "%s", inv_str(inv, r->tags));
+    snprintf(out->key, sizeof(out->key), "%s", inv_str(inv, r->key));
+    snprintf(out->profile, sizeof(out->profile), "%s", inv_str(inv, r->profile));
+    out->last_seen = r->last_seen;
+}
+
+/* 名前の記録の番号 (なければ -1) */
+static int base_find_name(const Inventory *inv, const char *name)
+{
+    int lo = 0, hi = inv->h ? (int)inv->h->record_count - 1 : -1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strcmp(name, inv_str(inv, inv->records[mid].name));
+        if (c == 0) return mid;
+        if (c < 0) hi = mid - 1;
+        else lo = mid + 1;
+    }
+    return -1;
+}
+
+static const InvTag *base_find_tag(const Inventory *inv, const char *tag)
+{
+    int lo = 0, hi = inv->h ? (int)inv->h->tag_count - 1 : -1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strcmp(tag, inv_str(inv, inv->tags[mid].tag));
+        if (c == 0) return &inv->tags[mid];
+        if (c < 0) hi = mid - 1;
+        else lo = mid + 1;
+    }
+    return NULL;
+}
+
+/* addrs の中で addr 以上の最初の位置 */
+static uint32_t base_addr_lower(const Inventory *inv, uint32_t addr)
+{
+    uint32_t lo = 0, hi = inv->h ? inv->h->addr_count : 0;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (inv->addrs[mid].addr < addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* ---------- 変更 (hosts.journal) ---------- */
+static int change_find(const Inventory *inv, const char *name)
+{
+    for (int i = 0; i < inv->change_count; i++) {
+        if (strcmp(inv->changes[i].rec.name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int inventory_apply(Inventory *inv, const HostRecord *r, int removed)
+{
+    int i = change_find(inv, r->name);
+    int base = base_find_name(inv, r->name);
+
+    if (i < 0) {
+        if (inv->change_count >= inv->change_cap) {
+            int ncap = inv->change_cap ? inv->change_cap * 2 : 64;
+            InvChange *n = (InvChange *)realloc(inv->changes, sizeof(InvChange) * (size_t)ncap);
+            if (!n) return 0;
+            inv->changes = n;
+            inv->change_cap = ncap;
+        }
+        i = inv->change_count++;
+    }
+    inv->changes[i].rec = *r;
+    inv->changes[i].removed = removed;
+    if (base >= 0) inv->shadowed[base] = 1;
+    return 1;
+}
+
+static void inventory_load_journal(Inventory *inv)
+{
+    char path[600];
+    size_t len;
+    char *data = NULL, *line, *next;
+
+    inventory_path("hosts.journal", path, sizeof(path));
+    data = read_whole_file(path, &len);
+    if (!data) return;
+
+    for (line = data; line && *line; line = next) {
+        char *f[7];
+        int n = 0;
+        HostRecord r;
+
+        next = strchr(line, '\n');
+        if (!next) break;              /* 書きかけの行 */
+        *next++ = '\0';
+        for (char *p = line; n < 7; n++) {
+            f[n] = p;
+            p = strchr(p, '\t');
+            if (!p) {
+                n++;
+                break;
+            }
+            *p++ = '\0';
+        }
+        memset(&r, 0, sizeof(r));
+        if (n >= 2) snprintf(r.name, sizeof(r.name), "%s", f[1]);
+        if (n == 2 && strcmp(f[0], "del") == 0) {
+            inventory_apply(inv, &r, 1);
+        } else if (n == 7 && strcmp(f[0], "set") == 0) {
+            snprintf(r.ips, sizeof(r.ips), "%s", f[2]);
+            snprintf(r.tags, sizeof(r.tags), "%s", f[3]);
+            snprintf(r.key, sizeof(r.key), "%s", f[4]);
+            snprintf(r.profile, sizeof(r.profile), "%s", f[5]);
+            r.last_seen = strtoll(f[6], NULL, 10);
+            inventory_apply(inv, &r, 0);
+        }
+    }
+    free(data);
+}
+
+/* 変更を hosts.journal に追記して反映する */
+static int inventory_log(Inventory *inv, const HostRecord *r, int removed)
+{
+    char path[600];
+
+    if (!inv->journal) {
+        inventory_path("hosts.journal", path, sizeof(path));
+        inv->journal = fopen(path, "ab");
+        if (!inv->journal) return 0;
+    }
+    if (removed) {
+        fprintf(inv->journal, "del\t%s\n", r->name);
+    } else {
+        fprintf(inv->journal, "set\t%s\t%s\t%s\t%s\t%s\t%lld\n", r->name, r->ips, r->tags, r->key,
+                r->profile, (long long)r->last_seen);
+    }
+    if (fflush(inv->journal) != 0) return 0;
+    return inventory_apply(inv, r, removed);
+}
+
+/* ---------- 書き直し ---------- */
+static const char *g_inv_sort_strings;   /* inv_pair_compare の文字列プール */
+
+typedef struct {
+    uint32_t key;            /* tag: pool offset / addr: IPv4 */
+    uint32_t record;
+} InvPair;
+
+static int inv_pair_compare(const void *a, const void *b)
+{
+    const InvPair *x = (const InvPair *)a, *y = (const InvPair *)b;
+    int c = strcmp(g_inv_sort_strings + x->key, g_inv_sort_strings + y->key);
+    if (c != 0) return c;
+    return (x->record > y->record) - (x->record < y->record);
+}
+
+static int inv_addr_compare(const void *a, const void *b)
+{
+    const InvAddr *x = (const InvAddr *)a, *y = (const InvAddr *)b;
+    if (x->addr != y->addr) return (x->addr > y->addr) - (x->addr < y->addr);
+    return (x->record > y->record) - (x->record < y->record);
+}
+
+static int host_record_compare(const void *a, const void *b)
+{
+    return strcmp(((const HostRecord *)a)->name, ((const HostRecord *)b)->name);
+}
+
+/* records (名前順) から hosts.db を作る */
+static int inventory_write_base(const HostRecord *records, int count, const char *path)
+{
+    InvHeader h;
+    SnapPool pool;
+    InvRecord *recs = NULL;
+    InvPair *tag_pairs = NULL;
+    InvAddr *addrs = NULL;
+    InvTag *tags = NULL;
+    uint32_t *postings = NULL;
+    size_t tag_pair_count = 0, tag_pair_cap = 0;
+    size_t addr_count = 0, addr_cap = 0;
+    uint32_t tag_count = 0;
+    uint32_t slots = 16;
+    StrBuf out = {0};
+    char tmp_path[640];
+    FILE *fp;
+    int ok = 0;
+
+    memset(&h, 0, sizeof(h));
+    memset(&pool, 0, sizeof(pool));
+    while (slots < (uint32_t)(count * 8 + 16) * 2) slots *= 2;
+    pool.slots = (uint32_t *)calloc(slots, sizeof(uint32_t));
+    pool.mask = slots - 1;
+    recs = (InvRecord *)calloc((size_t)count + 1, sizeof(InvRecord));
+    if (!pool.slots || !recs) goto done;
+    pool_intern(&pool, "");
+
+    for (int i = 0; i < count; i++) {
+        const HostRecord *r = &records[i];
+        char item[256];
+
+        recs[i].name = pool_intern(&pool, r->name);
+        recs[i].ips = pool_intern(&pool, r->ips);
+        recs[i].tags = pool_intern(&pool, r->tags);
+        recs[i].key = pool_intern(&pool, r->key);
+        recs[i].profile = pool_intern(&pool, r->profile);
+        recs[i].last_seen = r->last_seen;
+
+        for (const char *p = r->tags; *p; ) {
+            size_t len = strcspn(p, ",");
+            if (tag_pair_count >= tag_pair_cap) {
+                tag_pair_cap = tag_pair_cap ? tag_pair_cap * 2 : 256;
+                InvPair *n = (InvPair *)realloc(tag_pairs, sizeof(InvPair) * tag_pair_cap);
+                if (!n) goto done;
+                tag_pairs = n;
+            }
+            snprintf(item, sizeof(item), "%.*s", (int)len, p);
+            tag_pairs[tag_pair_count].key = pool_intern(&pool, item);
+            tag_pairs[tag_pair_count++].record = (uint32_t)i;
+            p += len + (p[len] ? 1 : 0);
+        }
+        for (const char *p = r->ips; *p; ) {
+            size_t len = strcspn(p, ",");
+            Subnet a;
+            snprintf(item, sizeof(item), "%.*s", (int)len, p);
+            if (!strchr(item, '/') && parse_cidr(item, &a)) {
+                if (addr_count >= addr_cap) {
+                    addr_cap = addr_cap ? addr_cap * 2 : 256;
+                    InvAddr *n = (InvAddr *)realloc(addrs, sizeof(InvAddr) * addr_cap);
+                    if (!n) goto done;
+                    addrs = n;
+                }
+                addrs[addr_count].addr = a.network;
+                addrs[addr_count++].record = (uint32_t)i;
+            }
+            p += len + (p[len] ? 1 : 0);
+        }
+    }
+
+    /* タグごとにまとめて postings へ */
+    g_inv_sort_strings = pool.data.data;
+    if (tag_pair_count) qsort(tag_pairs, tag_pair_count, sizeof(InvPair), inv_pair_compare);
+    if (addr_count) qsort(addrs, addr_count, sizeof(InvAddr), inv_addr_compare);
+    tags = (InvTag *)calloc(tag_pair_count + 1, sizeof(InvTag));
+    postings = (uint32_t *)calloc(tag_pair_count + 1, sizeof(uint32_t));
+    if (!tags || !postings) goto done;
+    for (size_t i = 0; i < tag_pair_count; i++) {
+        if (i == 0 || tag_pairs[i].key != tag_pairs[i - 1].key) {
+            tags[tag_count].tag = tag_pairs[i].key;
+            tags[tag_count++].first = (uint32_t)i;
+        }
+        tags[tag_count - 1].count++;
+        postings[i] = tag_pairs[i].record;
+    }
+
+    memcpy(h.magic, "OWIV", 4);
+    h.version = INVENTORY_VERSION;
+    h.record_size = (uint32_t)sizeof(InvRecord);
+    h.record_count = (uint32_t)count;
+    h.tag_count = tag_count;
+    h.posting_count = (uint32_t)tag_pair_count;
+    h.addr_count = (uint32_t)addr_count;
+    h.records_off = (uint32_t)((sizeof(InvHeader) + 15) & ~(size_t)15);
+    h.tags_off = h.records_off + h.record_count * (uint32_t)sizeof(InvRecord);
+    h.postings_off = h.tags_off + h.tag_count * (uint32_t)sizeof(InvTag);
+    h.addrs_off = h.postings_off + h.posting_count * (uint32_t)sizeof(uint32_t);
+    h.strings_off = h.addrs_off + h.addr_count * (uint32_t)sizeof(InvAddr);
+    h.total_size = h.strings_off + (uint32_t)pool.data.len;
+
+    out.data = (char *)calloc(1, h.total_size);
+    if (!out.data) goto done;
+    memcpy(out.data, &h, sizeof(h));
+    memcpy(out.data + h.records_off, recs, h.record_count * sizeof(InvRecord));
+    memcpy(out.data + h.tags_off, tags, h.tag_count * sizeof(InvTag));
+    memcpy(out.data + h.postings_off, postings, h.posting_count * sizeof(uint32_t));
+    if (addr_count) memcpy(out.data + h.addrs_off, addrs, h.addr_count * sizeof(InvAddr));
+    memcpy(out.data + h.strings_off, pool.data.data, pool.data.len);
+
+    /* 書きかけを読まれないよう一時ファイルから置き換える */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (!fp) goto done;
+    ok = (fwrite(out.data, 1, h.total_size, fp) == h.total_size);
+    ok = (fclose(fp) == 0) && ok;
+    ok = ok && replace_file(tmp_path, path);
+    if (!ok) remove(tmp_path);
+
+done:
+    g_inv_sort_strings = NULL;
+    free(out.data);
+    free(recs);
+    free(tag_pairs);
+    free(addrs);
+    free(tags);
+    free(postings);
+    free(pool.slots);
+    sb_free(&pool.data);
+    return ok;
+}
+
+static void inventory_release(Inventory *inv)
+{
+    if (inv->journal) fclose(inv->journal);
+    if (inv->map) unmap_file(inv->map, inv->map_size);
+    free(inv->shadowed);
+    free(inv->changes);
+    memset(inv, 0, sizeof(*inv));
+    inv->lock = FILE_LOCK_NONE;
+}
+
+/* ベースをマップして変更を読み込む。lock は失敗しても inv に残す (inventory_close で外す) */
+static int inventory_load(Inventory *inv, file_lock_t lock)
+{
+    char path[600];
+    size_t size = 0;
+
+    memset(inv, 0, sizeof(*inv));
+    inv->lock = lock;
+    inventory_path("hosts.db", path, sizeof(path));
+    inv->map = map_file(path, &size);
+    if (inv->map) {
+        if (!inventory_base_valid(inv->map, size)) {
+            unmap_file(inv->map, size);
+            inv->map = NULL;
+            return 0;
+        }
+        inv->map_size = size;
+        inv->h = (const InvHeader *)inv->map;
+        inv->records = (const InvRecord *)((const char *)inv->map + inv->h->records_off);
+        inv->tags = (const InvTag *)((const char *)inv->map + inv->h->tags_off);
+        inv->postings = (const uint32_t *)((const char *)inv->map + inv->h->postings_off);
+        inv->addrs = (const InvAddr *)((const char *)inv->map + inv->h->addrs_off);
+        inv->strings = (const char *)inv->map + inv->h->strings_off;
+    }
+    inv->shadowed = (unsigned char *)calloc(inv->h ? inv->h->record_count + 1 : 1, 1);
+    if (!inv->shadowed) return 0;
+    inventory_load_journal(inv);
+    return 1;
+}
+
+/* ベースと変更をまとめて hosts.db を書き直し、hosts.journal を空にする (ロックは持ったまま) */
+int inventory_compact(Inventory *inv)
+{
+    char db_path[600], journal_path[600];
+    file_lock_t lock = inv->lock;
+    HostRecord *all;
+    int count = 0, ok;
+    FILE *fp;
+
+    all = (HostRecord *)malloc(sizeof(HostRecord) * ((size_t)inventory_count(inv) + 1));
+    if (!all) return 0;
+    for (int i = 0; inv->h && i < (int)inv->h->record_count; i++) {
+        if (!inv->shadowed[i]) base_record(inv, i, &all[count++]);
+    }
+    for (int i = 0; i < inv->change_count; i++) {
+        if (!inv->changes[i].removed) all[count++] = inv->changes[i].rec;
+    }
+    qsort(all, (size_t)count, sizeof(HostRecord), host_record_compare);
+
+    /* マップを外してから置き換える (Windows はマップ中のファイルを置き換えられない) */
+    inventory_release(inv);
+    inventory_path("hosts.db", db_path, sizeof(db_path));
+    inventory_path("hosts.journal", journal_path, sizeof(journal_path));
+    ok = inventory_write_base(all, count, db_path);
+    if (ok && (fp = fopen(journal_path, "wb")) != NULL) fclose(fp);
+    free(all);
+
+    /* 書き直したもの (失敗なら元のベースと変更) を開き直す */
+    return inventory_load(inv, lock) && ok;
+}
+
+/* ---------- 公開 ---------- */
+/* 開けなければ (ベースが壊れている・別の版) 0。開けたら inventory_close まで hosts.lock を持つ */
+int inventory_open(Inventory *inv)
+{
+    char path[600];
+    file_lock_t lock;
+
+    inventory_path("hosts.lock", path, sizeof(path));
+    lock = file_lock(path, 1);
+    if (lock == FILE_LOCK_NONE) {
+        memset(inv, 0, sizeof(*inv));
+        inv->lock = FILE_LOCK_NONE;
+        return 0;
+    }
+    if (!inventory_load(inv, lock)) {
+        inventory_release(inv);
+        file_unlock(lock);
+        return 0;
+    }
+    return 1;
+}
+
+/* 変更が溜まっていればベースに畳んでから閉じる */
+void inventory_close(Inventory *inv)
+{
+    file_lock_t lock;
+
+    if (inv->change_count > INVENTORY_JOURNAL_MAX) inventory_compact(inv);
+    lock = inv->lock;
+    inventory_release(inv);
+    file_unlock(lock);
+}
+
+int inventory_count(const Inventory *inv)
+{
+    int n = inv->h ? (int)inv->h->record_count : 0;
+
+    for (int i = 0; inv->h && i < (int)inv->h->record_count; i++) n -= inv->shadowed[i];
+    for (int i = 0; i < inv->change_count; i++) n += !inv->changes[i].removed;
+    return n;
+}
+
+int inventory_get(const Inventory *inv, const char *name, HostRecord *out)
+{
+    int i = change_find(inv, name);
+
+    memset(out, 0, sizeof(*out));
+    if (i >= 0) {
+        if (inv->changes[i].removed) return 0;
+        *out = inv->changes[i].rec;
+        return 1;
+    }
+    i = base_find_name(inv, name);
+    if (i < 0) return 0;
+    base_record(inv, i, out);
+    return 1;
+}
+
+/* 名前、なければアドレスで記録を探す */
+int inventory_find_host(const Inventory *inv, const char *host, HostRecord *out)
+{
+    Subnet a;
+
+    if (inventory_get(inv, host, out)) return 1;
+    for (int i = 0; i < inv->change_count; i++) {
+        if (!inv->changes[i].removed && list_has(inv->changes[i].rec.ips, host)) {
+            *out = inv->changes[i].rec;
+            return 1;
+        }
+    }
+    if (inv->h && parse_cidr(host, &a) && !strchr(host, '/')) {
+        for (uint32_t i = base_addr_lower(inv, a.network);
+             i < inv->h->addr_count && inv->addrs[i].addr == a.network; i++) {
+            if (inv->shadowed[inv->addrs[i].record]) continue;
+            base_record(inv, (int)inv->addrs[i].record, out);
+            return 1;
+        }
+    }
+    /* IPv6 は索引が無いので全件 */
+    for (int i = 0; inv->h && strchr(host, ':') && i < (int)inv->h->record_count; i++) {
+        if (!inv->shadowed[i] && list_has(inv_str(inv, inv->records[i].ips), host)) {
+            base_record(inv, i, out);
+            return 1;
+        }
+    }
+    memset(out, 0, sizeof(*out));
+    return 0;
+}
+
+int inventory_put(Inventory *inv, const HostRecord *r)
+{
+    const char *fields[] = { r->name, r->ips, r->tags, r->key, r->profile };
+
+    if (!r->name[0]) return 0;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (strpbrk(fields[i], "\t\r\n")) return 0;
+    }
+    if (strpbrk(r->name, ", ") || strchr(r->ips, ' ')) return 0;
+    return inventory_log(inv, r, 0);
+}
+
+int inventory_remove(Inventory *inv, const char *name)
+{
+    HostRecord r;
+
+    if (!inventory_get(inv, name, &r)) return 0;
+    return inventory_log(inv, &r, 1);
+}
+
+/*
+ * 接続できたホストを記録する (fleet / scan / 鍵の登録の後)。
+ * 記録が無ければ host を名前とアドレスにして追加する。
+ * key: 登録した鍵の種類 (NULL = 変えない)、tags: 重ねるタグ (NULL = なし)
+ */
+int inventory_touch(Inventory *inv, const char *host, const char *key, const char *tags)
+{
+    HostRecord r;
+
+    if (!inventory_find_host(inv, host, &r)) {
+        snprintf(r.name, sizeof(r.name), "%s", host);
+        snprintf(r.ips, sizeof(r.ips), "%s", host);
+    }
+    if (key) snprintf(r.key, sizeof(r.key), "%s", key);
+    if (tags && !tags_merge(r.tags, sizeof(r.tags), tags)) return 0;
+    r.last_seen = (int64_t)time(NULL);
+    return inventory_put(inv, &r);
+}
+
+/* --scan で見つかった SSH デバイスを記録する (SSH デーモンをタグに)。記録後の件数 */
+int inventory_record_scan(const ScanResult *results, int count)
+{
+    Inventory inv;
+    char addr[32], tag[32];
+    int total;
+
+    if (!inventory_open(&inv)) return -1;
+    for (int i = 0; i < count; i++) {
+        if (results[i].daemon == SSH_DAEMON_NONE) continue;
+        format_ipv4(results[i].addr, addr, sizeof(addr));
+        snprintf(tag, sizeof(tag), "daemon=%s", ssh_daemon_name(results[i].daemon));
+        inventory_touch(&inv, addr, NULL, tag);
+    }
+    total = inventory_count(&inv);
+    inventory_close(&inv);
+    return total;
+}
+
+/* 接続に使うアドレス: 最初のアドレス、なければ名前 */
+void inventory_address(const HostRecord *r, char *buf, size_t size)
+{
+    size_t len = strcspn(r->ips, ",");
+
+    if (len > 0) snprintf(buf, size, "%.*s", (int)len, r->ips);
+    else snprintf(buf, size, "%s", r->name);
+}
+
+/* ---------- 選択 ---------- */
+static int host_matches(const char *name, const char *ips, const char *tags, const InvTerm *t)
+{
+    switch (t->kind) {
+    case INV_TERM_ALL:    return 1;
+    case INV_TERM_TAG:    return list_has(tags, t->text);
+    case INV_TERM_SUBNET: return ips_in_subnet(ips, &t->sn);
+    case INV_TERM_NAME:   return strcmp(name, t->text) == 0 || list_has(ips, t->text);
+    }
+    return 0;
+}
+
+/* skip: 候補を出した条件 (確認済み) */
+static int base_matches(const Inventory *inv, uint32_t i, const InvTerm *terms, int count, int skip)
+{
+    const InvRecord *r = &inv->records[i];
+
+    for (int t = 0; t < count; t++) {
+        if (t != skip && !host_matches(inv_str(inv, r->name), inv_str(inv, r->ips), inv_str(inv, r->tags), &terms[t])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int add_hit(int **hits, int *count, int *cap, int hit)
+{
+    if (*count >= *cap) {
+        int ncap = *cap ? *cap * 2 : 64;
+        int *n = (int *)realloc(*hits, sizeof(int) * (size_t)ncap);
+        if (!n) return 0;
+        *hits = n;
+        *cap = ncap;
+    }
+    (*hits)[(*count)++] = hit;
+    return 1;
+}
+
+/*
+ * selector に一致するホストを *out に入れて件数を返す (セレクターが不正なら -1)。
+ * 要素はベースの記録の番号 (>= 0) または変更の番号 (-1 - i)。inventory_hit() で取り出す。
+ */
+int inventory_select(const Inventory *inv, const char *selector, int **out)
+{
+    char text[512];
+    char *words[INVENTORY_MAX_TERMS + 1];
+    InvTerm terms[INVENTORY_MAX_TERMS];
+    int word_count, term_count = 0, best = -1;
+    uint32_t best_size = inv->h ? inv->h->record_count : 0;
+    int *hits = NULL, hit_count = 0, hit_cap = 0;
+
+    *out = NULL;
+    snprintf(text, sizeof(text), "%s", selector);
+    word_count = split_words(text, ", \t", words, INVENTORY_MAX_TERMS + 1);
+    if (word_count == 0 || word_count > INVENTORY_MAX_TERMS) return -1;
+    for (int w = 0; w < word_count; w++) {
+        InvTerm *t = &terms[term_count];
+        const char *tok = words[w];
+        t->text = tok;
+        if (strcmp(tok, "all") == 0) t->kind = INV_TERM_ALL;
+        else if (strchr(tok, '=')) t->kind = INV_TERM_TAG;
+        else if (parse_cidr(tok, &t->sn)) t->kind = INV_TERM_SUBNET;
+        else t->kind = INV_TERM_NAME;
+        term_count++;
+    }
+    if (term_count == 0) return -1;
+
+    /* ベース: 候補の最も少ない索引から */
+    for (int i = 0; inv->h && i < term_count; i++) {
+        uint32_t size = best_size;
+        if (terms[i].kind == INV_TERM_TAG) {
+            const InvTag *tag = base_find_tag(inv, terms[i].text);
+            size = tag ? tag->count : 0;
+        } else if (terms[i].kind == INV_TERM_SUBNET) {
+            uint32_t last = terms[i].sn.network | ~prefix_mask(terms[i].sn.prefix);
+            uint32_t end = (last == UINT32_MAX) ? inv->h->addr_count : base_addr_lower(inv, last + 1);
+            size = end - base_addr_lower(inv, terms[i].sn.network);
+        } else if (terms[i].kind == INV_TERM_NAME && base_find_name(inv, terms[i].text) >= 0) {
+            size = 1;                  /* 名前でなければアドレス (IPv6 等) として全件を確認 */
+        }
+        if (best < 0 || size < best_size) {
+            best = i;
+            best_size = size;
+        }
+    }
+    if (inv->h && best >= 0) {
+        const InvTerm *t = &terms[best];
+        if (t->kind == INV_TERM_TAG) {
+            const InvTag *tag = base_find_tag(inv, t->text);
+            for (uint32_t i = 0; tag && i < tag->count; i++) {
+                uint32_t r = inv->postings[tag->first + i];
+                if (!inv->shadowed[r] && base_matches(inv, r, terms, term_count, best)) {
+                    if (!add_hit(&hits, &hit_count, &hit_cap, (int)r)) break;
+                }
+            }
+        } else if (t->kind == INV_TERM_SUBNET) {
+            /* 複数のアドレスが範囲に入る記録は1回だけ */
+            unsigned char *seen = (unsigned char *)calloc(inv->h->record_count + 1, 1);
+            for (uint32_t i = base_addr_lower(inv, t->sn.network);
+                 seen && i < inv->h->addr_count && (inv->addrs[i].addr & prefix_mask(t->sn.prefix)) == t->sn.network;
+                 i++) {
+                uint32_t r = inv->addrs[i].record;
+                if (seen[r] || inv->shadowed[r]) continue;
+                seen[r] = 1;
+                if (base_matches(inv, r, terms, term_count, best)) {
+                    if (!add_hit(&hits, &hit_count, &hit_cap, (int)r)) break;
+                }
+            }
+            free(seen);
+        } else if (t->kind == INV_TERM_NAME && base_find_name(inv, t->text) >= 0) {
+            int r = base_find_name(inv, t->text);
+            if (r >= 0 && !inv->shadowed[r] && base_matches(inv, (uint32_t)r, terms, term_count, best)) {
+                add_hit(&hits, &hit_count, &hit_cap, r);
+            }
+        } else {
+            for (uint32_t r = 0; r < inv->h->record_count; r++) {
+                if (!inv->shadowed[r] && base_matches(inv, r, terms, term_count, best)) {
+                    if (!add_hit(&hits, &hit_count, &hit_cap, (int)r)) break;
+                }
+            }
+        }
+    }
+
+    /* 変更: 全件を確認 (INVENTORY_JOURNAL_MAX 件程度) */
+    for (int i = 0; i < inv->change_count; i++) {
+        const HostRecord *r = &inv->changes[i].rec;
+        int ok = !inv->changes[i].removed;
+        for (int t = 0; ok && t < term_count; t++) ok = host_matches(r->name, r->ips, r->tags, &terms[t]);
+        if (ok && !add_hit(&hits, &hit_count, &hit_cap, -1 - i)) break;
+    }
+    *out = hits;
+    return hit_count;
+}
+
+void inventory_hit(const Inventory *inv, int hit, HostRecord *out)
+{
+    if (hit >= 0) base_record(inv, hit, out);
+    else *out = inv->changes[-1 - hit].rec;
+}
+
+/* ---------- --inventory ---------- */
+static void inventory_print(const HostRecord *r)
+{
+    char seen[32] = "-";
+
+    if (r->last_seen) {
+        time_t t = (time_t)r->last_seen;
+        strftime(seen, sizeof(seen), "%Y-%m-%d %H:%M", localtime(&t));
+    }
+    printf("  %-20s %-16s %-8s %-16s %-10s %s\n", r->name, r->ips[0] ? r->ips : "-", r->key[0] ? r->key : "-",
+           seen, r->profile[0] ? r->profile : "-", r->tags[0] ? r->tags : "-");
+}
+
+/* "<name> [addr[,addr]] [key=value...]" の引数を r に重ねる */
+static int inventory_parse_host(HostRecord *r, int argc, char *argv[])
+{
+    int addrs = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strchr(argv[i], '=')) {
+            if (!tags_merge(r->tags, sizeof(r->tags), argv[i])) return 0;
+        } else {
+            if (addrs++ > 0 || strlen(argv[i]) >= sizeof(r->ips)) return 0;
+            snprintf(r->ips, sizeof(r->ips), "%s", argv[i]);
+        }
+    }
+    return 1;
+}
+
+/* hosts ファイル (1行 "<name> [addr[,addr]] [key=value...]"、アドレスだけでも可) を取り込む */
+static int inventory_import(Inventory *inv, const char *path)
+{
+    char line[MAX_LINE_LEN];
+    int added = 0, bad = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        printf("[ERROR] Host list not found: %s\n", path);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *words[32];
+        int n;
+        HostRecord r;
+        char *hash = strchr(line, '#');
+
+        if (hash) *hash = '\0';
+        n = split_words(line, " \t\r\n", words, 32);
+        if (n == 0) continue;
+        if (!inventory_get(inv, words[0], &r)) {
+            snprintf(r.name, sizeof(r.name), "%s", words[0]);
+            if (n == 1 || strchr(words[1], '=')) snprintf(r.ips, sizeof(r.ips), "%s", words[0]);
+        }
+        if (inventory_parse_host(&r, n - 1, words + 1) && inventory_put(inv, &r)) added++;
+        else bad++;
+    }
+    fclose(fp);
+    printf("Imported %d host(s)%s", added, bad ? "" : "\n");
+    if (bad) printf(", %d line(s) skipped\n", bad);
+    return bad ? 1 : 0;
+}
+
+/*
+ * --inventory [list [selector]]
+ * --inventory set <name> [addr[,addr]] [key=value...] [--profile <name>]
+ * --inventory rm <name> / import <hosts-file> / compact
+ */
+int run_inventory(int argc, char *argv[])
+{
+    Inventory inv;
+    const char *action = (argc > 0) ? argv[0] : "list";
+    const char *profile = take_option(&argc, argv, "--profile");
+    char path[600];
+    int ret = 0;
+
+    if (!inventory_open(&inv)) {
+        inventory_path("hosts.db", path, sizeof(path));
+        printf("[ERROR] Inventory is damaged or from another version: %s\n", path);
+        return 1;
+    }
+
+    if (strcmp(action, "list") == 0) {
+        int *hits;
+        uint64_t start = now_us();
+        int n = inventory_select(&inv, (argc > 1) ? argv[1] : "all", &hits);
+        uint64_t elapsed = now_us() - start;
+        if (n < 0) {
+            printf("[ERROR] Invalid selector: %s\n", argv[1]);
+            ret = 1;
+        } else {
+            HostRecord r;
+            if (n > 0) {
+                printf("  %-20s %-16s %-8s %-16s %-10s %s\n", "NAME", "ADDRESS", "KEY", "LAST SEEN", "PROFILE", "TAGS");
+            }
+            for (int i = 0; i < n; i++) {
+                inventory_hit(&inv, hits[i], &r);
+                inventory_print(&r);
+            }
+            printf("\n%d of %d host(s) selected in %llu us\n", n, inventory_count(&inv),
+                   (unsigned long long)elapsed);
+        }
+        free(hits);
+    } else if (strcmp(action, "set") == 0 && argc > 1) {
+        HostRecord r;
+        if (!inventory_get(&inv, argv[1], &r)) snprintf(r.name, sizeof(r.name), "%s", argv[1]);
+        if (profile) snprintf(r.profile, sizeof(r.profile), "%s", profile);
+        if (!inventory_parse_host(&r, argc - 2, argv + 2) || !inventory_put(&inv, &r)) {
+            printf("[ERROR] Invalid host entry (one address list, tags as key=value, no spaces or commas in the name)\n");
+            ret = 1;
+        } else {
+            inventory_print(&r);
+        }
+    } else if (strcmp(action, "rm") == 0 && argc > 1) {
+        if (!inventory_remove(&inv, argv[1])) {
+            printf("[ERROR] Not in the inventory: %s\n", argv[1]);
+            ret = 1;
+        }
+    } else if (strcmp(action, "import") == 0 && argc > 1) {
+        ret = inventory_import(&inv, argv[1]);
+    } else if (strcmp(action, "compact") == 0) {
+        int n = inv.change_count;
+        if (!inventory_compact(&inv)) {
+            printf("[ERROR] Cannot rewrite the inventory\n");
+            ret = 1;
+        } else {
+            printf("Merged %d change(s); %d host(s) in the inventory\n", n, inventory_count(&inv));
+        }
+    } else {
+        printf("Usage: openwrt-connect.exe --inventory [list [selector]]\n");
+        printf("       openwrt-connect.exe --inventory set <name> [addr[,addr]] [key=value...] [--profile <name>]\n");
+        printf("       openwrt-connect.exe --inventory rm <name>\n");
+        printf("       openwrt-connect.exe --inventory import <hosts-file>\n");
+        printf("       openwrt-connect.exe --inventory compact\n");
+        ret = 1;
+    }
+    inventory_close(&inv);
+    return ret;
+}
+
+/* ================================================== */
+/* Link tuning (--bench-link)                         */
+/* ================================================== */
+/*
+ * 暗号と圧縮の組み合わせごとに、接続だけの時間と LINK_*_BYTES の送信時間を測り、
+ * 最も速い組み合わせをデバイスの記録 (cipher / compression) に保存する。
+ * 以降の接続は ssh_build_args がそれを付ける。
+ * AES 命令のない MIPS では chacha20-poly1305 や aes128-ctr が、x86 では aes128-gcm が
+ * 速いことが多く、遅い回線では圧縮が効く。送るデータはスクリプト相当の文字列と
+ * 圧縮の効かないバイト列を半分ずつ。
+ * 接続再利用のマスターは既存の暗号のまま残るため、選んだ組み合わせは次の接続から使われる。
+ */
+typedef struct {
+    const char *cipher;
+    int compression;
+    int ok;
+    uint64_t connect_us;     /* 接続・認証・"true" の実行まで */
+    double rate;             /* bytes/s (接続時間を除く) */
+} LinkResult;
+
+/* 半分はスクリプト風の行、半分は擬似乱数 (64 KB ごとに交互) */
+static char *link_payload(size_t len)
+{
+    const size_t block = 64 * 1024;
+    char *p = (char *)malloc(len);
+    uint32_t x = 2463534242u;
+    unsigned int line_no = 0;
+
+    if (!p) return NULL;
+    for (size_t o = 0; o < len; ) {
+        size_t end = (len - o < block) ? len : o + block;
+        if ((o / block) % 2 == 0) {
+            while (o < end) {
+                char line[96];
+                int n = snprintf(line, sizeof(line), "uci set network.lan%u.ipaddr='192.168.%u.1' # step %u\n",
+                                 line_no % 8, line_no % 250, line_no);
+                size_t take = ((size_t)n < end - o) ? (size_t)n : end - o;
+                memcpy(p + o, line, take);
+                o += take;
+                line_no++;
+            }
+        } else {
+            for (; o < end; o++) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                p[o] = (char)x;
+            }
+        }
+    }
+    return p;
+}
+
+/* 接続再利用・記録済みの選択なしで1回 ssh を実行し、所要時間 (us) を返す。失敗は 0 */
+static uint64_t link_ssh(const SshTarget *t, const char *cipher, int compression, const char *remote,
+                         const char *data, size_t len, char *detail, size_t detail_size)
+{
+    SshTarget direct = *t;
+    ArgList a = {0};
+    ProcOptions opt;
+    ProcResult res;
+    uint64_t start, elapsed;
+
+    direct.ssh_dir = NULL;
+    direct.device = NULL;
+    ssh_build_args(&direct, &a);
+    args_add(&a, "-o");
+    args_add(&a, "BatchMode=yes");
+    args_add(&a, "-o");
+    args_add(&a, "ConnectTimeout=5");
+    args_add(&a, "-o");
+    args_addf(&a, "Ciphers=%s", cipher);
+    args_add(&a, "-o");
+    args_add(&a, compression ? "Compression=yes" : "Compression=no");
+    ssh_add_destination(&direct, &a);
+    args_add(&a, remote);
+
+    memset(&opt, 0, sizeof(opt));
+    opt.in = data ? PROC_IN_DATA : PROC_IN_NULL;
+    opt.in_data = data;
+    opt.in_len = len;
+    opt.merge_stderr = 1;
+    opt.timeout_ms = LINK_BENCH_TIMEOUT_MS;
+    opt.cancel = t->cancel;
+    start = now_us();
+    proc_run((const char *const *)a.argv, &opt, &res);
+    elapsed = now_us() - start;
+    args_free(&a);
+
+    if (detail) first_line(res.out.data ? res.out.data : "", detail, detail_size);
+    if (res.exit_code != 0) elapsed = 0;
+    proc_result_free(&res);
+    return elapsed;
+}
+
+/*
+ * LINK_CIPHERS x 圧縮なし/あり を測って results に入れ、最速の添字を返す (全て失敗なら -1)。
+ * report = 1 なら測るたびに1行表示する。
+ */
+static int link_measure(const SshTarget *t, size_t bytes, int report, LinkResult *results)
+{
+    char *payload = link_payload(bytes);
+    int count = 0, best = -1;
+
+    if (!payload) return -1;
+    for (int i = 0; LINK_CIPHERS[i]; i++) {
+        for (int compression = 0; compression <= 1; compression++) {
+            LinkResult *r = &results[count++];
+            char detail[128] = {0};
+            uint64_t connect_us, send_us = 0;
+
+            memset(r, 0, sizeof(*r));
+            r->cipher = LINK_CIPHERS[i];
+            r->compression = compression;
+            connect_us = link_ssh(t, r->cipher, compression, "true", NULL, 0, detail, sizeof(detail));
+            if (connect_us) {
+                send_us = link_ssh(t, r->cipher, compression, "cat >/dev/null", payload, bytes,
+                                   detail, sizeof(detail));
+            }
+            if (connect_us && send_us) {
+                uint64_t transfer_us = (send_us > connect_us + 1000) ? send_us - connect_us : 1000;
+                r->ok = 1;
+                r->connect_us = connect_us;
+                r->rate = (double)bytes * 1e6 / (double)transfer_us;
+                if (best < 0 || r->rate > results[best].rate) best = count - 1;
+            }
+            if (report) {
+                if (r->ok) {
+                    printf("  %-32s %-5s %6.0f ms  %8.2f MB/s\n", r->cipher, compression ? "on" : "off",
+                           r->connect_us / 1000.0, r->rate / (1024.0 * 1024.0));
+                } else {
+                    printf("  %-32s %-5s %9s  %s\n", r->cipher, compression ? "on" : "off", "-",
+                           detail[0] ? detail : "failed");
+                }
+                fflush(stdout);
+            }
+        }
+    }
+    free(payload);
+    return best;
+}
+
+/*
+ * 測定して最速の組み合わせを d とデバイスの記録に保存する。
+ * report = 1 (--bench-link) は全ての結果を表示、0 (link_tune) は選んだものだけ。
+ */
+int link_tune(const SshTarget *t, DeviceInfo *d, size_t bytes, int report)
+{
+    LinkResult results[LINK_CIPHER_COUNT * 2];
+    DeviceInfo learned;
+    int best;
+
+    if (report) {
+        printf("\nMeasuring %s@%s (%zu KB per option, no connection reuse)\n\n", t->user, t->host,
+               bytes / 1024);
+        printf("  %-32s %-5s %9s  %13s\n", "Cipher", "Comp", "Connect", "Throughput");
+    } else {
+        printf("Measuring the link to %s for the fastest cipher...\n", t->host);
+    }
+    fflush(stdout);
+    best = link_measure(t, bytes, report, results);
+    if (best < 0) {
+        printf("%s[WARNING] No cipher could be measured; ssh defaults stay in use\n", report ? "\n" : "");
+        return 0;
+    }
+
+    memset(&learned, 0, sizeof(learned));
+    snprintf(learned.cipher, sizeof(learned.cipher), "%s", results[best].cipher);
+    snprintf(learned.compression, sizeof(learned.compression), "%s", results[best].compression ? "yes" : "no");
+    device_learned(t->cfg, t->host, &learned);
+    if (d) {
+        snprintf(d->cipher, sizeof(d->cipher), "%s", learned.cipher);
+        snprintf(d->compression, sizeof(d->compression), "%s", learned.compression);
+    }
+    printf("%sUsing %s, compression %s (%.2f MB/s) for this device from now on\n", report ? "\n" : "",
+           results[best].cipher, results[best].compression ? "on" : "off",
+           results[best].rate / (1024.0 * 1024.0));
+    return 1;
+}
+
+/* ================================================== */
+/* Install script generator (template-based)          */
+/* ================================================== */
+/*
+ * デバイス側のファイル構成 (.conf の dir, bin から組み立てる)
+ *   <dir>/<script>.sh           スクリプト本体 (最後に取得できた版)
+ *   <dir>/<script>.sh.checked   最後に版を確認した時刻 (date +%s)
+ *   <bin>                       本体を起動するラッパー
+ *
+ * ラッパーは確認から script_ttl 秒以内なら本体をそのまま起動する。期限切れなら
+ * manifest (あれば) のハッシュで確認し、変わっていれば本体を取得し直す。
+ * 取得できなければ最後に取得できた版で起動する。どれを使ったかは標準エラーに1行出す。
+ *   OWRT_REFRESH=1  期限内でも確認する
+ *   OWRT_FRESH=1    確認済みとして扱う (こちらから送った直後・同じ版と確認済み)
+ *
+ * こちらで取得したスクリプトがある場合 (hash あり) は標準入力で受け取り、
+ * SHA-256 を確かめてから置き換える。hash なし (script_push = off、または
+ * 一度も取得できていない) の場合はラッパーだけを置き、本体は初回起動時に取得する。
+ * ラッパーの2行目に形式の版とスクリプトのハッシュ ("-" = なし) を記録する。
+ */
+
+/* <name>.sh をURLの末尾から抽出、なければコマンド名を使う */
+static void script_file_name(const CommandDef *cmd, char *buf, size_t size)
+{
+    const char *url_file = strrchr(cmd->url, '/');
+    if (url_file && url_file[1] != '\0') {
+        snprintf(buf, size, "%s", url_file + 1);
+        /* クエリパラメータがあれば除去 */
+        buf[strcspn(buf, "?#")] = '\0';
+    } else {
+        snprintf(buf, size, "%s.sh", cmd->name);
+    }
+}
+
+static void script_device_path(const CommandDef *cmd, StrBuf *path)
+{
+    char script_name[256];
+
+    script_file_name(cmd, script_name, sizeof(script_name));
+    sb_appendf(path, "%s/%s", cmd->dir, script_name);
+}
+
+/* ラッパー本体 (1要素 = 1行) */
+static const char *const SCRIPT_WRAPPER_BODY[] = {
+    "mkdir -p \"$D\"",
+    "now=$(date +%s); last=$(cat \"$S.checked\" 2>/dev/null); last=${last:-0}",
+    "if [ -f \"$S\" ] && [ -z \"$OWRT_REFRESH\" ] && { [ -n \"$OWRT_FRESH\" ] || [ $((now - last)) -lt \"$TTL\" ]; }; then",
+    "  [ -n \"$OWRT_FRESH\" ] || echo \"$N: cached copy (checked $(((now - last) / 60)) min ago)\" >&2",
+    "else",
+    "  have=$(sha256sum \"$S\" 2>/dev/null | cut -d' ' -f1); want=",
+    "  [ -z \"$M\" ] || want=$(wget --no-check-certificate -q -O - \"$M\" 2>/dev/null | cut -d' ' -f1)",
+    "  if [ -n \"$want\" ] && [ \"$want\" = \"$have\" ]; then",
+    "    echo \"$now\" > \"$S.checked\"; echo \"$N: cached copy is current (manifest)\" >&2",
+    "  elif wget --no-check-certificate -q -O \"$S.$$\" \"$U$B$now\" && [ -s \"$S.$$\" ] &&"
+    " got=$(sha256sum \"$S.$$\" | cut -d' ' -f1) && { [ -z \"$want\" ] || [ \"$got\" = \"$want\" ]; }; then",
+    "    if [ \"$got\" = \"$have\" ]; then rm -f \"$S.$$\"; echo \"$N: cached copy is current\" >&2;"
+    " else mv \"$S.$$\" \"$S\"; echo \"$N: downloaded new version\" >&2; fi",
+    "    echo \"$now\" > \"$S.checked\"",
+    "  elif [ -f \"$S\" ]; then",
+    "    rm -f \"$S.$$\"; echo \"$N: download failed, using last good copy\" >&2",
+    "  else",
+    "    rm -f \"$S.$$\"; echo \"$N: download failed\" >&2; exit 1",
+    "  fi",
+    "fi",
+    "exec sh \"$S\" \"$@\"",
+    NULL
+};
+
+/* ラッパーの設定行: N D S U M TTL B (キャッシュ回避の区切り)。.conf が変わればこの行も変わる */
+static void wrapper_vars_line(const CommandDef *cmd, int ttl, StrBuf *line)
+{
+    char script_name[256];
+
+    script_file_name(cmd, script_name, sizeof(script_name));
+    sb_puts(line, "N=");
+    sb_append_quoted(line, cmd->name);
+    sb_puts(line, "; D=");
+    sb_append_quoted(line, cmd->dir);
+    sb_puts(line, "; S=\"$D\"/");
+    sb_append_quoted(line, script_name);
+    sb_puts(line, "; U=");
+    sb_append_quoted(line, cmd->url);
+    sb_puts(line, "; M=");
+    sb_append_quoted(line, cmd->manifest);
+    sb_appendf(line, "; TTL=%d; B='%ct='", ttl, strchr(cmd->url, '?') ? '&' : '?');
+}
+
+/* <bin> がこの設定のラッパーかを確かめる条件 (grep -F で設定行を1行丸ごと照合) */
+static void append_wrapper_check(StrBuf *sb, const CommandDef *cmd, int ttl)
+{
+    StrBuf line = {0};
+
+    wrapper_vars_line(cmd, ttl, &line);
+    sb_puts(sb, "grep -qxF ");
+    sb_append_quoted(sb, line.data);
+    sb_puts(sb, " ");
+    sb_append_quoted(sb, cmd->bin);
+    sb_puts(sb, " 2>/dev/null");
+    sb_free(&line);
+}
+
+/* ラッパーを1行ずつ printf '%s\n' に渡して <bin> へ書くコマンド */
+static void append_write_wrapper(StrBuf *sb, const CommandDef *cmd, const char *hash, int ttl)
+{
+    StrBuf line = {0};
+
+    sb_puts(sb, "printf '%s\\n' '#!/bin/sh' ");
+    sb_appendf(&line, "%s %s", SCRIPT_WRAPPER_TAG, hash ? hash : "-");
+    sb_append_quoted(sb, line.data);
+
+    line.len = 0;
+    wrapper_vars_line(cmd, ttl, &line);
+    sb_puts(sb, " ");
+    sb_append_quoted(sb, line.data);
+    sb_free(&line);
+
+    for (int i = 0; SCRIPT_WRAPPER_BODY[i]; i++) {
+        sb_puts(sb, " ");
+        sb_append_quoted(sb, SCRIPT_WRAPPER_BODY[i]);
+    }
+    sb_puts(sb, " > ");
+    sb_append_quoted(sb, cmd->bin);
+    sb_puts(sb, " && chmod +x ");
+    sb_append_quoted(sb, cmd->bin);
+}
+
+void build_install_script(const CommandDef *cmd, const char *hash, int ttl, StrBuf *sb)
+{
+    if (hash) {
+        /* 標準入力 → 一時ファイル → ハッシュ確認 → 置き換え (確認時刻も更新) */
+        StrBuf path = {0}, tmp = {0};
+
+        script_device_path(cmd, &path);
+        sb_append_quoted(&tmp, path.data);
+        sb_puts(&tmp, ".$$");   /* 同時に書き込むプロセスと重ならない名前 (引用符の外で展開) */
+
+        sb_puts(sb, "mkdir -p ");
+        sb_append_quoted(sb, cmd->dir);
+        sb_appendf(sb, " && cat > %s && [ \"$(sha256sum < %s | cut -d' ' -f1)\" = %s ] && mv %s ",
+                   tmp.data, tmp.data, hash, tmp.data);
+        sb_append_quoted(sb, path.data);
+        sb_puts(sb, " && date +%s > ");
+        sb_append_quoted(sb, path.data);
+        sb_puts(sb, ".checked && ");
+        append_write_wrapper(sb, cmd, hash, ttl);
+        sb_appendf(sb, " || { rm -f %s; exit 1; }", tmp.data);
+        sb_free(&path);
+        sb_free(&tmp);
+    } else {
+        append_write_wrapper(sb, cmd, NULL, ttl);
+    }
+}
+
+/*
+ * リモートで実行するコマンド本体 (ssh の引数として渡す)
+ *
+ * hash あり: デバイス側の本体とラッパー (版と設定) がこの版であれば起動し、
+ *   そうでなければ何も実行せず SCRIPT_STALE_EXIT で終了する。
+ *   呼び出し側はスクリプトを送ってから再実行する (最新なら転送なし)。
+ *   スクリプト自身の終了コードが SCRIPT_STALE_EXIT と重ならないよう 1 に読み替える。
+ * hash なし: ラッパーが現在の形式・設定でなければ置き直してから起動
+ *   (本体の取得・期限の確認はラッパーが行う)
+ */
+void build_remote_command(const CommandDef *cmd, const char *hash, int ttl, int refresh, StrBuf *sb)
+{
+    if (hash) {
+        StrBuf path = {0};
+
+        script_device_path(cmd, &path);
+        sb_puts(sb, "[ \"$(sha256sum ");
+        sb_append_quoted(sb, path.data);
+        sb_appendf(sb, " 2>/dev/null | cut -d' ' -f1)\" = %s ] && grep -qx '%s %s' ",
+                   hash, SCRIPT_WRAPPER_TAG, hash);
+        sb_append_quoted(sb, cmd->bin);
+        sb_puts(sb, " 2>/dev/null && ");
+        append_wrapper_check(sb, cmd, ttl);
+        sb_appendf(sb, " || exit %d; OWRT_FRESH=1 ", SCRIPT_STALE_EXIT);
+        sb_append_quoted(sb, cmd->bin);
+        sb_appendf(sb, "; s=$?; [ $s -ne %d ] || s=1; exit $s", SCRIPT_STALE_EXIT);
+        sb_free(&path);
+    } else {
+        sb_appendf(sb, "{ grep -qs '^%s ' ", SCRIPT_WRAPPER_TAG);
+        sb_append_quoted(sb, cmd->bin);
+        sb_puts(sb, " && ");
+        append_wrapper_check(sb, cmd, ttl);
+        sb_puts(sb, "; } || ");
+        build_install_script(cmd, NULL, ttl, sb);
+        sb_puts(sb, refresh ? "; OWRT_REFRESH=1 " : "; ");
+        sb_append_quoted(sb, cmd->bin);
+    }
+}
+
+/* ================================================== */
+/* Output multiplexing                                */
+/* ================================================== */
+/*
+ * 並列に動く ssh (--fleet、依存グラフの手順) の出力をまとめる。
+ * 各ホストの出力はそのままホストごとのログへ流し、行に区切って
+ * まとめログ ("経過秒 名前 | 行") と、live ならコンソール ("[名前] 行") へ出す。
+ * 1ホストあたりのメモリは行の途中と最後の出力 (リングバッファ) の固定サイズで、
+ * スクリプトが何 MB 出力しても増えない。OUTPUT_LINE_MAX を超える行は分けて出す。
+ */
+static void output_mux_init(OutputMux *m, FILE *combined, int live)
+{
+    memset(m, 0, sizeof(*m));
+    mutex_init(&m->lock);
+    m->combined = combined;
+    m->live = live;
+    m->start_ms = now_ms();
+}
+
+static void output_mux_free(OutputMux *m)
+{
+    if (m->combined) fclose(m->combined);
+    m->combined = NULL;
+    mutex_destroy(&m->lock);
+}
+
+static void output_stream_init(OutputStream *s, OutputMux *m, const char *name, FILE *log)
+{
+    s->mux = m;
+    s->name = name;
+    s->log = log;
+    s->line_len = 0;
+    s->tail_pos = 0;
+    s->tail_wrapped = 0;
+}
+
+/* 行の途中を1行として出す */
+static void output_stream_flush(OutputStream *s)
+{
+    OutputMux *m = s->mux;
+
+    if (!s->line_len) return;
+    if (m && (m->combined || m->live)) {
+        mutex_lock(&m->lock);
+        if (m->combined) {
+            fprintf(m->combined, "%9.3f %s | %.*s\n", (double)(now_ms() - m->start_ms) / 1000.0,
+                    s->name, (int)s->line_len, s->line);
+        }
+        if (m->live) {
+            printf("[%s] %.*s\n", s->name, (int)s->line_len, s->line);
+            fflush(stdout);
+        }
+        mutex_unlock(&m->lock);
+    }
+    s->line_len = 0;
+}
+
+/* proc_output_fn: ProcOptions.on_output に渡す (ctx = OutputStream) */
+static void output_stream_feed(void *ctx, int stream, const char *data, size_t len)
+{
+    OutputStream *s = (OutputStream *)ctx;
+
+    (void)stream;
+    if (s->log) fwrite(data, 1, len, s->log);
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+
+        s->tail[s->tail_pos++] = c;
+        if (s->tail_pos == OUTPUT_TAIL_SIZE) {
+            s->tail_pos = 0;
+            s->tail_wrapped = 1;
+        }
+        if (c == '\r') continue;
+        if (c == '\n') {
+            output_stream_flush(s);
+            continue;
+        }
+        s->line[s->line_len++] = c;
+        if (s->line_len == OUTPUT_LINE_MAX) output_stream_flush(s);
+    }
+}
+
+/* 最後の出力から末尾 lines 行を複製して返す (出力なしは NULL) */
+static char *output_stream_tail(const OutputStream *s, int lines)
+{
+    size_t len = s->tail_wrapped ? OUTPUT_TAIL_SIZE : s->tail_pos;
+    size_t start = s->tail_wrapped ? s->tail_pos : 0;
+    char *buf = (char *)malloc(len + 1);
+    size_t n = 0, from = 0;
+
+    if (!buf) return NULL;
+    for (size_t i = 0; i < len; i++) {
+        char c = s->tail[(start + i) % OUTPUT_TAIL_SIZE];
+        if (c != '\r') buf[n++] = c;
+    }
+    while (n > 0 && buf[n - 1] == '\n') n--;
+    buf[n] = '\0';
+    if (n == 0) {
+        free(buf);
+        return NULL;
+    }
+    for (size_t i = n; i > 0; i--) {
+        if (buf[i - 1] == '\n' && --lines == 0) {
+            from = i;
+            break;
+        }
+    }
+    memmove(buf, buf + from, n - from + 1);
+    return buf;
+}
+
+/* ================================================== */
+/* Fleet mode (parallel execution)                    */
+/* ================================================== */
+/*
+ * 同じ [command.*] を複数ホストへ並列実行する。
+ * ワーカー数は fleet_concurrency で制限し、各ホストの出力は
+ * <APP_DATA_DIR>/fleet-logs/<日時>/<host>.log へ個別に、全ホスト分を combined.log へ行ごとに保存する。
+ * 非対話実行のため鍵認証のみ (BatchMode=yes) で接続する。
+ */
+typedef enum {
+    FLEET_PENDING = 0,
+    FLEET_OK,
+    FLEET_FAILED,
+    FLEET_SKIPPED
+} FleetStatus;
+
+typedef struct {
+    char host[64];
+    FleetStatus status;
+    int exit_code;
+    uint64_t start_ms;
+    uint64_t end_ms;
+    char note[64];
+    int provisioned;         /* --push-keys: 鍵が既に登録済みだった */
+    KeyType key_type;        /* --push-keys: このホストに使う鍵の種類 */
+    char *password;          /* --push-keys: 事前に入力したパスワード (使用後に消去) */
+    char *tail;              /* 失敗したホストの最後の出力 (OUTPUT_TAIL_LINES 行まで) */
+    char *report;            /* --snapshot / --drift: 前回からの変化 (ヒープ) */
+    int drift;               /* --snapshot / --drift: 変化したセクション数 */
+    size_t snap_fetched;     /* --snapshot / --drift: 受け取ったセクションのバイト数 */
+    size_t snap_total;       /* --snapshot / --drift: 全セクションのバイト数 */
+} FleetHost;
+
+typedef struct FleetRun FleetRun;
+struct FleetRun {
+    void (*job)(FleetRun *run, FleetHost *h);
+    const Config *cfg;
+    const char *sysroot;
+    const CommandDef *cmd;
+    const ScriptBlob *script;/* こちらで用意したスクリプト (data NULL = デバイス側で取得) */
+    const char *remote;      /* build_remote_command() の結果 */
+    const PushFile *push;    /* --push: 送るファイル */
+    const char *snapshot_stamp;  /* --snapshot: 記録する一覧の名前 (NULL = --drift、基準は変えない) */
+    char log_dir[512];
+    OutputMux out;           /* まとめログと --live の表示 */
+    FleetHost *hosts;
+    int count;
+    int next;
+    int done;
+    mutex_t lock;
+};
+
+static int add_fleet_host(FleetHost **hosts, int *count, int *cap, const char *name)
+{
+    if (*count >= *cap) {
+        int ncap = *cap ? *cap * 2 : 64;
+        FleetHost *n = (FleetHost *)realloc(*hosts, sizeof(FleetHost) * (size_t)ncap);
+        if (!n) return 0;
+        *hosts = n;
+        *cap = ncap;
+    }
+    FleetHost *h = &(*hosts)[(*count)++];
+    memset(h, 0, sizeof(*h));
+    snprintf(h->host, sizeof(h->host), "%s", name);
+    return 1;
+}
+
+/*
+ * ホスト一覧の読み込み
+ *   @<セレクター> (例: @site=tokyo,role=ap) → インベントリで選んだホスト
+ *   CIDR (例: 192.168.1.0/24) → 範囲をスキャンしSSH応答のあったホスト
+ *   それ以外 → 1行1ホストのファイル (# 以降はコメント)
+ */
+static int load_fleet_hosts(const Config *cfg, const char *spec, FleetHost **out)
+{
+    FleetHost *hosts = NULL;
+    int count = 0, cap = 0;
+    Subnet sn;
+
+    if (spec[0] == '@') {
+        Inventory inv;
+        HostRecord r;
+        char addr[64];
+        int *hits;
+
+        if (!inventory_open(&inv)) {
+            printf("[ERROR] Inventory is damaged or from another version.\n");
+            return -1;
+        }
+        uint64_t start = now_us();
+        int n = inventory_select(&inv, spec + 1, &hits);
+        uint64_t elapsed = now_us() - start;
+        if (n < 0) {
+            printf("[ERROR] Invalid selector: %s\n", spec + 1);
+            inventory_close(&inv);
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            inventory_hit(&inv, hits[i], &r);
+            inventory_address(&r, addr, sizeof(addr));
+            if (!add_fleet_host(&hosts, &count, &cap, addr)) break;
+        }
+        printf("Selected %d of %d inventory host(s) in %llu us\n", n, inventory_count(&inv),
+               (unsigned long long)elapsed);
+        free(hits);
+        inventory_close(&inv);
+    } else if (parse_cidr(spec, &sn)) {
+        int n = (sn.prefix >= 31) ? (1 << (32 - sn.prefix)) : (1 << (32 - sn.prefix)) - 2;
+        if (sn.prefix < 16) {
+            printf("[ERROR] Range too large (minimum /16): %s\n", spec);
+            return -1;
+        }
+        uint32_t *addrs = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)n);
+        ScanResult *results = (ScanResult *)calloc((size_t)n, sizeof(ScanResult));
+        if (!addrs || !results || !net_init()) {
+            free(addrs);
+            free(results);
+            return -1;
+        }
+        n = expand_subnet(&sn, addrs, n);
+        printf("Scanning %s for SSH devices...\n", spec);
+        int found = scan_hosts(addrs, n, cfg->ssh_port, cfg->scan_concurrency,
+                               cfg->scan_timeout_ms, results);
+        for (int i = 0; i < found; i++) {
+            char ip[32];
+            if (results[i].daemon == SSH_DAEMON_NONE) continue;
+            format_ipv4(results[i].addr, ip, sizeof(ip));
+            add_fleet_host(&hosts, &count, &cap, ip);
+        }
+        free(addrs);
+        free(results);
+    } else {
+        char line[MAX_LINE_LEN];
+        FILE *fp = fopen(spec, "r");
+        if (!fp) {
+            printf("[ERROR] Host list not found: %s\n", spec);
+            return -1;
+        }
+        while (fgets(line, sizeof(line), fp)) {
+            char *hash = strchr(line, '#');
+            if (hash) *hash = '\0';
+            trim(line);
+            line[strcspn(line, " \t")] = '\0';
+            if (line[0] == '\0') continue;
+            if (!add_fleet_host(&hosts, &count, &cap, line)) break;
+        }
+        fclose(fp);
+    }
+
+    *out = hosts;
+    return count;
+}
+
+/* ホストごとの出力をログファイルへ */
+/* 鍵認証のみ (BatchMode) で接続する ssh の引数 */
+static void fleet_ssh_args(const SshTarget *t, ArgList *a)
+{
+    ssh_build_args(t, a);
+    args_add(a, "-o");
+    args_add(a, "BatchMode=yes");
+    args_add(a, "-o");
+    args_addf(a, "ConnectTimeout=%d", FLEET_CONNECT_TIMEOUT);
+    ssh_add_destination(t, a);
+}
+
+/* 期限までの残り (ms)。期限なしは 0、過ぎていれば 1 (すぐに打ち切る) */
+static int fleet_time_left(uint64_t deadline)
+{
+    uint64_t now = now_ms();
+
+    if (!deadline) return 0;
+    return (deadline > now) ? (int)(deadline - now) : 1;
+}
+
+static void fleet_run_host(FleetRun *run, FleetHost *h)
+{
+    char key_path[512], pub_path[512], ssh_dir[512];
+    char file_name[64], log_path[1024];
+    SshTarget t;
+    ArgList a = {0};
+    ProcOptions opt;
+    ProcResult res;
+    OutputStream out;
+    FILE *log;
+
+    h->start_ms = now_ms();
+    if (!key_for_host(run->cfg, h->host, &h->key_type, key_path, pub_path, ssh_dir, sizeof(key_path))) {
+        h->status = FLEET_SKIPPED;
+        h->exit_code = -1;
+        snprintf(h->note, sizeof(h->note), "no SSH key (connect once first)");
+        h->end_ms = now_ms();
+        return;
+    }
+
+    safe_file_name(h->host, file_name, sizeof(file_name));
+    snprintf(log_path, sizeof(log_path), "%s%c%s.log", run->log_dir, PATH_SEP, file_name);
+    log = fopen(log_path, "wb");
+    if (!log) {
+        h->status = FLEET_FAILED;
+        h->exit_code = -1;
+        snprintf(h->note, sizeof(h->note), "cannot write log file");
+        h->end_ms = now_ms();
+        return;
+    }
+
+    output_stream_init(&out, &run->out, h->host, log);
+
+    /* ホストごとに1回きりの接続なので ControlMaster は使わない */
+    memset(&t, 0, sizeof(t));
+    t.sysroot = run->sysroot;
+    t.user = run->cfg->ssh_user;
+    t.host = h->host;
+    t.key_path = key_path;
+    t.key_type = h->key_type;
+    t.cfg = run->cfg;
+
+    /* 応答しなくなったホストでワーカーが止まらないよう、ホストごとの持ち時間で打ち切る */
+    uint64_t deadline = run->cfg->fleet_timeout ? h->start_ms + (uint64_t)run->cfg->fleet_timeout * 1000 : 0;
+
+    for (int attempt = 0; ; attempt++) {
+        fleet_ssh_args(&t, &a);
+        args_add(&a, run->remote);
+
+        memset(&opt, 0, sizeof(opt));
+        opt.in = PROC_IN_NULL;
+        opt.merge_stderr = 1;
+        opt.on_output = output_stream_feed;
+        opt.ctx = &out;
+        opt.timeout_ms = fleet_time_left(deadline);
+        proc_run((const char *const *)a.argv, &opt, &res);
+        args_free(&a);
+        proc_result_free(&res);
+
+        if (res.timed_out || !run->script->data || res.exit_code != SCRIPT_STALE_EXIT || attempt > 0) break;
+
+        /* デバイス側の版が古い: 送ってから再実行 */
+        memset(&opt, 0, sizeof(opt));
+        opt.merge_stderr = 1;
+        opt.on_output = output_stream_feed;
+        opt.ctx = &out;
+        opt.timeout_ms = fleet_time_left(deadline);
+        fleet_ssh_args(&t, &a);
+        if (!script_push(&a, run->cmd, run->script, run->cfg->script_ttl, &opt)) {
+            res.exit_code = 1;
+            snprintf(h->note, sizeof(h->note), "script install failed");
+            break;
+        }
+        snprintf(h->note, sizeof(h->note), "script sent (%zu bytes)", run->script->len);
+    }
+    output_stream_flush(&out);
+    fclose(log);
+
+    h->exit_code = res.exit_code;
+    h->status = (h->exit_code == 0 && !res.timed_out) ? FLEET_OK : FLEET_FAILED;
+    if (h->status == FLEET_FAILED) h->tail = output_stream_tail(&out, OUTPUT_TAIL_LINES);
+    if (res.timed_out) snprintf(h->note, sizeof(h->note), "timed out");
+    else if (h->exit_code == 255) snprintf(h->note, sizeof(h->note), "ssh connection/auth failed");
+    else if (h->exit_code < 0) snprintf(h->note, sizeof(h->note), "ssh could not be started");
+    else key_type_remember(run->cfg, h->host, NULL, h->key_type);
+    h->end_ms = now_ms();
+}
+
+static const char *fleet_status_name(FleetStatus s)
+{
+    switch (s) {
+    case FLEET_OK:      return "OK";
+    case FLEET_SKIPPED: return "SKIPPED";
+    case FLEET_PENDING: return "PENDING";
+    default:            return "FAILED";
+    }
+}
+
+static thread_ret_t THREAD_CC fleet_worker(void *arg)
+{
+    FleetRun *run = (FleetRun *)arg;
+
+    trace_thread_name("fleet worker");
+    for (;;) {
+        mutex_lock(&run->lock);
+        int i = run->next++;
+        mutex_unlock(&run->lock);
+        if (i >= run->count) break;
+
+        FleetHost *h = &run->hosts[i];
+        uint64_t start_us = trace_enabled() ? now_us() : 0;
+        run->job(run, h);
+        if (start_us) {
+            trace_complete(h->host, "host", start_us,
+                h->status == FLEET_OK ? "\"status\":\"ok\"" :
+                h->status == FLEET_SKIPPED ? "\"status\":\"skipped\"" :
+                h->status == FLEET_PENDING ? "\"status\":\"pending\"" : "\"status\":\"failed\"");
+        }
+
+        mutex_lock(&run->lock);
+        run->done++;
+        printf("[%*d/%d] %-16s %s (%.1f s)%s%s\n",
+            run->count >= 100 ? 3 : 2, run->done, run->count, h->host,
+            fleet_status_name(h->status), (double)(h->end_ms - h->start_ms) / 1000.0,
+            h->note[0] ? "  " : "", h->note);
+        fflush(stdout);
+        mutex_unlock(&run->lock);
+    }
+    return 0;
+}
+
+/* run->job を fleet_concurrency 本のワーカーで全ホストに実行 */
+static void fleet_run_jobs(FleetRun *run, int workers)
+{
+    thread_t *threads = (thread_t *)calloc((size_t)workers, sizeof(thread_t));
+    int started = 0;
+
+    run->next = 0;
+    run->done = 0;
+    for (int i = 0; threads && i < workers; i++) {
+        if (thread_start(&threads[started], fleet_worker, run)) started++;
+    }
+    if (started == 0) fleet_worker(run);
+    for (int i = 0; i < started; i++) thread_join(threads[i]);
+    free(threads);
+}
+
+/* 結果一覧を表示し、失敗・スキップの数を返す */
+static int fleet_print_summary(const FleetRun *run, const char *title, uint64_t total)
+{
+    int ok = 0, failed = 0, skipped = 0;
+    uint64_t slowest = 0;
+
+    printf("\n========================================\n");
+    printf("%s\n", title);
+    printf("========================================\n");
+    printf("  %-16s %-8s %5s %9s\n", "HOST", "RESULT", "EXIT", "TIME");
+    for (int i = 0; i < run->count; i++) {
+        const FleetHost *h = &run->hosts[i];
+        uint64_t dur = h->end_ms - h->start_ms;
+
+        if (h->status == FLEET_OK) ok++;
+        else if (h->status == FLEET_SKIPPED) skipped++;
+        else failed++;
+        if (dur > slowest) slowest = dur;
+
+        if (h->status == FLEET_SKIPPED) {
+            printf("  %-16s %-8s %5s %9s  %s\n", h->host, "SKIPPED", "-", "-", h->note);
+        } else {
+            printf("  %-16s %-8s %5d %7.1f s%s%s\n", h->host, h->status == FLEET_OK ? "OK" : "FAILED",
+                h->exit_code, (double)dur / 1000.0, h->note[0] ? "  " : "", h->note);
+        }
+    }
+    printf("----------------------------------------\n");
+    printf("OK %d / FAILED %d / SKIPPED %d\n", ok, failed, skipped);
+    printf("Total %.1f s (slowest host %.1f s)\n", (double)total / 1000.0, (double)slowest / 1000.0);
+
+    /* 失敗したホストの最後の出力 (全体はログに) */
+    for (int i = 0, shown = 0; i < run->count; i++) {
+        const FleetHost *h = &run->hosts[i];
+        const char *p = h->tail;
+
+        if (!p) continue;
+        if (shown++ == 0) printf("\nLast output of failed hosts:\n");
+        printf("  [%s]\n", h->host);
+        while (*p) {
+            size_t n = strcspn(p, "\n");
+            printf("    %.*s\n", (int)n, p);
+            p += n + (p[n] ? 1 : 0);
+        }
+    }
+    return failed + skipped;
+}
+
+/* 成功したホストの最終接続時刻 (with_key なら登録した鍵の種類も) をインベントリに記録 */
+static void fleet_remember_hosts(const FleetRun *run, int with_key)
+{
+    Inventory inv;
+
+    if (!inventory_open(&inv)) return;
+    for (int i = 0; i < run->count; i++) {
+        const FleetHost *h = &run->hosts[i];
+        if (h->status != FLEET_OK) continue;
+        inventory_touch(&inv, h->host, with_key ? KEY_TYPE_NAMES[h->key_type] : NULL, NULL);
+    }
+    inventory_close(&inv);
+}
+
+/*
+ * ログの圧縮 (fleet_log_compress = on): 実行後にログのディレクトリを
+ * <日時>.tar.gz にまとめて元のファイルを消す (Windows 10 以降は System32 の tar)。
+ * まとめられなかった場合はそのまま残す。
+ */
+static int fleet_compress_logs(const FleetRun *run, const char *sysroot, char *archive, size_t size)
+{
+    char tar[512];
+    char name[64], path[1024];
+    ProcOptions opt;
+    ProcResult res;
+
+#ifdef _WIN32
+    snprintf(tar, sizeof(tar), "%s\\System32\\tar.exe", sysroot);
+#else
+    (void)sysroot;
+    snprintf(tar, sizeof(tar), "tar");
+#endif
+    snprintf(archive, size, "%s.tar.gz", run->log_dir);
+    const char *argv[] = { tar, "-czf", archive, "-C", run->log_dir, ".", NULL };
+
+    memset(&opt, 0, sizeof(opt));
+    opt.in = PROC_IN_NULL;
+    opt.merge_stderr = 1;
+    proc_run(argv, &opt, &res);
+    proc_result_free(&res);
+    if (res.exit_code != 0) {
+        remove(archive);
+        return 0;
+    }
+    for (int i = 0; i < run->count; i++) {
+        safe_file_name(run->hosts[i].host, name, sizeof(name));
+        snprintf(path, sizeof(path), "%s%c%s.log", run->log_dir, PATH_SEP, name);
+        remove(path);
+    }
+    snprintf(path, sizeof(path), "%s%c%s", run->log_dir, PATH_SEP, FLEET_COMBINED_LOG);
+    remove(path);
+    remove_dir(run->log_dir);
+    return 1;
+}
+
+int run_fleet(const Config *cfg, const char *sysroot, const char *hosts_spec, const char *cmd_name,
+              int refresh, int live)
+{
+    FleetRun run;
+    CommandDef *cmd = find_command((Config *)cfg, cmd_name);
+    ScriptBlob script;
+    StrBuf remote = {0};
+    char stamp[32];
+    char log_root[480];
+    char combined[1024];
+    char archive[560];
+    time_t t = time(NULL);
+    char title[MAX_VALUE_LEN];
+
+    if (!cmd) {
+        printf("[ERROR] Unknown command: %s\n", cmd_name);
+        return 1;
+    }
+    if (cmd->steps[0]) {
+        printf("[ERROR] '%s' is a sequence; fleet mode runs a single command.\n", cmd_name);
+        return 1;
+    }
+    if (cmd->url[0] == '\0') {
+        printf("[ERROR] Command '%s' is an interactive SSH session; fleet mode needs a url.\n", cmd_name);
+        return 1;
+    }
+
+    memset(&run, 0, sizeof(run));
+    run.count = load_fleet_hosts(cfg, hosts_spec, &run.hosts);
+    if (run.count < 0) return 1;
+    if (run.count == 0) {
+        printf("[ERROR] No hosts in: %s\n", hosts_spec);
+        free(run.hosts);
+        return 1;
+    }
+
+    /* スクリプトは1回だけ取得し、全ホストで共有する */
+    script_cache_get(cfg, cmd, sysroot, refresh, &script);
+    build_remote_command(cmd, script.data ? script.hash : NULL, cfg->script_ttl, refresh, &remote);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+    /* カレントディレクトリ (インストール先のこともある) ではなくユーザーのデータ領域に置く */
+    app_data_dir(FLEET_LOG_ROOT, log_root, sizeof(log_root));
+    snprintf(run.log_dir, sizeof(run.log_dir), "%s%c%s", log_root, PATH_SEP, stamp);
+    make_dir(run.log_dir);
+    snprintf(combined, sizeof(combined), "%s%c%s", run.log_dir, PATH_SEP, FLEET_COMBINED_LOG);
+    output_mux_init(&run.out, fopen(combined, "wb"), live);
+
+    run.job = fleet_run_host;
+    run.cfg = cfg;
+    run.sysroot = sysroot;
+    run.cmd = cmd;
+    run.script = &script;
+    run.remote = remote.data;
+    mutex_init(&run.lock);
+
+    int workers = cfg->fleet_concurrency;
+    if (workers > run.count) workers = run.count;
+
+    printf("Running '%s' on %d host(s), %d at a time...\n", cmd->name, run.count, workers);
+    if (script.data) {
+        printf("Script: %.12s (%s, %zu bytes)\n", script.hash, script.source, script.len);
+    }
+    printf("\n");
+    uint64_t start = now_ms();
+    fleet_run_jobs(&run, workers);
+    uint64_t total = now_ms() - start;
+
+    snprintf(title, sizeof(title), "Fleet summary: %s", cmd->name);
+    int bad = fleet_print_summary(&run, title, total);
+    fleet_remember_hosts(&run, 0);
+    output_mux_free(&run.out);
+    if (cfg->fleet_log_compress && fleet_compress_logs(&run, sysroot, archive, sizeof(archive))) {
+        printf("Logs: %s (%s inside)\n", archive, FLEET_COMBINED_LOG);
+    } else {
+        printf("Logs: %s%c (all hosts: %s)\n", run.log_dir, PATH_SEP, FLEET_COMBINED_LOG);
+    }
+
+    mutex_destroy(&run.lock);
+    for (int i = 0; i < run.count; i++) free(run.hosts[i].tail);
+    free(run.hosts);
+    script_blob_free(&script);
+    sb_free(&remote);
+    return bad == 0 ? 0 : 1;
+}
+
+/* ================================================== */
+/* Key distribution (--push-keys)                     */
+/* ================================================== */
+/*
+ * 公開鍵をホスト一覧へまとめて登録する。
+ *   1. 全ホストを並列に鍵認証で確認。通ったホストは登録済みとして扱う
+ *      (追加の接続はしない)。
+ *   2. 残りのホストのパスワードを先にまとめて入力してもらい、
+ *      並列に KEY_INSTALL_SCRIPT を実行する。ssh のパスワード要求には
+ *      SSH_ASKPASS として起動された自分自身が答える (askpass_reply)。
+ * OpenSSH 8.4 未満は SSH_ASKPASS_REQUIRE が無いため、1台ずつ ssh に直接入力する。
+ */
+
+/* SSH_ASKPASS として起動されたか */
+static int is_askpass_call(void)
+{
+    char flag[100];
+    get_env(ASKPASS_FLAG_ENV, flag, sizeof(flag));
+    return flag[0] != '\0';
+}
+
+/*
+ * ssh のプロンプト (argv[1]) に答える。パスワード以外の質問には答えない。
+ * パスワードは起動元の AskpassServer からトークンと引き換えに受け取る。
+ */
+static int askpass_reply(int argc, char *argv[])
+{
+    char flag[100], password[256];
+    const char *prompt = (argc > 1) ? argv[1] : "";
+    const char *token;
+    struct sockaddr_in sa;
+    size_t used = 0;
+    sock_t fd;
+
+    if (!strstr(prompt, "assword")) return 1;
+    get_env(ASKPASS_FLAG_ENV, flag, sizeof(flag));
+    token = strchr(flag, ':');
+    if (!token || !net_init()) return 1;
+    token++;
+
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == SOCK_INVALID) return 1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((unsigned short)atoi(flag));
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        send(fd, token, (int)strlen(token), 0) < 0 || send(fd, "\n", 1, 0) < 0) {
+        sock_close(fd);
+        return 1;
+    }
+    for (;;) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (sock_poll(&pfd, 1, ASKPASS_REPLY_TIMEOUT_MS) <= 0) break;
+        int n = (int)recv(fd, password + used, (int)(sizeof(password) - 1 - used), 0);
+        if (n <= 0) break;
+        used += (size_t)n;
+        if (used >= sizeof(password) - 1) break;
+    }
+    sock_close(fd);
+    password[used] = '\0';
+    if (!used || password[used - 1] != '\n') {
+        wipe_secret(password, sizeof(password));
+        return 1;
+    }
+    printf("%s", password);
+    wipe_secret(password, sizeof(password));
+    return 0;
+}
+
+/* ssh -V から OpenSSH のバージョン (major * 100 + minor)。不明なら 0 */
+static int ssh_client_version(const char *sysroot)
+{
+    char ssh_exe[512];
+    ProcOptions opt;
+    ProcResult res;
+    int major = 0, minor = 0;
+
+    get_ssh_tool(sysroot, "ssh", ssh_exe, sizeof(ssh_exe));
+    const char *argv[] = { ssh_exe, "-V", NULL };
+    memset(&opt, 0, sizeof(opt));
+    opt.in = PROC_IN_NULL;
+    opt.merge_stderr = 1;
+    opt.timeout_ms = 5000;
+    proc_run(argv, &opt, &res);
+
+    const char *p = res.out.data ? strstr(res.out.data, "OpenSSH_") : NULL;
+    if (p) {
+        p += strlen("OpenSSH_");
+        if (strncmp(p, "for_Windows_", 12) == 0) p += 12;
+        if (sscanf(p, "%d.%d", &major, &minor) != 2) major = minor = 0;
+    }
+    proc_result_free(&res);
+    return major * 100 + minor;
+}
+
+#define HOST_CHANGED_NOTE "host key changed (run interactively to accept)"
+
+/* KEY_INSTALL_SCRIPT の出力から結果を h->note へ。登録できていれば 1 */
+static int key_install_result(const char *out, FleetHost *h)
+{
+    if (!out) out = "";
+    if (strstr(out, "key added:")) {
+        snprintf(h->note, sizeof(h->note), "key added");
+    } else if (strstr(out, "(duplicates removed)")) {
+        snprintf(h->note, sizeof(h->note), "already provisioned, duplicates removed");
+        h->provisioned = 1;
+    } else if (strstr(out, "key present:")) {
+        snprintf(h->note, sizeof(h->note), "already provisioned");
+        h->provisioned = 1;
+    } else {
+        const char *err = strstr(out, "ERROR: ");
+        if (host_key_changed(out)) snprintf(h->note, sizeof(h->note), HOST_CHANGED_NOTE);
+        else if (strstr(out, "Permission denied")) snprintf(h->note, sizeof(h->note), "wrong password");
+        else first_line(err ? err + 7 : out, h->note, sizeof(h->note));
+        return 0;
+    }
+    return 1;
+}
+
+/* KEY_INSTALL_SCRIPT を実行 (t->key_path が NULL なら h->password で認証) */
+static int key_install(FleetHost *h, const SshTarget *t, const char *pub_path)
+{
+    ProcResult res;
+
+    h->exit_code = key_install_quiet(t, pub_path, h->password, &res);
+    int ok = key_install_result(res.out.data, h);
+    if (res.timed_out) snprintf(h->note, sizeof(h->note), "timed out");
+    proc_result_free(&res);
+    return ok && h->exit_code == 0;
+}
+
+static void keys_target(FleetRun *run, FleetHost *h, SshTarget *t, char *key_path, char *pub_path,
+                        char *ssh_dir, size_t size)
+{
+    get_key_paths(run->cfg, h->host, h->key_type, key_path, pub_path, ssh_dir, size);
+    memset(t, 0, sizeof(*t));
+    t->sysroot = run->sysroot;
+    t->user = run->cfg->ssh_user;
+    t->host = h->host;
+    t->key_path = key_path;
+    t->key_type = h->key_type;
+    t->cfg = run->cfg;
+}
+
+/* 鍵が無ければ生成 (共有鍵は全ワーカーで1回だけ) */
+static int keys_ensure_key(FleetRun *run, FleetHost *h, const char *key_path, const char *ssh_dir)
+{
+    ProcResult res;
+    int ok = 1;
+
+    if (run->cfg->key_shared) mutex_lock(&run->lock);
+    if (!file_exists(key_path)) {
+        ok = (run_keygen(run->sysroot, h->key_type, key_path, ssh_dir, NULL, &res) == 0);
+        proc_result_free(&res);
+    }
+    if (run->cfg->key_shared) mutex_unlock(&run->lock);
+    if (!ok) {
+        h->status = FLEET_FAILED;
+        h->exit_code = 1;
+        snprintf(h->note, sizeof(h->note), "ssh-keygen failed");
+    }
+    return ok;
+}
+
+/* 1段目: 鍵の用意と鍵認証の確認。通れば重複を整理して完了、通らなければ PENDING */
+static void keys_probe_host(FleetRun *run, FleetHost *h)
+{
+    char key_path[512], pub_path[512], ssh_dir[512];
+    char banner[128];
+    SshTarget t;
+    DeviceInfo device;
+
+    h->start_ms = now_ms();
+    device_lookup(run->cfg, h->host, &device);
+    int known = (key_type_from_name(device.key_type) >= 0);
+    if (!known && probe_ssh_banner(run->cfg, h->host, banner, sizeof(banner))) {
+        device_set_banner(&device, banner);
+    }
+    h->key_type = key_choose(run->cfg, h->host, device.banner[0] ? device.banner : NULL);
+    keys_target(run, h, &t, key_path, pub_path, ssh_dir, sizeof(key_path));
+    t.device = &device;
+    if (!keys_ensure_key(run, h, key_path, ssh_dir)) {
+        h->end_ms = now_ms();
+        return;
+    }
+
+    AuthResult auth = test_key_auth(&t, h->note, sizeof(h->note));
+    if (auth == AUTH_DENIED && !known) {
+        auth = key_migrate_legacy(&t, key_path, pub_path, sizeof(key_path));
+        h->key_type = t.key_type;
+    }
+    switch (auth) {
+    case AUTH_OK:
+        /* 鍵が通った時点で登録済み (重複の整理のためだけに接続し直さない) */
+        key_type_remember(run->cfg, h->host, &device, h->key_type);
+        h->status = FLEET_OK;
+        h->exit_code = 0;
+        h->provisioned = 1;
+        snprintf(h->note, sizeof(h->note), "already provisioned");
+        break;
+    case AUTH_DENIED:
+        h->status = FLEET_PENDING;
+        h->exit_code = 0;
+        snprintf(h->note, sizeof(h->note), "password needed");
+        break;
+    case AUTH_HOST_CHANGED:
+        h->status = FLEET_FAILED;
+        h->exit_code = 255;
+        snprintf(h->note, sizeof(h->note), HOST_CHANGED_NOTE);
+        break;
+    default:
+        h->status = FLEET_FAILED;
+        h->exit_code = 255;
+        break;
+    }
+    h->end_ms = now_ms();
+}
+
+/* パスワード認証で h->key_type の鍵を登録し、鍵認証が通るか確認 */
+static AuthResult keys_push_one(FleetRun *run, FleetHost *h)
+{
+    char key_path[512], pub_path[512], ssh_dir[512];
+    SshTarget t;
+    DeviceInfo device;
+    AuthResult auth;
+
+    keys_target(run, h, &t, key_path, pub_path, ssh_dir, sizeof(key_path));
+    device_lookup(run->cfg, h->host, &device);
+    t.device = &device;
+    if (!keys_ensure_key(run, h, key_path, ssh_dir)) return AUTH_UNREACHABLE;
+    t.key_path = NULL;
+    if (!key_install(h, &t, pub_path)) return AUTH_UNREACHABLE;
+    t.key_path = key_path;
+    auth = test_key_auth(&t, NULL, 0);
+    if (auth == AUTH_OK) key_type_remember(run->cfg, h->host, &device, h->key_type);
+    return auth;
+}
+
+/* 2段目: パスワード認証で登録。ed25519 が受け付けられなければ RSA で登録し直す */
+static void keys_push_host(FleetRun *run, FleetHost *h)
+{
+    h->start_ms = now_ms();
+    h->status = FLEET_FAILED;
+
+    AuthResult auth = keys_push_one(run, h);
+    if (auth == AUTH_DENIED && h->key_type != KEY_RSA) {
+        h->key_type = KEY_RSA;
+        auth = keys_push_one(run, h);
+        if (auth == AUTH_OK) snprintf(h->note, sizeof(h->note), "key added (rsa, no ed25519 support)");
+    }
+    if (auth == AUTH_OK) {
+        h->status = FLEET_OK;
+    } else if (auth == AUTH_DENIED) {
+        snprintf(h->note, sizeof(h->note), "key written but not accepted");
+    }
+    h->end_ms = now_ms();
+}
+
+/* PENDING のホストのパスワードを先に入力してもらう */
+static void keys_ask_passwords(const Config *cfg, FleetHost *hosts, int count, int pending)
+{
+    char password[256];
+    char answer[16] = {0};
+    int same = 1;
+
+    if (pending > 1) {
+        printf("Use the same %s password for all %d hosts? [Y/n]: ", cfg->ssh_user, pending);
+        fflush(stdout);
+        if (fgets(answer, sizeof(answer), stdin) && (answer[0] == 'n' || answer[0] == 'N')) same = 0;
+    }
+    if (same) {
+        if (pending > 1) printf("Password for %s (%d hosts): ", cfg->ssh_user, pending);
+        else printf("Password for %s@%s: ", cfg->ssh_user, hosts[0].host);
+        fflush(stdout);
+        read_secret(password, sizeof(password));
+    }
+    for (int i = 0; i < count; i++) {
+        if (hosts[i].status != FLEET_PENDING) continue;
+        if (!same) {
+            printf("Password for %s@%s: ", cfg->ssh_user, hosts[i].host);
+            fflush(stdout);
+            read_secret(password, sizeof(password));
+        }
+        hosts[i].password = strdup(password);
+        if (!same) wipe_secret(password, sizeof(password));
+    }
+    wipe_secret(password, sizeof(password));
+}
+
+static void keys_forget_passwords(FleetHost *hosts, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (!hosts[i].password) continue;
+        wipe_secret(hosts[i].password, strlen(hosts[i].password));
+        free(hosts[i].password);
+        hosts[i].password = NULL;
+    }
+}
+
+int run_push_keys(const Config *cfg, const char *sysroot, const char *hosts_spec)
+{
+    FleetRun run;
+    FleetRun push;
+    int pending = 0, provisioned = 0;
+    uint64_t prompt_ms = 0;
+
+    memset(&run, 0, sizeof(run));
+    run.count = load_fleet_hosts(cfg, hosts_spec, &run.hosts);
+    if (run.count < 0) return 1;
+    if (run.count == 0) {
+        printf("[ERROR] No hosts in: %s\n", hosts_spec);
+        free(run.hosts);
+        return 1;
+    }
+    run.job = keys_probe_host;
+    run.cfg = cfg;
+    run.sysroot = sysroot;
+    mutex_init(&run.lock);
+
+    int workers = cfg->fleet_concurrency;
+    if (workers > run.count) workers = run.count;
+
+    printf("Checking keys on %d host(s), %d at a time...\n\n", run.count, workers);
+    uint64_t start = now_ms();
+    fleet_run_jobs(&run, workers);
+
+    /* パスワードが必要なホストだけを集めて2段目へ */
+    for (int i = 0; i < run.count; i++) {
+        if (run.hosts[i].status == FLEET_PENDING) pending++;
+    }
+    if (pending > 0) {
+        memset(&push, 0, sizeof(push));
+        push.hosts = (FleetHost *)malloc(sizeof(FleetHost) * (size_t)pending);
+        for (int i = 0; push.hosts && i < run.count; i++) {
+            if (run.hosts[i].status == FLEET_PENDING) push.hosts[push.count++] = run.hosts[i];
+        }
+    }
+    if (pending > 0 && push.hosts) {
+        printf("\n%d host(s) need the %s password to register the key.\n", pending, cfg->ssh_user);
+
+        if (ssh_client_version(sysroot) >= ASKPASS_MIN_SSH_VERSION) {
+            uint64_t prompt_start = now_ms();
+            keys_ask_passwords(cfg, push.hosts, push.count, pending);
+            prompt_ms = now_ms() - prompt_start;
+            push.job = keys_push_host;
+            push.cfg = cfg;
+            push.sysroot = sysroot;
+            mutex_init(&push.lock);
+            printf("\nRegistering keys on %d host(s)...\n\n", push.count);
+            fleet_run_jobs(&push, workers < push.count ? workers : push.count);
+            mutex_destroy(&push.lock);
+            keys_forget_passwords(push.hosts, push.count);
+        } else {
+            /* 古い ssh: パスワードは ssh に直接入力 (1台ずつ) */
+            printf("This ssh client cannot take passwords in advance; you will be asked per host.\n");
+            for (int i = 0; i < push.count; i++) {
+                FleetHost *h = &push.hosts[i];
+                char key_path[512], pub_path[512], ssh_dir[512];
+                SshTarget t;
+                AuthResult auth = AUTH_DENIED;
+
+                printf("\n--- %s ---\n", h->host);
+                h->start_ms = now_ms();
+                h->status = FLEET_FAILED;
+                h->exit_code = 1;
+                snprintf(h->note, sizeof(h->note), "key not registered");
+                for (int attempt = 0; attempt < 2 && auth == AUTH_DENIED; attempt++) {
+                    if (attempt > 0) {
+                        if (h->key_type == KEY_RSA) break;
+                        printf("The device did not accept the ed25519 key; registering an RSA key.\n");
+                        h->key_type = KEY_RSA;
+                    }
+                    keys_target(&run, h, &t, key_path, pub_path, ssh_dir, sizeof(key_path));
+                    if (!keys_ensure_key(&run, h, key_path, ssh_dir)) break;
+                    if (!send_public_key(&t, pub_path)) break;
+                    auth = test_key_auth(&t, NULL, 0);
+                }
+                if (auth == AUTH_OK) {
+                    key_type_remember(cfg, h->host, NULL, h->key_type);
+                    h->status = FLEET_OK;
+                    h->exit_code = 0;
+                    snprintf(h->note, sizeof(h->note), "key added");
+                }
+                h->end_ms = now_ms();
+            }
+        }
+
+        for (int i = 0, j = 0; i < run.count; i++) {
+            if (run.hosts[i].status == FLEET_PENDING) run.hosts[i] = push.hosts[j++];
+        }
+        free(push.hosts);
+    }
+    /* パスワード入力の待ち時間は合計に含めない */
+    uint64_t total = now_ms() - start - prompt_ms;
+
+    int bad = fleet_print_summary(&run, "Key distribution summary", total);
+    fleet_remember_hosts(&run, 1);
+    for (int i = 0; i < run.count; i++) {
+        if (run.hosts[i].provisioned) provisioned++;
+    }
+    printf("Already provisioned: %d of %d\n", provisioned, run.count);
+
+    mutex_destroy(&run.lock);
+    free(run.hosts);
+    return bad == 0 ? 0 : 1;
+}
+
+/* ================================================== */
+/* File push (--push)                                 */
+/* ================================================== */
+/*
+ * ローカルのファイル (.ipk・設定一式など) をデバイスへ送る。
+ *   1. PUSH_CHUNK_SIZE ごとに SHA-256 を計算する
+ *   2. 送り先のハッシュと、送り先の隣の途中ファイル (<送り先>.owc-<ハッシュ先頭>) の
+ *      チャンクごとのハッシュを1回の ssh で受け取る。送り先が既に同じ内容なら何もしない
+ *   3. 途中ファイルの先頭から正しいチャンクが続く所までを残して切り詰め、
+ *      残りのチャンクを1回の ssh でまとめて流して途中ファイルに追記する
+ *      (チャンクごとの接続や往復は無い)
+ *   4. 全体のハッシュを確かめ、mv で送り先に置き換える
+ * 途中ファイルは送り先と同じファイルシステムに置くので、/tmp (RAM) に2倍の容量は要らず、
+ * 置き換えはコピーなしの rename になる。フラッシュ上に残るため、回線が切れても
+ * デバイスが再起動しても、次回は届いた所から再開する。切れた場合は PUSH_RETRIES 回まで
+ * 調べ直して再開する。--compress は ssh の圧縮 (Compression=yes) を使う。
+ * デバイス側は busybox の sha256sum / dd / cat / mv だけで動く。
+ */
+typedef struct {
+    const PushFile *file;
+    const SshTarget *t;
+    char partial[600];       /* デバイス側の途中ファイル */
+    int resume;              /* 途中ファイルの先頭から正しく揃っているチャンク数 */
+    int sent;
+    uint64_t bytes;          /* 今回送ったバイト数 */
+    char error[128];
+} PushJob;
+
+/* local を読み込み、チャンクごとのハッシュを計算する。remote が '/' で終わればファイル名を補う */
+int push_file_load(const char *local, const char *remote, int compress, PushFile *f)
+{
+    const char *base = local;
+
+    memset(f, 0, sizeof(*f));
+    for (const char *p = local; *p; p++) {
+        if (*p == '/' || *p == '\\') base = p + 1;
+    }
+    if (remote[0] == '\0' || remote[strlen(remote) - 1] == '/') {
+        snprintf(f->remote, sizeof(f->remote), "%s%s", remote[0] ? remote : "/tmp/", base);
+    } else {
+        snprintf(f->remote, sizeof(f->remote), "%s", remote);
+    }
+    f->local = local;
+    f->compress = compress;
+
+    f->data = (const char *)map_file(local, &f->len);
+    if (!f->data && !file_exists(local)) return 0;
+    if (!f->data) f->len = 0;    /* 空のファイル */
+
+    f->chunk_count = (int)((f->len + PUSH_CHUNK_SIZE - 1) / PUSH_CHUNK_SIZE);
+    f->chunk_hash = (char (*)[65])calloc((size_t)f->chunk_count + 1, 65);
+    if (!f->chunk_hash) {
+        push_file_free(f);
+        return 0;
+    }
+    for (int i = 0; i < f->chunk_count; i++) {
+        size_t off = (size_t)i * PUSH_CHUNK_SIZE;
+        size_t n = (f->len - off < PUSH_CHUNK_SIZE) ? f->len - off : PUSH_CHUNK_SIZE;
+        sha256_hex(f->data + off, n, f->chunk_hash[i]);
+    }
+    sha256_hex(f->data ? f->data : "", f->len, f->hash);
+    return 1;
+}
+
+void push_file_free(PushFile *f)
+{
+    if (f->data) unmap_file(f->data, f->len);
+    free(f->chunk_hash);
+    memset(f, 0, sizeof(*f));
+}
+
+/* --compress: 記録済みの選択より前に付ける (ssh は最初に指定された値を使う) */
+static void push_ssh_args(const PushJob *job, ArgList *a)
+{
+    SshTarget t = *job->t;
+    DeviceInfo d;
+
+    if (job->file->compress) {
+        if (t.device) d = *t.device;
+        else memset(&d, 0, sizeof(d));
+        snprintf(d.compression, sizeof(d.compression), "yes");
+        t.device = &d;
+    }
+    ssh_build_args(&t, a);
+    args_add(a, "-o");
+    args_add(a, "BatchMode=yes");
+    args_add(a, "-o");
+    args_addf(a, "ConnectTimeout=%d", FLEET_CONNECT_TIMEOUT);
+    ssh_add_destination(&t, a);
+}
+
+static int push_ssh(const PushJob *job, const char *remote, const char *data, size_t len, int timeout_ms,
+                    ProcResult *res)
+{
+    ArgList a = {0};
+    ProcOptions opt;
+
+    push_ssh_args(job, &a);
+    args_add(&a, remote);
+    memset(&opt, 0, sizeof(opt));
+    opt.in = data ? PROC_IN_DATA : PROC_IN_NULL;
+    opt.in_data = data;
+    opt.in_len = len;
+    opt.merge_stderr = 1;
+    opt.timeout_ms = timeout_ms;
+    opt.cancel = job->t->cancel;
+    proc_run((const char *const *)a.argv, &opt, res);
+    args_free(&a);
+    return res->exit_code == 0;
+}
+
+/* T=<送り先>; P=<途中ファイル> をコマンドの先頭に */
+static void push_paths(const PushJob *job, StrBuf *cmd)
+{
+    sb_puts(cmd, "T=");
+    sb_append_quoted(cmd, job->file->remote);
+    sb_puts(cmd, "; P=");
+    sb_append_quoted(cmd, job->partial);
+    sb_puts(cmd, "; ");
+}
+
+/*
+ * デバイスの状態を調べる。送り先が既に同じ内容なら 1、
+ * 送る必要があれば 0 (job->resume を決める)、接続できなければ -1。
+ */
+static int push_inventory(PushJob *job)
+{
+    const PushFile *f = job->file;
+    unsigned char *have = NULL;
+    StrBuf cmd = {0};
+    ProcResult res;
+    const char *p;
+    int done = 0;
+
+    push_paths(job, &cmd);
+    sb_appendf(&cmd, "echo \"F $(sha256sum \"$T\" 2>/dev/null)\"; [ -f \"$P\" ] || exit 0; "
+                     "s=$(wc -c < \"$P\"); i=0; while [ $((i * %d)) -lt \"$s\" ]; do "
+                     "echo \"C $i $(dd if=\"$P\" bs=%d skip=$i count=1 2>/dev/null | sha256sum)\"; "
+                     "i=$((i + 1)); done; true", PUSH_CHUNK_SIZE, PUSH_CHUNK_SIZE);
+    push_ssh(job, cmd.data, NULL, 0, PUSH_TIMEOUT_MS, &res);
+    sb_free(&cmd);
+    if (res.exit_code != 0) {
+        first_line(res.out.data ? res.out.data : "", job->error, sizeof(job->error));
+        proc_result_free(&res);
+        return -1;
+    }
+
+    /* "F <hash>  <path>" の後に "C <チャンク番号> <hash>  -" が続く */
+    have = (unsigned char *)calloc((size_t)f->chunk_count + 1, 1);
+    if (!have) {
+        proc_result_free(&res);
+        return -1;
+    }
+    for (p = res.out.data ? res.out.data : ""; *p; ) {
+        size_t n = strcspn(p, "\n");
+        char hash[65] = {0};
+        int idx;
+
+        if (p[0] == 'F' && p[1] == ' ') {
+            if (n >= 66 && strncmp(p + 2, f->hash, 64) == 0) done = 1;
+        } else if (p[0] == 'C' && sscanf(p + 1, "%d %64s", &idx, hash) == 2 && idx >= 0 &&
+                   idx < f->chunk_count && strcmp(hash, f->chunk_hash[idx]) == 0) {
+            have[idx] = 1;
+        }
+        p += n + (p[n] ? 1 : 0);
+    }
+    /* 追記で作るので、使えるのは先頭から途切れずに揃っている所まで */
+    job->resume = 0;
+    while (job->resume < f->chunk_count && have[job->resume]) job->resume++;
+    free(have);
+    proc_result_free(&res);
+    return done;
+}
+
+/*
+ * 途中ファイルを揃っている所で切り詰め、残りのチャンクを1回の ssh で流して追記する。
+ * 全体のハッシュが合えば送り先に置き換える (他の版の途中ファイルも消す)。
+ */
+static int push_transfer(PushJob *job)
+{
+    const PushFile *f = job->file;
+    size_t off = (size_t)job->resume * PUSH_CHUNK_SIZE;
+    int count = f->chunk_count - job->resume;
+    StrBuf cmd = {0};
+    ProcResult res;
+    int ok;
+
+    if (off > f->len) off = f->len;
+    push_paths(job, &cmd);
+    sb_appendf(&cmd, "mkdir -p \"$(dirname \"$T\")\" && dd if=/dev/null of=\"$P\" bs=%d seek=%d 2>/dev/null && "
+                     "cat >> \"$P\" && h=$(sha256sum \"$P\") || exit 1; "
+                     "[ \"${h%%%% *}\" = %s ] || { echo \"checksum mismatch\"; exit 1; }; "
+                     "mv \"$P\" \"$T\" && rm -f \"$T\"%s*",
+               PUSH_CHUNK_SIZE, job->resume, f->hash, PUSH_PARTIAL_SUFFIX);
+    ok = push_ssh(job, cmd.data, f->len > off ? f->data + off : NULL, f->len - off,
+                  PUSH_TIMEOUT_MS + count * PUSH_CHUNK_TIMEOUT_MS, &res);
+    if (ok) {
+        job->sent += count;
+        job->bytes += f->len - off;
+    } else {
+        first_line(res.out.data ? res.out.data : "", job->error, sizeof(job->error));
+        if (!job->error[0]) snprintf(job->error, sizeof(job->error), "transfer interrupted");
+    }
+    proc_result_free(&res);
+    sb_free(&cmd);
+    return ok;
+}
+
+/*
+ * f を t へ送る。結果は stats に ("<n>/<m> chunks sent, x.xx MB/s" など)。
+ * 成功 (既に同じ内容だった場合を含む) なら 1。
+ */
+int push_to_host(const SshTarget *t, const PushFile *f, char *stats, size_t stats_size)
+{
+    PushJob job;
+    int state = -1, ok = 0, reused = -1;
+    uint64_t start = now_us(), elapsed;
+
+    memset(&job, 0, sizeof(job));
+    job.file = f;
+    job.t = t;
+    snprintf(job.partial, sizeof(job.partial), "%s%s%.16s", f->remote, PUSH_PARTIAL_SUFFIX, f->hash);
+
+    /* --compress: 既存のマスター接続は圧縮なしのため閉じ、この問い合わせを新しいマスターにする */
+    if (f->compress) ssh_mux_close(t);
+    for (int attempt = 0; !ok && attempt <= PUSH_RETRIES; attempt++) {
+        if (t->cancel && *t->cancel) break;
+        state = push_inventory(&job);
+        if (state != 0) break;
+        if (reused < 0) reused = job.resume;
+        ok = push_transfer(&job);
+    }
+    elapsed = now_us() - start;
+
+    if (state == 1) {
+        snprintf(stats, stats_size, "already up to date");
+        ok = 1;
+    } else if (ok && f->chunk_count == 0) {
+        snprintf(stats, stats_size, "empty file written");
+    } else if (ok && job.sent == 0) {
+        snprintf(stats, stats_size, "all %d chunks were on the device", f->chunk_count);
+    } else if (ok) {
+        snprintf(stats, stats_size, "%d/%d chunks sent%s, %.2f MB/s", job.sent, f->chunk_count,
+                 reused > 0 ? " (rest on device)" : "",
+                 (double)job.bytes / (1024.0 * 1024.0) / ((double)(elapsed ? elapsed : 1) / 1e6));
+    } else {
+        snprintf(stats, stats_size, "%s", job.error[0] ? job.error : "connection failed");
+    }
+    return ok;
+}
+
+/* --push の対象ファイルの表示 */
+static void push_print_file(const PushFile *f)
+{
+    printf("File: %s (%zu bytes, %d chunk%s, sha256 %.12s)\n", f->local, f->len, f->chunk_count,
+           f->chunk_count == 1 ? "" : "s", f->hash);
+    printf("Destination: %s%s\n", f->remote, f->compress ? " (compressed)" : "");
+}
+
+/* fleet の1ホスト分 */
+static void push_fleet_host(FleetRun *run, FleetHost *h)
+{
+    char key_path[512], pub_path[512], ssh_dir[512];
+    DeviceInfo device;
+    SshTarget t;
+
+    h->start_ms = now_ms();
+    if (!key_for_host(run->cfg, h->host, &h->key_type, key_path, pub_path, ssh_dir, sizeof(key_path))) {
+        h->status = FLEET_SKIPPED;
+        h->exit_code = -1;
+        snprintf(h->note, sizeof(h->note), "no SSH key (connect once first)");
+        h->end_ms = now_ms();
+        return;
+    }
+
+    /* 調べる接続と送る接続は (使えれば) 同じマスター接続を使い、終わったら閉じる */
+    memset(&t, 0, sizeof(t));
+    t.sysroot = run->sysroot;
+    t.user = run->cfg->ssh_user;
+    t.host = h->host;
+    t.key_path = key_path;
+    t.key_type = h->key_type;
+    t.device = device_lookup(run->cfg, h->host, &device) ? &device : NULL;
+    t.ssh_dir = ssh_dir;
+    t.cfg = run->cfg;
+
+    h->exit_code = push_to_host(&t, run->push, h->note, sizeof(h->note)) ? 0 : 1;
+    h->status = (h->exit_code == 0) ? FLEET_OK : FLEET_FAILED;
+    ssh_mux_close(&t);
+    h->end_ms = now_ms();
+}
+
+/* --push <file> <remote> <hosts>: 全ホストへ並列に送る */
+int run_push_fleet(const Config *cfg, const char *sysroot, const char *hosts_spec, const PushFile *f)
+{
+    FleetRun run;
+
+    memset(&run, 0, sizeof(run));
+    run.count = load_fleet_hosts(cfg, hosts_spec, &run.hosts);
+    if (run.count < 0) return 1;
+    if (run.count == 0) {
+        printf("[ERROR] No hosts in: %s\n", hosts_spec);
+        free(run.hosts);
+        return 1;
+    }
+    run.job = push_fleet_host;
+    run.cfg = cfg;
+    run.sysroot = sysroot;
+    run.push = f;
+    mutex_init(&run.lock);
+
+    int workers = cfg->fleet_concurrency;
+    if (workers > run.count) workers = run.count;
+
+    push_print_file(f);
+    printf("Pushing to %d host(s), %d at a time...\n\n", run.count, workers);
+    uint64_t start = now_ms();
+    fleet_run_jobs(&run, workers);
+    uint64_t total = now_ms() - start;
+
+    int bad = fleet_print_summary(&run, "Push summary", total);
+    fleet_remember_hosts(&run, 0);
+    mutex_destroy(&run.lock);
+    free(run.hosts);
+    return bad == 0 ? 0 : 1;
+}
+
+/* ================================================== */
+/* Health monitor (--monitor)                         */
+/* ================================================== */
+/*
+ * 多数のデバイスの状態を定期的に集めてローカルに保存する。
+ *   - デバイスごとに ssh を1本だけ開いたままにし、デバイス側のループが
+ *     monitor_interval 秒ごと (時計の区切りに揃える) に ubus の結果を出力する。
+ *     ポーリングのたびに接続・認証・プロセス起動をしないので、1台あたりの負荷は
+ *     ssh プロセス1つ。切れたら MONITOR_RECONNECT_MS 後に開き直す
+ *   - 全デバイスの出力を1つのスレッドがイベントで待つ (ProcWaiter: POSIX は poll、
+ *     Windows は I/O 完了ポート)。届いた時だけ起き、台数分のスレッドや定期的な確認は無い
+ *   - 出力 (@S ... @E で区切られた1回分) の JSON を MonSample に変換して保存する
+ *   - 保存先は metrics/monitor.lock で1プロセスに限る (ホスト id が混ざらないように)
+ *
+ * 保存形式: <HOME>/.openwrt-connect/metrics/<YYYYMMDD>.owts (UTC の日ごと、追記のみ)
+ *   "OWTS1\n" の後にレコードが続く。数値は LEB128 の可変長、符号付きは zigzag。
+ *     'H' id len name        ホスト id の名前 (その id の差分の基準をリセット)
+ *     'K' id time v[0..]     絶対値
+ *     'D' id dtime dv[0..]   同じホストの前のサンプルとの差
+ *     'X' id time            接続が切れた
+ *   ファイルを開くたび、およびホストごとに MONITOR_KEYFRAME_EVERY 件ごとに 'K' を書く。
+ *   変化の少ない値は差分が 0 になるため、1サンプルは 10 バイト前後。
+ *   途中で切れた末尾のレコードは読み込み時に無視し、追記を始める前に切り詰める。
+ * 照会 (--monitor-query) は期間に含まれる日のファイルだけを先頭から読む。
+ */
+typedef enum {
+    METRIC_UPTIME = 0,       /* seconds */
+    METRIC_LOAD1,            /* x100 */
+    METRIC_LOAD5,
+    METRIC_LOAD15,
+    METRIC_MEM_TOTAL,        /* KB */
+    METRIC_MEM_AVAILABLE,    /* KB */
+    METRIC_CLIENTS,          /* wireless stations (all hostapd interfaces) */
+    METRIC_COUNT
+} Metric;
+
+static const struct {
+    const char *name;
+    double scale;            /* 表示時に割る値 */
+    const char *unit;
+} METRICS[METRIC_COUNT] = {
+    { "uptime",    3600.0, "h"  },
+    { "load1",     100.0,  ""   },
+    { "load5",     100.0,  ""   },
+    { "load15",    100.0,  ""   },
+    { "mem_total", 1024.0, "MB" },
+    { "mem_avail", 1024.0, "MB" },
+    { "clients",   1.0,    ""   },
+};
+
+typedef struct {
+    int64_t time;            /* unix seconds */
+    int64_t v[METRIC_COUNT];
+} MonSample;
+
+typedef struct Monitor Monitor;
+
+typedef struct {
+    Monitor *mon;
+    int id;
+    char host[64];
+    char key_path[512];
+    KeyType key_type;
+    DeviceInfo device;       /* 登録済みの暗号・圧縮の選択 */
+    int has_device;
+    int up;
+    int down_reported;       /* 繋がらないことを表示済み */
+    ProcChild child;         /* ssh (child.ctx = この MonHost) */
+    uint64_t retry_at;       /* 開き直す時刻 (now_ms) */
+    char line[OUTPUT_LINE_MAX];
+    size_t line_len;
+    StrBuf reply;            /* @S から @E まで */
+    int in_reply;
+    char error[128];         /* 最後のプロトコル外の出力 */
+    MonSample last;          /* 最後に受け取ったサンプル (要約の表示用) */
+    int declared;            /* 開いているファイルに 'H' を書いた */
+    int since_key;
+    MonSample written;       /* 差分の基準 */
+} MonHost;
+
+struct Monitor {
+    const Config *cfg;
+    const char *sysroot;
+    MonHost *hosts;
+    ProcChild **kids;        /* hosts[i].child */
+    int count;
+    int interval;
+    volatile int stop;
+    ProcWaiter waiter;
+    char remote[1024];       /* デバイス側のループ */
+    FILE *store;             /* NULL でも store_day が同じなら開けなかった日 */
+    char store_day[16];
+    uint64_t samples;
+};
+
+/* ---------- 可変長整数 ---------- */
+static void put_varint(StrBuf *sb, uint64_t v)
+{
+    char b[10];
+    size_t n = 0;
+
+    do {
+        b[n] = (char)(v & 0x7f);
+        v >>= 7;
+        if (v) b[n] |= (char)0x80;
+        n++;
+    } while (v);
+    sb_append(sb, b, n);
+}
+
+static void put_svarint(StrBuf *sb, int64_t v)
+{
+    put_varint(sb, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+/* 途中で終わっていれば 0 */
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *out)
+{
+    uint64_t v = 0;
+
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *out = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int get_svarint(const unsigned char **p, const unsigned char *end, int64_t *out)
+{
+    uint64_t v;
+    if (!get_varint(p, end, &v)) return 0;
+    *out = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    return 1;
+}
+
+/* unix 時刻の UTC の日付 "YYYYMMDD" (スレッドから使うため gmtime を使わない) */
+static void utc_day_name(int64_t t, char *buf, size_t size)
+{
+    int64_t z = (t >= 0 ? t : t - 86399) / 86400 + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned d = doy - (153 * mp + 2) / 5 + 1;
+    unsigned m = mp < 10 ? mp + 3 : mp - 9;
+    int64_t y = (int64_t)yoe + era * 400 + (m <= 2);
+
+    snprintf(buf, size, "%04d%02d%02d", (int)(y % 10000), (int)m, (int)d);
+}
+
+static void monitor_file_path(const char *day, char *buf, size_t size)
+{
+    char dir[512];
+
+    app_data_dir("metrics", dir, sizeof(dir));
+    snprintf(buf, size, "%s%c%s.owts", dir, PATH_SEP, day);
+}
+
+/* "HH:MM:SS" (ローカル時刻)。localtime の領域を共有するため収集のスレッドからだけ呼ぶ */
+static void clock_text(time_t t, char *buf, size_t size)
+{
+    strftime(buf, size, "%H:%M:%S", localtime(&t));
+}
+
+/* ---------- 保存 ---------- */
+/* 1レコードを読み飛ばす。途中で切れている・知らない種類なら 0 */
+static int monitor_record_skip(const unsigned char **p, const unsigned char *end)
+{
+    const unsigned char *q = *p;
+    uint64_t id, len, v;
+    int fields;
+    char tag;
+
+    if (q >= end) return 0;
+    tag = (char)*q++;
+    if (!get_varint(&q, end, &id) || id >= MONITOR_MAX_HOSTS) return 0;
+    if (tag == 'H') {
+        if (!get_varint(&q, end, &len) || len > (uint64_t)(end - q)) return 0;
+        q += len;
+    } else {
+        fields = (tag == 'X') ? 1 : (tag == 'K' || tag == 'D') ? 1 + METRIC_COUNT : 0;
+        if (fields == 0) return 0;
+        for (int i = 0; i < fields; i++) {
+            if (!get_varint(&q, end, &v)) return 0;
+        }
+    }
+    *p = q;
+    return 1;
+}
+
+/* 先頭から完全なレコードが続くバイト数 (無い・空なら 0)。別の形式のファイルなら -1 */
+static int64_t monitor_valid_length(const char *path)
+{
+    size_t size, magic = strlen(MONITOR_FILE_MAGIC);
+    const unsigned char *data = (const unsigned char *)map_file(path, &size);
+    const unsigned char *p;
+    int64_t valid;
+
+    if (!data) return 0;
+    if (memcmp(data, MONITOR_FILE_MAGIC, size < magic ? size : magic) != 0) {
+        unmap_file(data, size);
+        return -1;
+    }
+    if (size < magic) {
+        /* 見出しを書いている途中で止まった */
+        unmap_file(data, size);
+        return 0;
+    }
+    p = data + magic;
+    while (monitor_record_skip(&p, data + size)) {}
+    valid = (int64_t)(p - data);
+    unmap_file(data, size);
+    return valid;
+}
+
+/*
+ * t の日のファイルを開く (日が変わったら全ホストの 'H' を書き直す)。
+ * 前回が書き込みの途中で止まっていれば、最後の完全なレコードまで切り詰めてから追記する
+ */
+static int monitor_store_open(Monitor *m, int64_t t)
+{
+    char day[16], path[600];
+    int64_t valid;
+
+    utc_day_name(t, day, sizeof(day));
+    if (strcmp(day, m->store_day) == 0) return m->store != NULL;
+    if (m->store) fclose(m->store);
+    snprintf(m->store_day, sizeof(m->store_day), "%s", day);
+    for (int i = 0; i < m->count; i++) m->hosts[i].declared = 0;
+    monitor_file_path(day, path, sizeof(path));
+    valid = monitor_valid_length(path);
+    m->store = (valid < 0) ? NULL : fopen(path, "r+b");
+    if (!m->store && valid == 0) m->store = fopen(path, "w+b");
+    if (m->store && (!file_truncate(m->store, (uint64_t)valid) || fseek(m->store, 0, SEEK_END) != 0)) {
+        fclose(m->store);
+        m->store = NULL;
+    }
+    if (!m->store) {
+        printf("[ERROR] Cannot store samples in %s%s\n", path, valid < 0 ? " (not a samples file)" : "");
+        fflush(stdout);
+        return 0;
+    }
+    /* "ab" だと MSVCRT の ftell は書くまで 0 を返すので、末尾へ移ってから確かめる */
+    if (ftell(m->store) == 0) fwrite(MONITOR_FILE_MAGIC, 1, strlen(MONITOR_FILE_MAGIC), m->store);
+    return 1;
+}
+
+/* 1サンプル (down = 1 なら切断の記録) を追記する */
+static void monitor_store(Monitor *m, MonHost *h, const MonSample *s, int down)
+{
+    StrBuf rec = {0};
+
+    if (!monitor_store_open(m, s->time)) return;
+    if (!h->declared) {
+        sb_append(&rec, "H", 1);
+        put_varint(&rec, (uint64_t)h->id);
+        put_varint(&rec, strlen(h->host));
+        sb_append(&rec, h->host, strlen(h->host));
+        h->declared = 1;
+        h->since_key = MONITOR_KEYFRAME_EVERY;
+    }
+    if (down) {
+        sb_append(&rec, "X", 1);
+        put_varint(&rec, (uint64_t)h->id);
+        put_svarint(&rec, s->time);
+    } else {
+        int key = (h->since_key >= MONITOR_KEYFRAME_EVERY);
+        sb_append(&rec, key ? "K" : "D", 1);
+        put_varint(&rec, (uint64_t)h->id);
+        put_svarint(&rec, key ? s->time : s->time - h->written.time);
+        for (int i = 0; i < METRIC_COUNT; i++) put_svarint(&rec, key ? s->v[i] : s->v[i] - h->written.v[i]);
+        h->since_key = key ? 1 : h->since_key + 1;
+        h->written = *s;
+        h->last = *s;
+        m->samples++;
+    }
+    fwrite(rec.data, 1, rec.len, m->store);
+    fflush(m->store);
+    sb_free(&rec);
+}
+
+/* ---------- ubus の JSON ---------- */
+static const char *json_skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+/* p から始まる値の直後 */
+static const char *json_value_end(const char *p, const char *end)
+{
+    int depth = 0;
+
+    if (p < end && *p != '"' && *p != '{' && *p != '[') {
+        while (p < end && *p != ',' && *p != '}' && *p != ']') p++;
+        return p;
+    }
+    for (; p < end; p++) {
+        if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\') p++;
+            }
+            if (depth == 0) return p + 1;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (--depth == 0) return p + 1;
+        }
+    }
+    return end;
+}
+
+/* obj ('{' の位置) の直下のメンバー key の値の先頭。なければ NULL */
+static const char *json_member(const char *obj, const char *end, const char *key)
+{
+    size_t key_len = strlen(key);
+    const char *p;
+
+    if (!obj || obj >= end || *obj != '{') return NULL;
+    p = json_skip_ws(obj + 1, end);
+    while (p < end && *p == '"') {
+        const char *k = p + 1, *q = k;
+        while (q < end && *q != '"') q += (*q == '\\') ? 2 : 1;
+        p = json_skip_ws(q + 1, end);
+        if (p >= end || *p != ':') return NULL;
+        p = json_skip_ws(p + 1, end);
+        if ((size_t)(q - k) == key_len && memcmp(k, key, key_len) == 0) return p;
+        p = json_skip_ws(json_value_end(p, end), end);
+        if (p < end && *p == ',') p = json_skip_ws(p + 1, end);
+    }
+    return NULL;
+}
+
+static int64_t json_int(const char *p, int64_t fallback)
+{
+    return (p && (*p == '-' || (*p >= '0' && *p <= '9'))) ? strtoll(p, NULL, 10) : fallback;
+}
+
+/*
+ * 1回分の出力を s に変換する。
+ *   ubus call system info の JSON と "@C <無線クライアント数>"
+ * load は 1/65536 単位、メモリはバイト単位で返る。
+ */
+static int monitor_parse(const char *reply, size_t len, MonSample *s)
+{
+    const char *end = reply + len;
+    const char *obj = memchr(reply, '{', len);
+    const char *mem, *load, *clients;
+
+    memset(s, 0, sizeof(*s));
+    if (!obj || !json_member(obj, end, "uptime")) return 0;
+    s->v[METRIC_UPTIME] = json_int(json_member(obj, end, "uptime"), 0);
+    load = json_member(obj, end, "load");
+    if (load && *load == '[') {
+        const char *p = load + 1;
+        for (int i = 0; i < 3; i++) {
+            p = json_skip_ws(p, end);
+            s->v[METRIC_LOAD1 + i] = json_int(p, 0) * 100 / 65536;
+            p = json_value_end(p, end);
+            if (p < end && *p == ',') p++;
+        }
+    }
+    mem = json_member(obj, end, "memory");
+    if (mem) {
+        int64_t total = json_int(json_member(mem, end, "total"), 0);
+        int64_t avail = json_int(json_member(mem, end, "available"), -1);
+        /* 古い procd は available が無い */
+        if (avail < 0) {
+            avail = json_int(json_member(mem, end, "free"), 0) + json_int(json_member(mem, end, "buffered"), 0) +
+                    json_int(json_member(mem, end, "cached"), 0);
+        }
+        s->v[METRIC_MEM_TOTAL] = total / 1024;
+        s->v[METRIC_MEM_AVAILABLE] = avail / 1024;
+    }
+    clients = strstr(reply, "\n@C ");
+    if (clients) s->v[METRIC_CLIENTS] = strtoll(clients + 4, NULL, 10);
+    return 1;
+}
+
+/* ---------- 収集 ---------- */
+static void monitor_event(MonHost *h, const char *what, const char *detail)
+{
+    char now[16];
+
+    clock_text(time(NULL), now, sizeof(now));
+    printf("[%s] %-16s %s%s%s\n", now, h->host, what, detail && detail[0] ? ": " : "", detail ? detail : "");
+    fflush(stdout);
+}
+
+static void monitor_line(MonHost *h, const char *line)
+{
+    Monitor *m = h->mon;
+    MonSample s;
+
+    if (strcmp(line, "@S") == 0) {
+        h->reply.len = 0;
+        h->in_reply = 1;
+    } else if (strcmp(line, "@E") == 0 && h->in_reply) {
+        h->in_reply = 0;
+        if (!monitor_parse(h->reply.data ? h->reply.data : "", h->reply.len, &s)) return;
+        s.time = (int64_t)time(NULL);
+        monitor_store(m, h, &s, 0);
+        if (!h->up) {
+            h->up = 1;
+            h->down_reported = 0;
+            monitor_event(h, "UP", NULL);
+        }
+    } else if (h->in_reply) {
+        if (h->reply.len + strlen(line) + 1 > MONITOR_REPLY_MAX) return;
+        sb_append(&h->reply, "\n", 1);
+        sb_append(&h->reply, line, strlen(line));
+    } else if (line[0]) {
+        snprintf(h->error, sizeof(h->error), "%s", line);
+    }
+}
+
+/* 切れた (または開けなかった) 後の記録と表示。MONITOR_RECONNECT_MS 後に開き直す */
+static void monitor_session_lost(MonHost *h)
+{
+    Monitor *m = h->mon;
+
+    h->retry_at = now_ms() + MONITOR_RECONNECT_MS;
+    if (m->stop) return;
+    /* 切れた時刻を記録し、繋がらない間は一度だけ表示 */
+    if (h->up) {
+        MonSample gap;
+        memset(&gap, 0, sizeof(gap));
+        gap.time = (int64_t)time(NULL);
+        monitor_store(m, h, &gap, 1);
+        h->up = 0;
+    }
+    if (!h->down_reported) {
+        h->down_reported = 1;
+        monitor_event(h, "DOWN", h->error[0] ? h->error : "session closed");
+    }
+}
+
+/* proc_child_fn: 行に分けて monitor_line へ。len = 0 は ssh の終了 */
+static void monitor_output(ProcChild *c, const char *data, size_t len)
+{
+    MonHost *h = (MonHost *)c->ctx;
+
+    if (len == 0) {
+        monitor_session_lost(h);
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char ch = data[i];
+        if (ch == '\n') {
+            h->line[h->line_len] = '\0';
+            monitor_line(h, h->line);
+            h->line_len = 0;
+        } else if (ch != '\r' && h->line_len + 1 < sizeof(h->line)) {
+            h->line[h->line_len++] = ch;
+        }
+    }
+}
+
+/* デバイス側のループを動かす ssh を起動する */
+static void monitor_session_open(MonHost *h)
+{
+    Monitor *m = h->mon;
+    SshTarget t;
+    ArgList a = {0};
+
+    memset(&t, 0, sizeof(t));
+    t.sysroot = m->sysroot;
+    t.user = m->cfg->ssh_user;
+    t.host = h->host;
+    t.key_path = h->key_path;
+    t.key_type = h->key_type;
+    t.device = h->has_device ? &h->device : NULL;
+    t.cfg = m->cfg;
+
+    /* 無応答の接続は ServerAlive で切る */
+    ssh_build_args(&t, &a);
+    args_add(&a, "-o");
+    args_add(&a, "BatchMode=yes");
+    args_add(&a, "-o");
+    args_addf(&a, "ConnectTimeout=%d", FLEET_CONNECT_TIMEOUT);
+    args_add(&a, "-o");
+    args_addf(&a, "ServerAliveInterval=%d", m->interval);
+    args_add(&a, "-o");
+    args_add(&a, "ServerAliveCountMax=3");
+    ssh_add_destination(&t, &a);
+    args_add(&a, m->remote);
+
+    h->error[0] = '\0';
+    h->line_len = 0;
+    h->in_reply = 0;
+    h->child.ctx = h;
+    if (!proc_child_start(&m->waiter, (const char *const *)a.argv, &h->child)) {
+        snprintf(h->error, sizeof(h->error), "cannot start ssh");
+        monitor_session_lost(h);
+    }
+    args_free(&a);
+}
+
+/* 区切りごとに全体の1行の要約を表示 */
+static void monitor_summary(Monitor *m, int64_t at)
+{
+    int up = 0;
+    int64_t load = 0, total = 0, avail = 0, clients = 0;
+    char clock[16];
+
+    for (int i = 0; i < m->count; i++) {
+        const MonHost *h = &m->hosts[i];
+        if (!h->up || h->last.time < at - m->interval) continue;
+        up++;
+        load += h->last.v[METRIC_LOAD1];
+        total += h->last.v[METRIC_MEM_TOTAL];
+        avail += h->last.v[METRIC_MEM_AVAILABLE];
+        clients += h->last.v[METRIC_CLIENTS];
+    }
+    clock_text((time_t)at, clock, sizeof(clock));
+    printf("[%s] up %d/%d  load1 avg %.2f  memory used %.0f%%  clients %lld  (%llu samples stored)\n",
+           clock, up, m->count, up ? (double)load / 100.0 / up : 0.0,
+           total ? 100.0 * (double)(total - avail) / (double)total : 0.0, (long long)clients,
+           (unsigned long long)m->samples);
+    fflush(stdout);
+}
+
+/* 次の要約の時刻 (区切りの MONITOR_SUMMARY_DELAY 秒後) */
+static int64_t monitor_next_summary(const Monitor *m)
+{
+    int64_t now = (int64_t)time(NULL);
+    return now - now % m->interval + m->interval + MONITOR_SUMMARY_DELAY;
+}
+
+/*
+ * 収集のスレッド (1本だけ)。出力・再接続の時刻・要約の時刻のいずれかまで眠る。
+ * 止めるときは全 ssh を止め、終了 (パイプが閉じる) を受け取ってから戻る
+ */
+static thread_ret_t THREAD_CC monitor_thread(void *arg)
+{
+    Monitor *m = (Monitor *)arg;
+    int64_t summary_at = monitor_next_summary(m);
+
+    trace_thread_name("monitor");
+    while (!m->stop) {
+        uint64_t now = now_ms();
+        int64_t wait_ms = ((int64_t)summary_at - (int64_t)time(NULL)) * 1000;
+
+        for (int i = 0; i < m->count && !m->stop; i++) {
+            MonHost *h = &m->hosts[i];
+            if (h->child.running) continue;
+            if (h->retry_at <= now) monitor_session_open(h);
+            if (!h->child.running && (int64_t)(h->retry_at - now) < wait_ms) wait_ms = (int64_t)(h->retry_at - now);
+        }
+        if (wait_ms < 0) wait_ms = 0;
+        proc_children_wait(&m->waiter, m->kids, m->count, (int)wait_ms, monitor_output);
+        if ((int64_t)time(NULL) >= summary_at && !m->stop) {
+            monitor_summary(m, summary_at);
+            summary_at = monitor_next_summary(m);
+        }
+    }
+
+    uint64_t deadline = now_ms() + PROC_DRAIN_WAIT_MS;
+    for (int i = 0; i < m->count; i++) proc_child_stop(&m->hosts[i].child);
+    for (;;) {
+        int running = 0;
+        for (int i = 0; i < m->count; i++) running += m->hosts[i].child.running;
+        if (running == 0 || now_ms() >= deadline) break;
+        proc_children_wait(&m->waiter, m->kids, m->count, (int)(deadline - now_ms()), monitor_output);
+    }
+    return 0;
+}
+
+/* --monitor <hosts>: Enter で終了 */
+int run_monitor(const Config *cfg, const char *sysroot, const char *hosts_spec)
+{
+    Monitor m;
+    FleetHost *list = NULL;
+    thread_t collector;
+    file_lock_t lock;
+    char path[600], line[16];
+
+    memset(&m, 0, sizeof(m));
+    int count = load_fleet_hosts(cfg, hosts_spec, &list);
+    if (count < 0) return 1;
+    m.cfg = cfg;
+    m.sysroot = sysroot;
+    m.interval = cfg->monitor_interval;
+    m.hosts = (MonHost *)calloc((size_t)(count ? count : 1), sizeof(MonHost));
+    m.kids = (ProcChild **)calloc((size_t)(count ? count : 1), sizeof(ProcChild *));
+    if (!m.hosts || !m.kids) return 1;
+
+    for (int i = 0; i < count; i++) {
+        MonHost *h = &m.hosts[m.count];
+        char pub_path[512], ssh_dir[512];
+
+        if (!key_for_host(cfg, list[i].host, &h->key_type, h->key_path, pub_path, ssh_dir, sizeof(h->key_path))) {
+            printf("  %-16s skipped: no SSH key (connect once first)\n", list[i].host);
+            continue;
+        }
+        if (m.count >= MONITOR_MAX_HOSTS) {
+            printf("  %-16s skipped: more than %d hosts\n", list[i].host, MONITOR_MAX_HOSTS);
+            continue;
+        }
+        h->has_device = device_lookup(cfg, list[i].host, &h->device);
+        h->mon = &m;
+        h->id = m.count;
+        m.kids[m.count++] = &h->child;
+        snprintf(h->host, sizeof(h->host), "%s", list[i].host);
+    }
+    free(list);
+    if (m.count == 0) {
+        printf("[ERROR] No hosts to monitor in: %s\n", hosts_spec);
+        free(m.hosts);
+        free(m.kids);
+        return 1;
+    }
+
+    /* ホスト id はこのプロセスの中でだけ決まるので、同じ保存先に書くのは1プロセスだけ */
+    app_data_dir("metrics", path, sizeof(path));
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "%cmonitor.lock", PATH_SEP);
+    lock = file_lock(path, 0);
+    if (lock == FILE_LOCK_NONE || !proc_waiter_init(&m.waiter)) {
+        if (lock == FILE_LOCK_NONE) printf("[ERROR] Another --monitor is already storing samples (%s)\n", path);
+        file_unlock(lock);
+        free(m.hosts);
+        free(m.kids);
+        return 1;
+    }
+
+    /* デバイス側: 時計の区切りごとに system info と無線クライアント数を出力 */
+    snprintf(m.remote, sizeof(m.remote),
+             "while :; do echo @S; ubus call system info; n=0; "
+             "for o in $(ubus list 'hostapd.*' 2>/dev/null); do "
+             "c=$(ubus call \"$o\" get_clients 2>/dev/null | grep -c '\"..:..:..:..:..:..\": {'); n=$((n+c)); done; "
+             "echo \"@C $n\"; echo @E; t=$(date +%%s); sleep $((%d - t %% %d)); done",
+             m.interval, m.interval);
+
+    monitor_file_path("*", path, sizeof(path));
+    printf("Monitoring %d host(s) every %d s (one session per host)\n", m.count, m.interval);
+    printf("Samples: %s\n", path);
+    printf("Press Enter to stop.\n\n");
+    fflush(stdout);
+    if (!thread_start(&collector, monitor_thread, &m)) {
+        proc_waiter_free(&m.waiter);
+        file_unlock(lock);
+        free(m.hosts);
+        free(m.kids);
+        return 1;
+    }
+
+    /* 標準入力が無い (サービス等) 場合は強制終了まで続ける */
+    if (!fgets(line, sizeof(line), stdin)) {
+        for (;;) sleep_ms(60000);
+    }
+    m.stop = 1;
+    proc_waiter_wake(&m.waiter);
+    thread_join(collector);
+
+    printf("Stopped (%llu samples stored)\n", (unsigned long long)m.samples);
+    if (m.store) fclose(m.store);
+    file_unlock(lock);
+    proc_waiter_free(&m.waiter);
+    for (int i = 0; i < m.count; i++) sb_free(&m.hosts[i].reply);
+    free(m.hosts);
+    free(m.kids);
+    return 0;
+}
+
+/* ---------- 照会 ---------- */
+typedef struct {
+    char host[64];
+    uint64_t count;
+    int downs;
+    int64_t first, last;
+    MonSample latest;
+    int64_t min[METRIC_COUNT], max[METRIC_COUNT];
+    double sum[METRIC_COUNT];
+} MonSeries;
+
+static MonSeries *monitor_series(MonSeries **series, int *count, const char *host)
+{
+    MonSeries *n;
+
+    for (int i = 0; i < *count; i++) {
+        if (strcmp((*series)[i].host, host) == 0) return &(*series)[i];
+    }
+    n = (MonSeries *)realloc(*series, sizeof(MonSeries) * (size_t)(*count + 1));
+    if (!n) return NULL;
+    *series = n;
+    n = &n[(*count)++];
+    memset(n, 0, sizeof(*n));
+    snprintf(n->host, sizeof(n->host), "%s", host);
+    return n;
+}
+
+/*
+ * 1日分のファイルを読み、[from, to] のサンプルを集計する (csv なら1行ずつ表示)。
+ * 戻り値はファイルのバイト数、*decoded に読んだサンプル数 (全ホスト) を足す。
+ */
+static size_t monitor_read_day(const char *day, const char *host, int64_t from, int64_t to, int csv,
+                               MonSeries **series, int *series_count, uint64_t *decoded)
+{
+    char path[600];
+    size_t size;
+    const unsigned char *data = NULL, *p, *end;
+    int *by_id;              /* id -> series の添字 + 1 (0 = 対象外) */
+    MonSample *prev;
+
+    monitor_file_path(day, path, sizeof(path));
+    data = (const unsigned char *)map_file(path, &size);
+    if (!data) return 0;
+    end = data + size;
+    p = data + strlen(MONITOR_FILE_MAGIC);
+    if (size < strlen(MONITOR_FILE_MAGIC) || memcmp(data, MONITOR_FILE_MAGIC, strlen(MONITOR_FILE_MAGIC)) != 0) {
+        unmap_file(data, size);
+        return 0;
+    }
+    by_id = (int *)calloc(MONITOR_MAX_HOSTS, sizeof(int));
+    prev = (MonSample *)calloc(MONITOR_MAX_HOSTS, sizeof(MonSample));
+    if (!by_id || !prev) {
+        free(by_id);
+        free(prev);
+        unmap_file(data, size);
+        return 0;
+    }
+
+    while (p < end) {
+        char tag = (char)*p++;
+        uint64_t id, len;
+        MonSample s;
+
+        if (!get_varint(&p, end, &id) || id >= MONITOR_MAX_HOSTS) break;
+        if (tag == 'H') {
+            char name[64];
+            if (!get_varint(&p, end, &len) || len > (uint64_t)(end - p)) break;
+            snprintf(name, sizeof(name), "%.*s", (int)len, (const char *)p);
+            p += len;
+            by_id[id] = 0;
+            if (!host || strcmp(host, name) == 0) {
+                MonSeries *r = monitor_series(series, series_count, name);
+                if (r) by_id[id] = (int)(r - *series) + 1;
+            }
+            memset(&prev[id], 0, sizeof(prev[id]));
+        } else if (tag == 'X') {
+            if (!get_svarint(&p, end, &s.time)) break;
+            if (by_id[id] && s.time >= from && s.time <= to) {
+                MonSeries *r = &(*series)[by_id[id] - 1];
+                r->downs++;
+                if (csv) printf("%s,%lld,down\n", r->host, (long long)s.time);
+            }
+        } else if (tag == 'K' || tag == 'D') {
+            int ok = get_svarint(&p, end, &s.time);
+            for (int i = 0; ok && i < METRIC_COUNT; i++) ok = get_svarint(&p, end, &s.v[i]);
+            if (!ok) break;
+            if (tag == 'D') {
+                s.time += prev[id].time;
+                for (int i = 0; i < METRIC_COUNT; i++) s.v[i] += prev[id].v[i];
+            }
+            prev[id] = s;
+            (*decoded)++;
+
+            if (!by_id[id] || s.time < from || s.time > to) continue;
+            MonSeries *r = &(*series)[by_id[id] - 1];
+            if (r->count == 0) {
+                r->first = s.time;
+                for (int i = 0; i < METRIC_COUNT; i++) r->min[i] = r->max[i] = s.v[i];
+            }
+            r->count++;
+            r->last = s.time;
+            r->latest = s;
+            for (int i = 0; i < METRIC_COUNT; i++) {
+                if (s.v[i] < r->min[i]) r->min[i] = s.v[i];
+                if (s.v[i] > r->max[i]) r->max[i] = s.v[i];
+                r->sum[i] += (double)s.v[i];
+            }
+            if (csv) {
+                printf("%s,%lld", r->host, (long long)s.time);
+                for (int i = 0; i < METRIC_COUNT; i++) printf(",%g", (double)s.v[i] / METRICS[i].scale);
+                printf("\n");
+            }
+        } else {
+            break;
+        }
+    }
+    free(by_id);
+    free(prev);
+    unmap_file(data, size);
+    return size;
+}
+
+static void print_metric_row(const char *name, const char *unit, double last, double min, double avg, double max)
+{
+    char label[32];
+    snprintf(label, sizeof(label), "%s%s%s%s", name, unit[0] ? " (" : "", unit, unit[0] ? ")" : "");
+    printf("  %-16s %10.2f %10.2f %10.2f %10.2f\n", label, last, min, avg, max);
+}
+
+/* --monitor-query [host] [hours] [--csv] */
+int run_monitor_query(const char *host, int hours, int csv)
+{
+    int64_t to = (int64_t)time(NULL), from = to - (int64_t)hours * 3600;
+    MonSeries *series = NULL;
+    int series_count = 0;
+    size_t bytes = 0;
+    uint64_t samples = 0, decoded = 0, start = now_us();
+    char day[16], prev_day[16] = "";
+
+    if (csv) {
+        printf("host,time");
+        for (int i = 0; i < METRIC_COUNT; i++) printf(",%s", METRICS[i].name);
+        printf("\n");
+    }
+    /* 期間に掛かる日のファイルだけ */
+    for (int64_t t = from - from % 86400; t <= to; t += 86400) {
+        utc_day_name(t, day, sizeof(day));
+        if (strcmp(day, prev_day) == 0) continue;
+        snprintf(prev_day, sizeof(prev_day), "%s", day);
+        bytes += monitor_read_day(day, host, from, to, csv, &series, &series_count, &decoded);
+    }
+    if (csv) {
+        free(series);
+        return 0;
+    }
+
+    for (int i = 0; i < series_count; i++) samples += series[i].count;
+    if (samples == 0) {
+        printf("No samples%s%s in the last %d hour(s)\n", host ? " for " : "", host ? host : "", hours);
+        free(series);
+        return 1;
+    }
+    printf("Last %d hour(s): %llu samples (%zu bytes read, %.1f bytes/sample stored, decoded in %.1f ms)\n\n",
+           hours, (unsigned long long)samples, bytes, (double)bytes / (double)decoded, (now_us() - start) / 1000.0);
+
+    if (!host) {
+        printf("  %-16s %8s %6s %7s %10s %8s\n", "HOST", "SAMPLES", "DOWN", "LOAD1", "MEM AVAIL", "CLIENTS");
+        for (int i = 0; i < series_count; i++) {
+            const MonSeries *r = &series[i];
+            if (r->count == 0) continue;
+            printf("  %-16s %8llu %6d %7.2f %7.0f MB %8lld\n", r->host, (unsigned long long)r->count, r->downs,
+                   r->latest.v[METRIC_LOAD1] / 100.0, r->latest.v[METRIC_MEM_AVAILABLE] / 1024.0,
+                   (long long)r->latest.v[METRIC_CLIENTS]);
+        }
+    } else {
+        const MonSeries *r = &series[0];
+        char first[16], last[16];
+        clock_text((time_t)r->first, first, sizeof(first));
+        clock_text((time_t)r->last, last, sizeof(last));
+        printf("%s: %s - %s, unreachable %d time(s)\n\n", r->host, first, last, r->downs);
+        printf("  %-16s %10s %10s %10s %10s\n", "METRIC", "LAST", "MIN", "AVG", "MAX");
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            print_metric_row(METRICS[i].name, METRICS[i].unit, r->latest.v[i] / METRICS[i].scale,
+                             r->min[i] / METRICS[i].scale, r->sum[i] / (double)r->count / METRICS[i].scale,
+                             r->max[i] / METRICS[i].scale);
+        }
+    }
+    free(series);
+    return 0;
+}
+
+/* ================================================== */
+/* Configuration snapshots (--snapshot / --drift)     */
+/* ================================================== */
+/*
+ * デバイスの /etc/config を config セクション単位に分けて記録し、
+ * 前回からの変化 (ドリフト) を一覧にする。
+ *   1. こちらが持っている前回のセクション名とハッシュを標準入力で送る
+ *   2. デバイス側でファイルをセクションごとに分けて sha256sum し、
+ *      ハッシュが同じものは名前だけ、違うもの・新しいものは内容を返す
+ *      (1回の接続、送られてくるのは変わったセクションだけ)
+ *   3. 内容は SHA-256 の名前で snapshots/objects/ に置く (デバイス間・回の間で共有)
+ *   4. ホストごとの一覧 (manifest) と前回の一覧を比べて、変更・追加・削除を表示
+ * セクション名は uci と同じ "<パッケージ>.<名前>" (無名は "<パッケージ>.@<型>[n]")。
+ * 最初のセクションより前の行 (コメント等) は "<パッケージ>.-"。
+ * --snapshot は一覧を記録して基準を更新し、--drift は比べるだけで基準を変えない。
+ * デバイス側は busybox の awk / sha256sum / wc / cat だけで動く。
+ */
+typedef struct {
+    char name[96];
+    char hash[65];
+    size_t size;
+} SnapEntry;
+
+typedef struct {
+    SnapEntry *e;
+    int count;
+    char taken[32];          /* 記録した日時 (manifest 名) */
+} SnapManifest;
+
+/*
+ * 標準入力: "<セクション名> <ハッシュ>" の行 (前回の一覧)
+ * 出力: "= <名前>" (変わらず) / "+ <名前> <ハッシュ> <バイト数>" と内容、最後に "@end"
+ */
+static const char SNAPSHOT_SCRIPT[] =
+    "d=/tmp/owc-snap.$$; rm -rf $d; mkdir -p $d/s || exit 1; cat > $d/known;"
+    "for f in /etc/config/*; do [ -f \"$f\" ] || continue;"
+    " awk -v o=\"$d/s/${f##*/}\" -v q=\"'\" '"
+    "BEGIN { n = o \".-\" } /^[ \\t]*$/ { next }"
+    " /^[ \\t]*config[ \\t]/ { close(n); t = $2; gsub(/\"/, \"\", t); gsub(q, \"\", t);"
+    " s = $3; gsub(/\"/, \"\", s); gsub(q, \"\", s);"
+    " if (s == \"\") s = \"@\" t \"[\" c[t] + 0 \"]\"; c[t]++; n = o \".\" s }"
+    " { print > n }' \"$f\"; done;"
+    "cd $d/s || exit 1;"
+    "sha256sum * 2>/dev/null | awk -v k=$d/known '"
+    "BEGIN { while ((getline l < k) > 0) { split(l, a, \" \"); h[a[1]] = a[2] } }"
+    " { print (h[$2] == $1 ? \"=\" : \"+\"), $2, $1 }' > $d/list;"
+    "while read t n h; do if [ \"$t\" = + ]; then echo \"+ $n $h $(wc -c < \"$n\")\"; cat \"$n\";"
+    " else echo \"= $n\"; fi; done < $d/list;"
+    "echo @end; cd /; rm -rf $d";
+
+static void snapshot_host_dir(const char *host, char *buf, size_t size)
+{
+    char dir[512], name[64];
+
+    app_data_dir("snapshots", dir, sizeof(dir));
+    safe_file_name(host, name, sizeof(name));
+    snprintf(buf, size, "%s%c%s", dir, PATH_SEP, name);
+    make_dir(buf);
+}
+
+/* snapshots/objects/<先頭2文字>/<ハッシュ> */
+static void snapshot_object_path(const char *hash, char *buf, size_t size)
+{
+    char dir[512];
+
+    app_data_dir("snapshots", dir, sizeof(dir));
+    snprintf(buf, size, "%s%cobjects", dir, PATH_SEP);
+    make_dir(buf);
+    snprintf(buf + strlen(buf), size - strlen(buf), "%c%.2s", PATH_SEP, hash);
+    make_dir(buf);
+    snprintf(buf + strlen(buf), size - strlen(buf), "%c%s", PATH_SEP, hash);
+}
+
+/* 同じ内容が既にあれば書かない (別のデバイス・前回の分と共有) */
+static int snapshot_store_object(const char *hash, const char *data, size_t len)
+{
+    char path[700];
+
+    snapshot_object_path(hash, path, sizeof(path));
+    if (file_exists(path)) return 1;
+    return write_whole_file(path, data, len);
+}
+
+static int compare_snap_entry(const void *a, const void *b)
+{
+    return strcmp(((const SnapEntry *)a)->name, ((const SnapEntry *)b)->name);
+}
+
+static const SnapEntry *manifest_find(const SnapManifest *m, const char *name)
+{
+    SnapEntry key;
+
+    if (m->count == 0) return NULL;
+    snprintf(key.name, sizeof(key.name), "%s", name);
+    return (const SnapEntry *)bsearch(&key, m->e, (size_t)m->count, sizeof(SnapEntry), compare_snap_entry);
+}
+
+static int manifest_add(SnapManifest *m, int *cap, const char *name, const char *hash, size_t size)
+{
+    if (m->count >= SNAPSHOT_MAX_SECTIONS) return 0;
+    if (m->count >= *cap) {
+        int ncap = *cap ? *cap * 2 : 64;
+        SnapEntry *n = (SnapEntry *)realloc(m->e, sizeof(SnapEntry) * (size_t)ncap);
+        if (!n) return 0;
+        m->e = n;
+        *cap = ncap;
+    }
+    SnapEntry *e = &m->e[m->count++];
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    snprintf(e->hash, sizeof(e->hash), "%s", hash);
+    e->size = size;
+    return 1;
+}
+
+static void manifest_free(SnapManifest *m)
+{
+    free(m->e);
+    memset(m, 0, sizeof(*m));
+}
+
+/* "<ハッシュ> <バイト数> <セクション名>" の行。無ければ 0 (m は空) */
+static int manifest_load(const char *path, SnapManifest *m)
+{
+    size_t len;
+    char *data = read_whole_file(path, &len);
+    int cap = 0;
+
+    memset(m, 0, sizeof(*m));
+    if (!data) return 0;
+    for (char *line = data; *line; ) {
+        size_t n = strcspn(line, "\n");
+        char hash[65], name[96];
+        unsigned long size;
+
+        if (line[n]) line[n++] = '\0';
+        if (strncmp(line, "# taken ", 8) == 0) {
+            snprintf(m->taken, sizeof(m->taken), "%s", line + 8);
+        } else if (line[0] != '#' && sscanf(line, "%64s %lu %95s", hash, &size, name) == 3) {
+            manifest_add(m, &cap, name, hash, (size_t)size);
+        }
+        line += n;
+    }
+    free(data);
+    qsort(m->e, (size_t)m->count, sizeof(SnapEntry), compare_snap_entry);
+    return 1;
+}
+
+static int manifest_write(const char *path, const char *host, const SnapManifest *m)
+{
+    StrBuf sb = {0};
+    int ok;
+
+    sb_appendf(&sb, "%s\n# host %s\n# taken %s\n", SNAPSHOT_MANIFEST_TAG, host, m->taken);
+    for (int i = 0; i < m->count; i++) {
+        sb_appendf(&sb, "%s %lu %s\n", m->e[i].hash, (unsigned long)m->e[i].size, m->e[i].name);
+    }
+    ok = write_whole_file(path, sb.data, sb.len);
+    sb_free(&sb);
+    return ok;
+}
+
+/*
+ * デバイスから今のセクション一覧を得る (変わったセクションだけ内容を受け取り保存)。
+ * fetched に受け取った内容のバイト数。失敗したら 0 (error に理由)
+ */
+static int snapshot_fetch(const SshTarget *t, const SnapManifest *old,
+                          SnapManifest *cur, size_t *fetched, char *error, size_t error_size)
+{
+    StrBuf known = {0};
+    ArgList a = {0};
+    ProcOptions opt;
+    ProcResult res;
+    int cap = 0, complete = 0;
+
+    memset(cur, 0, sizeof(*cur));
+    *fetched = 0;
+    for (int i = 0; i < old->count; i++) sb_appendf(&known, "%s %s\n", old->e[i].name, old->e[i].hash);
+
+    fleet_ssh_args(t, &a);
+    args_add(&a, SNAPSHOT_SCRIPT);
+    memset(&opt, 0, sizeof(opt));
+    opt.in = known.len ? PROC_IN_DATA : PROC_IN_NULL;
+    opt.in_data = known.data;
+    opt.in_len = known.len;
+    opt.timeout_ms = SNAPSHOT_TIMEOUT_MS;
+    proc_run((const char *const *)a.argv, &opt, &res);
+    args_free(&a);
+    sb_free(&known);
+
+    if (res.exit_code != 0) {
+        first_line(res.err.data ? res.err.data : res.out.data, error, error_size);
+        if (res.exit_code == 255 || !error[0]) {
+            snprintf(error, error_size, res.timed_out ? "timed out" : "ssh connection/auth failed");
+        }
+        proc_result_free(&res);
+        return 0;
+    }
+
+    const char *p = res.out.data ? res.out.data : "";
+    const char *end = p + res.out.len;
+    while (p < end && !complete) {
+        size_t n = strcspn(p, "\n");
+        char name[96], hash[65], sum[65];
+        unsigned long size;
+
+        if (n == 4 && strncmp(p, "@end", 4) == 0) {
+            complete = 1;
+        } else if (p[0] == '=' && sscanf(p, "= %95s", name) == 1) {
+            const SnapEntry *e = manifest_find(old, name);
+            if (!e) break;
+            manifest_add(cur, &cap, e->name, e->hash, e->size);
+        } else if (p[0] == '+' && sscanf(p, "+ %95s %64s %lu", name, hash, &size) == 3) {
+            const char *body = p + n + 1;
+            if (body > end || (size_t)(end - body) < size) break;
+            sha256_hex(body, size, sum);
+            if (strcmp(sum, hash) != 0 || !snapshot_store_object(hash, body, size)) break;
+            manifest_add(cur, &cap, name, hash, size);
+            *fetched += size;
+            p = body + size;
+            continue;
+        } else {
+            break;
+        }
+        p += n + (p[n] ? 1 : 0);
+    }
+    proc_result_free(&res);
+    if (!complete) {
+        snprintf(error, error_size, "incomplete or corrupt reply from the device");
+        manifest_free(cur);
+        return 0;
+    }
+    qsort(cur->e, (size_t)cur->count, sizeof(SnapEntry), compare_snap_entry);
+    return 1;
+}
+
+/* 行 [s, e) が text の行に含まれるか */
+static int text_has_line(const char *text, const char *s, size_t len)
+{
+    for (const char *p = text; *p; ) {
+        size_t n = strcspn(p, "\n");
+        if (n == len && memcmp(p, s, len) == 0) return 1;
+        p += n + (p[n] ? 1 : 0);
+    }
+    return 0;
+}
+
+/* from にだけある行を mark 付きで (SNAPSHOT_DETAIL_LINES 行まで) */
+static int snapshot_diff_lines(StrBuf *sb, const char *from, const char *other, char mark, int shown)
+{
+    for (const char *p = from; *p; ) {
+        size_t n = strcspn(p, "\n");
+        if (n > 0 && !text_has_line(other, p, n)) {
+            if (shown < SNAPSHOT_DETAIL_LINES) {
+                size_t skip = strspn(p, " \t");
+                sb_appendf(sb, "        %c %.*s\n", mark, (int)(n > skip ? n - skip : 0), p + skip);
+            }
+            shown++;
+        }
+        p += n + (p[n] ? 1 : 0);
+    }
+    return shown;
+}
+
+/* 変更されたセクションの行の違い */
+static void snapshot_section_diff(StrBuf *sb, const SnapEntry *before, const SnapEntry *after)
+{
+    char path[700];
+    size_t len;
+    char *old_text, *new_text;
+    int shown;
+
+    snapshot_object_path(before->hash, path, sizeof(path));
+    old_text = read_whole_file(path, &len);
+    snapshot_object_path(after->hash, path, sizeof(path));
+    new_text = read_whole_file(path, &len);
+    if (old_text && new_text) {
+        shown = snapshot_diff_lines(sb, old_text, new_text, '-', 0);
+        shown = snapshot_diff_lines(sb, new_text, old_text, '+', shown);
+        if (shown > SNAPSHOT_DETAIL_LINES) sb_appendf(sb, "        ... %d more line(s)\n", shown - SNAPSHOT_DETAIL_LINES);
+    }
+    free(old_text);
+    free(new_text);
+}
+
+/* old → cur の変化を sb へ。変化したセクション数を返す */
+static int snapshot_report(StrBuf *sb, const SnapManifest *old, const SnapManifest *cur)
+{
+    int changed = 0, added = 0, removed = 0;
+    StrBuf lines = {0};
+
+    for (int i = 0; i < cur->count; i++) {
+        const SnapEntry *e = manifest_find(old, cur->e[i].name);
+        if (!e) {
+            sb_appendf(&lines, "    + %s\n", cur->e[i].name);
+            added++;
+        } else if (strcmp(e->hash, cur->e[i].hash) != 0) {
+            sb_appendf(&lines, "    ~ %s\n", cur->e[i].name);
+            snapshot_section_diff(&lines, e, &cur->e[i]);
+            changed++;
+        }
+    }
+    for (int i = 0; i < old->count; i++) {
+        if (!manifest_find(cur, old->e[i].name)) {
+            sb_appendf(&lines, "    - %s\n", old->e[i].name);
+            removed++;
+        }
+    }
+    if (changed + added + removed > 0) {
+        sb_appendf(sb, "%d changed, %d added, %d removed (since %s)\n", changed, added, removed, old->taken);
+        sb_append(sb, lines.data, lines.len);
+    }
+    sb_free(&lines);
+    return changed + added + removed;
+}
+
+/* fleet の1ホスト分 */
+static void snapshot_fleet_host(FleetRun *run, FleetHost *h)
+{
+    char key_path[512], pub_path[512], ssh_dir[512];
+    char dir[600], latest[700], path[700];
+    DeviceInfo device;
+    SshTarget t;
+    SnapManifest old, cur;
+    StrBuf report = {0};
+    size_t fetched, total = 0;
+    int has_base;
+
+    h->start_ms = now_ms();
+    if (!key_for_host(run->cfg, h->host, &h->key_type, key_path, pub_path, ssh_dir, sizeof(key_path))) {
+        h->status = FLEET_SKIPPED;
+        h->exit_code = -1;
+        snprintf(h->note, sizeof(h->note), "no SSH key (connect once first)");
+        h->end_ms = now_ms();
+        return;
+    }
+
+    memset(&t, 0, sizeof(t));
+    t.sysroot = run->sysroot;
+    t.user = run->cfg->ssh_user;
+    t.host = h->host;
+    t.key_path = key_path;
+    t.key_type = h->key_type;
+    t.device = device_lookup(run->cfg, h->host, &device) ? &device : NULL;
+    t.cfg = run->cfg;
+
+    snapshot_host_dir(h->host, dir, sizeof(dir));
+    snprintf(latest, sizeof(latest), "%s%clatest", dir, PATH_SEP);
+    has_base = manifest_load(latest, &old);
+    if (!snapshot_fetch(&t, &old, &cur, &fetched, h->note, sizeof(h->note))) {
+        h->status = FLEET_FAILED;
+        h->exit_code = 1;
+        manifest_free(&old);
+        h->end_ms = now_ms();
+        return;
+    }
+
+    for (int i = 0; i < cur.count; i++) total += cur.e[i].size;
+    h->snap_fetched = fetched;
+    h->snap_total = total;
+    if (has_base) h->drift = snapshot_report(&report, &old, &cur);
+    else sb_appendf(&report, "no earlier snapshot%s\n", run->snapshot_stamp ? "" : " (take one with --snapshot)");
+    h->report = report.data;
+
+    h->exit_code = 0;
+    if (run->snapshot_stamp) {
+        /* 日時ごとの一覧を残し、latest を次の基準にする */
+        snprintf(cur.taken, sizeof(cur.taken), "%s", run->snapshot_stamp);
+        snprintf(path, sizeof(path), "%s%c%s.manifest", dir, PATH_SEP, run->snapshot_stamp);
+        if (!manifest_write(path, h->host, &cur) || !manifest_write(latest, h->host, &cur)) {
+            snprintf(h->note, sizeof(h->note), "cannot write the snapshot");
+            h->exit_code = 1;
+        }
+    }
+    if (h->exit_code == 0) {
+        snprintf(h->note, sizeof(h->note), "%d sections, %.1f of %.1f KB fetched", cur.count,
+                 fetched / 1024.0, total / 1024.0);
+    }
+    h->status = (h->exit_code == 0) ? FLEET_OK : FLEET_FAILED;
+    manifest_free(&old);
+    manifest_free(&cur);
+    h->end_ms = now_ms();
+}
+
+/*
+ * --snapshot <hosts> (record = 1) / --drift <hosts> (record = 0)。
+ * 失敗があれば 1、--drift で変化したホストがあれば 2
+ */
+int run_snapshot(const Config *cfg, const char *sysroot, const char *hosts_spec, int record)
+{
+    FleetRun run;
+    char stamp[32];
+    time_t now = time(NULL);
+    size_t fetched = 0, total = 0;
+    int drifted = 0, reported = 0;
+
+    memset(&run, 0, sizeof(run));
+    run.count = load_fleet_hosts(cfg, hosts_spec, &run.hosts);
+    if (run.count < 0) return 1;
+    if (run.count == 0) {
+        printf("[ERROR] No hosts in: %s\n", hosts_spec);
+        free(run.hosts);
+        return 1;
+    }
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    run.job = snapshot_fleet_host;
+    run.cfg = cfg;
+    run.sysroot = sysroot;
+    run.snapshot_stamp = record ? stamp : NULL;
+    mutex_init(&run.lock);
+
+    int workers = cfg->fleet_concurrency;
+    if (workers > run.count) workers = run.count;
+
+    printf("%s %d host(s), %d at a time...\n\n", record ? "Snapshot of" : "Checking drift on", run.count, workers);
+    uint64_t start = now_ms();
+    fleet_run_jobs(&run, workers);
+    uint64_t elapsed = now_ms() - start;
+
+    int bad = fleet_print_summary(&run, record ? "Snapshot summary" : "Drift summary", elapsed);
+    fleet_remember_hosts(&run, 0);
+
+    printf("\nConfiguration drift:\n");
+    for (int i = 0; i < run.count; i++) {
+        FleetHost *h = &run.hosts[i];
+        fetched += h->snap_fetched;
+        total += h->snap_total;
+        if (h->drift) drifted++;
+        if (h->report && h->report[0]) {
+            printf("  [%s] %s", h->host, h->report);
+            reported++;
+        }
+        free(h->report);
+        free(h->tail);
+    }
+    if (reported == 0) printf("  none\n");
+    printf("\nFetched %.1f KB of %.1f KB of configuration (%d of %d host(s) drifted)\n",
+           fetched / 1024.0, total / 1024.0, drifted, run.count);
+    if (record) {
+        char dir[512];
+        app_data_dir("snapshots", dir, sizeof(dir));
+        printf("Snapshots: %s (%s)\n", dir, stamp);
+    }
+
+    mutex_destroy(&run.lock);
+    free(run.hosts);
+    if (bad) return 1;
+    return (!record && drifted) ? 2 : 0;
+}
+
+/* ================================================== */
+/* Command sequences                                  */
+/* ================================================== */
+/*
+ * 複数のコマンドを1回の起動で続けて実行する。
+ *   openwrt-connect.exe a b c          a → b → c の順
+ *   [sequence.<name>] steps = a b c    .conf で名前を付けた手順
+ * steps は空白またはカンマ区切り。"c:a+b" のように依存を書いた場合は
+ * 依存グラフとして扱い、依存が成功した手順から並列に実行する
+ * (依存を書いていない手順はすぐに始まる)。依存先は steps でそれより
+ * 前に書いた手順に限るため、循環は起こらない。
+ * IP検出・鍵認証は最初に1回だけ行い、接続再利用が使えれば全手順が
+ * 同じマスター接続上のチャネルとして動く。
+ * 失敗した手順があれば、まだ始まっていない手順は実行しない。
+ */
+
+/* steps[] に1手順追加。deps は "a+b" (NULL = 依存なし、ordered なら直前の手順) */
+static int sequence_add(Config *cfg, SeqRun *run, const char *name, char *deps, int ordered)
+{
+    CommandDef *c = find_command(cfg, name);
+    SeqStep *s = &run->steps[run->count];
+
+    if (!c) {
+        printf("[ERROR] Unknown command: %s\n", name);
+        return 0;
+    }
+    if (c->steps[0]) {
+        printf("[ERROR] Sequence '%s' cannot be a step of another sequence\n", name);
+        return 0;
+    }
+    if (c->url[0] == '\0') {
+        printf("[ERROR] Command '%s' is an interactive SSH session and cannot be run as a step\n", name);
+        return 0;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->run = run;
+    s->cmd = c;
+    if (ordered && run->count > 0) s->deps[s->dep_count++] = run->count - 1;
+    while (deps && *deps) {
+        char *dep = deps;
+        char *plus = strchr(deps, '+');
+        int found = -1;
+
+        if (plus) *plus = '\0';
+        deps = plus ? plus + 1 : NULL;
+        if (!dep[0]) continue;
+        for (int i = run->count - 1; i >= 0 && found < 0; i--) {
+            if (strcmp(run->steps[i].cmd->name, dep) == 0) found = i;
+        }
+        if (found < 0) {
+            printf("[ERROR] Step '%s' depends on '%s', which is not listed before it\n", name, dep);
+            return 0;
+        }
+        if (s->dep_count >= SEQUENCE_MAX_DEPS) {
+            printf("[ERROR] Step '%s' has more than %d dependencies\n", name, SEQUENCE_MAX_DEPS);
+            return 0;
+        }
+        s->deps[s->dep_count++] = found;
+    }
+    run->count++;
+    return 1;
+}
+
+/* [sequence.*] の steps を展開 */
+static int sequence_parse(Config *cfg, const CommandDef *seq, SeqRun *run)
+{
+    size_t len = strlen(seq->steps);
+    char *text = (char *)malloc(len + 1);
+    int cap = 1;
+    int ok = 1;
+
+    if (!text) return 0;
+    memcpy(text, seq->steps, len + 1);
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == ',' || isspace((unsigned char)text[i])) {
+            text[i] = '\0';
+            cap++;
+        }
+    }
+    run->graph = (strchr(seq->steps, ':') != NULL);
+    run->steps = (SeqStep *)calloc((size_t)cap, sizeof(SeqStep));
+    for (size_t i = 0; ok && run->steps && i < len; ) {
+        char *name = text + i;
+        size_t n = strlen(name);
+        char *colon = strchr(name, ':');
+
+        i += n + 1;
+        if (n == 0) continue;
+        if (colon) *colon = '\0';
+        ok = sequence_add(cfg, run, name, colon ? colon + 1 : NULL, !run->graph);
+    }
+    free(text);
+    if (ok && run->steps && run->count == 0) {
+        printf("[ERROR] Sequence '%s' has no steps\n", seq->name);
+        ok = 0;
+    }
+    return ok && run->steps;
+}
+
+/*
+ * 実行する手順を組み立てる。names が [sequence.*] 1つならその steps、
+ * それ以外は names を指定順に実行する。エラーは表示して 0
+ */
+int sequence_build(Config *cfg, int count, char *names[], SeqRun *run)
+{
+    CommandDef *first = find_command(cfg, names[0]);
+    int ok = 1;
+
+    memset(run, 0, sizeof(*run));
+    mutex_init(&run->lock);
+    if (count == 1 && first && first->steps[0]) {
+        snprintf(run->title, sizeof(run->title), "%s", first->label[0] ? first->label : first->name);
+        ok = sequence_parse(cfg, first, run);
+    } else {
+        run->steps = (SeqStep *)calloc((size_t)count, sizeof(SeqStep));
+        for (int i = 0; ok && run->steps && i < count; i++) {
+            size_t used = strlen(run->title);
+            snprintf(run->title + used, sizeof(run->title) - used, "%s%s", i ? " > " : "", names[i]);
+            ok = sequence_add(cfg, run, names[i], NULL, 1);
+        }
+        ok = ok && run->steps;
+    }
+    if (!ok) sequence_free(run);
+    return ok;
+}
+
+/* 全手順のスクリプトを先に用意する (同じコマンドはキャッシュから) */
+void sequence_fetch_scripts(SeqRun *run)
+{
+    for (int i = 0; i < run->count; i++) {
+        SeqStep *s = &run->steps[i];
+        script_cache_get(run->cfg, s->cmd, run->sysroot, run->refresh, &s->script);
+    }
+}
+
+void sequence_free(SeqRun *run)
+{
+    for (int i = 0; run->steps && i < run->count; i++) {
+        script_blob_free(&run->steps[i].script);
+    }
+    free(run->steps);
+    run->steps = NULL;
+    run->count = 0;
+}
+
+static void sequence_ssh_args(const SeqRun *run, ArgList *a)
+{
+    if (run->graph) {
+        /* 並列の手順は端末を共有できないので非対話 (鍵認証のみ) */
+        fleet_ssh_args(run->target, a);
+    } else {
+        ssh_build_args(run->target, a);
+        args_add(a, "-tt");
+        ssh_add_destination(run->target, a);
+    }
+}
+
+static void sequence_io(SeqStep *s, ProcOptions *opt)
+{
+    memset(opt, 0, sizeof(*opt));
+    if (s->run->graph) {
+        opt->in = PROC_IN_NULL;
+        opt->merge_stderr = 1;
+        opt->on_output = output_stream_feed;
+        opt->ctx = &s->out;
+    } else {
+        opt->in = PROC_IN_INHERIT;
+        opt->out = PROC_OUT_INHERIT;
+    }
+}
+
+/* 1手順を実行して終了コードを返す。デバイス側の版が古ければ送ってから1回だけ再実行 */
+static int sequence_exec(SeqStep *s)
+{
+    SeqRun *run = s->run;
+    ArgList a = {0};
+    StrBuf remote = {0};
+    ProcOptions opt;
+    ProcResult res;
+    int ret;
+
+    for (int attempt = 0; ; attempt++) {
+        sequence_ssh_args(run, &a);
+        build_remote_command(s->cmd, s->script.data ? s->script.hash : NULL, run->cfg->script_ttl,
+                             run->refresh, &remote);
+        args_add(&a, remote.data);
+        sb_free(&remote);
+        sequence_io(s, &opt);
+        proc_run((const char *const *)a.argv, &opt, &res);
+        args_free(&a);
+        proc_result_free(&res);
+        ret = res.exit_code;
+
+        if (!s->script.data || ret != SCRIPT_STALE_EXIT || attempt > 0) break;
+
+        /* 期限内のキャッシュを使っていた場合、先に新しい版がないか確認 */
+        if (strcmp(s->script.source, "cache") == 0) {
+            ScriptBlob latest;
+            if (script_cache_get(run->cfg, s->cmd, run->sysroot, 1, &latest)) {
+                script_blob_free(&s->script);
+                s->script = latest;
+            }
+        }
+        sequence_io(s, &opt);
+        if (run->graph) {
+            fleet_ssh_args(run->target, &a);
+        } else {
+            ssh_build_args(run->target, &a);
+            ssh_add_destination(run->target, &a);
+            printf("Sending script to device (%zu bytes)...\n", s->script.len);
+        }
+        if (!script_push(&a, s->cmd, &s->script, run->cfg->script_ttl, &opt)) {
+            snprintf(s->note, sizeof(s->note), "script install failed");
+            ret = 1;
+            break;
+        }
+        snprintf(s->note, sizeof(s->note), "script sent (%zu bytes)", s->script.len);
+    }
+    output_stream_flush(&s->out);
+    return ret;
+}
+
+static const char *sequence_status_name(StepStatus st)
+{
+    switch (st) {
+    case STEP_OK:      return "OK";
+    case STEP_SKIPPED: return "SKIPPED";
+    case STEP_PENDING: return "PENDING";
+    case STEP_RUNNING: return "RUNNING";
+    default:           return "FAILED";
+    }
+}
+
+/* 依存が成功した手順を1つ取り出す。無ければ NULL (*waiting = 実行中の手順待ち) */
+static SeqStep *sequence_next(SeqRun *run, int *waiting)
+{
+    *waiting = 0;
+    for (int i = 0; i < run->count; i++) {
+        SeqStep *s = &run->steps[i];
+        int ready = 1;
+
+        if (s->status != STEP_PENDING) continue;
+        if (run->stopped) {
+            s->status = STEP_SKIPPED;
+            s->exit_code = -1;
+            snprintf(s->note, sizeof(s->note), "not run (an earlier step failed)");
+            run->done++;
+            continue;
+        }
+        for (int d = 0; d < s->dep_count; d++) {
+            if (run->steps[s->deps[d]].status != STEP_OK) ready = 0;
+        }
+        if (ready) {
+            s->status = STEP_RUNNING;
+            s->start_ms = now_ms();
+            return s;
+        }
+        *waiting = 1;
+    }
+    return NULL;
+}
+
+static thread_ret_t THREAD_CC sequence_worker(void *arg)
+{
+    SeqRun *run = (SeqRun *)arg;
+
+    trace_thread_name("sequence step");
+    for (;;) {
+        int waiting;
+        uint64_t start_us;
+
+        mutex_lock(&run->lock);
+        SeqStep *s = sequence_next(run, &waiting);
+        if (s && !run->graph) {
+            printf("\n---- [%d/%d] %s - %s ----\n\n", (int)(s - run->steps) + 1, run->count,
+                   s->cmd->name, s->cmd->label);
+            fflush(stdout);
+        }
+        mutex_unlock(&run->lock);
+        if (!s) {
+            if (!waiting) break;
+            sleep_ms(20);
+            continue;
+        }
+
+        start_us = trace_enabled() ? now_us() : 0;
+        s->exit_code = sequence_exec(s);
+        s->end_ms = now_ms();
+        s->status = (s->exit_code == 0) ? STEP_OK : STEP_FAILED;
+        if (s->exit_code == 255) snprintf(s->note, sizeof(s->note), "ssh connection/auth failed");
+        else if (s->exit_code < 0) snprintf(s->note, sizeof(s->note), "ssh could not be started");
+        if (start_us) {
+            trace_complete(s->cmd->name, "step", start_us,
+                           s->status == STEP_OK ? "\"status\":\"ok\"" : "\"status\":\"failed\"");
+        }
+
+        mutex_lock(&run->lock);
+        if (s->status != STEP_OK) run->stopped = 1;
+        run->done++;
+        printf("%s[%*d/%d] %-16s %s (%.1f s)%s%s\n", run->graph ? "" : "\n",
+               run->count >= 100 ? 3 : 2, run->done, run->count, s->cmd->name,
+               sequence_status_name(s->status), (double)(s->end_ms - s->start_ms) / 1000.0,
+               s->note[0] ? "  " : "", s->note);
+        fflush(stdout);
+        mutex_unlock(&run->lock);
+    }
+    return 0;
+}
+
+/* 結果一覧を表示し、失敗・未実行の数を返す */
+static int sequence_print_summary(const SeqRun *run, uint64_t total)
+{
+    int ok = 0, failed = 0, skipped = 0;
+
+    printf("\n========================================\n");
+    printf("%s\n", run->title);
+    printf("========================================\n");
+    printf("  %-16s %-8s %5s %9s\n", "STEP", "RESULT", "EXIT", "TIME");
+    for (int i = 0; i < run->count; i++) {
+        const SeqStep *s = &run->steps[i];
+
+        if (s->status == STEP_OK) ok++;
+        else if (s->status == STEP_SKIPPED) skipped++;
+        else failed++;
+
+        if (s->status == STEP_SKIPPED) {
+            printf("  %-16s %-8s %5s %9s  %s\n", s->cmd->name, "SKIPPED", "-", "-", s->note);
+        } else {
+            printf("  %-16s %-8s %5d %7.1f s%s%s\n", s->cmd->name, sequence_status_name(s->status),
+                   s->exit_code, (double)(s->end_ms - s->start_ms) / 1000.0,
+                   s->note[0] ? "  " : "", s->note);
+        }
+    }
+    printf("----------------------------------------\n");
+    printf("OK %d / FAILED %d / SKIPPED %d\n", ok, failed, skipped);
+    printf("Total %.1f s\n", (double)total / 1000.0);
+    return failed + skipped;
+}
+
+/*
+ * 全手順を実行し、失敗・未実行の数を返す。
+ * 順に実行する場合は1手順ずつ端末をつなぎ、依存グラフの場合は
+ * 実行できる手順を並列に (fleet_concurrency 本まで) 実行する。
+ */
+int sequence_run(SeqRun *run)
+{
+    uint64_t start = now_ms();
+    int workers = run->graph ? run->count : 1;
+
+    if (workers > run->cfg->fleet_concurrency) workers = run->cfg->fleet_concurrency;
+    output_mux_init(&run->mux, NULL, 1);
+    for (int i = 0; i < run->count; i++) {
+        output_stream_init(&run->steps[i].out, &run->mux, run->steps[i].cmd->name, NULL);
+    }
+    if (workers > 1) {
+        thread_t *threads = (thread_t *)calloc((size_t)workers, sizeof(thread_t));
+        int started = 0;
+
+        for (int i = 0; threads && i < workers; i++) {
+            if (thread_start(&threads[started], sequence_worker, run)) started++;
+        }
+        if (started == 0) sequence_worker(run);
+        for (int i = 0; i < started; i++) thread_join(threads[i]);
+        free(threads);
+    } else {
+        sequence_worker(run);
+    }
+    output_mux_free(&run->mux);
+    return sequence_print_summary(run, now_ms() - start);
+}
+
+/* ================================================== */
+/* Background agent (--agent)                         */
+/* ================================================== */
+/*
+ * 常駐プロセスが最近使ったデバイスの認証済みセッションを保持し、
+ * ショートカットからの起動はローカル IPC で準備済みの結果を受け取るだけにする。
+ *   POSIX:   ~/.openwrt-connect/agent.sock (Unix ドメインソケット, 0600)
+ *   Windows: \\.\pipe\openwrt-connect-<USERNAME> (本人のみの DACL、リモートからの接続は拒否。
+ *            起動側はパイプを立てたプロセスが同じユーザーかを確かめてから要求を送る)
+ * 1接続で1行の要求を送り、応答は接続が閉じるまで:
+ *   HELLO          -> OK version=<n> pid=<pid>
+ *   DETECT         -> OK ip=<default gateway>
+ *   WARM <host>    -> OK                      (裏で準備を始める)
+ *   PREPARE <host> -> OK key_type=<type> | ERR <reason>
+ *   STATUS         -> 1セッション1行
+ *   STOP           -> OK                      (セッションを閉じて終了)
+ * 鍵のパスは受け取らず、起動側が key_type から自分で決める。
+ * エージェントが ControlMaster を張り、起動側の ssh は同じ ControlPath で参加する
+ * (鍵交換・認証なし)。接続再利用が無い環境 (Windows の ssh、ssh_mux = off) では
+ * 保持しても本セッションのハンドシェイクは省けないため、セッションは持たず
+ * DETECT (経路の変更通知で更新するゲートウェイ) だけを受け持つ。
+ * セッションは AGENT_CHECK_INTERVAL_MS ごとに生存確認し、agent_idle_timeout 秒
+ * 使われなければ閉じる。
+ */
+typedef enum {
+    AGENT_EMPTY = 0,
+    AGENT_PREPARING,
+    AGENT_READY,
+    AGENT_FAILED
+} AgentState;
+
+typedef struct {
+    char host[256];
+    AgentState state;
+    KeyType key_type;
+    char key_path[512];
+    char ssh_dir[512];
+    char error[256];
+    uint64_t last_used_ms;
+    uint64_t last_check_ms;
+} AgentSession;
+
+typedef struct {
+    Config cfg;              /* ssh_mux_persist をアイドル時間に合わせたコピー */
+    const char *sysroot;
+    AgentSession sessions[AGENT_MAX_SESSIONS];
+    mutex_t lock;
+#ifndef _WIN32
+    char socket_path[600];
+#endif
+} Agent;
+
+typedef struct {
+    Agent *ag;
+#ifdef _WIN32
+    HANDLE pipe;
+#else
+    sock_t fd;
+#endif
+} AgentClient;
+
+static void agent_endpoint(char *buf, size_t size)
+{
+#ifdef _WIN32
+    char user[128];
+    char safe[128];
+
+    get_env("USERNAME", user, sizeof(user));
+    safe_file_name(user, safe, sizeof(safe));
+    snprintf(buf, size, "%s%s", AGENT_PIPE_PREFIX, safe);
+#else
+    char dir[512];
+
+    app_data_dir("", dir, sizeof(dir));
+    snprintf(buf, size, "%s%s", dir, AGENT_SOCKET_NAME);
+#endif
+}
+
+#ifdef _WIN32
+/* プロセスを実行しているユーザーの SID (文字列) */
+static int process_user_sid(HANDLE process, char *buf, size_t size)
+{
+    DWORD info[128];                         /* TOKEN_USER + SID (DWORD 境界) */
+    DWORD len = 0;
+    HANDLE token;
+    char *str = NULL;
+    int ok = 0;
+
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token)) return 0;
+    if (GetTokenInformation(token, TokenUser, info, sizeof(info), &len) &&
+        ConvertSidToStringSidA(((TOKEN_USER *)info)->User.Sid, &str)) {
+        snprintf(buf, size, "%s", str);
+        LocalFree(str);
+        ok = 1;
+    }
+    CloseHandle(token);
+    return ok;
+}
+
+/* パイプの向こうが自分と同じユーザーのプロセスか (別ユーザーが先に立てた同名のパイプを拒む) */
+static int pipe_server_is_self_user(HANDLE pipe)
+{
+    char mine[192], theirs[192];
+    ULONG pid = 0;
+    HANDLE server;
+    int ok;
+
+    if (!GetNamedPipeServerProcessId(pipe, &pid)) return 0;
+    server = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!server) return 0;
+    ok = process_user_sid(server, theirs, sizeof(theirs)) &&
+         process_user_sid(GetCurrentProcess(), mine, sizeof(mine)) && strcmp(mine, theirs) == 0;
+    CloseHandle(server);
+    return ok;
+}
+#endif
+
+/* 起動側: request を送り、応答を reply に受け取る。エージェントが無ければ 0 */
+int agent_request(const char *request, char *reply, size_t size, int timeout_ms)
+{
+    char endpoint[600];
+
+    agent_endpoint(endpoint, sizeof(endpoint));
+    reply[0] = '\0';
+#ifdef _WIN32
+    DWORD mode = PIPE_READMODE_MESSAGE, got = 0, written = 0;
+    HANDLE pipe;
+    int ok;
+
+    if (!WaitNamedPipeA(endpoint, (DWORD)timeout_ms)) return 0;
+    /* エージェントにこちらの権限で動かせない (識別のみ) */
+    pipe = CreateFileA(endpoint, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                       SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) return 0;
+    ok = pipe_server_is_self_user(pipe) && SetNamedPipeHandleState(pipe, &mode, NULL, NULL) &&
+         WriteFile(pipe, request, (DWORD)strlen(request), &written, NULL) &&
+         (ReadFile(pipe, reply, (DWORD)size - 1, &got, NULL) || GetLastError() == ERROR_MORE_DATA);
+    CloseHandle(pipe);
+    reply[ok ? got : 0] = '\0';
+    return ok;
+#else
+    struct sockaddr_un addr;
+    size_t used = 0;
+    sock_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == SOCK_INVALID) return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(endpoint) >= sizeof(addr.sun_path)) {
+        sock_close(fd);
+        return 0;
+    }
+    memcpy(addr.sun_path, endpoint, strlen(endpoint) + 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        sock_close(fd);
+        return 0;
+    }
+    if (send(fd, request, strlen(request), MSG_NOSIGNAL) < 0 || send(fd, "\n", 1, MSG_NOSIGNAL) < 0) {
+        sock_close(fd);
+        return 0;
+    }
+    for (;;) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (sock_poll(&pfd, 1, timeout_ms) <= 0) break;
+        ssize_t n = recv(fd, reply + used, size - 1 - used, 0);
+        if (n <= 0) break;
+        used += (size_t)n;
+        if (used >= size - 1) break;
+    }
+    reply[used] = '\0';
+    sock_close(fd);
+    return used > 0;
+#endif
+}
+
+/* 自分自身を --agent で起動する (待たない・コンソールから切り離す) */
+static void agent_spawn(void)
+{
+    char exe[512];
+
+    get_exe_path(exe, sizeof(exe));
+#ifdef _WIN32
+    char cmdline[600];
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+
+    snprintf(cmdline, sizeof(cmdline), "\"%s\" --agent", exe);
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    if (CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, DETACHED_PROCESS | CREATE_NEW_PROCESS_GROUP,
+                       NULL, NULL, &si, &pi)) {
+        CloseHandle(pi.hThread);
+        CloseHandle(pi.hProcess);
+    }
+#else
+    /* 二重 fork で init の子にする (ゾンビを残さない) */
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (fork() == 0) {
+            int null_fd = open(NULL_DEVICE, O_RDWR);
+            setsid();
+            if (null_fd >= 0) {
+                dup2(null_fd, 0);
+                dup2(null_fd, 1);
+                dup2(null_fd, 2);
+            }
+            execl(exe, exe, "--agent", (char *)NULL);
+        }
+        _exit(0);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+#endif
+}
+
+/* 応答の "name=value" を取り出す (to_eol なら行末まで: 空白を含むパス用) */
+static int reply_field(const char *reply, const char *name, int to_eol, char *buf, size_t size)
+{
+    size_t n = strlen(name);
+
+    for (const char *p = reply; (p = strstr(p, name)) != NULL; p += n) {
+        if ((p == reply || p[-1] == ' ') && p[n] == '=') {
+            p += n + 1;
+            snprintf(buf, size, "%.*s", (int)strcspn(p, to_eol ? "\r\n" : " \r\n"), p);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* 起動側: エージェントが応答すれば 1。応答がなければ次回のために起動しておく */
+int agent_connect(const Config *cfg)
+{
+    char reply[128];
+
+    char version[16];
+
+    if (!cfg->agent) return 0;
+    if (agent_request("HELLO", reply, sizeof(reply), AGENT_REQUEST_TIMEOUT_MS)) {
+        /* 古い版のエージェントには問い合わせない (--agent stop で入れ替える) */
+        return strncmp(reply, "OK ", 3) == 0 && reply_field(reply, "version", 0, version, sizeof(version)) &&
+               atoi(version) == AGENT_PROTOCOL_VERSION;
+    }
+    agent_spawn();
+    return 0;
+}
+
+/*
+ * 起動側: エージェントに host の準備を依頼。鍵の確認まで済んでいれば 1。
+ * 鍵のパスは応答から受け取らず、こちらで選ぶ鍵がエージェントの確認した種類と同じときだけ使う。
+ */
+int agent_prepare(const Config *cfg, const char *host, KeyType *type, char *key_path, size_t size)
+{
+    char request[300], reply[1024], type_name[16];
+    char pub_path[512], ssh_dir[512];
+    KeyType local;
+
+    snprintf(request, sizeof(request), "PREPARE %s", host);
+    if (!agent_request(request, reply, sizeof(reply), AUTH_PROBE_TIMEOUT_MS + AGENT_REQUEST_TIMEOUT_MS) ||
+        strncmp(reply, "OK ", 3) != 0) {
+        return 0;
+    }
+    if (!reply_field(reply, "key_type", 0, type_name, sizeof(type_name)) ||
+        key_type_from_name(type_name) < 0 ||
+        !key_for_host(cfg, host, &local, key_path, pub_path, ssh_dir, size) ||
+        (int)local != key_type_from_name(type_name)) {
+        return 0;
+    }
+    *type = local;
+    return 1;
+}
+
+/* 起動側: 次回の起動に備えて host を保持してもらう */
+void agent_warm(const char *host)
+{
+    char request[300], reply[64];
+
+    snprintf(request, sizeof(request), "WARM %s", host);
+    agent_request(request, reply, sizeof(reply), AGENT_REQUEST_TIMEOUT_MS);
+}
+
+static const char *agent_state_name(AgentState s)
+{
+    switch (s) {
+    case AGENT_PREPARING: return "preparing";
+    case AGENT_READY:     return "ready";
+    case AGENT_FAILED:    return "failed";
+    default:              return "-";
+    }
 }
 
-int get_default_gateway(char *ip, size_t size)
+static void agent_target(Agent *ag, const AgentSession *s, SshTarget *t)
 {
-    PMIB_IPFORWARDTABLE pIpForwardTable = NULL;
-    ULONG dwSize = 0;
-    DWORD dwRetVal = 0;
-    int found = 0;
+    memset(t, 0, sizeof(*t));
+    t->sysroot = ag->sysroot;
+    t->user = ag->cfg.ssh_user;
+    t->host = s->host;
+    t->key_path = s->key_path;
+    t->key_type = s->key_type;
+    t->ssh_dir = s->ssh_dir;
+    t->cfg = &ag->cfg;
+}
 
-    dwRetVal = GetIpForwardTable(NULL, &dwSize, 0);
-    if (dwRetVal == ERROR_INSUFFICIENT_BUFFER) {
-        pIpForwardTable = (MIB_IPFORWARDTABLE *)malloc(dwSize);
-        if (pIpForwardTable == NULL) return 0;
-    } else {
-        return 0;
-    }
+/* host のセッション。無ければ空き (なければ最も古いもの) を PREPARING で確保し
+ * *created を立てる。追い出したセッションは *evicted に写す (マスター接続はロックの外で閉じる)。
+ * ロック中に呼ぶ */
+static AgentSession *agent_session(Agent *ag, const char *host, int *created, AgentSession *evicted)
+{
+    AgentSession *oldest = NULL;
 
-    if (GetIpForwardTable(pIpForwardTable, &dwSize, 0) == NO_ERROR) {
-        for (DWORD i = 0; i < pIpForwardTable->dwNumEntries; i++) {
-            if (pIpForwardTable->table[i].dwForwardDest == 0) {
-                struct in_addr addr;
-                addr.S_un.S_addr = pIpForwardTable->table[i].dwForwardNextHop;
-                char temp[64];
-                snprintf(temp, sizeof(temp), "%d.%d.%d.%d",
-                    addr.S_un.S_un_b.s_b1, addr.S_un.S_un_b.s_b2,
-                    addr.S_un.S_un_b.s_b3, addr.S_un.S_un_b.s_b4);
-                if (is_private_ip(temp)) {
-                    strncpy(ip, temp, size - 1);
-                    ip[size - 1] = '\0';
-                    found = 1;
-                    break;
-                }
-            }
+    *created = 0;
+    evicted->state = AGENT_EMPTY;
+    for (int i = 0; i < AGENT_MAX_SESSIONS; i++) {
+        AgentSession *s = &ag->sessions[i];
+        if (s->state != AGENT_EMPTY && strcmp(s->host, host) == 0) return s;
+    }
+    for (int i = 0; i < AGENT_MAX_SESSIONS; i++) {
+        AgentSession *s = &ag->sessions[i];
+        if (s->state == AGENT_EMPTY) {
+            oldest = s;
+            break;
         }
+        if (s->state != AGENT_PREPARING && (!oldest || s->last_used_ms < oldest->last_used_ms)) oldest = s;
     }
-
-    free(pIpForwardTable);
-    return found;
+    if (!oldest) return NULL;
+    if (oldest->state == AGENT_READY) *evicted = *oldest;
+    memset(oldest, 0, sizeof(*oldest));
+    snprintf(oldest->host, sizeof(oldest->host), "%s", host);
+    oldest->state = AGENT_PREPARING;
+    oldest->last_used_ms = now_ms();
+    *created = 1;
+    return oldest;
 }
 
-int detect_router_ip(char *ip, size_t size)
+/* 鍵認証を確認し、接続再利用が使えればマスター接続を張る。s は PREPARING */
+static void agent_prepare_session(Agent *ag, AgentSession *s)
 {
-    char temp[64];
+    char host[256], key_path[512], pub_path[512], ssh_dir[512], detail[256];
+    DeviceInfo device;
+    KeyType type;
+    SshTarget t;
+    AuthResult auth = AUTH_UNREACHABLE;
 
-    if (get_default_gateway(temp, sizeof(temp))) {
-        strncpy(ip, temp, size - 1);
-        ip[size - 1] = '\0';
-        return 1;
+    mutex_lock(&ag->lock);
+    snprintf(host, sizeof(host), "%s", s->host);
+    mutex_unlock(&ag->lock);
+
+    int have_key = key_for_host(&ag->cfg, host, &type, key_path, pub_path, ssh_dir, sizeof(key_path));
+    snprintf(detail, sizeof(detail), "no SSH key (connect once first)");
+    if (have_key) {
+        device_lookup(&ag->cfg, host, &device);
+        memset(&t, 0, sizeof(t));
+        t.sysroot = ag->sysroot;
+        t.user = ag->cfg.ssh_user;
+        t.host = host;
+        t.key_path = key_path;
+        t.key_type = type;
+        t.device = &device;
+        t.ssh_dir = ssh_dir;
+        t.cfg = &ag->cfg;
+        auth = test_key_auth(&t, detail, sizeof(detail));
+        if (auth == AUTH_OK) key_type_remember(&ag->cfg, host, &device, type);
     }
 
-    return 0;
+    mutex_lock(&ag->lock);
+    if (strcmp(s->host, host) == 0) {
+        s->key_type = type;
+        snprintf(s->key_path, sizeof(s->key_path), "%s", key_path);
+        snprintf(s->ssh_dir, sizeof(s->ssh_dir), "%s", ssh_dir);
+        snprintf(s->error, sizeof(s->error), "%s", auth == AUTH_OK ? "" : detail);
+        s->state = (auth == AUTH_OK) ? AGENT_READY : AGENT_FAILED;
+        s->last_check_ms = now_ms();
+    }
+    mutex_unlock(&ag->lock);
 }
 
-/* ================================================== */
-/* SSH key authentication                             */
-/* ================================================== */
-int file_exists(const char *path)
+typedef struct {
+    Agent *ag;
+    AgentSession *s;
+} AgentJob;
+
+static thread_ret_t THREAD_CC agent_warm_thread(void *arg)
 {
-    DWORD attr = GetFileAttributesA(path);
-    return (attr != INVALID_FILE_ATTRIBUTES && !(attr & FILE_ATTRIBUTE_DIRECTORY));
+    AgentJob *job = (AgentJob *)arg;
+
+    trace_thread_name("agent warm");
+    agent_prepare_session(job->ag, job->s);
+    free(job);
+    return 0;
 }
 
-void get_key_paths(const Config *cfg, const char *ip, char *priv, char *pub, char *ssh_dir, size_t size)
+/* 生存確認。マスター接続が切れていれば張り直す */
+static void agent_check_session(Agent *ag, AgentSession *s)
 {
-    char userprofile[512] = {0};
-    char key_name[256] = {0};
-    char ip_safe[256] = {0};
-    const char *p;
-    char *q;
+    AgentSession copy;
+    SshTarget t;
+    int alive;
 
-    /* IPアドレスのドットをアンダースコアに置き換え */
-    for (p = ip, q = ip_safe; *p && (q - ip_safe < (int)sizeof(ip_safe) - 1); p++) {
-        *q++ = (*p == '.') ? '_' : *p;
-    }
-    *q = '\0';
+    mutex_lock(&ag->lock);
+    copy = *s;
+    mutex_unlock(&ag->lock);
 
-    /* 鍵名を生成: <prefix>_<IP>_rsa */
-    snprintf(key_name, sizeof(key_name), "%s_%s_rsa", cfg->ssh_key_prefix, ip_safe);
+    agent_target(ag, &copy, &t);
+    alive = ssh_mux_check(&t);
 
-    GetEnvironmentVariableA("USERPROFILE", userprofile, sizeof(userprofile));
-    snprintf(ssh_dir, size, "%s\\.ssh", userprofile);
-    snprintf(priv, size, "%s\\%s", ssh_dir, key_name);
-    snprintf(pub, size, "%s\\%s.pub", ssh_dir, key_name);
+    mutex_lock(&ag->lock);
+    int same = (strcmp(s->host, copy.host) == 0 && s->state == AGENT_READY);
+    if (same && alive) s->last_check_ms = now_ms();
+    if (same && !alive) s->state = AGENT_PREPARING;
+    mutex_unlock(&ag->lock);
+    if (same && !alive) agent_prepare_session(ag, s);
 }
 
-int ensure_ssh_key(const char *sysroot, const char *key_path, const char *ssh_dir)
+/* 生存確認とアイドルセッションの片付け */
+static thread_ret_t THREAD_CC agent_maintain_thread(void *arg)
 {
-    char cmd[2048];
-
-    if (file_exists(key_path)) return 1;
+    Agent *ag = (Agent *)arg;
+    uint64_t idle_ms = (uint64_t)ag->cfg.agent_idle_timeout * 1000;
 
-    CreateDirectoryA(ssh_dir, NULL);
+    trace_thread_name("agent maintain");
+    for (;;) {
+        sleep_ms(1000);
+        for (int i = 0; i < AGENT_MAX_SESSIONS; i++) {
+            AgentSession *s = &ag->sessions[i];
+            SshTarget t;
+            int drop = 0, close_mux = 0, check = 0;
+            uint64_t now = now_ms();
 
-    printf("Generating SSH key...\n");
-    snprintf(cmd, sizeof(cmd),
-        "%s\\System32\\OpenSSH\\ssh-keygen.exe -t rsa -N \"\" -f \"%s\"",
-        sysroot, key_path);
+            mutex_lock(&ag->lock);
+            if ((s->state == AGENT_READY || s->state == AGENT_FAILED) && now - s->last_used_ms >= idle_ms) {
+                drop = 1;
+                close_mux = (s->state == AGENT_READY);
+                agent_target(ag, s, &t);
+                s->state = AGENT_PREPARING;      /* 片付け中は他から使わせない */
+            } else if (s->state == AGENT_READY && now - s->last_check_ms >= AGENT_CHECK_INTERVAL_MS) {
+                check = 1;
+            }
+            mutex_unlock(&ag->lock);
 
-    return (system(cmd) == 0);
+            if (close_mux) ssh_mux_close(&t);
+            if (drop) {
+                mutex_lock(&ag->lock);
+                memset(s, 0, sizeof(*s));
+                mutex_unlock(&ag->lock);
+            }
+            if (check) agent_check_session(ag, s);
+        }
+    }
+    return 0;
 }
 
-int test_key_auth(const char *sysroot, const char *key_path, const char *ip, const char *user)
+/* PREPARE / WARM: host のセッションを用意する。wait なら結果を reply に書く */
+static void agent_cmd_prepare(Agent *ag, const char *host, int wait, StrBuf *reply)
 {
-    char cmd[2048];
+    AgentSession *s, evicted;
+    int start = 0;
+
+    if (!host[0]) {
+        sb_puts(reply, "ERR missing host\n");
+        return;
+    }
+    if (!ssh_mux_available(&ag->cfg)) {
+        sb_puts(reply, wait ? "ERR no connection reuse\n" : "OK\n");
+        return;
+    }
+    mutex_lock(&ag->lock);
+    s = agent_session(ag, host, &start, &evicted);
+    if (s && s->state == AGENT_FAILED) {
+        s->state = AGENT_PREPARING;
+        start = 1;
+    }
+    if (s) s->last_used_ms = now_ms();
+    mutex_unlock(&ag->lock);
+    if (evicted.state == AGENT_READY) {
+        SshTarget t;
+        agent_target(ag, &evicted, &t);
+        ssh_mux_close(&t);
+    }
+    if (!s) {
+        sb_puts(reply, "ERR all sessions busy\n");
+        return;
+    }
 
-    snprintf(cmd, sizeof(cmd),
-        "%s\\System32\\OpenSSH\\ssh.exe"
-        SSH_OPTS
-        " -o BatchMode=yes"
-        " -o ConnectTimeout=5"
-        " -i \"%s\""
-        " %s@%s exit",
-        sysroot, key_path, user, ip);
+    if (!wait) {
+        AgentJob *job = (AgentJob *)malloc(sizeof(AgentJob));
+        thread_t th;
+        if (start && job) {
+            job->ag = ag;
+            job->s = s;
+            if (thread_start(&th, agent_warm_thread, job)) thread_detach(th);
+            else agent_warm_thread(job);
+        } else {
+            free(job);
+        }
+        sb_puts(reply, "OK\n");
+        return;
+    }
+
+    if (start) {
+        agent_prepare_session(ag, s);
+    } else {
+        /* 別の要求・WARM が準備中: 終わるまで待つ */
+        uint64_t deadline = now_ms() + AUTH_PROBE_TIMEOUT_MS;
+        for (;;) {
+            mutex_lock(&ag->lock);
+            int busy = (s->state == AGENT_PREPARING && strcmp(s->host, host) == 0);
+            mutex_unlock(&ag->lock);
+            if (!busy || now_ms() > deadline) break;
+            sleep_ms(20);
+        }
+    }
 
-    return (system(cmd) == 0);
+    mutex_lock(&ag->lock);
+    if (strcmp(s->host, host) != 0) {
+        sb_puts(reply, "ERR session closed\n");
+    } else if (s->state == AGENT_READY) {
+        s->last_used_ms = now_ms();
+        sb_appendf(reply, "OK key_type=%s\n", KEY_TYPE_NAMES[s->key_type]);
+    } else {
+        sb_appendf(reply, "ERR %s\n", s->error[0] ? s->error : agent_state_name(s->state));
+    }
+    mutex_unlock(&ag->lock);
 }
 
-int send_public_key(const char *sysroot, const char *pub_path, const char *ip, const char *user)
+static void agent_cmd_status(Agent *ag, StrBuf *reply)
 {
-    char cmd[4096];
+    uint64_t now = now_ms();
+    int n = 0;
 
-    printf("Registering public key (password required once)...\n\n");
-    snprintf(cmd, sizeof(cmd),
-        "type \"%s\" | %s\\System32\\OpenSSH\\ssh.exe"
-        SSH_OPTS
-        " %s@%s"
-        " \""
-        "[ -f /etc/openwrt_release ] || { echo 'ERROR: Not an OpenWrt device. Aborting.'; exit 1; };"
-        "cat > /tmp/.pubkey_tmp;"
-        "  [ -d /etc/dropbear ] && cat /tmp/.pubkey_tmp >> /etc/dropbear/authorized_keys && chmod 600 /etc/dropbear/authorized_keys;"
-        "  [ -d /root/.ssh ]    && cat /tmp/.pubkey_tmp >> /root/.ssh/authorized_keys    && chmod 600 /root/.ssh/authorized_keys;"
-        "  rm -f /tmp/.pubkey_tmp"
-        "\"",
-        pub_path, sysroot, user, ip);
+    mutex_lock(&ag->lock);
+    for (int i = 0; i < AGENT_MAX_SESSIONS; i++) {
+        const AgentSession *s = &ag->sessions[i];
+        if (s->state == AGENT_EMPTY) continue;
+        sb_appendf(reply, "%-16s %-9s %-7s idle %4llu s  checked %4llu s ago  %s\n", s->host,
+                   agent_state_name(s->state), s->state == AGENT_READY ? KEY_TYPE_NAMES[s->key_type] : "-",
+                   (unsigned long long)((now - s->last_used_ms) / 1000),
+                   (unsigned long long)(s->last_check_ms ? (now - s->last_check_ms) / 1000 : 0), s->error);
+        n++;
+    }
+    mutex_unlock(&ag->lock);
+    if (n == 0) sb_puts(reply, "(no sessions)\n");
+}
 
-    return (system(cmd) == 0);
+static void agent_cmd_detect(Agent *ag, StrBuf *reply)
+{
+    char ip[64];
+
+    /* 経路の変更通知が来るまでは前回の結果 (route_watch_start 済み) */
+    if (!detect_router_ip(&ag->cfg, ip, sizeof(ip))) ip[0] = '\0';
+    if (ip[0]) sb_appendf(reply, "OK ip=%s\n", ip);
+    else sb_puts(reply, "ERR no default gateway\n");
 }
 
-/* ================================================== */
-/* Configuration file parser                          */
-/* ================================================== */
-int load_config(const char *exe_path, Config *cfg)
+/* 1行の要求を処理する。STOP なら 1 */
+static int agent_handle(Agent *ag, char *request, StrBuf *reply)
 {
-    char conf_path[MAX_VALUE_LEN];
-    char line[MAX_LINE_LEN];
-    char current_section[128] = {0};
-    char current_command[64] = {0};
-    FILE *fp;
+    char *arg;
 
-    /* defaults */
-    strcpy(cfg->product_name, "OpenWrt Connect");
-    strcpy(cfg->default_ip, "192.168.1.1");
-    strcpy(cfg->ssh_user, "root");
-    strcpy(cfg->ssh_key_prefix, "owrt-connect");
-    cfg->command_count = 0;
+    request[strcspn(request, "\r\n")] = '\0';
+    arg = strchr(request, ' ');
+    if (arg) *arg++ = '\0';
+    else arg = request + strlen(request);
 
-    /* .confのパスを構築 (EXEと同じディレクトリの.confを自動検出) */
-    if (!find_conf_file(exe_path, conf_path, sizeof(conf_path))) {
-        printf("[WARN] No .conf file found in: %s\n", exe_path);
-        printf("[WARN] Using built-in defaults.\n\n");
-        return 0;
+    if (strcmp(request, "HELLO") == 0) {
+#ifdef _WIN32
+        sb_appendf(reply, "OK version=%d pid=%lu\n", AGENT_PROTOCOL_VERSION, (unsigned long)GetCurrentProcessId());
+#else
+        sb_appendf(reply, "OK version=%d pid=%ld\n", AGENT_PROTOCOL_VERSION, (long)getpid());
+#endif
+    } else if (strcmp(request, "DETECT") == 0) {
+        agent_cmd_detect(ag, reply);
+    } else if (strcmp(request, "PREPARE") == 0) {
+        agent_cmd_prepare(ag, arg, 1, reply);
+    } else if (strcmp(request, "WARM") == 0) {
+        agent_cmd_prepare(ag, arg, 0, reply);
+    } else if (strcmp(request, "STATUS") == 0) {
+        agent_cmd_status(ag, reply);
+    } else if (strcmp(request, "STOP") == 0) {
+        sb_puts(reply, "OK\n");
+        return 1;
+    } else {
+        sb_appendf(reply, "ERR unknown request: %s\n", request);
     }
+    return 0;
+}
 
-    fp = fopen(conf_path, "r");
-    if (!fp) {
-        printf("[WARN] Config file not found: %s\n", conf_path);
-        printf("[WARN] Using built-in defaults.\n\n");
-        return 0;
+/* セッションを閉じて終了 */
+static void agent_shutdown(Agent *ag)
+{
+    mutex_lock(&ag->lock);
+    for (int i = 0; i < AGENT_MAX_SESSIONS; i++) {
+        SshTarget t;
+        if (ag->sessions[i].state != AGENT_READY) continue;
+        agent_target(ag, &ag->sessions[i], &t);
+        ssh_mux_close(&t);
     }
+#ifndef _WIN32
+    remove(ag->socket_path);
+#endif
+    exit(0);
+}
 
-    while (fgets(line, sizeof(line), fp)) {
-        trim(line);
+static thread_ret_t THREAD_CC agent_client_thread(void *arg)
+{
+    AgentClient *c = (AgentClient *)arg;
+    char request[1024];
+    StrBuf reply = {0};
+    int stop = 0;
+    size_t used = 0;
 
-        /* 空行・コメント行をスキップ */
-        if (line[0] == '\0' || line[0] == '#') continue;
+#ifdef _WIN32
+    DWORD n = 0, written;
+    if (ReadFile(c->pipe, request, sizeof(request) - 1, &n, NULL) || GetLastError() == ERROR_MORE_DATA) used = n;
+#else
+    /* 改行まで読む */
+    while (used < sizeof(request) - 1 && !memchr(request, '\n', used)) {
+        struct pollfd pfd = { c->fd, POLLIN, 0 };
+        if (sock_poll(&pfd, 1, AGENT_REQUEST_TIMEOUT_MS) <= 0) break;
+        ssize_t n = recv(c->fd, request + used, sizeof(request) - 1 - used, 0);
+        if (n <= 0) break;
+        used += (size_t)n;
+    }
+#endif
+    request[used] = '\0';
+    if (used > 0) stop = agent_handle(c->ag, request, &reply);
 
-        /* セクションヘッダ */
-        if (line[0] == '[') {
-            char *end = strchr(line, ']');
-            if (end) {
-                *end = '\0';
-                strncpy(current_section, line + 1, sizeof(current_section) - 1);
-                current_section[sizeof(current_section) - 1] = '\0';
-
-                /* [command.<name>] の場合、コマンドを登録 */
-                if (strncmp(current_section, "command.", 8) == 0) {
-                    const char *cmd_name = current_section + 8;
-                    if (cfg->command_count < MAX_COMMANDS && strlen(cmd_name) > 0) {
-                        CommandDef *c = &cfg->commands[cfg->command_count];
-                        memset(c, 0, sizeof(CommandDef));
-                        strncpy(c->name, cmd_name, sizeof(c->name) - 1);
-                        strncpy(current_command, cmd_name, sizeof(current_command) - 1);
-                        cfg->command_count++;
-                    }
-                } else {
-                    current_command[0] = '\0';
-                }
-            }
-            continue;
-        }
+#ifdef _WIN32
+    if (reply.len) WriteFile(c->pipe, reply.data, (DWORD)reply.len, &written, NULL);
+    FlushFileBuffers(c->pipe);
+    DisconnectNamedPipe(c->pipe);
+    CloseHandle(c->pipe);
+#else
+    if (reply.len) send(c->fd, reply.data, reply.len, MSG_NOSIGNAL);
+    sock_close(c->fd);
+#endif
+    sb_free(&reply);
+    if (stop) agent_shutdown(c->ag);
+    free(c);
+    return 0;
+}
 
-        /* key = value の解析 */
-        char *eq = strchr(line, '=');
-        if (!eq) continue;
+static void agent_client_start(Agent *ag, AgentClient *tmpl)
+{
+    AgentClient *c = (AgentClient *)malloc(sizeof(AgentClient));
+    thread_t th;
 
-        *eq = '\0';
-        char key[128], val[MAX_VALUE_LEN];
-        strncpy(key, line, sizeof(key) - 1);
-        key[sizeof(key) - 1] = '\0';
-        strncpy(val, eq + 1, sizeof(val) - 1);
-        val[sizeof(val) - 1] = '\0';
-        trim(key);
-        trim(val);
+    if (!c) return;
+    *c = *tmpl;
+    c->ag = ag;
+    if (thread_start(&th, agent_client_thread, c)) thread_detach(th);
+    else agent_client_thread(c);
+}
 
-        /* [general] セクション */
-        if (strcmp(current_section, "general") == 0) {
-            if (strcmp(key, "product_name") == 0)
-                strncpy(cfg->product_name, val, sizeof(cfg->product_name) - 1);
-            else if (strcmp(key, "default_ip") == 0)
-                strncpy(cfg->default_ip, val, sizeof(cfg->default_ip) - 1);
-            else if (strcmp(key, "ssh_user") == 0)
-                strncpy(cfg->ssh_user, val, sizeof(cfg->ssh_user) - 1);
-            else if (strcmp(key, "ssh_key_prefix") == 0)
-                strncpy(cfg->ssh_key_prefix, val, sizeof(cfg->ssh_key_prefix) - 1);
-        }
-
-        /* [command.*] セクション */
-        if (current_command[0] != '\0' && cfg->command_count > 0) {
-            CommandDef *c = &cfg->commands[cfg->command_count - 1];
-            if (strcmp(key, "label") == 0)
-                strncpy(c->label, val, sizeof(c->label) - 1);
-            else if (strcmp(key, "icon") == 0)
-                strncpy(c->icon, val, sizeof(c->icon) - 1);
-            else if (strcmp(key, "url") == 0)
-                strncpy(c->url, val, sizeof(c->url) - 1);
-            else if (strcmp(key, "dir") == 0)
-                strncpy(c->dir, val, sizeof(c->dir) - 1);
-            else if (strcmp(key, "bin") == 0)
-                strncpy(c->bin, val, sizeof(c->bin) - 1);
+/* 要求の受付 (戻らない。開けなければ 1) */
+static int agent_serve(Agent *ag, const char *endpoint)
+{
+    AgentClient tmpl;
+
+#ifdef _WIN32
+    DWORD first = FILE_FLAG_FIRST_PIPE_INSTANCE;
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, FALSE };
+    char sid[192], sddl[256];
+
+    /* 本人だけが開ける (既定の DACL は Everyone の読み取りと LocalSystem・管理者を許す) */
+    int have_sid = process_user_sid(GetCurrentProcess(), sid, sizeof(sid));
+    snprintf(sddl, sizeof(sddl), "D:P(A;;GA;;;%s)", have_sid ? sid : "");
+    if (!have_sid || !ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl, SDDL_REVISION_1,
+                                                                           &sa.lpSecurityDescriptor, NULL)) {
+        printf("[ERROR] Cannot restrict %s to the current user (error %lu)\n", endpoint,
+               (unsigned long)GetLastError());
+        return 1;
+    }
+    for (;;) {
+        HANDLE pipe = CreateNamedPipeA(endpoint, PIPE_ACCESS_DUPLEX | first,
+                                       PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT |
+                                       PIPE_REJECT_REMOTE_CLIENTS,
+                                       PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, &sa);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            printf("[ERROR] Cannot create %s (error %lu)\n", endpoint, (unsigned long)GetLastError());
+            return 1;
+        }
+        first = 0;
+        if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
+            CloseHandle(pipe);
+            continue;
         }
+        tmpl.pipe = pipe;
+        agent_client_start(ag, &tmpl);
     }
+#else
+    struct sockaddr_un addr;
+    sock_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t old_mask;
 
-    fclose(fp);
-    return 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (fd == SOCK_INVALID || strlen(endpoint) >= sizeof(addr.sun_path)) {
+        printf("[ERROR] Cannot create %s\n", endpoint);
+        return 1;
+    }
+    memcpy(addr.sun_path, endpoint, strlen(endpoint) + 1);
+    snprintf(ag->socket_path, sizeof(ag->socket_path), "%s", endpoint);
+    remove(endpoint);                        /* 応答しなかった前回のソケット */
+    old_mask = umask(077);                   /* 本人以外は接続できない */
+    int ok = (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, 16) == 0);
+    umask(old_mask);
+    if (!ok) {
+        printf("[ERROR] Cannot listen on %s: %s\n", endpoint, strerror(errno));
+        sock_close(fd);
+        return 1;
+    }
+    for (;;) {
+        sock_t c = accept(fd, NULL, NULL);
+        if (c == SOCK_INVALID) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            printf("[ERROR] accept: %s\n", strerror(errno));
+            return 1;
+        }
+        tmpl.fd = c;
+        agent_client_start(ag, &tmpl);
+    }
+#endif
 }
 
-CommandDef* find_command(Config *cfg, const char *name)
+int run_agent(const Config *cfg, const char *sysroot)
 {
-    for (int i = 0; i < cfg->command_count; i++) {
-        if (strcmp(cfg->commands[i].name, name) == 0) {
-            return &cfg->commands[i];
-        }
+    char endpoint[600];
+    char reply[128];
+    thread_t th;
+    Agent *ag;
+
+    agent_endpoint(endpoint, sizeof(endpoint));
+    if (agent_request("HELLO", reply, sizeof(reply), AGENT_REQUEST_TIMEOUT_MS)) {
+        printf("Agent already running (%s)\n", endpoint);
+        return 0;
     }
-    return NULL;
-}
+    ag = (Agent *)calloc(1, sizeof(Agent));
+    if (!ag) return 1;
+    ag->cfg = *cfg;
+    /* エージェントが落ちてもマスター接続が残り続けないよう、自然に閉じる時間にする */
+    ag->cfg.ssh_mux_persist = cfg->agent_idle_timeout + AGENT_CHECK_INTERVAL_MS / 1000;
+    ag->sysroot = sysroot;
+    mutex_init(&ag->lock);
+    route_watch_start();
 
-/* ================================================== */
-/* Install script generator (template-based)          */
-/* ================================================== */
-/*
- * テンプレートからインストールスクリプトを生成
- * .confの url, dir, bin から組み立てる
- *
- * 生成されるスクリプト:
- *   #!/bin/sh
- *   DIR="<dir>"
- *   mkdir -p "$DIR"
- *   CACHE="?t=$(date +%s)"
- *   wget --no-check-certificate -O "$DIR/<script>.sh" "<url>${CACHE}"
- *   chmod +x "$DIR/<script>.sh"
- *   sh "$DIR/<script>.sh" "$@"
- */
-void build_install_script(const CommandDef *cmd, char *buf, size_t size)
-{
-    /* <name>.sh をURLの末尾から抽出、なければコマンド名を使う */
-    const char *url_file = strrchr(cmd->url, '/');
-    char script_name[128];
-    if (url_file) {
-        strncpy(script_name, url_file + 1, sizeof(script_name) - 1);
-        script_name[sizeof(script_name) - 1] = '\0';
-        /* クエリパラメータがあれば除去 */
-        char *qmark = strchr(script_name, '?');
-        if (qmark) *qmark = '\0';
+    printf("Agent listening on %s\n", endpoint);
+    if (ssh_mux_available(cfg)) {
+        printf("Sessions: up to %d, closed after %d s idle, checked every %d s\n", AGENT_MAX_SESSIONS,
+               cfg->agent_idle_timeout, AGENT_CHECK_INTERVAL_MS / 1000);
     } else {
-        snprintf(script_name, sizeof(script_name), "%s.sh", cmd->name);
+        printf("No connection reuse: address detection only, no sessions kept\n");
     }
+    fflush(stdout);
+    if (thread_start(&th, agent_maintain_thread, ag)) thread_detach(th);
+    return agent_serve(ag, endpoint);
+}
+
+/* --agent [status|stop] */
+int agent_command(const Config *cfg, const char *sysroot, const char *action)
+{
+    char reply[4096];
 
-    snprintf(buf, size,
-        "printf '#!/bin/sh\\n"
-        "CONFIG_DIR=\\\"%s\\\"\\n"
-        "mkdir -p \\\"$CONFIG_DIR\\\"\\n"
-        "CACHE_BUSTER=\\\"?t=$(date +%%%%s)\\\"\\n"
-        "wget --no-check-certificate -O \\\"$CONFIG_DIR/%s\\\" \\\"%s${CACHE_BUSTER}\\\"\\n"
-        "chmod +x \\\"$CONFIG_DIR/%s\\\"\\n"
-        "sh \\\"$CONFIG_DIR/%s\\\" \\\"$@\\\"\\n' > %s && "
-        "chmod +x %s",
-        cmd->dir, script_name, cmd->url,
-        script_name, script_name,
-        cmd->bin, cmd->bin);
+    if (!action) return run_agent(cfg, sysroot);
+    if (strcmp(action, "status") != 0 && strcmp(action, "stop") != 0) {
+        printf("Usage: openwrt-connect.exe --agent [status|stop]\n");
+        return 1;
+    }
+    if (!agent_request(strcmp(action, "stop") == 0 ? "STOP" : "STATUS", reply, sizeof(reply),
+                       AGENT_REQUEST_TIMEOUT_MS * 5)) {
+        printf("Agent is not running\n");
+        return 1;
+    }
+    printf("%s", strcmp(action, "stop") == 0 ? "Agent stopped\n" : reply);
+    return 0;
 }
 
 /* ================================================== */
@@ -441,31 +10784,98 @@ void build_install_script(const CommandDef *cmd, char *buf, size_t size)
 int main(int argc, char *argv[])
 {
     Config cfg;
-    const char *arg = (argc > 1) ? argv[1] : NULL;
+    const char *arg;
     char ip[256] = {0};
     char input[256] = {0};
-    char cmd[MAX_CMD_BUF];
     char sysroot[512] = {0};
     char key_path[512] = {0};
     char pub_path[512] = {0};
+    char legacy_key[512], legacy_pub[512];
     char ssh_dir[512] = {0};
     char exe_dir[512] = {0};
+    char detail[256] = {0};
+    SshTarget target;
+    Speculation spec;
+    DeviceInfo device;
+    int device_known;
+    ScriptBlob script;
+    SeqRun seq;
     int use_key = 0;
+    int auth_assumed = 0;
+    int key_inline = 0;
+    int ret;
+    int phase;
     CommandDef *target_cmd = NULL;
+    int show_timing = take_flag(&argc, argv, "--timing");
+    int refresh;
+    int live;
+    int bench_link;
+    int compress;
+    int pushing = 0;
+    PushFile push;
+    const char *trace_path;
 
-    GetEnvironmentVariableA("SYSTEMROOT", sysroot, sizeof(sysroot));
+    proc_init();
+
+    /* --push-keys 中の ssh から SSH_ASKPASS として呼ばれた */
+    if (is_askpass_call()) return askpass_reply(argc, argv);
+
+    refresh = take_flag(&argc, argv, "--refresh");
+    live = take_flag(&argc, argv, "--live");
+    bench_link = take_flag(&argc, argv, "--bench-link");
+    compress = take_flag(&argc, argv, "--compress");
+    trace_path = take_option(&argc, argv, "--trace");
+    if (trace_path) trace_start(trace_path);
+
+    arg = (argc > 1) ? argv[1] : NULL;
+    get_env("SYSTEMROOT", sysroot, sizeof(sysroot));
     get_exe_dir(exe_dir, sizeof(exe_dir));
 
+    /* --compile-config [out]: .conf を解析してスナップショットを書き出す */
+    if (arg && strcmp(arg, "--compile-config") == 0) {
+        return compile_config(exe_dir, (argc > 2) ? argv[2] : NULL);
+    }
+
     /* .confファイルを読み込み */
+    phase = phase_begin("config");
     load_config(exe_dir, &cfg);
+    phase_end(phase);
 
     /* --help */
     if (arg && strcmp(arg, "--help") == 0) {
-        printf("Usage: openwrt-connect.exe [command|--list|--help]\n\n");
+        printf("Usage: openwrt-connect.exe [command...|--scan [cidr...]|--fleet <hosts> <command>|--push-keys <hosts>|--push <file> <path> [hosts]|--monitor <hosts>|--monitor-query [host] [hours]|--snapshot <hosts>|--drift <hosts>|--inventory ...|--agent [status|stop]|--bench-link|--list|--help]\n\n");
         printf("  (no args)    Interactive SSH connection\n");
         printf("  <command>    Execute command defined in .conf\n");
+        printf("               (several commands or a [sequence.*] run in order over one session)\n");
+        printf("  --scan       Discover SSH devices on local subnets (or given CIDRs)\n");
+        printf("  --fleet      Run <command> on every host in <hosts> (file or CIDR) in parallel\n");
+        printf("               (--live: show every host's output as it arrives)\n");
+        printf("  --push-keys  Register the SSH key on every host in <hosts>, passwords asked up front\n");
+        printf("  --push       Send <file> to <path> on the device (or every host in [hosts])\n");
+        printf("               in checksummed chunks; an interrupted push resumes\n");
+        printf("               (--compress: use SSH compression)\n");
+        printf("  --monitor    Poll uptime / load / memory / clients of every host in <hosts>\n");
+        printf("               every monitor_interval seconds and store the samples locally\n");
+        printf("  --monitor-query [host] [hours]\n");
+        printf("               Summarize stored samples (default: all hosts, 24 hours; --csv: raw rows)\n");
+        printf("  --snapshot   Record /etc/config of every host in <hosts> per section; only\n");
+        printf("               sections changed since the last snapshot are transferred\n");
+        printf("  --drift      Show what changed on every host in <hosts> since its last snapshot\n");
+        printf("               (exit code 2 when any host drifted)\n");
+        printf("  --inventory  Host inventory: list [selector] / set <name> [addr] [key=value...]\n");
+        printf("               [--profile <name>] / rm <name> / import <hosts-file> / compact\n");
+        printf("               <hosts> may be @<selector>, e.g. @site=tokyo,role=ap or @10.1.0.0/16\n");
+        printf("  --agent      Run the background agent that keeps device sessions ready\n");
+        printf("               (status: list its sessions, stop: close them and exit)\n");
+        printf("  --bench-link Measure each SSH cipher / compression against the device\n");
+        printf("               and keep the fastest for later connections\n");
         printf("  --list       List available commands\n");
         printf("  --help       Show this help\n");
+        printf("  --timing     Show per-phase timing after the session\n");
+        printf("  --trace FILE Write phases and child processes as Chrome trace JSON\n");
+        printf("  --refresh    Check the script's url now even if script_ttl has not passed\n");
+        printf("  --compile-config [out]\n");
+        printf("               Write the parsed .conf as a binary snapshot (build step)\n");
         return 0;
     }
 
@@ -474,7 +10884,10 @@ int main(int argc, char *argv[])
         printf("Available commands (.conf):\n\n");
         for (int i = 0; i < cfg.command_count; i++) {
             CommandDef *c = &cfg.commands[i];
-            if (c->url[0] != '\0') {
+            if (c->steps[0] != '\0') {
+                printf("  %-12s %s\n", c->name, c->label[0] ? c->label : c->name);
+                printf("  %12s steps: %s\n", "", c->steps);
+            } else if (c->url[0] != '\0') {
                 printf("  %-12s %s\n", c->name, c->label);
                 printf("  %12s url: %s\n", "", c->url);
                 printf("  %12s bin: %s\n", "", c->bin);
@@ -486,19 +10899,117 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    /* コマンドの検索 */
+    /* --scan [cidr...] */
+    if (arg && strcmp(arg, "--scan") == 0) {
+        return run_scan(&cfg, argc - 2, argv + 2);
+    }
+
+    /* --fleet <hosts> <command> */
+    if (arg && strcmp(arg, "--fleet") == 0) {
+        if (argc < 4) {
+            printf("Usage: openwrt-connect.exe --fleet <hosts-file|cidr> <command>\n");
+            return 1;
+        }
+        return run_fleet(&cfg, sysroot, argv[2], argv[3], refresh, live);
+    }
+
+    /* --agent [status|stop] */
+    if (arg && strcmp(arg, "--agent") == 0) {
+        return agent_command(&cfg, sysroot, (argc > 2) ? argv[2] : NULL);
+    }
+
+    /* --inventory [list|set|rm|import|compact] ... */
+    if (arg && strcmp(arg, "--inventory") == 0) {
+        return run_inventory(argc - 2, argv + 2);
+    }
+
+    /* --push-keys <hosts> */
+    if (arg && strcmp(arg, "--push-keys") == 0) {
+        if (argc < 3) {
+            printf("Usage: openwrt-connect.exe --push-keys <hosts-file|cidr>\n");
+            return 1;
+        }
+        return run_push_keys(&cfg, sysroot, argv[2]);
+    }
+
+    /* --monitor <hosts>: Enter で終了 */
+    if (arg && strcmp(arg, "--monitor") == 0) {
+        if (argc < 3) {
+            printf("Usage: openwrt-connect.exe --monitor <hosts-file|cidr>\n");
+            return 1;
+        }
+        return run_monitor(&cfg, sysroot, argv[2]);
+    }
+
+    /* --monitor-query [host] [hours] [--csv] */
+    if (arg && strcmp(arg, "--monitor-query") == 0) {
+        int csv = take_flag(&argc, argv, "--csv");
+        const char *host = NULL;
+        int hours = 24;
+        for (int i = 2; i < argc; i++) {
+            if (atoi(argv[i]) > 0 && strspn(argv[i], "0123456789") == strlen(argv[i])) hours = atoi(argv[i]);
+            else host = argv[i];
+        }
+        return run_monitor_query(host, hours, csv);
+    }
+
+    /* --snapshot <hosts> / --drift <hosts>: 設定のセクションごとの記録と前回からの変化 */
+    if (arg && (strcmp(arg, "--snapshot") == 0 || strcmp(arg, "--drift") == 0)) {
+        if (argc < 3) {
+            printf("Usage: openwrt-connect.exe %s <hosts-file|cidr>\n", arg);
+            return 1;
+        }
+        return run_snapshot(&cfg, sysroot, argv[2], strcmp(arg, "--snapshot") == 0);
+    }
+
+    /* --push <file> <path> [hosts]: ホスト一覧があれば並列に、なければ対話の接続先へ */
+    if (arg && strcmp(arg, "--push") == 0) {
+        if (argc < 4) {
+            printf("Usage: openwrt-connect.exe --push <file> <remote-path> [hosts-file|cidr] [--compress]\n");
+            return 1;
+        }
+        if (!push_file_load(argv[2], argv[3], compress, &push)) {
+            printf("[ERROR] Cannot read %s\n", argv[2]);
+            return 1;
+        }
+        if (argc > 4) {
+            ret = run_push_fleet(&cfg, sysroot, argv[4], &push);
+            push_file_free(&push);
+            return ret;
+        }
+        pushing = 1;
+        arg = NULL;
+    }
+
+    /* コマンドの検索 (複数指定・[sequence.*] は1回の接続で続けて実行) */
+    memset(&seq, 0, sizeof(seq));
     if (arg) {
-        target_cmd = find_command(&cfg, arg);
+        const char *unknown = NULL;
+        for (int i = 1; i < argc && !unknown; i++) {
+            if (!find_command(&cfg, argv[i])) unknown = argv[i];
+        }
+        target_cmd = unknown ? NULL : find_command(&cfg, arg);
         if (!target_cmd) {
-            printf("[ERROR] Unknown command: %s\n\n", arg);
+            printf("[ERROR] Unknown command: %s\n\n", unknown);
             printf("Available commands:\n");
             for (int i = 0; i < cfg.command_count; i++) {
-                printf("  %s - %s\n", cfg.commands[i].name, cfg.commands[i].label);
+                printf("  %s - %s\n", cfg.commands[i].name,
+                       cfg.commands[i].label[0] ? cfg.commands[i].label : cfg.commands[i].name);
             }
             printf("\nUse --help for more information.\n");
-            system("pause");
+            pause_console();
             return 1;
         }
+        if (argc > 2 || target_cmd->steps[0]) {
+            if (!sequence_build(&cfg, argc - 1, argv + 1, &seq)) {
+                pause_console();
+                return 1;
+            }
+            seq.cfg = &cfg;
+            seq.sysroot = sysroot;
+            seq.target = &target;
+            seq.refresh = refresh;
+        }
     }
 
     /* SSH-onlyコマンドの判定 (urlが空 = SSHセッション) */
@@ -507,7 +11018,13 @@ int main(int argc, char *argv[])
 
     /* バナー表示 */
     printf("========================================\n");
-    if (is_remote_cmd) {
+    if (bench_link) {
+        printf("%s - Link Benchmark\n", cfg.product_name);
+    } else if (pushing) {
+        printf("%s - File Push\n", cfg.product_name);
+    } else if (seq.count) {
+        printf("%s - %s\n", cfg.product_name, seq.title);
+    } else if (is_remote_cmd) {
         printf("%s - %s\n", cfg.product_name, target_cmd->label);
     } else if (target_cmd) {
         printf("%s - %s\n", cfg.product_name, target_cmd->label);
@@ -516,10 +11033,35 @@ int main(int argc, char *argv[])
     }
     printf("========================================\n\n");
 
+    /* エージェント (agent = on): 応答しなければ次回のために起動し、今回は従来どおり */
+    phase = phase_begin("agent");
+    int agent_up = agent_connect(&cfg);
+    phase_end(phase);
+
     /* IPアドレス検出・入力 */
-    if (!detect_router_ip(ip, sizeof(ip))) {
-        strcpy(ip, cfg.default_ip);
+    phase = phase_begin("detect");
+    RaceResult race;
+    memset(&race, 0, sizeof(race));
+    int detected = (agent_up && agent_request("DETECT", input, sizeof(input), AGENT_REQUEST_TIMEOUT_MS) &&
+                    reply_field(input, "ip", 0, ip, sizeof(ip)) && is_ip_literal(ip));
+    if (!detected && cfg.connect_race) {
+        /* 候補アドレスへ同時に接続し、最初に SSH バナーを返したもの */
+        detected = race_connect(&cfg, &race);
+        if (detected) snprintf(ip, sizeof(ip), "%s", race.ip);
+        /* どれも応答しない: 接続確認は済んでいるので経路表の最上位 */
+        else detected = get_default_gateway(ip, sizeof(ip));
+    }
+    if (!detected && !detect_router_ip(&cfg, ip, sizeof(ip))) {
+        snprintf(ip, sizeof(ip), "%s", cfg.default_ip);
     }
+    input[0] = '\0';
+    phase_end(phase);
+
+    /* 入力待ちの間に既定IPへの準備を進める (エージェントがあれば任せる) */
+    memset(&spec, 0, sizeof(spec));
+    int agent_sessions = (agent_up && ssh_mux_available(&cfg));
+    if (agent_sessions) agent_warm(ip);
+    else speculate_start(&spec, &cfg, sysroot, ip);
 
     printf("Enter OpenWrt IP address [%s]: ", ip);
     fflush(stdout);
@@ -531,73 +11073,342 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (spec.started && strcmp(spec.ip, ip) != 0) {
+        speculate_cancel(&spec);
+    } else if (spec.started) {
+        phase = phase_begin("prefetch wait");
+        speculate_join(&spec);
+        phase_end(phase);
+    }
+
+    /* エージェントが鍵認証を確認済みなら、その鍵をそのまま使う */
+    KeyType agent_key_type = KEY_ED25519;
+    char agent_key[512] = {0};
+    int agent_ready = 0;
+    if (agent_sessions) {
+        phase = phase_begin("agent prepare");
+        agent_ready = agent_prepare(&cfg, ip, &agent_key_type, agent_key, sizeof(agent_key));
+        phase_end(phase);
+    }
+
+    /* デバイスの記録 (先行処理で読んでいればそれを使う) */
+    int spec_used = (spec.key_path[0] && strcmp(spec.ip, ip) == 0);
+    if (spec_used) {
+        device = spec.device;
+        device_known = spec.device_known;
+    } else {
+        device_known = device_lookup(&cfg, ip, &device);
+    }
+    /* 起動時の接続の競争で測った往復時間 (鍵認証が通れば記録に残る) */
+    if (race.ip[0] && strcmp(race.ip, ip) == 0) rtt_update(&device, race.rtt_ms);
+    if (device_known && device.board[0]) {
+        printf("Known device: %s / %s (%s key)\n", device.board,
+               device.release[0] ? device.release : "unknown release",
+               device.key_type[0] ? device.key_type : "no");
+    }
+
+    /* 鍵の種類: 記録があればそれ、初めてのデバイスはバナーで古い dropbear を判定 */
+    KeyType key_type;
+    int key_known = (key_type_from_name(device.key_type) >= 0);
+    if (agent_ready) {
+        key_type = agent_key_type;
+    } else if (spec_used) {
+        key_type = spec.key_type;
+    } else if (key_known) {
+        key_type = (KeyType)key_type_from_name(device.key_type);
+    } else {
+        char banner[128];
+        phase = phase_begin("banner");
+        if (race.ip[0] && strcmp(race.ip, ip) == 0) device_set_banner(&device, race.banner);
+        else if (probe_ssh_banner(&cfg, ip, banner, sizeof(banner))) device_set_banner(&device, banner);
+        key_type = key_choose(&cfg, ip, device.banner[0] ? device.banner : NULL);
+        phase_end(phase);
+    }
+
     /* SSH鍵パスの生成 */
-    get_key_paths(&cfg, ip, key_path, pub_path, ssh_dir, sizeof(key_path));
+    get_key_paths(&cfg, ip, key_type, key_path, pub_path, ssh_dir, sizeof(key_path));
+    if (agent_ready) {
+        snprintf(key_path, sizeof(key_path), "%s", agent_key);
+        snprintf(pub_path, sizeof(pub_path), "%s.pub", agent_key);
+    }
+
+    memset(&target, 0, sizeof(target));
+    target.sysroot = sysroot;
+    target.user = cfg.ssh_user;
+    target.host = ip;
+    target.key_type = key_type;
+    target.device = &device;
+    target.ssh_dir = ssh_dir;
+    target.cfg = &cfg;
 
-    /* SSH鍵認証のセットアップ */
-    if (ensure_ssh_key(sysroot, key_path, ssh_dir)) {
-        if (test_key_auth(sysroot, key_path, ip, cfg.ssh_user)) {
-            use_key = 1;
+    /* SSH鍵認証のセットアップ (接続再利用時は最初に認証した接続がマスターになる) */
+    phase = phase_begin("keygen");
+    int have_key = ensure_ssh_key(sysroot, key_type, key_path, ssh_dir);
+    phase_end(phase);
+    if (have_key) {
+        target.key_path = key_path;
+        AuthResult auth;
+        if (agent_ready) {
+            /* エージェントが確認済み (接続再利用ならそのマスター接続に参加する) */
+            auth = AUTH_OK;
+        } else if (spec.auth_done && spec.auth != AUTH_UNREACHABLE) {
+            /* 入力待ちの間に確認済み */
+            auth = spec.auth;
+        } else if (!ssh_mux_available(&cfg) && key_known && device_known && device.release[0] &&
+                   !pushing && !seq.count && !bench_link && !(cfg.link_tune && !device.cipher[0])) {
+            /* 接続再利用が無い (Windows 等): 鍵が通った記録があれば確認の接続を省いて本セッションへ。
+               鍵が通らなければ本セッションが失敗し、そこで登録し直す */
+            auth = AUTH_OK;
+            auth_assumed = 1;
+        } else if (!ssh_mux_available(&cfg) && !device_known && !pushing && !seq.count && !bench_link &&
+                   !cfg.link_tune && !key_legacy_present(&target, legacy_key, legacy_pub, sizeof(legacy_key))) {
+            /* 接続再利用が無い環境で初めての鍵: 確認・登録・再確認・本セッションを別々に接続せず、
+               本セッションの接続で (鍵が通らなければパスワードで) 入り、最初に鍵を登録する。
+               デバイスの記録だけ作り、鍵が受け付けられたかは次回の起動の確認で記録する */
+            auth = AUTH_OK;
+            key_inline = 1;
         } else {
-            if (send_public_key(sysroot, pub_path, ip, cfg.ssh_user)) {
-                use_key = 1;
-            } else {
-                system("pause");
+            phase = phase_begin("auth probe");
+            auth = test_key_auth(&target, detail, sizeof(detail));
+            phase_end(phase);
+        }
+
+        if (auth == AUTH_HOST_CHANGED) {
+            /* 同じ IP で別のデバイス (または再インストール) */
+            if (!confirm_new_device(&cfg, ip, &device)) {
+                pause_console();
                 return 1;
             }
+            device_known = key_known = 0;
+            phase = phase_begin("auth probe");
+            auth = test_key_auth(&target, detail, sizeof(detail));
+            phase_end(phase);
+        }
+        if (auth == AUTH_UNREACHABLE || auth == AUTH_HOST_CHANGED) {
+            printf("[ERROR] Cannot connect to %s: %s\n\n", ip, detail);
+            pause_console();
+            return 1;
+        }
+        if (auth == AUTH_DENIED && !key_known) {
+            /* 以前の RSA 鍵が登録済みなら、それで新しい鍵を登録する */
+            phase = phase_begin("key migrate");
+            auth = key_migrate_legacy(&target, key_path, pub_path, sizeof(key_path));
+            phase_end(phase);
+        }
+        use_key = (auth == AUTH_OK);
+        for (int attempt = 0; !use_key && attempt < 2; attempt++) {
+            if (attempt > 0) {
+                /* 登録した鍵が通らない: ed25519 非対応の dropbear とみなして RSA で登録し直す */
+                if (target.key_type == KEY_RSA) break;
+                printf("\nThe device did not accept the ed25519 key; registering an RSA key instead.\n");
+                target.key_type = KEY_RSA;
+                get_key_paths(&cfg, ip, KEY_RSA, key_path, pub_path, ssh_dir, sizeof(key_path));
+                if (!ensure_ssh_key(sysroot, KEY_RSA, key_path, ssh_dir)) break;
+            }
+            phase = phase_begin("key push");
+            int pushed = send_public_key(&target, pub_path);
+            phase_end(phase);
+            if (!pushed) break;
+            /* 登録した鍵そのものを確かめる (既存のマスター接続は使わない) */
+            SshTarget probe = target;
+            probe.ssh_dir = NULL;
+            phase = phase_begin("auth probe");
+            use_key = (test_key_auth(&probe, detail, sizeof(detail)) == AUTH_OK);
+            phase_end(phase);
+        }
+        if (!use_key) {
+            printf("[ERROR] Key authentication could not be set up for %s\n\n", ip);
+            pause_console();
+            return 1;
+        }
+        if (!key_inline) {
+            if (!agent_ready) key_type_remember(&cfg, ip, &device, target.key_type);
+            race_remember(ip);
+            /* 次回の起動ではエージェントが準備済みにしておく (今回起動したエージェントにも伝える) */
+            if (cfg.agent && ssh_mux_available(&cfg) && !agent_ready) agent_warm(ip);
+        }
+    }
+    if (!use_key) target.key_path = NULL;
+
+    /* 暗号・圧縮の測定 (--bench-link、または link_tune = on で未測定のデバイス) */
+    if (bench_link && !use_key) {
+        printf("[ERROR] --bench-link needs key authentication to %s\n\n", ip);
+        pause_console();
+        return 1;
+    }
+    if (bench_link || (cfg.link_tune && use_key && !device.cipher[0])) {
+        phase = phase_begin("link bench");
+        int tuned = link_tune(&target, &device, bench_link ? LINK_BENCH_BYTES : LINK_TUNE_BYTES, bench_link);
+        phase_end(phase);
+        if (bench_link) {
+            if (show_timing) print_phase_times(&cfg);
+            printf("\n");
+            pause_console();
+            return tuned ? 0 : 1;
+        }
+    }
+
+    /* --push: ファイルを送って終了 */
+    if (pushing) {
+        if (!use_key) {
+            printf("[ERROR] --push needs key authentication to %s\n\n", ip);
+            pause_console();
+            return 1;
         }
+        printf("\nTarget: %s@%s\n", cfg.ssh_user, ip);
+        push_print_file(&push);
+        phase = phase_begin("push");
+        int pushed = push_to_host(&target, &push, detail, sizeof(detail));
+        phase_end(phase);
+        printf("\n%s%s\n", pushed ? "Pushed: " : "[ERROR] Push failed: ", detail);
+        push_file_free(&push);
+        if (show_timing) print_phase_times(&cfg);
+        printf("\n");
+        pause_console();
+        return pushed ? 0 : 1;
+    }
+
+    /* 複数のコマンド: スクリプトを先に全て用意し、同じ接続先で順に (または並列に) 実行 */
+    if (seq.count) {
+        phase = phase_begin("script fetch");
+        sequence_fetch_scripts(&seq);
+        phase_end(phase);
+
+        printf("\nTarget: %s@%s\n", cfg.ssh_user, ip);
+        printf("Steps: %d%s\n", seq.count, seq.graph ? " (parallel where dependencies allow)" : "");
+        phase = phase_begin("steps");
+        int failed = sequence_run(&seq);
+        phase_end(phase);
+        sequence_free(&seq);
+
+        if (show_timing) print_phase_times(&cfg);
+        printf("\n");
+        pause_console();
+        return failed ? 1 : 0;
     }
 
-    /* SSHコマンドの構築 */
+    /* リモートスクリプトをローカルキャッシュから用意 */
+    memset(&script, 0, sizeof(script));
     if (is_remote_cmd) {
-        /* リモートコマンド実行モード */
-        char install_script[4096];
-        build_install_script(target_cmd, install_script, sizeof(install_script));
+        phase = phase_begin("script fetch");
+        script_cache_get(&cfg, target_cmd, sysroot, refresh, &script);
+        phase_end(phase);
+    }
 
+    if (is_remote_cmd) {
         printf("\nTarget: %s@%s\n", cfg.ssh_user, ip);
-        printf("Command: %s\n\n", target_cmd->name);
-        printf("Connecting and executing command...\n\n");
-
-        if (use_key) {
-            snprintf(cmd, sizeof(cmd),
-                "%s\\System32\\OpenSSH\\ssh.exe"
-                SSH_OPTS
-                " -i \"%s\""
-                " -tt %s@%s"
-                " \"command -v %s >/dev/null 2>&1 || (%s); %s\"",
-                sysroot, key_path, cfg.ssh_user, ip,
-                target_cmd->name, install_script, target_cmd->name);
-        } else {
-            snprintf(cmd, sizeof(cmd),
-                "%s\\System32\\OpenSSH\\ssh.exe"
-                SSH_OPTS
-                " -tt %s@%s"
-                " \"command -v %s >/dev/null 2>&1 || (%s); %s\"",
-                sysroot, cfg.ssh_user, ip,
-                target_cmd->name, install_script, target_cmd->name);
+        printf("Command: %s\n", target_cmd->name);
+        if (script.data) {
+            printf("Script: %.12s (%s, %zu bytes)\n", script.hash, script.source, script.len);
+        } else if (cfg.script_push) {
+            printf("Script: not available locally, the device will download it\n");
         }
+        printf("\nConnecting and executing command...\n\n");
     } else {
         /* インタラクティブSSHモード */
         printf("\nTarget: %s@%s\n\n", cfg.ssh_user, ip);
         printf("Connecting...\n\n");
+    }
+    if (key_inline) printf("Registering public key on this connection (password required once)...\n\n");
 
-        if (use_key) {
-            snprintf(cmd, sizeof(cmd),
-                "%s\\System32\\OpenSSH\\ssh.exe"
-                SSH_OPTS
-                " -i \"%s\""
-                " -tt %s@%s",
-                sysroot, key_path, cfg.ssh_user, ip);
-        } else {
-            snprintf(cmd, sizeof(cmd),
-                "%s\\System32\\OpenSSH\\ssh.exe"
-                SSH_OPTS
-                " -tt %s@%s",
-                sysroot, cfg.ssh_user, ip);
+    /* デバイス側の版が古ければ SCRIPT_STALE_EXIT が返るので、送ってから1回だけ再実行 */
+    for (int attempt = 0; ; attempt++) {
+        ArgList ssh_args = {0};
+        StrBuf remote = {0};
+
+        ssh_build_args(&target, &ssh_args);
+        args_add(&ssh_args, "-tt");
+        if (auth_assumed) {
+            /* 鍵が通らないときパスワード入力に進まず失敗させる */
+            args_add(&ssh_args, "-o");
+            args_add(&ssh_args, "PreferredAuthentications=publickey");
+        }
+        ssh_add_destination(&target, &ssh_args);
+        if (key_inline && !key_install_inline(&target, pub_path, &remote)) key_inline = 0;
+        if (is_remote_cmd) {
+            build_remote_command(target_cmd, script.data ? script.hash : NULL, cfg.script_ttl, refresh,
+                                 &remote);
+        } else if (key_inline) {
+            /* 鍵の登録に続けてログインシェル */
+            sb_puts(&remote, "exec \"${SHELL:-/bin/sh}\" -l");
+        }
+        if (remote.data) args_add(&ssh_args, remote.data);
+        sb_free(&remote);
+
+        phase = phase_begin("session");
+        ret = proc_run_simple((const char *const *)ssh_args.argv, PROC_IN_INHERIT, PROC_OUT_INHERIT);
+        phase_end(phase);
+        args_free(&ssh_args);
+
+        if (key_inline && ret == KEY_INLINE_FAILED_EXIT) {
+            printf("\n[ERROR] Key authentication could not be set up for %s\n", ip);
+            break;
+        }
+        if (key_inline && ret == 255) {
+            /* 初めての接続が失敗した: 別のデバイス (ホスト鍵の変更) なら確認して1回だけ再接続 */
+            SshTarget probe = target;
+            probe.ssh_dir = NULL;
+            key_inline = 0;
+            phase = phase_begin("auth probe");
+            AuthResult auth = test_key_auth(&probe, detail, sizeof(detail));
+            phase_end(phase);
+            if (auth == AUTH_HOST_CHANGED && confirm_new_device(&cfg, ip, &device)) {
+                key_inline = 1;
+                attempt--;   /* 古い版のスクリプトを送り直す回数には数えない */
+                continue;
+            }
+            if (auth == AUTH_OK) {
+                /* 鍵は登録済みだった (255 はリモートコマンドの終了コード) */
+                key_type_remember(&cfg, ip, &device, target.key_type);
+                race_remember(ip);
+            }
+        }
+        /* 鍵は登録済み (スクリプトを送り直した後の再実行では登録しない) */
+        if (key_inline) device_learned(&cfg, ip, &device);
+        key_inline = 0;
+        if (auth_assumed && ret == 255) {
+            /* 確認を省いた鍵が通らなかった可能性: 確かめて、登録し直せたら1回だけ再接続 */
+            auth_assumed = 0;
+            phase = phase_begin("auth probe");
+            int reauthed = key_reauth(&target, pub_path, detail, sizeof(detail));
+            phase_end(phase);
+            if (reauthed) {
+                printf("\nReconnecting...\n\n");
+                attempt--;   /* 古い版のスクリプトを送り直す回数には数えない */
+                continue;
+            }
+        }
+
+        if (!script.data || ret != SCRIPT_STALE_EXIT || attempt > 0) break;
+
+        /* 期限内のキャッシュを使っていた場合、デバイス側が新しい可能性があるので確認してから送る */
+        if (strcmp(script.source, "cache") == 0) {
+            ScriptBlob latest;
+            phase = phase_begin("script fetch");
+            if (script_cache_get(&cfg, target_cmd, sysroot, 1, &latest)) {
+                script_blob_free(&script);
+                script = latest;
+                printf("Script: %.12s (%s, %zu bytes)\n", script.hash, script.source, script.len);
+            }
+            phase_end(phase);
         }
-    }
 
-    int ret = system(cmd);
+        ProcOptions push_opt;
+        memset(&push_opt, 0, sizeof(push_opt));
+        push_opt.out = PROC_OUT_INHERIT;
+        ssh_build_args(&target, &ssh_args);
+        ssh_add_destination(&target, &ssh_args);
+        printf("Sending script to device (%zu bytes)...\n", script.len);
+        phase = phase_begin("script push");
+        int pushed = script_push(&ssh_args, target_cmd, &script, cfg.script_ttl, &push_opt);
+        phase_end(phase);
+        if (!pushed) {
+            printf("[ERROR] Could not install the script on the device\n");
+            ret = 1;
+            break;
+        }
+    }
+    script_blob_free(&script);
 
     if (is_remote_cmd) {
         printf("\n========================================\n");
@@ -609,7 +11420,9 @@ int main(int argc, char *argv[])
         printf("========================================\n");
     }
 
+    if (show_timing) print_phase_times(&cfg);
+
     printf("\n");
-    system("pause");
+    pause_console();
     return 0;
 }
@@ -0,0 +1,198 @@
+/*
+ * probe-test.c - loopback tests for the discovery core
+ *
+ * Starts SSH-banner listeners on 127.0.0.x and checks scan_hosts()
+ * (--scan) and race_connect() (startup address racing) against them:
+ * banner classification, silent ports, closed ports, and which
+ * candidate wins the race. Linux only (uses several 127.0.0.x
+ * addresses); HOME is pointed at a temporary directory.
+ *
+ * Build / run (from the repository root):
+ *   ./openwrt-connect-build.sh test
+ * or
+ *   cc -std=gnu11 -O2 -pthread -o probe-test tests/probe-test.c && ./probe-test
+ */
+#define main openwrt_connect_main
+#include "../openwrt-connect.c"
+#undef main
+
+/* バナーを返す (banner が NULL なら accept しない = 無言のポート) */
+typedef struct {
+    sock_t fd;
+    uint32_t addr;
+    const char *banner;
+    volatile int stop;
+    thread_t thread;
+} Listener;
+
+static int g_failed;
+
+static void check(int ok, const char *what)
+{
+    printf("%s  %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok) g_failed++;
+}
+
+static thread_ret_t THREAD_CC listener_thread(void *arg)
+{
+    Listener *l = (Listener *)arg;
+
+    while (!l->stop) {
+        struct pollfd pfd = { l->fd, POLLIN, 0 };
+        if (sock_poll(&pfd, 1, 50) <= 0) continue;
+        sock_t c = accept(l->fd, NULL, NULL);
+        if (c == SOCK_INVALID) continue;
+        send(c, l->banner, strlen(l->banner), 0);
+        sock_close(c);
+    }
+    return 0;
+}
+
+/* addr:port で待ち受ける。port が 0 なら空きポートを選んで返す */
+static int listener_start(Listener *l, uint32_t addr, int port, const char *banner)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int on = 1;
+
+    memset(l, 0, sizeof(*l));
+    l->addr = addr;
+    l->banner = banner;
+    l->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (l->fd == SOCK_INVALID) return 0;
+    setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((unsigned short)port);
+    sa.sin_addr.s_addr = htonl(addr);
+    if (bind(l->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(l->fd, 16) != 0 ||
+        getsockname(l->fd, (struct sockaddr *)&sa, &len) != 0) {
+        sock_close(l->fd);
+        return 0;
+    }
+    if (banner && !thread_start(&l->thread, listener_thread, l)) {
+        sock_close(l->fd);
+        return 0;
+    }
+    return ntohs(sa.sin_port);
+}
+
+static void listener_stop(Listener *l)
+{
+    l->stop = 1;
+    if (l->banner) thread_join(l->thread);
+    sock_close(l->fd);
+}
+
+static void test_classify(void)
+{
+    check(classify_ssh_banner("SSH-2.0-dropbear_2022.82") == SSH_DAEMON_DROPBEAR, "classify dropbear");
+    check(classify_ssh_banner("SSH-2.0-OpenSSH_9.6p1 Debian") == SSH_DAEMON_OPENSSH, "classify OpenSSH");
+    check(classify_ssh_banner("SSH-2.0-libssh_0.10") == SSH_DAEMON_OTHER, "classify other SSH");
+    check(classify_ssh_banner("HTTP/1.1 400 Bad Request") == SSH_DAEMON_NONE, "classify non-SSH");
+    check(classify_ssh_banner("") == SSH_DAEMON_NONE, "classify empty");
+}
+
+static void test_scan(void)
+{
+    const uint32_t lo = 0x7f000000;   /* 127.0.0.0 */
+    Listener drop, open_ssh, silent;
+    ScanResult results[8];
+    uint32_t hosts[4];
+
+    int port = listener_start(&drop, lo | 1, 0, "SSH-2.0-dropbear_2022.82\r\n");
+    if (!port || !listener_start(&open_ssh, lo | 2, port, "SSH-2.0-OpenSSH_9.6\r\n") ||
+        !listener_start(&silent, lo | 3, port, NULL)) {
+        check(0, "scan: start loopback listeners");
+        return;
+    }
+
+    /* .4 は誰も待ち受けていない (接続拒否) */
+    hosts[0] = lo | 4;
+    hosts[1] = lo | 3;
+    hosts[2] = lo | 2;
+    hosts[3] = lo | 1;
+    uint64_t start = now_ms();
+    int found = scan_hosts(hosts, 4, port, 2, 1000, results);
+    uint64_t took = now_ms() - start;
+
+    check(found == 3, "scan: three open ports found, closed port skipped");
+    if (found == 3) {
+        check(results[0].addr == (lo | 1) && results[1].addr == (lo | 2) && results[2].addr == (lo | 3),
+              "scan: results sorted by address");
+        check(results[0].daemon == SSH_DAEMON_DROPBEAR &&
+              strcmp(results[0].banner, "SSH-2.0-dropbear_2022.82") == 0,
+              "scan: dropbear banner read and trimmed");
+        check(results[1].daemon == SSH_DAEMON_OPENSSH, "scan: OpenSSH banner classified");
+        check(results[2].daemon == SSH_DAEMON_NONE && results[2].banner[0] == '\0',
+              "scan: silent port reported without banner");
+        check(results[0].rtt_ms >= 0 && results[0].rtt_ms < 1000, "scan: connect time recorded");
+    }
+    check(took < 1000 + SCAN_BANNER_TIMEOUT_MS * 2, "scan: silent port limited by the banner timeout");
+
+    listener_stop(&drop);
+    listener_stop(&open_ssh);
+    listener_stop(&silent);
+}
+
+static void test_race(void)
+{
+    const uint32_t lo = 0x7f000000;
+    Listener primary, last_known;
+    RaceResult race;
+    Config cfg;
+
+    int port = listener_start(&primary, lo | 1, 0, "SSH-2.0-dropbear_2022.82\r\n");
+    if (!port || !listener_start(&last_known, lo | 2, port, "SSH-2.0-dropbear_2019.78\r\n")) {
+        check(0, "race: start loopback listeners");
+        return;
+    }
+
+    config_defaults(&cfg);
+    cfg.ssh_port = port;
+
+    /* default_ip が応答する */
+    cfg.default_ip = "127.0.0.1";
+    int won = race_connect(&cfg, &race);
+    check(won && strcmp(race.ip, "127.0.0.1") == 0, "race: default_ip answering on loopback wins");
+    check(won && strcmp(race.banner, "SSH-2.0-dropbear_2022.82") == 0, "race: winner's banner kept");
+    check(won && race.rtt_ms >= 0 && race.rtt_ms < 2000, "race: winner's round trip measured");
+
+    /* default_ip は応答しない: 前回鍵認証の通ったアドレスが選ばれる */
+    cfg.default_ip = "127.0.0.3";
+    race_remember("127.0.0.2");
+    won = race_connect(&cfg, &race);
+    check(won && strcmp(race.ip, "127.0.0.2") == 0 && strcmp(race.source, "last-known") == 0,
+          "race: last-known address wins when default_ip is closed");
+    check(race.candidates >= 2, "race: default_ip and last-known both raced");
+
+    listener_stop(&primary);
+    listener_stop(&last_known);
+
+    /* 誰も応答しない */
+    race_remember("127.0.0.4");
+    won = race_connect(&cfg, &race);
+    check(!won && race.ip[0] == '\0', "race: no winner when nothing answers");
+}
+
+int main(void)
+{
+    char home[] = "/tmp/owc-probe-test.XXXXXX";
+
+    if (!mkdtemp(home)) {
+        printf("[ERROR] Cannot create a temporary HOME\n");
+        return 1;
+    }
+    setenv(HOME_ENV, home, 1);
+
+    test_classify();
+    test_scan();
+    test_race();
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", home);
+    if (system(cmd) != 0) printf("[WARN] Could not remove %s\n", home);
+
+    printf("\n%s (%d failed)\n", g_failed ? "FAILED" : "OK", g_failed);
+    return g_failed ? 1 : 0;
+}